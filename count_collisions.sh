@@ -11,6 +11,8 @@ main (){
 	printf "HASH FUN 1: %5d\n" $(count_collisions $CNT 1)
 	printf "HASH FUN 2: %5d\n" $(count_collisions $CNT 2)
 	printf "HASH FUN 3: %5d\n" $(count_collisions $CNT 3)
+	printf "HASH FUN 4: %5d\n" $(count_collisions $CNT 4)
+	printf "HASH FUN 5: %5d\n" $(count_collisions $CNT 5)
 	
 	rm -f $TMP
 
@@ -4,6 +4,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include "kv.h"
 #include "common.h"
 
@@ -14,11 +18,52 @@ typedef enum { false, true} bool;
 char* usage_string = NULL;
 char* help_string = NULL;
 
+#define NB_READERS 4
+#define NB_WRITERS 4
+#define WRITER_KEYS 2000
+
+/* Reads again and again a key stored at the beginning of the test */
+void* reader(void* db){
+	KV *kv = db;
+	kv_datum key; key.ptr = "My key2"; key.len = 8;
+	char buf[8];
+	kv_datum val; val.ptr = buf; 
+
+	int i;
+	for (i = 0; i < 1000; i++) {
+		val.len = sizeof buf;
+		if ( kv_get(kv, &key, &val) != 1 || 
+		     memcmp(buf, "My val2", 8) != 0) raler(kv,"kv_get (reader)");
+	}
+
+	return NULL;
+}
+
+
+/* Stores the keys first .. first + WRITER_KEYS - 1 of a sharded database */
+typedef struct { KV *kv; unsigned int first; } writer_arg;
+
+void* writer(void* arg){
+	writer_arg *w = arg;
+	unsigned int nkey, nval;
+	kv_datum key; key.ptr = &nkey; key.len = sizeof nkey;
+	kv_datum val; val.ptr = &nval; val.len = sizeof nval;
+
+	for (nkey = w->first; nkey < w->first + WRITER_KEYS; nkey++) {
+		nval = 3 * nkey;
+		if ( kv_put(w->kv, &key, &val) == -1) raler(w->kv, "kv_put (writer)");
+	}
+
+	return NULL;
+}
+
+
 int main(void){
 
 	KV *kv ;
 	kv_datum key; key.ptr = "My key1"; key.len = 8;
 	kv_datum val; val.ptr = "My val1"; val.len = 8;
+	int r;
 
 
 	/* Get and next from write only */
@@ -39,6 +84,11 @@ int main(void){
 	/* Exact fit free space */
     	if ((kv = kv_open("MYDB", "r+", 0, FIRST_FIT)) == NULL) raler(kv,"kv_open");
 
+	/* Tiny buffer pool: blocks are often replaced */
+	if ( kv_setopt(kv, KV_OPT_BLK_POOL, 0) == 0 || errno != EINVAL)
+		raler(kv, "kv_setopt (0)");
+	if ( kv_setopt(kv, KV_OPT_BLK_POOL, 2) == -1) raler(kv, "kv_setopt");
+
 	val.ptr = "My val2"; val.len = 8;
 	key.ptr = "My key2";
 	if ( kv_put(kv, &key, &val) == -1) raler(kv,"kv_put");
@@ -88,6 +138,82 @@ int main(void){
 		kval[1]--;
 	}
 	
+	/* Fill the hole by slices, then at once */
+	if (kv_compact(kv, 4096) != 1) raler(kv, "kv_compact (slice)");
+	if (kv_compact(kv, 0) != 0) raler(kv, "kv_compact");
+
+	/* Write the changes without closing, then only the header */
+	if (kv_sync(kv) == -1) raler(kv, "kv_sync");
+	if (kv_sync(kv) == -1) raler(kv, "kv_sync");
+
+	kv_stats stats;
+	if (kv_getstats(kv, &stats) == -1 || stats.blk_misses == 0)
+		raler(kv, "kv_getstats");
+
+	/* Concurrent readers on the same database */
+	pthread_t readers[NB_READERS];
+	int t;
+	for (t = 0; t < NB_READERS; t++)
+		if (pthread_create(&readers[t], NULL, reader, kv) != 0)
+			raler(kv, "pthread_create");
+	for (t = 0; t < NB_READERS; t++) pthread_join(readers[t], NULL);
+
+	/* Batch: the last value of a key is kept */
+	kv_datum keys[3] = { { "My key2", 8 }, { "My key3", 8 }, { "My key2", 8 } };
+	kv_datum vals[3] = { { "first", 6 }, { "My val3", 8 }, { "last", 5 } };
+	if (kv_put_batch(kv, keys, vals, 3) == -1) raler(kv, "kv_put_batch");
+	char buf[8];
+	val.ptr = buf; val.len = sizeof buf;
+	if (kv_get(kv, &keys[0], &val) != 1 || val.len != 5 || 
+	    memcmp(buf, "last", 5) != 0) raler(kv, "kv_put_batch (get)");
+
+	/* Several keys at once (one is missing, the others allocated) */
+	keys[1].ptr = "No key"; keys[1].len = 7;
+	int status[3];
+	vals[0].ptr = vals[1].ptr = vals[2].ptr = NULL;
+	if (kv_get_many(kv, keys, vals, status, 3) != 2 || status[1] != 0 ||
+	    vals[2].len != 5 || memcmp(vals[2].ptr, "last", 5) != 0)
+		raler(kv, "kv_get_many");
+	free(vals[0].ptr);
+	free(vals[2].ptr);
+
+	/* Values taken from an arena, until it is full */
+	char zone[24];
+	kv_arena arena = { zone, sizeof zone, 0 };
+	if (kv_set_arena(kv, &arena) == -1) raler(kv, "kv_set_arena");
+	vals[0].ptr = vals[2].ptr = NULL;
+	if (kv_get_many(kv, keys, vals, status, 3) != 2 || 
+	    vals[0].ptr != zone || vals[2].ptr != zone + 16)
+		raler(kv, "kv_get_many (arena)");
+	val.ptr = NULL;
+	if (kv_get(kv, &keys[0], &val) != -1 || errno != ENOBUFS)
+		raler(kv, "kv_get (arena full)");
+	arena.used = 0;
+	val.ptr = NULL;
+	if (kv_get(kv, &keys[0], &val) != 1 || val.ptr != zone)
+		raler(kv, "kv_get (arena)");
+	if (kv_set_arena(kv, NULL) == -1) raler(kv, "kv_set_arena (NULL)");
+
+	/* A long key, compared piece by piece */
+	char long_key[1000];
+	memset(long_key, 'k', sizeof long_key);
+	kv_datum lkey = { long_key, sizeof long_key };
+	val.ptr = "long"; val.len = 5;
+	if (kv_put(kv, &lkey, &val) == -1) raler(kv, "kv_put (long key)");
+	val.ptr = buf; val.len = sizeof buf;
+	if (kv_get(kv, &lkey, &val) != 1) raler(kv, "kv_get (long key)");
+	long_key[sizeof long_key - 1] = 'l';
+	if (kv_get(kv, &lkey, &val) != 0) raler(kv, "kv_get (other key)");
+
+	/* Views on the mapping of .kv */
+	kv_datum vkey, view;
+	if (kv_get_view(kv, &keys[2], &view) != 1 || view.len != 5 ||
+	    memcmp(view.ptr, "last", 5) != 0) raler(kv, "kv_get_view");
+	kv_start(kv);
+	while ((r = kv_next_view(kv, &vkey, &view)) == 1);
+	if (r == -1) raler(kv, "kv_next_view");
+	kv_release_views(kv);
+
 	/* Use all the hash functions */
 	if (kv_close(kv) == -1) raler(kv, "kv_close");
 
@@ -99,10 +225,249 @@ int main(void){
 	if ( kv_put(kv, &key, &val) == -1) raler(kv,"kv_put");
 	if ( kv_get(kv, &key, &val) == -1) raler(kv,"kv_get");
 
+    	if ((kv = kv_open("MYDB", "w+", 4, FIRST_FIT)) == NULL) raler(kv,"kv_open");
+	if ( kv_put(kv, &key, &val) == -1) raler(kv,"kv_put");
+	if ( kv_get(kv, &key, &val) == -1) raler(kv,"kv_get");
+
+    	if ((kv = kv_open("MYDB", "w+", 5, FIRST_FIT)) == NULL) raler(kv,"kv_open");
+	if ( kv_put(kv, &key, &val) == -1) raler(kv,"kv_put");
+	if ( kv_get(kv, &key, &val) == -1) raler(kv,"kv_get");
+
     	if ((kv = kv_open("MYDB", "w+", 3, FIRST_FIT)) == NULL) raler(kv,"kv_open");
 	if ( kv_put(kv, &key, &val) == -1) raler(kv,"kv_put");
 	if ( kv_get(kv, &key, &val) == -1) raler(kv,"kv_get");
 
+	/* Enough keys to split buckets of the directory */
+	unsigned int nkey;
+	key.ptr = &nkey; key.len = sizeof nkey;
+	val.ptr = &nkey; val.len = sizeof nkey;
+	for (nkey = 0; nkey < 100000; nkey++)
+		if ( kv_put(kv, &key, &val) == -1) raler(kv,"kv_put");
+	if (kv_close(kv) == -1) raler(kv, "kv_close");
+
+    	if ((kv = kv_open("MYDB", "r", 0, FIRST_FIT)) == NULL) raler(kv,"kv_open");
+	unsigned int nval;
+	val.ptr = &nval;
+	for (nkey = 0; nkey < 100000; nkey += 7) {
+		val.len = sizeof nval;
+		if ( kv_get(kv, &key, &val) != 1 || nval != nkey) 
+			raler(kv,"kv_get (split)");
+	}
+
+	if (kv_close(kv) == -1) raler(kv, "kv_close");
+
+	/* Big values in the blob log, rewritten by kv_compact */
+	if ((kv = kv_open("MYDB", "w+v", 0, FIRST_FIT)) == NULL) 
+		raler(kv, "kv_open (blob)");
+	if ( kv_setopt(kv, KV_OPT_BLOB_MIN, 4) == 0 || errno != EINVAL)
+		raler(kv, "kv_setopt (blob min)");
+	if ( kv_setopt(kv, KV_OPT_BLOB_MIN, 100) == -1) raler(kv, "kv_setopt");
+	char big[300];
+	for (r = 0; r < 3; r++) {
+		for (nkey = 0; nkey < 50; nkey++) {
+			memset(big, 'a' + r + nkey % 20, sizeof big);
+			val.ptr = big; val.len = sizeof big;
+			if (kv_put(kv, &key, &val) == -1) raler(kv, "kv_put (blob)");
+		}
+	}
+	if (kv_compact(kv, 0) != 0) raler(kv, "kv_compact (blob)");
+	nkey = 7;
+	val.ptr = NULL;
+	if (kv_get(kv, &key, &val) != 1 || val.len != sizeof big ||
+	    ((char*) val.ptr)[0] != 'c' + 7) raler(kv, "kv_get (blob)");
+	free(val.ptr);
+	if (kv_get_view(kv, &key, &view) != 1 || view.len != sizeof big ||
+	    ((char*) view.ptr)[299] != 'c' + 7) raler(kv, "kv_get_view (blob)");
+	kv_release_views(kv);
+	if (kv_close(kv) == -1) raler(kv, "kv_close");
+
+	/* Write-ahead log: a process dies without closing the database */
+	switch (fork()) {
+	case -1: raler(NULL, "fork");
+		/* fallthrough - raler does not return */
+	case 0:
+		if ((kv = kv_open("MYDB", "w+ij", 0, FIRST_FIT)) == NULL) 
+			raler(kv, "kv_open (wal)");
+		if ( kv_setopt(kv, KV_OPT_SYNC, -2) == 0 || errno != EINVAL)
+			raler(kv, "kv_setopt (sync)");
+		if ( kv_setopt(kv, KV_OPT_SYNC, KV_SYNC_NONE) == -1) 
+			raler(kv, "kv_setopt (sync)");
+		/* Small couples, stored in the blocks */
+		val.ptr = &nkey; val.len = sizeof nkey;
+		for (nkey = 0; nkey < 2000; nkey++)
+			if ( kv_put(kv, &key, &val) == -1) raler(kv, "kv_put");
+		if (kv_sync(kv) == -1) raler(kv, "kv_sync");
+		/* After the checkpoint: replaced, deleted, then synced */
+		if ( kv_setopt(kv, KV_OPT_SYNC, 5) == -1) 
+			raler(kv, "kv_setopt (sync)");
+		val.ptr = &nval; val.len = sizeof nval;
+		for (nkey = 0; nkey < 1000; nkey++) {
+			nval = nkey + 1;
+			if ( kv_put(kv, &key, &val) == -1) raler(kv, "kv_put");
+		}
+		if ( kv_setopt(kv, KV_OPT_SYNC, KV_SYNC_ALWAYS) == -1) 
+			raler(kv, "kv_setopt (sync)");
+		for (nkey = 1000; nkey < 1500; nkey++)
+			if ( kv_del(kv, &key) == -1) raler(kv, "kv_del");
+		/* A batch of changes, logged at once */
+		kv_batch *batch = kv_batch_begin(kv);
+		if (batch == NULL) raler(kv, "kv_batch_begin");
+		val.ptr = &nval; val.len = sizeof nval;
+		for (nkey = 1500; nkey < 1600; nkey++) {
+			nval = 2 * nkey;
+			if ( kv_batch_put(batch, &key, &val) == -1) 
+				raler(kv, "kv_batch_put");
+		}
+		for (nkey = 0; nkey < 10; nkey++)
+			if ( kv_batch_del(batch, &key) == -1) 
+				raler(kv, "kv_batch_del");
+		if ( kv_batch_commit(batch) == -1) raler(kv, "kv_batch_commit");
+		_exit(0);
+	}
+	if (wait(&r) == -1 || r != 0) raler(NULL, "wait");
+
+	if ((kv = kv_open("MYDB", "r", 0, FIRST_FIT)) != NULL || errno != EBUSY)
+		raler(kv, "kv_open (wal read only)");
+	if ((kv = kv_open("MYDB", "r+", 0, FIRST_FIT)) == NULL) 
+		raler(kv, "kv_open (wal recovery)");
+	for (nkey = 0; nkey < 2000; nkey++) {
+		val.ptr = NULL;
+		r = kv_get(kv, &key, &val);
+		if (nkey < 10 || (nkey >= 1000 && nkey < 1500)) {
+			if (r != 0) raler(kv, "kv_get (wal deleted)");
+			continue;
+		} 
+		nval = nkey < 1000 ? nkey + 1 : nkey < 1600 ? 2 * nkey : nkey;
+		if (r != 1 || val.len != sizeof nval || 
+		    memcmp(val.ptr, &nval, sizeof nval) != 0)
+			raler(kv, "kv_get (wal)");
+		free(val.ptr);
+	}
+
+	/* Batch: the last change of a key counts, a missing key is ignored */
+	kv_batch *batch = kv_batch_begin(kv);
+	val.ptr = &nval; val.len = sizeof nval;
+	nval = 7;
+	for (nkey = 0; nkey < 20; nkey++)
+		if ( kv_batch_put(batch, &key, &val) == -1) 
+			raler(kv, "kv_batch_put");
+	nkey = 10;
+	if ( kv_batch_del(batch, &key) == -1) raler(kv, "kv_batch_del");
+	nkey = 1000;
+	if ( kv_batch_del(batch, &key) == -1) raler(kv, "kv_batch_del");
+	if ( kv_batch_commit(batch) == -1) raler(kv, "kv_batch_commit");
+	for (nkey = 0; nkey <= 20; nkey++) {
+		val.len = sizeof nval;
+		r = kv_get(kv, &key, &val);
+		if ((nkey == 10 && r != 0) || (nkey == 20 && nval != 21) ||
+		    (nkey != 10 && nkey != 20 && (r != 1 || nval != 7))) 
+			raler(kv, "kv_get (batch)");
+	}
+
+	/* An abandoned batch changes nothing */
+	if ((batch = kv_batch_begin(kv)) == NULL) raler(kv, "kv_batch_begin");
+	if ( kv_batch_del(batch, &key) == -1) raler(kv, "kv_batch_del");
+	kv_batch_abort(batch);
+	val.len = sizeof nval;
+	if ( kv_get(kv, &key, &val) != 1) raler(kv, "kv_batch_abort");
+
+	if (kv_close(kv) == -1) raler(kv, "kv_close");
+
+	/* A batch failing to write its data keeps the old values */
+	switch (fork()) {
+	case -1: raler(NULL, "fork");
+		/* fallthrough - raler does not return */
+	case 0: {
+		kv_datum old[2] = { { "key A", 6 }, { "key B", 6 } };
+		kv_datum new[2] = { { "new A", 6 }, { NULL, 200000 } };
+		if ((kv = kv_open("MYDB", "w+", 0, FIRST_FIT)) == NULL) 
+			raler(kv, "kv_open (batch)");
+		for (t = 0; t < 2; t++)
+			if ( kv_put(kv, &old[t], &old[t]) == -1) 
+				raler(kv, "kv_put (batch)");
+		if ((new[1].ptr = calloc(1, new[1].len)) == NULL) 
+			raler(kv, "calloc");
+		struct rlimit lim = { 1 << 16, 1 << 16 };
+		signal(SIGXFSZ, SIG_IGN);
+		if (setrlimit(RLIMIT_FSIZE, &lim) == -1) raler(kv, "setrlimit");
+		if ( kv_put_batch(kv, old, new, 2) != -1) 
+			raler(kv, "kv_put_batch (too big)");
+		for (t = 0; t < 2; t++) {
+			val.ptr = NULL;
+			if ( kv_get(kv, &old[t], &val) != 1 || val.len != 6 ||
+			     memcmp(val.ptr, old[t].ptr, 6) != 0) 
+				raler(kv, "kv_get (batch failed)");
+			free(val.ptr);
+		}
+		_exit(0);
+	}
+	}
+	if (wait(&r) == -1 || r != 0) raler(NULL, "wait");
+
+	/* Sharded database: writers of different shards run in parallel */
+	if ((kv = kv_open_sharded("MYSHARDS", 0, "w+", 0, FIRST_FIT)) != NULL ||
+	    errno != EINVAL) raler(kv, "kv_open_sharded (0)");
+	if ((kv = kv_open_sharded("MYSHARDS", 4, "w+", 5, FIRST_FIT)) == NULL) 
+		raler(kv, "kv_open_sharded");
+	writer_arg args[NB_WRITERS];
+	pthread_t writers[NB_WRITERS];
+	for (t = 0; t < NB_WRITERS; t++) {
+		args[t].kv = kv;
+		args[t].first = t * WRITER_KEYS;
+		if (pthread_create(&writers[t], NULL, writer, &args[t]) != 0)
+			raler(kv, "pthread_create");
+	}
+	for (t = 0; t < NB_WRITERS; t++) pthread_join(writers[t], NULL);
+
+	for (nkey = 0; nkey < NB_WRITERS * WRITER_KEYS; nkey += 2)
+		if ( kv_del(kv, &key) == -1) raler(kv, "kv_del (shards)");
+	if ((batch = kv_batch_begin(kv)) != NULL || errno != EINVAL)
+		raler(kv, "kv_batch_begin (shards)");
+	if (kv_close(kv) == -1) raler(kv, "kv_close (shards)");
+
+	/* The number of shards must not change */
+	if ((kv = kv_open_sharded("MYSHARDS", 3, "r", 0, FIRST_FIT)) != NULL ||
+	    errno != EINVAL) raler(kv, "kv_open_sharded (3)");
+	if ((kv = kv_open_sharded("MYSHARDS", 5, "r+", 0, FIRST_FIT)) != NULL ||
+	    errno != EINVAL) raler(kv, "kv_open_sharded (5)");
+	if ((kv = kv_open_sharded("MYSHARDS", 4, "r", 0, FIRST_FIT)) == NULL) 
+		raler(kv, "kv_open_sharded (r)");
+
+	for (nkey = 0; nkey < NB_WRITERS * WRITER_KEYS; nkey++) {
+		val.len = sizeof nval;
+		r = kv_get(kv, &key, &val);
+		if ((nkey % 2 == 0 && r != 0) || 
+		    (nkey % 2 == 1 && (r != 1 || nval != 3 * nkey))) 
+			raler(kv, "kv_get (shards)");
+	}
+
+	/* kv_next reads the shards one after the other */
+	kv_start(kv);
+	key.len = val.len = sizeof nval;
+	for (r = 0; kv_next(kv, &key, &val) == 1; r++) {
+		if (nkey % 2 != 1 || nval != 3 * nkey) raler(kv, "kv_next (shards)");
+		key.len = val.len = sizeof nval;
+	}
+	if (r != NB_WRITERS * WRITER_KEYS / 2) raler(kv, "kv_next (shards)");
+
+	/* kv_get_many gives the values in the order of the keys */
+	unsigned int many_keys[10], many_vals[10];
+	kv_datum keys_many[10], vals_many[10];
+	int many_status[10];
+	for (t = 0; t < 10; t++) {
+		many_keys[t] = 7 * t;
+		keys_many[t].ptr = &many_keys[t]; 
+		keys_many[t].len = sizeof (unsigned int);
+		vals_many[t].ptr = &many_vals[t]; 
+		vals_many[t].len = sizeof (unsigned int);
+	}
+	if (kv_get_many(kv, keys_many, vals_many, many_status, 10) != 5)
+		raler(kv, "kv_get_many (shards)");
+	for (t = 0; t < 10; t++)
+		if (many_status[t] != t % 2 || (t % 2 == 1 && 
+		    many_vals[t] != 3 * many_keys[t]))
+			raler(kv, "kv_get_many (shards)");
+
 	/* End test */
 	if (kv_close(kv) == -1) raler(kv, "kv_close");
 
@@ -167,6 +167,7 @@ int main (int argc, char *argv [])
 	    {
 		case -1 :
 		    raler (kv, "kv_get") ;
+		    /* fallthrough - raler ne revient pas */
 		case 0 :
 		    fprintf (stderr, "%s: non trouvé\n", argv [i]) ;
 		    r = 1 ;
@@ -11,11 +11,21 @@
 extern int errno;
 
 #define MAX_KEY 100
+#define BENCH_KEYS 1024		/* Keys hashed in a loop by the benchmark */
 
 typedef enum { false, true} bool;
 
-char* usage_string = "usage: %s [-h][-i hidx][-s size]\n";
-char* help_string = "usage: %s [-h][-i hidx][-s size]\n";
+char* usage_string = "usage: %s [-h][-i hidx][-s size][-b][-l len]\n";
+char* help_string = "\
+Affiche size valeurs de hachage (modulo 999983) de clefs aléatoires.\n\
+\n\
+Les options sont :\n\
+-h : à l'aide !\n\
+-i : index de la fonction de hachage (0 à 5)\n\
+-s : nombre de clefs\n\
+-b : mesure le débit de la fonction au lieu d'afficher les valeurs\n\
+-l : longueur des clefs du test de débit (défaut : 16)\n\
+";
 
 len_t hash_function1(const kv_datum *key){
         len_t hash = 0;
@@ -75,8 +85,12 @@ int generate_hash(int hidx, len_t n){
 				break;
 			case 3: hash = hash_function3(&key);
 				break;
-			default: perror("Invalid hidx");
-			 	 exit(1);
+			/* Word-at-a-time functions, compared on the same range */
+			default: if (kv_hash(hidx, &key, &hash) == -1){
+					perror("Invalid hidx");
+			 		exit(1);
+				 }
+				 hash %= 999983;
 				
 		};
 		
@@ -88,14 +102,55 @@ int generate_hash(int hidx, len_t n){
 
 
 
+/* Hash n keys of len bytes and print the throughput */
+int bench_hash(int hidx, len_t n, len_t len){
+	char *keys = malloc((size_t) BENCH_KEYS * len);
+	if (keys == NULL) return -1;
+
+	len_t i;
+	for (i = 0; i < (len_t) BENCH_KEYS * len; i++)
+		keys[i] = rand();
+
+	kv_datum key;
+	key.len = len;
+
+	struct timeval start, end;
+	len_t hash, sum = 0;
+	if (gettimeofday(&start,NULL) == -1) goto error;
+	for (i = 0; i < n; i++){
+		key.ptr = keys + (size_t) (i % BENCH_KEYS) * len;
+		if (kv_hash(hidx, &key, &hash) == -1) goto error;
+		sum += hash;
+	}
+	if (gettimeofday(&end,NULL) == -1) goto error;
+
+	double sec = (end.tv_sec - start.tv_sec) +
+		     (end.tv_usec - start.tv_usec) / 1e6;
+	if (sec <= 0) sec = 1e-6;
+
+	/* sum keeps the loop from being optimized out */
+	printf("hidx %d, %u keys of %u bytes: %.0f hash/s, %.1f MB/s (%u)\n",
+		hidx, n, len, n / sec, (double) n * len / sec / 1e6, sum);
+
+	free(keys);
+	return 0;
+
+error:
+	free(keys);
+	return -1;
+}
+
+
 int main(int argc, char* argv[]){
 	/* Default values */
 	int hidx = 0 ;
 	len_t size_test = 10;
+	bool bench = false;
+	len_t key_len = 16;
 
 
 	int opt ;
-	while ((opt = getopt (argc, argv, "hi:s:")) != -1) {
+	while ((opt = getopt (argc, argv, "hi:s:bl:")) != -1) {
 		switch (opt) {
 			case 'h' :				/* help */
 				usage (argv [0], 0) ;
@@ -106,12 +161,27 @@ int main(int argc, char* argv[]){
 			case 's' :
 				size_test = atoi(optarg);
 				break;
+			case 'b' :
+				bench = true;
+				break;
+			case 'l' :
+				key_len = atoi(optarg);
+				break;
 	    		default :
 				usage (argv [0], 1);
 		}
 	}
 	
 
+	if (bench) {
+		if (key_len == 0) usage (argv [0], 1);
+		if (bench_hash(hidx,size_test,key_len) == -1) {
+			perror("hash benchmark");
+			exit(1);
+		}
+		exit (0);
+	}
+
 	if (generate_hash(hidx,size_test) == -1) {
 		perror("hash generation");
 		exit(1);
@@ -1,44 +1,102 @@
+#define _FILE_OFFSET_BITS 64 /// Files of the large format exceed 2 GB
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include "kv.h"
 #include <stdio.h>
 
 /**
- * This will tell the program to keep dkv sorted (compatible with test-130) 
- * You can comment it out for better performances.
+ * This will tell kv_next to return the entries in the order of the file .kv
+ * (compatible with test-130), otherwise they are returned in the order of 
+ * the file .dkv. You can comment it out for better performances.
  */
 #define _SORT_DKV_
 
+typedef enum { false, true} bool;
+
+/**
+ * Offsets and sizes inside the files. They always take 64 bits in memory, 
+ * but are stored on 32 bits (format of the original project, the files
+ * can't exceed 4 GB) or on 64 bits (large format), see OFF_SIZE.
+ */
+typedef uint64_t pos_t;
+
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ HEADERS  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 /* Size of the headers (bytes) 
  * ----------------------------------------------------------
- *   HEADER |  	CONTENT
- * ---------+------------------------------------------------
- * HSIZE_H  | Magic number + hash function identifier
- * HSIZE_KV | Magic number
- * HSIZE_BLK| Magic number + number allocated blocks
- * HSIZE_DKV| Magic number + numer of entries + offset end kv
+ *   HEADER   |  	CONTENT
+ * -----------+----------------------------------------------
+ * HSIZE_H    | Magic number + hash function identifier
+ * HSIZE_H2   | Same as HSIZE_H + level + split pointer + number of keys
+ * HSIZE_H64  | Same as HSIZE_H2, number of keys on 64 bits
+ * HSIZE_KV   | Magic number
+ * HSIZE_BLK  | Magic number + number allocated blocks
+ * HSIZE_DKV  | Magic number + numer of entries + offset end kv
+ * HSIZE_DKV64| Same as HSIZE_DKV, offset end kv on 64 bits
  * ----------------------------------------------------------
  */
-#define HSIZE_H	  (MGN_SIZE + sizeof (len_t))	
-#define HSIZE_KV  (MGN_SIZE)			
-#define HSIZE_BLK (MGN_SIZE + sizeof (len_t))	
-#define HSIZE_DKV (MGN_SIZE + 2*sizeof (len_t))
+#define HSIZE_H	    (MGN_SIZE + sizeof (len_t))	
+#define HSIZE_H2    (MGN_SIZE + 4*sizeof (len_t))
+#define HSIZE_H64   (MGN_SIZE + 3*sizeof (len_t) + sizeof (pos_t))
+#define HSIZE_KV    (MGN_SIZE)			
+#define HSIZE_BLK   (MGN_SIZE + sizeof (len_t))	
+#define HSIZE_DKV   (MGN_SIZE + 2*sizeof (len_t))
+#define HSIZE_DKV64 (MGN_SIZE + sizeof (len_t) + sizeof (pos_t))
 
 /* Size of the biggest header */ 
-#define MAX_HSIZE HSIZE_DKV //Update manually
+#define MAX_HSIZE HSIZE_H64 //Update manually
+
+/**
+ * The large format (magic numbers MGN_H64, MGN_BLK64 and MGN_DKV64) stores
+ * on 64 bits the offsets of the slots of .h and .blk, the entries of .dkv
+ * and the end of .kv. It is chosen when the database is created (see 
+ * set_flags) and only exists with a directory with linear hashing. The
+ * records of .kv and the headers of the blocks are the same in both formats.
+ */
+
+/* Size (bytes) of an offset stored in the files of a database */
+#define OFF_SIZE(kv) ((size_t) (kv)->off_size)
+
+/* Size of the header of the file .h (depends on its version and format) */
+#define HSIZE_H_OF(kv) (((kv)->h_version == 1)? HSIZE_H : \
+			(OFF_SIZE(kv) == sizeof (pos_t))? HSIZE_H64 : HSIZE_H2)
+
+/* Size of the header of the file .dkv */
+#define HSIZE_DKV_OF(kv) ((OFF_SIZE(kv) == sizeof (pos_t))? \
+			HSIZE_DKV64 : HSIZE_DKV)
+
+/* Size of the whole file .h (header + one slot per hash value) */
+#define SIZE_H (HSIZE_H + NB_HASH * sizeof (len_t))
+
+/* Offset of the slot of a bucket in the file .h */
+#define H_SLOT(kv, n) (HSIZE_H_OF(kv) + (size_t) (n) * OFF_SIZE(kv))
+
+/* Size of the file .h, version 2, able to hold the buckets of a level */
+#define SIZE_H2(kv, level) (HSIZE_H_OF(kv) + \
+			((size_t) H_BUCKETS << ((level) + 1)) * OFF_SIZE(kv))
 
 /* Magic numbers */
 #define MGN_H	0x68617368
+#define MGN_H2	0x68736832 /// Directory with linear hashing (version 2)
+#define MGN_H64	0x68733634 /// Same as MGN_H2, large format
 #define MGN_KV	0x6b766462
 #define MGN_BLK 0x626c6b76
+#define MGN_BLK2 0x626c6b32 /// Blocks with fingerprints (version 2)
+#define MGN_BLK64 0x626c3634 /// Same as MGN_BLK2, large format
+#define MGN_BLK3 0x626c6b33 /// Blocks with inline records (version 3)
+#define MGN_BLK364 0x62333634 /// Same as MGN_BLK3, large format
 #define MGN_DKV 0x646b766b
+#define MGN_DKV64 0x646b3634 /// Large format
 
 #define MGN_SIZE 4 /// Size of a magic number
 
@@ -61,6 +119,38 @@
  * number, the address needs to be calculated taking in count SIZE_BLK and 
  * HSIZE_BLK).
  *
+ * The header is followed by the slots of the block. In the version 2 of the
+ * file (magic number MGN_BLK2) each slot has the following form:
+ *
+ * +------------------------------+------------------------------+
+ * |   Offset of the data (.kv)   |    Fingerprint of the key    |
+ * +------------------------------+------------------------------+
+ *
+ * The fingerprint is a second hash of the key, independent from the hash
+ * used for the file .h: it allows to skip the reading of the keys stored
+ * in .kv that cannot be equal to the searched one. The version 1 of the
+ * file (magic number MGN_BLK) only contains the offsets. Such files are
+ * upgraded to the version 2 when opened for writing (see upgrade_blk) and
+ * read as they are otherwise. In the large format (magic number MGN_BLK64)
+ * the offset takes 64 bits, so the slots are packed on 12 bytes.
+ *
+ * The version 3 (magic numbers MGN_BLK3 and MGN_BLK364, chosen when the 
+ * database is created, see set_flags) also stores the small couples inline,
+ * in the block itself: no .kv record, no .dkv entry, and kv_get reads nothing
+ * but the block. Such a couple takes a head slot, whose offset is SLOT_INLINE
+ * and whose fingerprint is the one of the key, followed by as many slots as
+ * needed to hold its record:
+ *
+ * +------------+------------+--------+--------+
+ * | key size   | value size |  key   | value  |
+ * | (1 byte)   | (1 byte)   |        |        |
+ * +------------+------------+--------+--------+
+ *
+ * The following slots are raw bytes: the slots of a block must be read in
+ * order (see read_blk, which marks them SLOT_CONT). A free inline couple 
+ * leaves all its slots at 0. The number of keys of .h counts the slots used 
+ * instead, so that the chains keep the same length.
+ *
  * Below, the constants, macros and data structures relatives to this file:
  */
 
@@ -71,79 +161,417 @@
 /* Size of the header of each block */
 #define SIZE_BLK_HEAD 4
 
-/* Max blocks nb in the file .blk */
-#define MAX_BLKS ((UNSIGNED_MAX(len_t) - HSIZE_BLK) / SIZE_BLK)  
+/* Max blocks nb in the file .blk (the offsets of the blocks must fit in the
+ * slots of .h, their numbers in the headers of the blocks) */
+#define MAX_BLKS(kv) ((OFF_SIZE(kv) == sizeof (pos_t))? FLAG_USED - 1 : \
+			(UNSIGNED_MAX(len_t) - HSIZE_BLK) / SIZE_BLK)
+
+/* A slot of a block (version 2), as used in memory */
+typedef struct {
+	pos_t offset_kv;   /// Offset to the stored data in .kv (0 = free slot)
+	len_t fingerprint; /// Fingerprint of the stored key
+	} blk_slot;
+
+/* Offsets of the slots of inline couples (below HSIZE_KV, never in .kv) */
+#define SLOT_INLINE 1 /// Head slot of an inline couple
+#define SLOT_CONT 2   /// Following slots, in memory only
+
+/* Max size of the key plus the value of an inline couple */
+#define INLINE_MAX 64
+
+/* Size of the record of an inline couple */
+#define INLINE_SIZE(key, val) (2 + (key)->len + (val)->len)
+
+/* Number of slots of an inline couple (head included) for a record size */
+#define INLINE_SLOTS(kv, size) (1 + ((size) + SIZE_SLOT(kv) - 1) / SIZE_SLOT(kv))
+
+/* The couple is stored inline (only in the version 3) */
+#define IS_INLINE(kv, key, val) ((kv)->blk_version == 3 && \
+		(pos_t) (key)->len + (val)->len <= INLINE_MAX)
+
+/* Flag of the cursor of kv_next once .kv has been read: the rest of the 
+ * cursor is the number of the next slot to look at among all the blocks
+ * (block number * MAX_BLK_ENTR + slot), see next_inline */
+#define NEXT_INLINE ((pos_t) 1 << (sizeof (pos_t)*CHAR_BIT-1))
+
+/* Size of a slot, depending on the version and the format of the file .blk */
+#define SIZE_SLOT(kv) (((kv)->blk_version == 1)? \
+			sizeof (len_t) : OFF_SIZE(kv) + sizeof (len_t))
 
 /* Max entries (slots) for each block */
-#define MAX_BLK_ENTR ((SIZE_BLK-SIZE_BLK_HEAD) / sizeof (len_t)) 
+#define MAX_BLK_ENTR(kv) ((SIZE_BLK-SIZE_BLK_HEAD) / SIZE_SLOT(kv)) 
+#define MAX_BLK_ENTR_V1 ((SIZE_BLK-SIZE_BLK_HEAD) / sizeof (len_t)) 
+
+/* Offset of the slot number n (starting from 0) of the block at offset blk */
+#define SLOT_OFFSET(kv, blk, n) ((blk) + SIZE_BLK_HEAD + (n) * SIZE_SLOT(kv))
 
 
 /* Struct used by the function read_blk to store the informations of a block */
 typedef struct {
-	len_t offset_nextblk; /// Next chained block
+	pos_t offset_nextblk; /// Next chained block
 	len_t n_entries;      /// Number entries	
-	len_t data[SIZE_BLK]; /// Entries
+	blk_slot slots[MAX_BLK_ENTR_V1]; /// Entries
+	char raw[SIZE_BLK];   /// Copy of the block (version 3: inline records)
 	} block;
 
+/* Record of the inline couple whose head slot is the slot n of a block */
+#define INLINE_REC(kv, blk, n) ((blk)->raw + SIZE_BLK_HEAD + \
+				((n) + 1) * SIZE_SLOT(kv))
+
 
 /*
  * This data type is used by the function scan_blocks and provides a serie
  * of usefull information when searching a key into a concatenation of blocks
  */
 typedef struct {
-	len_t last_block;   /// Last block visited
-	len_t slot_entry;   /// Slot refering to the entry
+	pos_t last_block;   /// Last block visited
+	pos_t slot_entry;   /// Slot refering to the entry
 	len_t nblk_entries; /// Entries in last block
-	len_t offset_kv;    /// Address to the stored data
-	len_t free_slot;    /// First slot with value 0
-	len_t free_block;   /// Block with free slot
+	pos_t offset_kv;    /// Address to the stored data
+	len_t entry_slots;  /// Slots of the entry found (more if inline)
+	char record[2 + INLINE_MAX]; /// Record of the entry found, if inline
+	pos_t free_slot;    /// First slot with value 0
+	pos_t free_block;   /// Block with free slot
 	} scan_infos;
 
 
+/* A couple of a chain rewritten by split_bucket, as copied from its block */
+typedef struct {
+	size_t start;	    /// First slot of the couple in the copy
+	len_t len;	    /// Number of slots (more than 1 if inline)
+	} chain_entry;
+
+
+/* An entry of a batch of kv_put_batch, sorted by bucket (then by position) */
+typedef struct {
+	len_t hash;   /// Bucket of the key
+	size_t index; /// Position of the entry in the batch
+	} batch_entry;
+
+/* A change of kv_batch_commit, sorted by key then by position */
+typedef struct {
+	len_t type;	/// WAL_PUT or WAL_DEL
+	kv_datum key;	/// Key
+	kv_datum val;	/// Value (WAL_PUT)
+	kv_datum old;	/// Value before the batch (allocated)
+	int found;	/// The key was stored before the batch
+	size_t index;	/// Position of the change in the batch
+	} batch_op;
+
+/* A key of kv_get_many, sorted by bucket then by offset of its value */
+typedef struct {
+	len_t hash;	  /// Bucket of the key
+	size_t index;	  /// Position of the key in the request
+	pos_t val_offset; /// Offset to the value in .kv (0 = not found)
+	len_t val_len;	  /// Size of the stored value
+	len_t fp;	  /// Fingerprint of the key
+	bool allocated;	  /// The value has been allocated by read_values
+	} many_entry;
+
+/* Max gap (bytes) between two values read by the same preadv */
+#define MAX_READ_GAP 4096
+
+
+
 
 
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ FILE .DKV ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
 /* Check if a given mem_usage of a dkv_entry is pointing to used space */
-#define DKV_IS_USED(mem_usage) ((mem_usage & FLAG_USED) == FLAG_USED)
+#define DKV_IS_USED(mem_usage) ((mem_usage & DKV_USED) == DKV_USED)
 /* Get the size (bytes) of the space pointed by a mem_usage of a dkv_entry*/
-#define DKV_GET_SIZE(mem_usage) (mem_usage & (~FLAG_USED))
+#define DKV_GET_SIZE(mem_usage) (mem_usage & (~DKV_USED))
+
+/* Page of dkv_cache containing a slot */
+#define DKV_PAGE(slot) ((slot) * sizeof (dkv_entry) / CACHE_PAGE)
 
-/* Every entry of the file .dkv has the following form */
+/* Size of an entry in the file .dkv (two offsets) */
+#define SIZE_DKV_ENTRY(kv) (2 * OFF_SIZE(kv))
+
+/* Max size of a space of .kv, which must fit with its flag in a stored
+ * mem_usage */
+#define MAX_SPACE(kv) ((OFF_SIZE(kv) == sizeof (pos_t))? DKV_USED : \
+			(pos_t) FLAG_USED)
+
+/* Max offset of the end of the file .kv */
+#define MAX_END_KV(kv) ((OFF_SIZE(kv) == sizeof (pos_t))? \
+			(pos_t) INT64_MAX : (pos_t) UNSIGNED_MAX(len_t))
+
+/* Every entry of the file .dkv has the following form (the flag being the
+ * highest bit of the stored offset, see get_dkv_entries) */
 typedef struct {
-	len_t mem_usage; /// 1 bit flag (used/free) + size allocated space
-	len_t offset;	 /// offset to the stored data in the file .kv
+	pos_t mem_usage; /// 1 bit flag (used/free) + size allocated space
+	pos_t offset;	 /// offset to the stored data in the file .kv
 	} dkv_entry;
 
 /* This struct provides a way to link a stored data to his
  * slot of the fil .dkv
  */
 typedef struct {
-	len_t offset_kv; /// offset to the data in the file .kv
+	pos_t offset_kv; /// offset to the data in the file .kv
 	len_t dkv_slot;  /// number of the slot refering to that data
 	} kv_stored;
 
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~ FILE .BF (BLOOM FILTER) ~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+/**
+ * The optional file .bf holds a blocked Bloom filter of the stored keys: a
+ * key sets BF_PROBES bits in a single line of BF_LINE bytes (a cache line),
+ * chosen by a hash independent from the directory. A key whose bits are not
+ * all set is certainly absent, and kv_get answers without reading .h nor 
+ * .blk. kv_del clears no bit: the deleted keys are forgotten when the filter
+ * is rebuilt, at the end of a compaction, or when it is rebuilt twice bigger
+ * because it holds more than one key every BF_BITS bits.
+ *
+ * The filter is written by kv_sync. Before the first key added after a sync
+ * the state in the header becomes BF_DIRTY: a filter found dirty at the 
+ * opening may miss keys, it is rebuilt (or ignored if the database is 
+ * read-only).
+ *
+ * Header of .bf (the lines start at BF_LINE):
+ * Magic number | state | number of lines | keys added | keys deleted
+ */
+#define MGN_BF 0x62666c74
+#define HSIZE_BF (MGN_SIZE + 2*sizeof (len_t) + 2*sizeof (pos_t))
+
+#define BF_CLEAN 0
+#define BF_DIRTY 1
+
+/* Size of a line, number of bits set by a key in its line */
+#define BF_LINE 64
+#define BF_PROBES 7
+
+/* Bits of the filter per key (about 1% of false positives) */
+#define BF_BITS 10
+
+/* Min number of lines of a filter */
+#define BF_MIN_LINES 64
+
+/* Number of keys a filter can hold */
+#define BF_CAPACITY(kv) ((pos_t) (kv)->bf_lines * BF_LINE * CHAR_BIT / BF_BITS)
+
+/* Suffix of the file of the filter */
+#define BF_SFFX ".bf"
+
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~ FILE .BLOB (BLOB LOG) ~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+/**
+ * The optional file .blob (mode 'v') keeps the big values apart from .kv: a
+ * value of at least blob_min bytes is appended to this log, and its record
+ * in .kv only holds the key and a reference to it. The big values thus 
+ * don't fragment the free spaces of .kv. A record of the log has the same 
+ * form as a record of .kv (the key is kept for the garbage collector):
+ *
+ * | key size | key | value size | value |
+ *
+ * and the value of the record of .kv referring to it is:
+ *
+ * | BLOB_FLAG + BLOB_REF_SIZE | value size | offset of the record in .blob |
+ *
+ * Once a database has a log, the values of BLOB_FLAG bytes or more always go
+ * there: a size of value with this flag is always a reference.
+ *
+ * The records of the log never change, an overwritten or deleted value 
+ * becomes garbage. kv_compact, once .kv is compact, rewrites the log when
+ * the garbage is more than half of it (see blob_gc): the records still
+ * referenced slide towards the beginning of the file and their references
+ * are updated.
+ *
+ * Header of .blob (the records follow it):
+ * Magic number | blob_min | bytes of garbage
+ */
+#define MGN_BLOB 0x626c6f62
+#define HSIZE_BLOB (MGN_SIZE + sizeof (len_t) + sizeof (pos_t))
+
+/* Flag of the size of a value referring to the log, size of the reference */
+#define BLOB_FLAG FLAG_USED
+#define BLOB_REF_SIZE (sizeof (len_t) + sizeof (pos_t))
+
+/* Default min size of the values of the log */
+#define BLOB_MIN 4096
+
+/* Does a value go to the log? */
+#define IS_BLOB(kv, val) ((kv)->_fd_blob != -1 && ((val)->len >= BLOB_FLAG \
+			|| ((kv)->blob_min != 0 && (val)->len >= (kv)->blob_min)))
+
+/* Is a size of value read in .kv the one of a reference to the log? */
+#define IS_BLOB_REF(kv, size) ((kv)->_fd_blob != -1 && \
+			((size) & BLOB_FLAG) != 0)
+
+/* Size taken in .kv by a value */
+#define VAL_SPACE(kv, val) (IS_BLOB(kv, val)? BLOB_REF_SIZE : (val)->len)
+
+/* The log is rewritten when it is mostly garbage */
+#define BLOB_GC_NEEDED(kv) ((kv)->_fd_blob != -1 && \
+			2 * (kv)->blob_garbage > (kv)->blob_end - HSIZE_BLOB)
+
+/* Suffix of the file of the log */
+#define BLOB_SFFX ".blob"
+
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~ FILE .WAL (WRITE-AHEAD LOG) ~~~~~~~~~~~~~~~~~~~~~~~*/
+
+/**
+ * The files of a database are only consistent after a checkpoint: kv_sync,
+ * kv_close, or a change making the log grow beyond WAL_MAX. With the 
+ * optional file .wal (mode 'j'), a database survives a crash between two
+ * checkpoints. Since the last checkpoint, the log has received:
+ * - a redo record for each change (kv_put, kv_del, kv_put_batch), once the
+ *   change is done and before the call returns, or a single one for all
+ *   the changes of a kv_batch_commit;
+ * - an undo record for each page of the files modified in place: the 
+ *   content of the page at the checkpoint, written before its first 
+ *   modification (see wal_undo).
+ * kv_open, when it finds records in the log, puts back the pages and the
+ * sizes of the files at the checkpoint, replays the changes and makes a
+ * checkpoint, which empties the log. A torn record (a crash while it was
+ * written) ends the log.
+ *
+ * The records are written by write(), hence survive a crash of the process.
+ * For a crash of the system, the sync policy (KV_OPT_SYNC) gives when the
+ * redo records are synced: never (KV_SYNC_NONE, only the checkpoints), by a
+ * thread every n ms (n > 0), or before a change returns (KV_SYNC_ALWAYS). In
+ * the last case the writers waiting for the sync share the same fdatasync 
+ * (group commit, see wal_sync_to). Whatever the policy, the undo records 
+ * are synced before the pages they save are modified: a page written in
+ * place can reach the disk at any time (eviction from the pool, mapping of
+ * .h), and the database could not go back to its checkpoint without them.
+ * The policy thus only decides how many of the last changes may be lost.
+ *
+ * Record: | type | payload size | payload | checksum |
+ * WAL_PUT:  | key size | key | value size | value |
+ * WAL_DEL:  | key size | key |
+ * WAL_UNDO: | file | offset | content of the page |
+ * WAL_BATCH: | WAL_PUT | key size | key | value size | value | 
+ *	      | WAL_DEL | key size | key | ... (one per change, see batch_next)
+ * The checksum chains wyhash64 on the head and on the parts of the payload
+ * (see wal_parts).
+ *
+ * Header of .wal (the records follow it):
+ * Magic number | sizes of the files at the checkpoint | checksum
+ */
+#define MGN_WAL 0x77616c30
+#define HSIZE_WAL (MGN_SIZE + WAL_FILES * sizeof (pos_t) + sizeof (uint64_t))
+
+/* Types of records */
+#define WAL_PUT 1
+#define WAL_DEL 2
+#define WAL_UNDO 3
+#define WAL_BATCH 4
+
+/* Size of the head and of the checksum of a record */
+#define WAL_HEAD (sizeof (len_t) + sizeof (pos_t))
+#define WAL_SUM sizeof (uint64_t)
+
+/* Files saved by the undo records (a file of size 0 did not exist) */
+#define WAL_H 0
+#define WAL_BLK 1
+#define WAL_KV 2
+#define WAL_DKV 3
+#define WAL_BLOB 4
+#define WAL_FILES 5
+
+/* Size of the pages saved by the undo records */
+#define WAL_PAGE 4096
+
+/* Size of the log triggering a checkpoint */
+#define WAL_MAX (64 << 20)
+
+/* Suffix of the file of the log */
+#define WAL_SFFX ".wal"
+
+/* Point of the log a change waits for before returning (0: none) */
+#define WAL_WAIT(kv) (((kv)->wal_redo && \
+			(kv)->wal_policy == KV_SYNC_ALWAYS)? (kv)->wal_lsn : 0)
+
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ INDEX TREES ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+/**
+ * An index tree is an AVL tree whose keys are couples (k1, k2) of pos_t
+ * compared in lexicographic order. Each node carries a value and the node of
+ * its subtree having the smallest k2, which allows to find in logarithmic
+ * time the smallest k2 among the keys whose k1 is greater than a given value.
+ *
+ * The nodes live in a pool (an array reallocated when needed) and are
+ * referred by their number in the pool, the number 0 meaning "no node".
+ *
+ * The free spaces of the file .kv are indexed by such a tree, with k1 = size
+ * of the free space and k2 = offset of the free space. All the entries of
+ * .dkv are also indexed by offset (k1 = offset, k2 = 0 and value = slot of
+ * dkv_cache): this index keeps them sorted while the slots of dkv_cache 
+ * never move, except when the last one fills a removed slot.
+ */
+
+/* A node of an index tree */
+typedef struct {
+	pos_t k1, k2;	   /// Key
+	len_t val;	   /// Value associated to the key
+	len_t min_k2;	   /// Node of the subtree with the smallest k2
+	len_t left, right; /// Children
+	len_t height;	   /// Height of the subtree
+	} idx_node;
+
+/* An index tree */
+typedef struct {
+	idx_node* nodes;   /// Pool of nodes (the node 0 is never used)
+	len_t max_nodes;   /// Number of nodes allocated in the pool
+	len_t used_nodes;  /// Number of nodes of the pool used at least once
+	len_t free_nodes;  /// Chain of released nodes (linked by `right`)
+	len_t root;	   /// Root of the tree
+	} idx_tree;
+
+
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ COMMON ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 /* Hash functions identifiers */
 #define HASH_1 1
 #define HASH_2 2
 #define HASH_3 3
+#define HASH_4 4 /// xxHash32 (directories with linear hashing only)
+#define HASH_5 5 /// wyhash (directories with linear hashing only)
+
+/* Number of distinct hash values (= number of slots of the file .h) */
+#define NB_HASH 999983
+
+/**
+ * The directory of the version 2 of the file .h grows by linear hashing: it
+ * has (H_BUCKETS << level) + split buckets, the bucket of a hash being given
+ * by its last bits (see h_bucket). When the average number of keys per bucket
+ * exceeds H_LOAD, the bucket `split` is split between itself and the bucket 
+ * (H_BUCKETS << level) + split. Once all the buckets of a level have been
+ * split, the level is incremented and split goes back to 0.
+ * The version 1 of the file has a fixed directory of NB_HASH buckets.
+ */
+
+/* Number of buckets at level 0 */
+#define H_BUCKETS 256
+
+/* Max number of buckets */
+#define H_MAX_BUCKETS (1 << 24)
+
+/* Average number of keys per bucket above which a bucket is split */
+#define H_LOAD(kv) (MAX_BLK_ENTR(kv) / 2)
 
 /* Minimum allocation/deallocation unit for a cache 
- * @note Currently the only cache implemented is the one refering to the
- * 	 entries of the file .dkv
+ * @note This concerns the cache of the entries of the file .dkv, the
+ *	 blocks of .blk have their own buffer pool
  */
 #define CACHE_PAGE 4096
 
 /* This flag marks an address/reference of type len_t as used.
- * In this program it is employed to mark a dkv_entry or the header of a block.
+ * In this program it is employed to mark the header of a block, and the
+ * entries of .dkv stored on 32 bits.
  * @result First bit = 1, rest of the bits = 0 (0x800...000)
  */
 #define FLAG_USED ((len_t) 1 << (sizeof (len_t)*CHAR_BIT-1)) //
 
+/* Same flag, marking a dkv_entry in memory (and in the large format) */
+#define DKV_USED ((pos_t) 1 << (sizeof (pos_t)*CHAR_BIT-1))
+
 /**
  * Slice a selection of bits (numeroted from 0 to n-1) 
  * @param: x Data from where to slice
@@ -153,14 +581,113 @@ typedef struct {
 
 
 
+/* Max number of buffers of a vectored write (see safe_writev_at) */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /* Calculate max unsigned value of t */
 #define UNSIGNED_MAX(t) (( (unsigned long long) 1 << \
 			   (sizeof (t) * CHAR_BIT) ) - 1)
 
 
 
-typedef enum { false, true} bool;
+/**
+ * The blocks are read and written through a buffer pool: a fixed number of
+ * pages, each one holding a whole block, replaced in LRU order. The modified
+ * pages are written back to the file when replaced and by kv_sync.
+ * The pages are numbered from 1, the page 0 only being the head of the
+ * circular LRU list (its `next` is the most recently used page).
+ */
+
+/* Default number of pages of the buffer pool (see kv_setopt) */
+#define BLK_POOL_PAGES 256
+
+/* A page of the buffer pool */
+typedef struct {
+	pos_t offset;	   /// Offset of the block in .blk (0 = unused page)
+	bool dirty;	   /// Modified since it has been read
+	len_t prev, next;  /// Neighbours in the LRU list
+	len_t hnext;	   /// Next page in the same bucket
+	char data[SIZE_BLK]; /// Content of the block
+	} blk_page;
+
+/* The buffer pool */
+typedef struct {
+	blk_page* pages;   /// Pages (nb_pages + 1 with the head of the list)
+	len_t nb_pages;	   /// Number of usable pages
+	len_t* buckets;	   /// Pages indexed by number of block (nb_pages)
+	unsigned long hits;   /// Blocks found in the pool
+	unsigned long misses; /// Blocks read from the file
+	pthread_mutex_t mutex; /// Protects the pool from concurrent kv_get
+	} blk_pool;
+
+
+
+/* A read-only mapping of the file .kv, used by the views (see kv_get_view) */
+typedef struct {
+	char* ptr;	   /// Start of the mapping (offset 0 of .kv)
+	size_t size;	   /// Size (bytes) of the mapping
+	} kv_mapping;
+
+/* Max size (bytes) of the run of couples moved at once by kv_compact */
+#define COMPACT_RUN (1 << 20)
+
+/* Minimum size of the mapping of .kv */
+#define MIN_KV_MAP (1 << 20)
+
+/**
+ * A sharded database (see kv_open_sharded) spreads its keys between the
+ * databases dbname.0 ... dbname.n-1, the shard of a key being given by a
+ * hash independent from the one of the buckets (see shard_index).
+ */
+
+/* Max number of shards */
+#define MAX_SHARDS 1024
+
+/* Seed of the hash of the shards ("shrd") */
+#define SHARD_SEED 0x73687264
+
+/* Min and max size of the scratch buffer of a database (see scratch_get) */
+#define MIN_SCRATCH 4096
+#define MAX_SCRATCH (1 << 20)
+
+/* Alignment of the data taken from the arena of the user (see alloc_datum) */
+#define ARENA_ALIGN 16
+
+/* Max number of entries sorted in memory by the bulk loader (see
+ * kv_build_add), the following ones are spilled to a temporary file */
+#define BUILD_RUN (1 << 20)
+
+/* Size of the write buffers of the bulk loader */
+#define BUILD_BUFFER (1 << 20)
+
+/* Number of entries read at once from each run by the merge */
+#define BUILD_READ 4096
 
+/* Suffix of the temporary file of the bulk loader */
+#define BUILD_SFFX ".runs"
+
+/* Suffix of the database built by the converter (see kv_convert) */
+#define CONV_SFFX ".conv"
+
+/* Initial size of the buffer of a batch (see kv_batch_begin) */
+#define BATCH_BUFFER 4096
+
+/* A couple added by the bulk loader, sorted by bucket then by offset */
+typedef struct {
+	len_t hash;	 /// Hash of the key
+	pos_t offset_kv; /// Offset to the couple in .kv (0 = overwritten)
+	len_t fp;	 /// Fingerprint of the key
+	} build_entry;
+
+/* A sorted run of entries, read back by the merge */
+typedef struct {
+	build_entry* buf; /// Entries read from the run
+	size_t pos, len;  /// Next entry to return and number of entries in buf
+	size_t left;	  /// Entries of the run not read yet
+	off_t next;	  /// Offset of these entries in the temporary file
+	} build_run;
 
 
 /**
@@ -173,24 +700,144 @@ struct KV {
 	int _fd_blk;		/// File descriptor for the file .blk
 	int _fd_kv;		/// File descriptor for the file .kv
 	int _fd_dkv;		/// File descriptor for the file .dkv
+	int _fd_bf;		/// File descriptor for the file .bf (or -1)
+	int _fd_blob;		/// File descriptor for the file .blob (or -1)
+	int _fd_wal;		/// File descriptor for the file .wal (or -1)
 
 	/* Behaviour */
 	int flags;		/// Opening flags
+	int off_size;		/// Size of the offsets in the files (4 or 8)
 	bool write_only;	/// Read perissions
 	alloc_t alloc;		/// Id of the allocation function
 	len_t (*_hash_fun)(const kv_datum*); /// Pointer to the hash function
+	bool bf_create;		/// Create the Bloom filter if missing (mode 'b')
+	bool blob_create;	/// Create the blob log if missing (mode 'v')
+	bool wal_create;	/// Create the write-ahead log if missing ('j')
+
+	/* Directory (file .h) */
+	int h_version;		/// Version of the file .h (1 or 2)
+	len_t h_level;		/// Level of the linear hashing (version 2)
+	len_t h_split;		/// Next bucket to split (version 2)
+	pos_t nb_keys;		/// Number of stored keys (version 2)
 
 	/* Mem usage infos */	
+	int blk_version;	/// Version of the file .blk (1, 2 or 3)
 	len_t nb_blocks;	/// Number allocated blocks on the file .blk
 	len_t nb_dkv_entries;	/// Number of entries on the file .dkv	
-	len_t end_kv;		/// Offset to the end of the file .kv
+	pos_t end_kv;		/// Offset to the end of the file .kv
 
 	/* Caches */
-	len_t max_dkv_cache;	/// Amount of memory allocated for dkv_cache
+	char* h_map;		/// Mapping of the file .h (header included)
+	size_t h_map_size;	/// Size (bytes) of the mapping h_map
+	size_t max_dkv_cache;	/// Amount of memory allocated for dkv_cache
+	bool dkv_loaded;	/// The file .dkv has been loaded in dkv_cache
 	dkv_entry* dkv_cache;	/// Array containing the entries of .dkv
+	char* dkv_dirty;	/// Pages of dkv_cache modified since last sync
+	len_t synced_dkv_entries; /// Number of entries in the file .dkv
+	idx_tree free_space;	/// Free entries of .dkv indexed by size
+	idx_tree dkv_offsets;	/// Entries of .dkv indexed by offset
+	blk_pool pool;		/// Buffer pool of the blocks of .blk
+	kv_mapping kv_map;	/// Mapping of .kv used by the views
+	kv_mapping* old_kv_maps; /// Smaller mappings, kept for older views
+	int nb_old_kv_maps;	/// Number of old mappings
+	pthread_mutex_t kv_map_mutex; /// Protects the mappings of .kv
+	char* view_copies;	/// Copies of the inline couples and of the
+				/// values of .blob returned as views (list,
+				/// see view_alloc)
+
+	/* Temporaries and returned data */
+	char* scratch;		/// Buffer of the writers (see scratch_get)
+	size_t scratch_size;	/// Size (bytes) of scratch
+	kv_arena* arena;	/// Memory of the user for the returned data
+				/// (NULL: malloc, see kv_set_arena)
+	pthread_mutex_t arena_mutex; /// Protects arena from concurrent kv_get
+
+	/* Bloom filter (file .bf) */
+	uint64_t* bf;		/// Lines of the filter (NULL without filter)
+	len_t bf_lines;		/// Number of lines
+	pos_t bf_keys;		/// Keys added (having set some bit)
+	pos_t bf_dels;		/// Keys deleted since the filter was built
+	char* bf_dirty;		/// Pages of bf modified since last sync
+	bool bf_clean;		/// The file .bf is marked BF_CLEAN
+	bool bf_changed;	/// The filter changed since last sync
+
+	/* Blob log (file .blob) */
+	len_t blob_min;		/// Min size of the values of the log (0: the
+				/// values go there only if they are huge)
+	pos_t blob_end;		/// End of the log
+	pos_t blob_garbage;	/// Bytes of the records no more referenced
+	bool blob_changed;	/// The header changed since last sync
+
+	/* Write-ahead log (file .wal) */
+	pos_t wal_sizes[WAL_FILES]; /// Sizes of the files at the checkpoint
+	idx_tree wal_pages;	/// Pages having an undo record (k1 = file, 
+				/// k2 = number of the page)
+	bool wal_undo;		/// Undo records are written
+	bool wal_redo;		/// Redo records are written (not during the
+				/// replay)
+	pos_t wal_end;		/// End of the log
+	pos_t wal_replay;	/// End of the records to replay (0: none)
+	long wal_policy;	/// Sync policy (see KV_OPT_SYNC)
+	uint64_t wal_lsn;	/// Bytes written to the log since kv_open
+	uint64_t wal_synced;	/// Bytes of wal_lsn synced
+	bool wal_syncing;	/// A thread is syncing the log
+	bool wal_stop;		/// The thread of the policy must stop
+	bool wal_thread_on;	/// The thread of the policy runs
+	pthread_t wal_thread;	/// Thread syncing the log every n ms
+	pthread_mutex_t wal_mutex; /// Protects the sync state of the log
+	pthread_cond_t wal_cond; /// Signals the end of a sync, or the stop
+
+	/* Shards (see kv_open_sharded) */
+	KV** shards;		/// Databases of the shards (NULL if not sharded,
+				/// no file is then open)
+	len_t nb_shards;	/// Number of shards
+	len_t next_shard;	/// Shard read by kv_next
+	KV* parent;		/// Sharded database of a shard (NULL if none)
+
+	/* Concurrency */
+	pthread_rwlock_t lock;	/// Shared by kv_get, exclusive otherwise
 
 	/* Others */
-	len_t next_entry;	/// Used by kv_next to return the correct value
+	pos_t next_entry;	/// Used by kv_next to return the correct value
+				/// (offset of .kv or slot of .dkv)
+};
+
+
+/**
+ * A database being built by the bulk loader (see kv_build_open). The couples
+ * are appended to .kv and .dkv, their entries are sorted by bucket (through
+ * runs spilled to a temporary file if needed) and the files .blk and .h are
+ * written at once by kv_build_close.
+ */
+struct kv_builder {
+	KV* kv;			/// Database being built
+	char* kv_buf;		/// Couples not written yet (then blocks)
+	size_t kv_used;		/// Bytes used in kv_buf
+	dkv_entry* dkv_buf;	/// Entries of .dkv not written yet
+	size_t dkv_used;	/// Entries used in dkv_buf
+	build_entry* entries;	/// Entries not spilled yet (BUILD_RUN max)
+	size_t nb_entries;	/// Entries used in entries
+	char* runs_name;	/// Name of the temporary file of the runs
+	int _fd_runs;		/// File descriptor of this file (-1 if none)
+	size_t* runs;		/// Number of entries of each run spilled
+	size_t nb_runs;		/// Number of runs spilled
+	pos_t* dead;		/// Offsets of the overwritten couples
+	size_t nb_dead;		/// Number of overwritten couples
+	size_t max_dead;	/// Size of the array dead
+	len_t blk_written;	/// Blocks already written into .blk
+};
+
+
+/**
+ * A batch of changes being prepared (see kv_batch_begin). The changes are
+ * kept as the payload of the WAL_BATCH record logging them.
+ */
+struct kv_batch {
+	KV* kv;			/// Database
+	char* ops;		/// Changes (see batch_next)
+	pos_t len;		/// Bytes used in ops
+	pos_t size;		/// Size of ops
+	size_t nb_ops;		/// Number of changes
 };
 
 
@@ -200,6 +847,23 @@ struct KV {
 
 /*~~~~~~~~~~~~~~~~~~~~~ INTERNAL FUNCTIONS PROTOTYPES ~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
+/*************** API bodies (called with kv->lock held) ***********/
+
+int sync_kv(KV *kv);
+int put_entry(KV *kv, const kv_datum *key, const kv_datum *val);
+int put_batch
+(KV *kv, const kv_datum *keys, const kv_datum *vals, size_t n);
+int get_entry(KV *kv, const kv_datum *key, kv_datum *val);
+int read_entry(KV *kv, const kv_datum *key, kv_datum *val);
+int commit_batch(KV *kv, const kv_batch *b);
+int get_many
+(KV *kv, const kv_datum *keys, kv_datum *vals, int *status, size_t n);
+int del_entry(KV *kv, const kv_datum *key);
+int next_couple(KV *kv, kv_datum *key, kv_datum *val);
+int get_view(KV *kv, const kv_datum *key, kv_datum *val);
+int next_view(KV *kv, kv_datum *key, kv_datum *val);
+int compact_kv(KV *kv, size_t max_bytes);
+
 /*************** Opening and closure database ********************/
 
 void initKV(KV *db);
@@ -209,7 +873,26 @@ int setHashFun(KV *db, int hidx);
 int writeHeaders(KV *db, int hidx);
 void infail_kvclose(KV *db);
 int load_cache(KV* kv);
+int need_dkv(KV* kv);
 int useHeaders(KV *db);
+int map_h(KV *kv);
+char* map_kv(KV *kv);
+void release_views(KV *kv);
+void unmap_kv(KV *kv);
+int upgrade_blk(KV *kv, const char *dbname);
+
+/* Shards (see kv_open_sharded) */
+len_t count_shards(const char *dbname, len_t max);
+len_t shard_index(KV *kv, const kv_datum *key);
+KV *shard_of(KV *kv, const kv_datum *key);
+void shard_order
+(KV *kv, const kv_datum *keys, size_t n, size_t *order, size_t *first);
+int shard_put_batch
+(KV *kv, const kv_datum *keys, const kv_datum *vals, size_t n);
+int shard_get_many
+(KV *kv, const kv_datum *keys, kv_datum *vals, int *status, size_t n);
+int shard_next(KV *kv, kv_datum *key, kv_datum *val, bool view);
+int close_shards(KV *kv);
 
 /*************** Memory management ******************************/
 
@@ -217,66 +900,238 @@ int useHeaders(KV *db);
 int insert_first_entry
 (KV *kv, len_t hash, const kv_datum *key, const kv_datum *val);
 int insert_to_chain 
-(KV *kv, const kv_datum *key, const kv_datum *val, len_t offset_first_blk);
+(KV *kv, const kv_datum *key, const kv_datum *val, pos_t offset_first_blk);
+int link_slot(KV *kv, const scan_infos *infos, pos_t offset_kv, len_t fp);
+int link_inline
+(KV *kv, const scan_infos *infos, const kv_datum *key, const kv_datum *val);
+pos_t find_room(KV *kv, const scan_infos *infos, len_t need);
+int link_entry(KV *kv, len_t hash, const kv_datum *key, 
+	       const kv_datum *val, pos_t offset_kv);
+int cmp_batch_entries(const void *a, const void *b);
+
+/* Batches of changes (kv_batch_*) */
+int batch_add
+(kv_batch *b, len_t type, const kv_datum *key, const kv_datum *val);
+int batch_next(const char *ops, pos_t size, pos_t *used, len_t *type,
+	       kv_datum *key, kv_datum *val);
+int cmp_batch_ops(const void *a, const void *b);
+void undo_batch(KV *kv, const batch_op *ops, size_t n);
 
 /* Insertion into .dkv */
 int push_dkv_entry(KV *kv, const dkv_entry* dkv_content);
+int resize_dkv_cache(KV *kv, size_t size);
+int sync_dkv(KV *kv);
 int use_dkv_slot(KV *kv, len_t offset, dkv_entry* new);
-#ifdef _SORT_DKV_
-int shift_dkv(KV *kv, len_t pos, int dir);
-#endif
 
 /* Store data into .kv */
 int store_kv
 (KV *kv, const kv_datum* key, const kv_datum* value, kv_stored* ref_kv);
 int write_to_kv
-(KV* kv, len_t offset, const kv_datum* key ,const kv_datum* value);
+(KV* kv, pos_t offset, const kv_datum* key ,const kv_datum* value, len_t flag);
+int stored_value(KV *kv, const kv_datum *key, const kv_datum *val, 
+		 char *ref, kv_datum *stored);
+int rewrite_kv
+(KV *kv, pos_t offset_kv, const kv_datum* key, const kv_datum* value);
 
 /* Blocks allocation (file .blk) */
-len_t allocate_blk(KV *kv, len_t* block_number);
-len_t extend_blocks_chain(KV *kv, len_t last_block);
+pos_t allocate_blk(KV *kv, len_t* block_number);
+pos_t extend_blocks_chain(KV *kv, pos_t last_block);
 
 /* Suppressions  */
-int remove_data(KV *kv, len_t kv_offset);
+int remove_data(KV *kv, pos_t kv_offset);
+int free_entry(KV *kv, const scan_infos *infos);
+
+/* Compaction of .kv */
+int compact_run(KV *kv, size_t *moved);
+int move_data(KV *kv, pos_t offset_kv, pos_t new_offset, const char *data);
+pos_t find_slot(KV *kv, len_t hash, pos_t offset_kv);
+
+/* Bulk loading (see kv_build_open) */
+kv_builder *build_open(const char *dbname, int hidx, const char *mode);
+int build_flush(kv_builder *b);
+int build_spill(kv_builder *b);
+int build_index(kv_builder *b);
+int build_next(kv_builder *b, build_run *runs, size_t n, build_entry *e);
+int build_bucket(kv_builder *b, build_entry *bucket, size_t n);
+int build_flush_blocks(kv_builder *b);
+int build_dkv(kv_builder *b);
+void build_drop(kv_builder *b);
+int cmp_build_entries(const void *a, const void *b);
+int cmp_build_fps(const void *a, const void *b);
+int cmp_offsets(const void *a, const void *b);
+int rename_db(const char *from, const char *to);
 
 /********************** Search/compute ******************************/
 
 /* Find entries */
-int scan_blocks
-(KV *kv, len_t offset_blk, const kv_datum *key, scan_infos *infos);
-len_t key_to_kv(KV* kv, const kv_datum *key, len_t* block_slot);
-int dkv_find_contiguos(KV* kv,len_t offset_kv, len_t indexes[3], bool found[3]);
+int scan_blocks(KV *kv, pos_t offset_blk, const kv_datum *key, len_t need,
+		scan_infos *infos);
+int key_to_kv(KV* kv, const kv_datum *key, scan_infos *infos);
+int find_bucket_keys(KV *kv, const kv_datum *keys, kv_datum *vals, 
+		     int *status, many_entry *entries, size_t n);
+int match_key(KV *kv, pos_t offset_kv, const kv_datum *key, len_t *val_len);
+int cmp_many_buckets(const void *a, const void *b);
+int cmp_many_values(const void *a, const void *b);
+int dkv_find_contiguos(KV* kv,pos_t offset_kv, len_t indexes[3], bool found[3]);
+len_t dkv_lookup(KV* kv, pos_t offset_kv);
+int dkv_set_slot(KV *kv, len_t dkv_slot, const dkv_entry* entry);
+int dkv_remove_slot(KV *kv, len_t dkv_slot, len_t* follow);
+int next_record(KV *kv, pos_t *key_offset, pos_t *cursor, char *record);
+int next_inline(KV *kv, pos_t *cursor, char *record);
 
 /* Free memory space */
 int first_fit
-(KV *kv, len_t size, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
+(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
 int worst_fit
-(KV *kv, len_t size, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
+(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
 int best_fit
-(KV *kv, len_t size, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
+(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
+int use_free_space
+(KV *kv, len_t node, dkv_entry* dkv_content ,len_t* dkv_entry_offset);
+int end_kv_space(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_slot);
+int index_dkv(KV *kv);
+
+/* Index trees */
+int idx_insert(idx_tree *t, pos_t k1, pos_t k2, len_t val);
+int idx_reserve(idx_tree *t);
+int idx_remove(idx_tree *t, pos_t k1, pos_t k2);
+len_t idx_lower_bound(idx_tree *t, pos_t k1, pos_t k2);
+len_t idx_prev(idx_tree *t, pos_t k1, pos_t k2);
+len_t idx_max(idx_tree *t);
+len_t idx_first_fit(idx_tree *t, pos_t k1);
+void idx_drop(idx_tree *t);
+void idx_update(idx_tree *t, len_t n);
+len_t idx_rotate_right(idx_tree *t, len_t n);
+len_t idx_rotate_left(idx_tree *t, len_t n);
+len_t idx_balance(idx_tree *t, len_t n);
+len_t idx_insert_node(idx_tree *t, len_t n, len_t new);
+len_t idx_remove_min(idx_tree *t, len_t n);
+len_t idx_remove_node
+(idx_tree *t, len_t n, pos_t k1, pos_t k2, len_t *removed);
+
+/* Bloom filter (file .bf) */
+int bf_open(KV *kv, const char *dbname);
+int bf_build(KV *kv, pos_t extra);
+int bf_reserve(KV *kv, size_t n);
+uint64_t bf_hash(const kv_datum *key);
+bool bf_test(KV *kv, const kv_datum *key);
+int bf_add(KV *kv, const kv_datum *key);
+void bf_del(KV *kv);
+int bf_mark(KV *kv);
+int bf_sync(KV *kv);
+void bf_drop(KV *kv);
+
+/* Blob log (file .blob) */
+int blob_open(KV *kv, const char *dbname);
+int blob_put(KV *kv, const kv_datum *key, const kv_datum *val, char *ref);
+int blob_get(KV *kv, len_t key_len, const char *ref, kv_datum *val);
+int blob_forget(KV *kv, pos_t offset_kv);
+int blob_gc(KV *kv);
+int blob_sync(KV *kv);
+void blob_drop(KV *kv);
+
+/* Write-ahead log (file .wal) */
+int wal_open(KV *kv, const char *dbname);
+int wal_restore(KV *kv, const char *dbname);
+int wal_recover(KV *kv);
+int wal_read(KV *kv, pos_t offset, char **record, pos_t *size);
+int wal_parts(len_t type, char *payload, pos_t size, struct iovec *iov);
+uint64_t wal_sum(const char *head, const struct iovec *iov, int n);
+int wal_write(KV *kv, len_t type, const struct iovec *iov, int n);
+int wal_put(KV *kv, const kv_datum *key, const kv_datum *val);
+int wal_del(KV *kv, const kv_datum *key);
+int wal_batch(KV *kv, const kv_batch *b);
+int wal_apply(KV *kv, len_t type, const kv_datum *key, const kv_datum *val);
+int wal_trim(KV *kv);
+int wal_undo(KV *kv, int file, pos_t offset, pos_t size);
+int wal_truncate(KV *kv, int file, pos_t size);
+int wal_fd(KV *kv, int file);
+int wal_checkpoint(KV *kv);
+int wal_sync_to(KV *kv, uint64_t lsn);
+int wal_set_policy(KV *kv, long policy);
+void* wal_flusher(void *arg);
+void wal_drop(KV *kv);
 
 /* Hash functions */
 len_t hash_fun1(const kv_datum *key);
 len_t hash_fun2(const kv_datum *key);
 len_t hash_fun3(const kv_datum *key);
+len_t hash_full1(const kv_datum *key);
+len_t hash_full2(const kv_datum *key);
+len_t hash_full3(const kv_datum *key);
+len_t hash_xxh32(const kv_datum *key);
+len_t hash_wyhash(const kv_datum *key);
+uint64_t wyhash64(const kv_datum *key, uint64_t seed);
+uint32_t read_u32(const unsigned char *p);
+uint64_t read_u64(const unsigned char *p);
+void wy_mum(uint64_t *a, uint64_t *b);
+uint64_t wy_mix(uint64_t a, uint64_t b);
+len_t key_fingerprint(const kv_datum *key);
+len_t reverse_bits(len_t x);
 
 /********************** Others ******************************/
 
 /* Blocks (file .blk) */
-int read_blk(KV *kv, len_t blk_offset, block *blk) ;
+int read_blk(KV *kv, pos_t blk_offset, block *blk) ;
+int write_slot(KV *kv, pos_t offset_slot, pos_t offset_kv, len_t fingerprint);
+int write_blk_head(KV *kv, pos_t blk_offset, len_t header);
+int write_inline
+(KV *kv, pos_t offset_slot, const kv_datum *key, const kv_datum *val);
+void inline_datums(const char *record, kv_datum *key, kv_datum *val);
+char* view_record(KV *kv, const char *record);
+char* view_alloc(KV *kv, size_t size);
+int view_blob(KV *kv, len_t key_len, const char *ref, kv_datum *val);
+
+/* Buffer pool of .blk */
+int pool_init(KV *kv, len_t nb_pages);
+void pool_clear(KV *kv);
+void pool_drop(KV *kv);
+int pool_flush(KV *kv);
+char* pool_page(KV *kv, pos_t blk_offset, bool load, bool modify);
+void pool_touch(KV *kv, len_t page);
 
 /* kv_datum */
-int fill_datum(int fd, len_t offset, len_t size, kv_datum *dat);
+int fill_datum(KV *kv, int fd, pos_t offset, len_t size, kv_datum *dat);
+int read_value(KV *kv, pos_t val_offset, len_t key_len, kv_datum *val);
+int copy_datum(KV *kv, const char *data, len_t size, kv_datum *dat);
+void *alloc_datum(KV *kv, size_t size);
+void free_datum(KV *kv, void *ptr);
+char *scratch_get(KV *kv, size_t size);
+int read_values
+(KV *kv, kv_datum *vals, int *status, many_entry *entries, size_t n);
 void init_datum(kv_datum *dat);
 void drop_datum(kv_datum *dat);
-inline int eq_datum(const kv_datum *a, const kv_datum *b);
-int read_datum(KV *kv, len_t offset, kv_datum *dat);
+static inline int eq_datum(const kv_datum *a, const kv_datum *b);
+int read_datum(KV *kv, pos_t offset, kv_datum *dat);
+
+/* Hash table (file .h) */
+pos_t h_get(KV *kv, len_t hash);
+int h_set(KV *kv, len_t hash, pos_t offset_blk);
+len_t key_bucket(KV *kv, const kv_datum *key);
+len_t h_bucket(KV *kv, len_t hash);
+int h_grow(KV *kv);
+int split_bucket(KV *kv);
+int remap_h(KV *kv, len_t level);
+size_t chain_blocks(KV *kv, const chain_entry *entries, size_t n);
+int write_chain(KV *kv, const pos_t *blocks, size_t nb_blocks, 
+		const char *raw, const chain_entry *entries, size_t n);
 
 /* Read/write at offset */
-ssize_t read_at(int fd, len_t offset, void *buff, size_t count);
-ssize_t safe_read_at(int fd, len_t offset, void *buff, size_t count);
-ssize_t write_at(int fd, len_t offset, const void *buff, size_t count);
-ssize_t safe_write_at(int fd, len_t offset, const void *buff, size_t count);
+ssize_t read_at(int fd, pos_t offset, void *buff, size_t count);
+ssize_t safe_read_at(int fd, pos_t offset, void *buff, size_t count);
+ssize_t write_at(int fd, pos_t offset, const void *buff, size_t count);
+ssize_t safe_write_at(int fd, pos_t offset, const void *buff, size_t count);
+int safe_writev_at(int fd, pos_t offset, const struct iovec *iov, size_t iovcnt);
+
+/* Stored offsets (see OFF_SIZE) */
+pos_t get_off(KV *kv, const char *raw);
+void put_off(KV *kv, char *raw, pos_t off);
+void get_slot(KV *kv, const char *raw, len_t n, blk_slot *slot);
+void put_slot(KV *kv, char *raw, len_t n, const blk_slot *slot);
+int read_dkv_entries(KV *kv, len_t first, dkv_entry *entries, size_t n);
+int write_dkv_entries
+(KV *kv, len_t first, const dkv_entry *entries, size_t n);
+int write_dkv_head(KV *kv);
 
 
 
@@ -295,6 +1150,9 @@ KV *kv_open (const char *dbname, const char *mode, int hidx, alloc_t alloc){
 	if (  set_flags(db, mode)  == -1) goto error;
 
 	if ( openFilesKV(db,dbname,db->flags) == -1 ) goto error;
+
+	/* Back to the last checkpoint after a crash */
+	if (wal_open(db, dbname) == -1) goto error;
 				
 	struct stat infos;
 	if ( fstat(db->_fd_kv, &infos) == -1) goto error;
@@ -304,15 +1162,24 @@ KV *kv_open (const char *dbname, const char *mode, int hidx, alloc_t alloc){
 		if (setHashFun(db,hidx)    == -1 ||
 		    writeHeaders(db, hidx) == -1
 		) goto error;
+		db->dkv_loaded = true; // Nothing to load
 
 	} else {
 
-		if (useHeaders(db) == -1 ||
-		    load_cache(db) == -1
-		) goto error;
+		/* The entries of .dkv will be loaded when needed */
+		if (useHeaders(db) == -1) goto error;
 		
 	}
 
+	if (map_h(db) == -1 || pool_init(db, BLK_POOL_PAGES) == -1) goto error;
+
+	/* Old databases get fingerprints as soon as they are writable */
+	if (db->blk_version == 1 && db->flags != O_RDONLY &&
+	    upgrade_blk(db, dbname) == -1) goto error;
+
+	if (bf_open(db, dbname) == -1 || blob_open(db, dbname) == -1 ||
+	    wal_recover(db) == -1) goto error;
+
 	return db;		
 
 error: 
@@ -322,29 +1189,73 @@ error:
 
 
 
-int kv_close (KV *kv) {
+KV *kv_open_sharded 
+(const char *dbname, int nshards, const char *mode, int hidx, alloc_t alloc){
 
-	if ( kv->flags != O_RDONLY){
-		/* Sync file .blk */	
-		if ( safe_write_at(kv->_fd_blk,MGN_SIZE,
-			&kv->nb_blocks,sizeof (len_t)) == -1 ) return -1;
-	
-		/* Sync file .dkv */
-		if ( safe_write_at(kv->_fd_dkv,MGN_SIZE,
-			&kv->nb_dkv_entries,sizeof (len_t)) == -1 ) return -1;
-	
-		if ( safe_write_at(kv->_fd_dkv,MGN_SIZE + sizeof (len_t),
-			&kv->end_kv,sizeof (len_t)) == -1 ) return -1;
-	
-		if ( safe_write_at(kv->_fd_dkv, HSIZE_DKV, kv->dkv_cache,
-			kv->nb_dkv_entries * sizeof (dkv_entry)) == -1 ) return -1;
+	if (nshards < 1 || nshards > MAX_SHARDS) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-		if (ftruncate(kv->_fd_dkv, HSIZE_DKV + 
-			kv->nb_dkv_entries * sizeof (dkv_entry)) == -1) return -1;
-		
+	KV *db;
+	if ( ( db = malloc(sizeof(KV)) ) == NULL) return NULL;
+	initKV(db);
+
+	len_t i;
+	char *name = malloc(strlen(dbname) + 12); // dbname.<shard>
+	db->shards = calloc(nshards, sizeof (KV*));
+	if (name == NULL || db->shards == NULL) goto error;
+	db->nb_shards = nshards;
+
+	if (set_flags(db, mode) == -1) goto error;
+
+	/* With another number of shards, the keys would be searched in the
+	 * wrong ones */
+	if ((db->flags & O_TRUNC) == 0) {
+		i = count_shards(dbname, db->nb_shards + 1);
+		if (i != 0 && i != db->nb_shards) {
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	for (i = 0; i < db->nb_shards; i++) {
+		sprintf(name, "%s.%lu", dbname, (unsigned long) i);
+		db->shards[i] = kv_open(name, mode, hidx, alloc);
+		if (db->shards[i] == NULL) goto error;
+		db->shards[i]->parent = db;
 	}
 
+	free(name);
+	return db;
+
+error:
+	free(name);
+	int _errbkp = errno;
+	if (db->shards != NULL)
+		for (i = 0; i < db->nb_shards; i++)
+			if (db->shards[i] != NULL) kv_close(db->shards[i]);
+	free(db->shards);
+	pthread_rwlock_destroy(&db->lock);
+	free(db);
+	errno = _errbkp;
+	return NULL;
+}
+
+
+
+int kv_close (KV *kv) {
+
+	if (kv->shards != NULL) return close_shards(kv);
+
+	if (kv_sync(kv) == -1) return -1;
+
+	if (munmap(kv->h_map, kv->h_map_size) == -1) return -1;
+
 	free(kv->dkv_cache);
+	free(kv->dkv_dirty);
+	idx_drop(&kv->free_space);
+	idx_drop(&kv->dkv_offsets);
 	
 	/* Close all open files */
 	if( close(kv->_fd_h)   == -1 ||
@@ -352,6 +1263,13 @@ int kv_close (KV *kv) {
 	    close(kv->_fd_blk) == -1 ||
 	    close(kv->_fd_dkv) == -1 ) return -1;
 
+	pool_drop(kv);
+	unmap_kv(kv);
+	bf_drop(kv);
+	blob_drop(kv);
+	wal_drop(kv);
+	free(kv->scratch);
+	pthread_rwlock_destroy(&kv->lock);
 	
 	free(kv);
 	
@@ -360,1398 +1278,6855 @@ int kv_close (KV *kv) {
 }
 
 
+/*
+ * The functions of the API only take the lock of the database and call their
+ * body, in part 2. Any number of threads can call kv_get at the same time on
+ * the same database, while the other functions run alone. The changes wait
+ * for the sync of their log, if needed, once the lock is released (see 
+ * wal_sync_to).
+ * A sharded database has no file: the call goes to the shard of the key, or
+ * to each shard, whose lock is taken. Its own lock only protects next_shard.
+ */
 
-int kv_put (KV *kv, const kv_datum *key, const kv_datum *val){
-
-	len_t offset_blk;
-
-	/* hash = offset of .h */	
-	len_t hash = HSIZE_H + sizeof (len_t) * kv->_hash_fun(key);
-	
-	ssize_t nb = read_at(kv->_fd_h, hash, &offset_blk, sizeof offset_blk);
-	switch (nb){
-		case -1: return -1;
-
-		case (sizeof offset_blk):
-			 /* Add entry to chain of blocks */
-			 if (offset_blk != 0) {
-			 	if (insert_to_chain(kv, key, val, 
-					offset_blk) == -1) return -1;
-				break;
-			 }
-		case  0: /* Empty slot: first use of this hash */
-			 if (insert_first_entry( kv, hash,
-				key, val) == -1) return -1;
-			 break;
+int kv_sync (KV *kv) {
 
-		default: return -1;
+	if (kv->shards != NULL) {
+		int r = 0;
+		len_t i;
+		for (i = 0; i < kv->nb_shards; i++)
+			if (kv_sync(kv->shards[i]) == -1) r = -1;
+		return r;
 	}
-	
-	return 0;	
 
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = wal_checkpoint(kv);
+	pthread_rwlock_unlock(&kv->lock);
+
+	return r;
 }
 
 
-int kv_get (KV *kv, const kv_datum *key, kv_datum *val){
+int kv_setopt (KV *kv, kv_opt_t opt, long value) {
 
-	/* Do you have the permissions? */
-	if (kv->write_only) {
-		errno = EACCES;
-		return -1;
+	if (kv->shards != NULL) {
+		len_t i;
+		for (i = 0; i < kv->nb_shards; i++)
+			if (kv_setopt(kv->shards[i], opt, value) == -1) 
+				return -1;
+		return 0;
 	}
 
-	/* Get offset on .kv */
-	len_t key_offset;
-	if ((key_offset = key_to_kv(kv, key, NULL)) == 0){
-		return (errno == ENOENT)? 0 : -1;
+	int r = -1;
+	pthread_rwlock_wrlock(&kv->lock);
 
+	switch (opt) {
+		case KV_OPT_BLK_POOL:
+			if (value < 1 || (unsigned long) value >= 
+			    UNSIGNED_MAX(len_t) / 2) {
+				errno = EINVAL;
+				break;
+			}
+			if (pool_flush(kv) == -1) break;
+			r = pool_init(kv, value);
+			break;
+		case KV_OPT_BLOB_MIN:
+			if (kv->_fd_blob == -1 || value <= (long) BLOB_REF_SIZE ||
+			    (unsigned long) value >= BLOB_FLAG) {
+				errno = EINVAL;
+				break;
+			}
+			if (kv->flags == O_RDONLY) {
+				errno = EBADF;
+				break;
+			}
+			kv->blob_min = value;
+			kv->blob_changed = true;
+			r = 0;
+			break;
+		case KV_OPT_SYNC:
+			if (kv->_fd_wal == -1 || value < KV_SYNC_NONE) {
+				errno = EINVAL;
+				break;
+			}
+			r = wal_set_policy(kv, value);
+			break;
+		default:
+			errno = EINVAL;
 	}
 
-	/* Read size of the stored value */
-	len_t val_offset = key_offset + key->len + sizeof (len_t);
-	len_t val_size;
-	if (safe_read_at(kv->_fd_kv, val_offset, &val_size, 
-		sizeof val_size) == -1) return -1;
+	pthread_rwlock_unlock(&kv->lock);
+	return r;
+}
 
-	/* Read data */
-	if ( fill_datum(kv->_fd_kv, val_offset + sizeof (len_t),
-		 val_size, val) == -1) return -1;
 
-	return 1;
+int kv_set_arena (KV *kv, kv_arena *arena) {
+
+	if (kv->shards != NULL) {
+		len_t i;
+		for (i = 0; i < kv->nb_shards; i++)
+			kv_set_arena(kv->shards[i], arena);
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&kv->lock);
+	kv->arena = arena;
+	pthread_rwlock_unlock(&kv->lock);
 
+	return 0;
 }
 
 
-int kv_del (KV *kv, const kv_datum *key) {
+int kv_getstats (KV *kv, kv_stats *stats) {
 
-	/* Get offset on .kv, and offset on .blk */
-	len_t offset_kv, block_slot;
-	if ((offset_kv = key_to_kv(kv, key, &block_slot)) == 0){
-		return  -1;
+	if (kv->shards != NULL) {
+		kv_stats one;
+		len_t i;
+		stats->blk_hits = stats->blk_misses = 0;
+		for (i = 0; i < kv->nb_shards; i++) {
+			kv_getstats(kv->shards[i], &one);
+			stats->blk_hits += one.blk_hits;
+			stats->blk_misses += one.blk_misses;
+		}
+		return 0;
 	}
-	
-	/* Remove data on .kv */
-	if (remove_data(kv, offset_kv) == -1) return -1;
 
-	/* Remove reference on .blk */	
-	len_t zero = 0;
-	if (safe_write_at(kv->_fd_blk, block_slot, 
-		&zero, sizeof zero) == -1) return -1;
+	pthread_mutex_lock(&kv->pool.mutex);
+	stats->blk_hits = kv->pool.hits;
+	stats->blk_misses = kv->pool.misses;
+	pthread_mutex_unlock(&kv->pool.mutex);
 
 	return 0;
 }
 
-void kv_start (KV *kv){ kv->next_entry = 0; }
 
-int kv_next (KV *kv, kv_datum *key, kv_datum *val){
+int kv_put (KV *kv, const kv_datum *key, const kv_datum *val){
 
-	/* Do you have the permissions? */
-	if (kv->write_only) {
-		errno = EACCES;
-		return -1;
-	}
+	if (kv->shards != NULL) return kv_put(shard_of(kv, key), key, val);
 
-	/* End of kv */	
-	if (kv->next_entry >= kv->nb_dkv_entries) return 0;
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = put_entry(kv, key, val);
+	uint64_t lsn = WAL_WAIT(kv);
+	pthread_rwlock_unlock(&kv->lock);
 
-	/* Skip empty blocks of memory */	
-	while (DKV_IS_USED(kv->dkv_cache[kv->next_entry].mem_usage) == 0) {
-		
-		kv->next_entry++; 
-		if (kv->next_entry >= kv->nb_dkv_entries) return 0;
-	}
-	
+	if (r == 0 && lsn != 0) r = wal_sync_to(kv, lsn);
+	return r;
+}
 
-	/* Read total size of the stored key */
-	len_t key_offset = kv->dkv_cache[kv->next_entry].offset;
-	len_t key_size;
-	if (safe_read_at(kv->_fd_kv, key_offset, &key_size, 
-		sizeof key_size) == -1) return -1;
 
-	/* Read total size of the stored value */
-	len_t val_offset = key_offset + key_size + sizeof (len_t);
-	len_t val_size;
-	if (safe_read_at(kv->_fd_kv, val_offset, &val_size, 
-		sizeof val_size) == -1) return -1;
+int kv_put_batch 
+(KV *kv, const kv_datum *keys, const kv_datum *vals, size_t n){
 
-	/* Read data */
-	if ( fill_datum(kv->_fd_kv, key_offset + sizeof (len_t),
-					 key_size, key) == -1 ||
-	     fill_datum(kv->_fd_kv, val_offset + sizeof (len_t), 
-					val_size, val)	== -1 
-	   ) return -1;
-	
-	kv->next_entry++;
+	if (kv->shards != NULL) return shard_put_batch(kv, keys, vals, n);
 
-	return 1;
-}
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = put_batch(kv, keys, vals, n);
+	uint64_t lsn = WAL_WAIT(kv);
+	pthread_rwlock_unlock(&kv->lock);
 
-/*~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS BODIES (part 2: internals) ~~~~~~~~~~~~~~~~~~~*/
+	if (r == 0 && lsn != 0) r = wal_sync_to(kv, lsn);
+	return r;
+}
 
-/**
- * Translates a stored key into its offset on .kv.
- * @param kv Database
- * @param key Pointer to a struct containing the key to search
- * @param blocks If this pointer is not NULL it is filled with the offset of the
- *	  slot ( file .blk) who points to the key.
- * @return The offset of the key on the file .kv or 0 in case of error
- */
-len_t key_to_kv(KV* kv, const kv_datum *key, len_t* block_slot){
 
-	/* hash = offset of .h */	
-	len_t hash = HSIZE_H + sizeof (len_t) * kv->_hash_fun(key);
+int kv_compact (KV *kv, size_t max_bytes){
 
-	/* Read offset first block of the chain */	
-	len_t offset_blk;
-	ssize_t nb = read_at(kv->_fd_h, hash, &offset_blk, sizeof offset_blk);
+	if (kv->shards != NULL) {
+		int r = 0;
+		len_t i;
+		for (i = 0; i < kv->nb_shards; i++) {
+			switch (kv_compact(kv->shards[i], max_bytes)) {
+				case -1: return -1;
+				case 1: r = 1; 
+			}
+		}
+		return r;
+	}
 
-	switch (nb){
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = compact_kv(kv, max_bytes);
+	pthread_rwlock_unlock(&kv->lock);
 
-		case  0: errno = ENOENT;
-		case -1: return 0;
+	return r;
+}
 
-		default: if (nb < (ssize_t) sizeof offset_blk 
-					|| offset_blk == 0 ){
 
-				errno = ENOENT;
-				return 0;
-			 }
-	}
+int kv_get (KV *kv, const kv_datum *key, kv_datum *val){
 
-	
-	/* Find offset on .kv */	
-	scan_infos infos;	
-	if (scan_blocks(kv, offset_blk, key, &infos) == -1) return 0;
+	if (kv->shards != NULL) return kv_get(shard_of(kv, key), key, val);
 
-	if (infos.offset_kv == 0 ) {
-		errno = ENOENT;
-		return 0;
-	}
+	pthread_rwlock_rdlock(&kv->lock);
+	int r = get_entry(kv, key, val);
+	pthread_rwlock_unlock(&kv->lock);
 
-	if (block_slot != NULL) *block_slot = infos.slot_entry;	
-	return infos.offset_kv;
+	return r;
 }
 
 
-/**
- * Fill a given kv_datum with the data contained in the given file at the given
- * offset. If dat.ptr is NULL it is allocated, otherwise dat.len represent the
- * maximum of data to be read.
- * @param fd File descriptor
- * @param offset Offset to the value to read.
- * @param size Size of the data to read. This parameter is ignored if dat.ptr 
- *	  is not NULL, in this case dat.len is considered
- * @param dat Pointer to the kv_datum structure where to store the data
- * @return 0 in case of success, -1 otherwise
- */
-int fill_datum(int fd, len_t offset, len_t size, kv_datum *dat){
-	
-	/* Empty value */
-	if (size == 0) {
-		dat->len = 0;
-		return 0;
-	}
+int kv_get_many 
+(KV *kv, const kv_datum *keys, kv_datum *vals, int *status, size_t n){
 
-	/* Allocate ptr if necessary, adapt the size otherwise */
-	if (dat->ptr == NULL){
+	if (kv->shards != NULL) 
+		return shard_get_many(kv, keys, vals, status, n);
 
-		if ((dat->ptr = malloc(size)) == NULL) return -1;
+	pthread_rwlock_rdlock(&kv->lock);
+	int r = get_many(kv, keys, vals, status, n);
+	pthread_rwlock_unlock(&kv->lock);
 
-	} else {
-		size  = (size > dat->len)? dat->len : size;
-	}
+	return r;
+}
 
-	if (safe_read_at(fd, offset, dat->ptr, size) == -1) return -1;
 
-	dat->len = size;
+int kv_del (KV *kv, const kv_datum *key) {
 
-	return 0;
+	if (kv->shards != NULL) return kv_del(shard_of(kv, key), key);
+
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = del_entry(kv, key);
+	uint64_t lsn = WAL_WAIT(kv);
+	pthread_rwlock_unlock(&kv->lock);
+
+	if (r == 0 && lsn != 0) r = wal_sync_to(kv, lsn);
+	return r;
 }
 
 
-/**
- * Insert an entry using an empty .h slot
- * @param kv Database
- * @param hash Corresponding hash (= offset to the .h slot)
- * @param key,val Couple (key,value) to store
- * @return 0 in case of success, -1 otherwise
+/*
+ * A batch belongs to its thread until kv_batch_commit: the changes are only
+ * copied in memory, without the lock.
  */
-int insert_first_entry
-(KV *kv, len_t hash, const kv_datum *key, const kv_datum *val){
-	
-	/* Store the couple key-value */
-	kv_stored ref_kv;
-	if ( store_kv(kv, key, val, &ref_kv) == -1) return -1;
 
-	/* Allocate a new empty block */
-	len_t offset_blk = allocate_blk(kv, NULL);
-	if (offset_blk == 0) goto err_kv_lost;
+kv_batch *kv_batch_begin (KV *kv){
 
-	/* Update hash table */
-	if ( safe_write_at(kv->_fd_h, hash, &offset_blk,
-		sizeof offset_blk) == -1) goto err_blk_lost; 
+	/* The changes of a batch can only be atomic in a single shard */
+	if (kv->shards != NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-	/* Write the entry to the block */
-	if ( safe_write_at(kv->_fd_blk, offset_blk + SIZE_BLK_HEAD, 
-		&ref_kv.offset_kv, sizeof (len_t) ) == -1) goto err_kv_lost;
+	kv_batch *b = malloc(sizeof (kv_batch));
+	if (b == NULL) return NULL;
 
-	len_t n_entries = 1;
-	if ( safe_write_at(kv->_fd_blk, offset_blk , 
-		&n_entries, sizeof (len_t) ) == -1) goto err_kv_lost;
+	b->kv = kv;
+	b->ops = NULL;
+	b->len = b->size = 0;
+	b->nb_ops = 0;
 
-	return 0;
+	return b;
+}
 
 
-err_blk_lost:
-	//pop_block(KV *kv); // Further implementation
-err_kv_lost:
-	remove_data(kv, ref_kv.offset_kv);
-	return -1;
+int kv_batch_put (kv_batch *b, const kv_datum *key, const kv_datum *val){
 
+	return batch_add(b, WAL_PUT, key, val);
 }
 
 
+int kv_batch_del (kv_batch *b, const kv_datum *key){
 
-/**
- * Insert an entry to a chain of blocks 
- * @param kv Database
- * @param key,val Couple key,value to store
- * @param offset_first_blk Offset to the first block of the chain
- * @return 0 in case of success, -1 otherwie
- * @warning: the insertion of values with identical keys result in the 
- * 	     suppression of the first inserted value. If an error occours
- *	     both values could be lost
- */
-int insert_to_chain
-(KV *kv, const kv_datum *key, const kv_datum *val, len_t offset_first_blk){
-	
-	// Offsets to the slot and block where to insert the entry
-	len_t insertion_slot  = 0;  	
-	len_t insertion_block = 0;
-	
-	// By default don't increment the num of entries of the insertion block
-	bool increment_nblk_entries = false; 
+	return batch_add(b, WAL_DEL, key, NULL);
+}
 
 
-	/* Step 1: Calculate insertion_block and insertion_slot */
+int kv_batch_commit (kv_batch *b){
 
-	scan_infos infos;	
-	if (scan_blocks(kv,offset_first_blk,key,&infos) == -1) return -1;
+	KV *kv = b->kv;
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = commit_batch(kv, b);
+	uint64_t lsn = WAL_WAIT(kv);
+	pthread_rwlock_unlock(&kv->lock);
 
-	/* Check if key exists */
-	if (infos.slot_entry != 0) {
-		/* Fill slot with 0 */
-		len_t free_value = 0;
-		if ( safe_write_at(kv->_fd_blk, infos.slot_entry, 
-			&free_value, sizeof (len_t) ) == -1) return -1;
+	kv_batch_abort(b);
+	if (r == 0 && lsn != 0) r = wal_sync_to(kv, lsn);
+	return r;
+}
 
- 		/* Remove old value */
-		if ( remove_data(kv, infos.offset_kv) == -1) return -1;
 
-		/* New free slot avalable */
-		if ( infos.free_slot == 0) {
-			infos.free_slot = infos.slot_entry;
-			infos.free_block= infos.last_block;
-		}
-	}
+void kv_batch_abort (kv_batch *b){
 
+	free(b->ops);
+	free(b);
+}
 
-	/* Check if there is any free slot avalable */		
-	if (infos.free_slot != 0) {
-		/* Free slot found */
-		insertion_slot = infos.free_slot;
-		insertion_block = infos.free_block;
+void kv_start (KV *kv){ 
 
-	} else {
-		/* Use the last block of the chain */
-		if (infos.nblk_entries >= MAX_BLK_ENTR) {
-			/* Last block is full */
-			infos.last_block = extend_blocks_chain(kv, 
-						infos.last_block);
-			if (infos.last_block == 0) return -1;
-			infos.nblk_entries = 0;
-		}
-	
-		/* Append to the last block */
-		insertion_block = infos.last_block;
-		insertion_slot = infos.last_block + SIZE_BLK_HEAD 
-				+ infos.nblk_entries * sizeof (len_t);
+	pthread_rwlock_wrlock(&kv->lock);
+	kv->next_entry = 0; 
+	kv->next_shard = 0;
+	if (kv->shards != NULL) kv_start(kv->shards[0]);
+	pthread_rwlock_unlock(&kv->lock);
+}
 
-		increment_nblk_entries = true;
-	}
-		
+int kv_next (KV *kv, kv_datum *key, kv_datum *val){
 
-	/* Step 2: Store the couple key-value */
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = (kv->shards != NULL)? shard_next(kv, key, val, false) :
+		next_couple(kv, key, val);
+	pthread_rwlock_unlock(&kv->lock);
 
-	// Store data
-	kv_stored ref_kv;
-	if ( store_kv(kv, key, val, &ref_kv) == -1) return -1;
+	return r;
+}
 
-	// Write block entry
-	if (safe_write_at(kv->_fd_blk, insertion_slot, 
-		&ref_kv.offset_kv, sizeof (len_t)) == -1) goto err_kv_lost;
-
-	// Increment the header of the block if necessary	
-	if (increment_nblk_entries) {
-		infos.nblk_entries++;
-		if (safe_write_at(kv->_fd_blk, insertion_block,
-			&infos.nblk_entries, sizeof (len_t)) == -1) {
-			goto err_kv_lost;
-		}
-	}
 
+int kv_get_view (KV *kv, const kv_datum *key, kv_datum *val){
 
-	return 0;	
+	if (kv->shards != NULL) return kv_get_view(shard_of(kv, key), key, val);
 
-err_kv_lost:
-	remove_data(kv, ref_kv.offset_kv);
-	return -1;
-	
-}
+	pthread_rwlock_rdlock(&kv->lock);
+	int r = get_view(kv, key, val);
+	pthread_rwlock_unlock(&kv->lock);
 
+	return r;
+}
 
 
+int kv_next_view (KV *kv, kv_datum *key, kv_datum *val){
 
+	pthread_rwlock_wrlock(&kv->lock);
+	int r = (kv->shards != NULL)? shard_next(kv, key, val, true) :
+		next_view(kv, key, val);
+	pthread_rwlock_unlock(&kv->lock);
 
+	return r;
+}
 
 
+void kv_release_views (KV *kv){
 
-/**
- * Traverse the chain of blocks searching for a key while collecting 
- * different informations depending on the given mode. Those informations
- * are stored into the fields of the given scan_infos structure.
- * @param: kv The database
- * @param: first_blk Offset (address) to the first block
- * @param: key The key to search
- * @param: infos The address to the struct of type scan_infos to be filled
- *
- * Here is a more detailed explaination of the fields of the struct scan_infos:
- *
- * +--------------+--------------------------------------------------+
- * |   FIELD      |         VALUE				     |
- * +--------------+--------------------------------------------------+
- * | slot_entry   | If the key exists it contains the offset to the  |
- * |              | slot refering the entry, 0 otherwise.	     |
- * +--------------+--------------------------------------------------+
- * | offset_kv    | If the key exists it contains the offset to the  |
- * |              | slot refering the stored data, 0 otherwise.      |
- * +--------------+--------------------------------------------------+
- * | free_slot    | The offset to the first free slot found, 0 if    |
- * |              | none has been found.		 	     |
- * +--------------+--------------------------------------------------+
- * | last_block   | If slot_entry == 0, it contains the offset to the|
- * |              | last allocated block of the chain, otherwise it  |
- * |              | contains the offset to the block where the entry |
- * |              | has been found (the last block visited by	     |
- * |              | by scan_infos).				     |
- * +--------------+--------------------------------------------------+
- * | free_block   | If free_slot != 0 it contains the offset to the  |
- * | 		  | block containing the free slot.		     |
- * +--------------+--------------------------------------------------+
- * | nblk_entries | Number of entries in last_block		     |
- * +--------------+--------------------------------------------------+
- * @return 0 in case of success, -1 otherwise
- */
-int scan_blocks
-(KV *kv, len_t offset_blk, const kv_datum *key, scan_infos *infos) {
+	if (kv->shards != NULL) {
+		len_t i;
+		for (i = 0; i < kv->nb_shards; i++)
+			kv_release_views(kv->shards[i]);
+		return;
+	}
 
-	
-	kv_datum current_entry;
-	init_datum(&current_entry);
+	pthread_rwlock_wrlock(&kv->lock);
+	release_views(kv);
+	pthread_rwlock_unlock(&kv->lock);
+}
 
-	#define EMPTY 0
-	memset(infos, EMPTY, sizeof (scan_infos));
-	
-	block blk;
-	len_t off_last_blk = 0;
 
-	while ( offset_blk != EMPTY ){ // While there are blocks
+int kv_hash (int hidx, const kv_datum *key, len_t *hash){
 
-		// Read block
-		if ( read_blk(kv, offset_blk, &blk) == -1) goto error;
-		// Scan block
-		len_t i;
-		for (i = 1; i <= blk.n_entries; i++) { // the entry 0 is the header
-		
-			len_t offset_slot = offset_blk + i*sizeof (len_t);
-	
-			if (blk.data[i] == EMPTY ) {
-				/* Free slot */
-				if (infos->free_slot == EMPTY) {
-					infos->free_slot = offset_slot;
-					infos->free_block = offset_blk;
-				}
-				continue;
-			}
-	
-			/* Read stored key */
-			if (read_datum(kv, blk.data[i], &current_entry) == -1)
-				goto error;
-	
-			if (eq_datum(key,&current_entry)) {
-				/* Key found */
-				infos->slot_entry = offset_slot;
-				infos->offset_kv = blk.data[i];
-				infos->last_block = offset_blk;
-				infos->nblk_entries  = blk.n_entries;
-				drop_datum(&current_entry);
-				return 0;
-			}
-		}
-			
-		off_last_blk = offset_blk;
-		offset_blk = blk.offset_nextblk;
-	}
-	
-	/* End of the chain (no entry has been found) */
-	
-	infos->last_block = off_last_blk;
-	infos->nblk_entries  = blk.n_entries;
-	drop_datum(&current_entry);
+	/* Functions of a new database */
+	KV kv;
+	kv.h_version = 2;
+	if (setHashFun(&kv, hidx) == -1) return -1;
 
+	*hash = kv._hash_fun(key);
 	return 0;
-
-error:
-	drop_datum(&current_entry);
-	return -1;
 }
 
 
-/**
- * Read a whole block into a struct of type block
- * @param: kv Target database
- * @param: blk_offset Offset to the target block
- * @param: blk Address of the block struct where to store the data
- * @return: 0 in cae of success, -1 otherwise
+/*
+ * The bulk loader owns its database until kv_build_close: it does not need
+ * the lock, and writes the files directly instead of using the caches.
  */
-int read_blk(KV *kv, len_t blk_offset, block *blk) {
 
-	ssize_t read_size;
+kv_builder *kv_build_open (const char *dbname, int hidx, int large){
 
-	//Read block
-	switch (read_size = read_at(kv->_fd_blk, blk_offset,
-				 blk->data, SIZE_BLK) ) {
+	return build_open(dbname, hidx, large? "wl" : "w");
+}
 
-		case  0: errno = EINVAL;
-		case -1: return -1;
-		
-		default: if (read_size < SIZE_BLK_HEAD){
-			 	errno = EINVAL;
-				return -1;
-			}
-	}
 
-	/* Position first bit from the left */
-	int first_bit = sizeof (len_t) * CHAR_BIT - 1;
-	
-	/* Check if the block is full */
-	if (BITSLICE(blk->data[0], first_bit, first_bit) == 0) { 
-		// Block not full
-		blk->n_entries = blk->data[0];
-		blk->offset_nextblk = 0;
-	} else {
-		// Block full
-		blk->n_entries = MAX_BLK_ENTR; 
-		blk->offset_nextblk = HSIZE_BLK + SIZE_BLK * 
-				BITSLICE(blk->data[0],first_bit-1,0);
+int kv_build_add (kv_builder *b, const kv_datum *key, const kv_datum *val){
+
+	KV *kv = b->kv;
+	unsigned long long size = 2 * sizeof (len_t) + 
+			(unsigned long long) key->len + VAL_SPACE(kv, val);
+
+	/* The size must fit in a dkv_entry, the offsets in the format */
+	if (size >= MAX_SPACE(kv) || kv->end_kv + size > MAX_END_KV(kv)) {
+		errno = EFBIG;
+		return -1;
 	}
 
-	return 0;
-}
-	
+	if (b->nb_entries == BUILD_RUN && build_spill(b) == -1) return -1;
 
+	if ( (b->kv_used + size > BUILD_BUFFER ||
+	      (b->dkv_used + 1) * sizeof (dkv_entry) > BUILD_BUFFER) &&
+	     build_flush(b) == -1 ) return -1;
 
-/**
- * Allocates a new empty block
- * @param: kv Database
- * @param block_number A pointer where to store the number of the new allocated
- *	  block if it's not null, and if the function executed successfully
- * @return: The address of the new block or 0 in case of error
- */
-len_t allocate_blk(KV *kv, len_t* block_number){
+	/* A big value goes to the blob log (see kv_convert) */
+	char ref[BLOB_REF_SIZE];
+	kv_datum stored;
+	int blob = stored_value(kv, key, val, ref, &stored);
+	if (blob == -1) return -1;
+	len_t flag = blob? BLOB_FLAG : 0;
 
-	/* Do not allocate more than allowed max of blocks */
-	len_t n_blocks = kv->nb_blocks;
-	if (n_blocks >= MAX_BLKS ) return 0;
+	if (size > BUILD_BUFFER) {
+		/* Too big for the buffer (empty now): written directly */
+		if (write_to_kv(kv, kv->end_kv, key, &stored, flag) == -1) 
+			return -1;
+	} else {
+		char *data = b->kv_buf + b->kv_used;
+		len_t stored_len = stored.len | flag;
+		memcpy(data, &key->len, sizeof (len_t));
+		memcpy(data + sizeof (len_t), key->ptr, key->len);
+		data += sizeof (len_t) + key->len;
+		memcpy(data, &stored_len, sizeof (len_t));
+		memcpy(data + sizeof (len_t), stored.ptr, stored.len);
+		b->kv_used += size;
+	}
 
-	/* Write header new block */
-	len_t blk_offset = HSIZE_BLK + n_blocks*SIZE_BLK; // Offset new block
-	len_t blk_head = 0; 				  // Init header with 0
-	if ( safe_write_at(kv->_fd_blk, blk_offset, 
-		&blk_head, sizeof blk_head) == -1 ) return 0;
+	dkv_entry entry = { DKV_USED | size, kv->end_kv };
+	b->dkv_buf[b->dkv_used++] = entry;
 
-	if (block_number != NULL) *block_number = n_blocks;
+	build_entry e = { kv->_hash_fun(key), kv->end_kv, key_fingerprint(key) };
+	b->entries[b->nb_entries++] = e;
 
-	kv->nb_blocks = n_blocks + 1;
-	
-	return blk_offset;
+	kv->nb_dkv_entries++;
+	kv->end_kv += size;
 
+	return 0;
 }
 
 
-	
-/**
- * Extends a chain of blocks by adding a new block at the end of it
- * @param kv Database
- * @param last_block Offset to the last block of the chain
- * @return the offset of the new allocated block or 0 in case of error
- */
-len_t extend_blocks_chain(KV *kv, len_t last_block){
-
-	/* Allocate a new empty block */
-	len_t block_number;
-	len_t offset_blk = allocate_blk(kv, &block_number);
-	if (offset_blk == 0) return 0;
+int kv_build_close (kv_builder *b){
 
-	/* Update last_block header: [ 1 | block_number] */
-	len_t header = FLAG_USED | block_number;
-	if ( safe_write_at(kv->_fd_blk, last_block, &header,
-		sizeof header) == -1) return 0;
+	KV *kv = b->kv;
 
+	if (build_flush(b) == -1 ||
+	    build_index(b) == -1 ||
+	    build_dkv(b)   == -1 ) goto error;
 
-	return offset_blk;
+	/* Header of .dkv (.blk and .h are synced by kv_close) */
+	if (write_dkv_head(kv) == -1) goto error;
 
-}
+	/* A Bloom filter is filled from the new .dkv */
+	if (kv->bf != NULL && bf_build(kv, 0) == -1) goto error;
 
+	b->kv = NULL;
+	if (kv_close(kv) == -1) goto error;
 
+	build_drop(b);
+	return 0;
 
-/**
- * Stores a couple (key,value) into the file .kv creating a reference into
- * the file .dkv
- * @param: kv, Database to use
- * @param: key, Key to save
- * @param: value, Value to save
- * @param: ref_kv, Pointer to a struct kv_stored where to write informations
- *	   about the stored couple.
- * @return: 0 in case of success, -1 otherwise
- */
-int store_kv
-(KV *kv, const kv_datum* key, const kv_datum* value, kv_stored* ref_kv){
-
-	len_t size_entry = key->len + value->len + 2 * sizeof (len_t);
-	len_t dkv_slot;
-	dkv_entry free_dkv_slot;
+error:
+	build_drop(b);
+	return -1;
+}
 
-	/* Find a free space in the file .kv*/
-	int ret;
-	switch (kv->alloc) {
-		case FIRST_FIT: ret = first_fit(kv, size_entry,
-					&free_dkv_slot, &dkv_slot);
-				break;
-		case WORST_FIT: ret = worst_fit(kv, size_entry, 
-					&free_dkv_slot, &dkv_slot);
-				break;
-		case BEST_FIT:  ret = best_fit(kv, size_entry, 
-					&free_dkv_slot, &dkv_slot);
-				break;
-		
-		default: errno = EINVAL;
-			 return -1;
-	}
 
-	if (ret == -1) return -1;
+/*
+ * The converter copies the couples of the database to a new one in the large
+ * format, with the bulk loader, then puts the new files in place of the old 
+ * ones. The database must not be open elsewhere during the conversion.
+ */
 
-	dkv_entry new_dkv_entry = { FLAG_USED | size_entry, 
-				    free_dkv_slot.offset 
-				  };
+int kv_convert (const char *dbname){
 
+	KV *kv = kv_open(dbname, "r", 0, FIRST_FIT);
+	if (kv == NULL) return -1;
 
-	
-	/* Note that the order of the 2 following actions is important
-	   in order to avoid to create a reference to inexisting data in case
-	   of error  */ 
+	/* Already in the large format: nothing to do */
+	if (OFF_SIZE(kv) == sizeof (pos_t)) return kv_close(kv);
 
-	/* First: write data into the file .kv */
-	if (write_to_kv(kv, new_dkv_entry.offset, key, value) == -1) return -1;
-	
-	/* Second: update file .dkv */
-	if (ret == 0){
-		
-		if (push_dkv_entry(kv,&new_dkv_entry) == -1) return -1;
-		kv->end_kv += size_entry;
+	kv_builder *b = NULL;
+	kv_datum key, val;
+	uint32_t hidx;
+	int r;
+	size_t ll = strlen(dbname);
+	char *conv_name = malloc(ll + sizeof CONV_SFFX);
+	if (conv_name == NULL) goto error;
+	memcpy(conv_name, dbname, ll);
+	memcpy(conv_name + ll, CONV_SFFX, sizeof CONV_SFFX);
+
+	/* Same hash function as the old database, inline couples and blob log
+	   if it has them */
+	char mode[] = "wl\0\0\0", *m = mode + 2;
+	if (kv->blk_version == 3) *m++ = 'i';
+	if (kv->_fd_blob != -1) *m++ = 'v';
+	memcpy(&hidx, kv->h_map + MGN_SIZE, sizeof hidx);
+	if ((b = build_open(conv_name, (int) hidx, mode)) == NULL) goto error;
+	if (kv->_fd_blob != -1) {
+		b->kv->blob_min = kv->blob_min;
+		b->kv->blob_changed = true;
+	}
 
-	} else {
-		if (use_dkv_slot(kv, dkv_slot, 
-				&new_dkv_entry) == -1) return -1;
+	/* The couples are read without copy */
+	kv->next_entry = 0;
+	while ((r = next_view(kv, &key, &val)) == 1) {
+		if (kv_build_add(b, &key, &val) == -1) goto error;
+		release_views(kv); // The copies of the values of .blob
+	}
+	if (r == -1) goto error;
+
+	r = kv_build_close(b);
+	b = NULL;
+	if (r == -1) goto error;
+
+	r = kv_close(kv);
+	kv = NULL;
+	if (r == -1 || rename_db(conv_name, dbname) == -1) goto error;
+
+	/* The Bloom filter and the write-ahead log of the old database are 
+	   made again for the new one */
+	char reopen[] = "r+\0\0", *o = reopen + 2;
+	memcpy(conv_name + ll, BF_SFFX, sizeof BF_SFFX);
+	if (unlink(conv_name) == 0) *o++ = 'b';
+	else if (errno != ENOENT) goto error;
+	memcpy(conv_name + ll, WAL_SFFX, sizeof WAL_SFFX);
+	if (unlink(conv_name) == 0) *o++ = 'j';
+	else if (errno != ENOENT) goto error;
+
+	if (o != reopen + 2) {
+		if ((kv = kv_open(dbname, reopen, 0, FIRST_FIT)) == NULL) 
+			goto error;
+		r = kv_close(kv);
+		kv = NULL;
+		if (r == -1) goto error;
 	}
-	
-	ref_kv->offset_kv = new_dkv_entry.offset;
-	ref_kv->dkv_slot = dkv_slot;
 
+	free(conv_name);
 	return 0;
 
+error:
+	if (b != NULL) build_drop(b);
+	if (kv != NULL) infail_kvclose(kv);
+	free(conv_name);
+	return -1;
 }
 
-
+/*~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS BODIES (part 2: internals) ~~~~~~~~~~~~~~~~~~~*/
 
 /**
- * Writes a couple (key,value) to a given offset in the .kv file
+ * Writes all the pending changes to the files of the database (@ref kv_sync)
  * @param kv Database
- * @param offset Offset to the space where to write the couple (key,value)
- * @param key,value Data to write
- * @return 0 in case of success -1 otherwise
+ * @return 0 in case of success, -1 otherwise
  */
-int write_to_kv
-(KV* kv, len_t offset, const kv_datum* key ,const kv_datum* value){
-
-	/* Use a unique array to avoid multiple writing steps */
-	size_t total_size = key->len + value->len + 2*sizeof (len_t);
-	char* data = malloc (total_size);
-	if (data == NULL) return -1;
-
-	/* Two references to the array previously allocated */
-	char* data_key = data;
-	char* data_value = data + sizeof (len_t) + key->len;
-
-	/* Fill the array with the given values */
-	(*(len_t*) data_key) = key->len;
-	memcpy(data_key + sizeof (len_t), key->ptr, key->len);
-
-	(*(len_t*) data_value) = value->len;
-	memcpy(data_value + sizeof (len_t), value->ptr, value->len);
-
-	/* Store the content of the array on .kv */
-	if (safe_write_at(kv->_fd_kv ,offset ,data ,total_size ) == -1){
-		free(data);
-		return -1;
+int sync_kv(KV *kv) {
+
+	if ( kv->flags == O_RDONLY) return 0;
+
+	/* Sync file .blk */	
+	if ( pool_flush(kv) == -1 ||
+	     wal_undo(kv, WAL_BLK, MGN_SIZE, sizeof (len_t)) == -1 ||
+	     safe_write_at(kv->_fd_blk,MGN_SIZE,
+		&kv->nb_blocks,sizeof (len_t)) == -1 ) return -1;
+
+	/* Sync file .dkv (nothing changed if not loaded) */
+	if (kv->dkv_loaded && sync_dkv(kv) == -1) return -1;
+
+	/* Sync file .h */
+	if (kv->h_version == 2) {
+		char *lh = kv->h_map + MGN_SIZE + sizeof (len_t);
+		if (wal_undo(kv, WAL_H, lh - kv->h_map, 
+			2 * sizeof (len_t) + OFF_SIZE(kv)) == -1) return -1;
+		memcpy(lh, &kv->h_level, sizeof (len_t));
+		memcpy(lh + sizeof (len_t), &kv->h_split, sizeof (len_t));
+		put_off(kv, lh + 2 * sizeof (len_t), kv->nb_keys);
 	}
+	if (msync(kv->h_map, kv->h_map_size, MS_SYNC) == -1) return -1;
 
-	free(data);
-	return 0;
+	/* Sync file .blob (its header only: the records are already written) */
+	if (blob_sync(kv) == -1) return -1;
+
+	/* Sync file .bf, once the keys it holds are on the disk */
+	return bf_sync(kv);
 }
 
 
+
 /**
- * Push a new dkv_entry at the end of the file .dkv
- * @param kv Database to use
- * @param new_entry A pointer to the dkv_entry to push
+ * Stores a couple key/value (@ref kv_put)
+ * @param kv Database
+ * @param key Key
+ * @param val Value
  * @return 0 in case of success, -1 otherwise
  */
-int push_dkv_entry(KV *kv, const dkv_entry* new_entry){
+int put_entry(KV *kv, const kv_datum *key, const kv_datum *val){
 
-	/* Number of entries */
-	len_t nb_entries = kv->nb_dkv_entries + 1;
-	
-	/* Allocate more memory if necessary */
-	if (kv->max_dkv_cache < nb_entries * sizeof (dkv_entry)){
-		dkv_entry* ptr = realloc ( kv->dkv_cache, 
-			kv->max_dkv_cache + CACHE_PAGE);
-		if (ptr == NULL) return -1;
+	if (need_dkv(kv) == -1) return -1;
+	release_views(kv);
+	if (bf_add(kv, key) == -1) return -1;
+
+	len_t hash = key_bucket(kv, key);
 
-		kv->dkv_cache = ptr;
-		kv->max_dkv_cache += CACHE_PAGE;
+	/* Read offset first block of the chain */
+	pos_t offset_blk = h_get(kv, hash);
+
+	if (offset_blk != 0) {
+		/* Add entry to chain of blocks */
+		if (insert_to_chain(kv, key, val, offset_blk) == -1) return -1;
+	} else {
+		/* Empty slot: first use of this hash */
+		if (insert_first_entry(kv, hash, key, val) == -1) return -1;
 	}
+	
+	if (h_grow(kv) == -1 || wal_put(kv, key, val) == -1) return -1;
 
-	/* Write new_entry at the bottom of the file */
-	kv->dkv_cache[kv->nb_dkv_entries] = (*new_entry);
+	return wal_trim(kv);
 
-	/* Update the number of entries */
-	kv->nb_dkv_entries = nb_entries;
+}
 
-	return 0;
-}	
 
 /**
- * Change te old content of a dkv slot with a new content. If the size of the
- * data pointed by new is smaller than the size of the data of the given 
- * dkv_slot then a new dvk entry pointing to the free remaining memory is 
- * generated.
- *
+ * Stores n couples key/value (@ref kv_put_batch). The result is the same as
+ * n calls to put_entry, except for the place of the new data: the couples 
+ * are written at once at the end of .kv, in the order of the batch, instead
+ * of filling the free spaces (the inline couples go to their blocks). The 
+ * couples are processed bucket by bucket: the block chains are read once 
+ * and stay in the buffer pool. An old couple is only removed when the new 
+ * one takes its place: if the new data cannot be written, nothing changes,
+ * and after a later error the couples already stored are logged, as they
+ * would be by put_entry.
  * @param kv Database
- * @param dkv_slot Number of the slot to use (= index kv->dkv_cache).
- *	  The size of the space pointed by this slot must be smaller or equal
- *	  than the size pointed by the new entry.
- * @param new  A pointer to the new dkv_entry to store at offset
+ * @param keys,vals Couples to store (if a key appears several times, the 
+ *	  last value is kept)
+ * @param n Number of couples
  * @return 0 in case of success, -1 otherwise
  */
-int use_dkv_slot
-(KV *kv, len_t dkv_slot, dkv_entry* new){
-
-	/* Calculate remaining free space  */ 	
-	dkv_entry old = kv->dkv_cache[dkv_slot];
-	len_t size_new = DKV_GET_SIZE(new->mem_usage);
+int put_batch
+(KV *kv, const kv_datum *keys, const kv_datum *vals, size_t n){
+
+	if (n == 0) return 0;
+	if (need_dkv(kv) == -1) return -1;
+	release_views(kv);
+
+	size_t i, j, pushed = 0;
+	if (bf_reserve(kv, n) == -1) return -1;
+	for (i = 0; i < n; i++) 
+		if (bf_add(kv, &keys[i]) == -1) return -1;
+
+	int ret = -1;
+	const kv_datum *dropped = NULL; // Key maybe removed, not stored again
+	scan_infos infos;
+	batch_entry *sorted = malloc(n * sizeof (batch_entry));
+	pos_t *offsets = calloc(n, sizeof (pos_t)); // 0: overwritten in batch,
+						    // or linked; SLOT_INLINE:
+						    // inline
+	bool *linked = calloc(n, sizeof (bool));
+	len_t *lens = malloc(2 * n * sizeof (len_t));
+	struct iovec *iov = malloc(4 * n * sizeof (struct iovec));
+	char *refs = NULL;	// References to the blob log
+	if (sorted == NULL || offsets == NULL || linked == NULL || 
+	    lens == NULL || iov == NULL) goto end;
+	if (kv->_fd_blob != -1 && 
+	    (refs = malloc(n * BLOB_REF_SIZE)) == NULL) goto end;
+
+	/* Step 1: sort by bucket, keep the last occurrence of each key */
+	for (i = 0; i < n; i++) {
+		sorted[i].hash = key_bucket(kv, &keys[i]);
+		sorted[i].index = i;
+	}
+	qsort(sorted, n, sizeof (batch_entry), cmp_batch_entries);
 
-	dkv_entry new_free;
-	new_free.mem_usage = DKV_GET_SIZE(old.mem_usage) - size_new;
-	new_free.offset = old.offset + size_new;
+	for (i = 0; i < n; i++) {
+		const kv_datum *key = &keys[sorted[i].index];
 
+		/* Only the last occurrence of a key is stored */
+		for (j = i + 1; j < n && sorted[j].hash == sorted[i].hash; j++)
+			if (eq_datum(key, &keys[sorted[j].index])) break;
+		if (j < n && sorted[j].hash == sorted[i].hash) continue;
+		offsets[sorted[i].index] = SLOT_INLINE; // Or set at step 2
+	}
 
-	if (new_free.mem_usage > 0) {
-		#ifdef _SORT_DKV_
-		/* Keep dkv sorted */
-		if (shift_dkv(kv, dkv_slot, 1) == -1) return -1;
-		kv->dkv_cache[dkv_slot] = *new;
-		kv->dkv_cache[dkv_slot+1] = new_free;
-		#else
-		/* There is remaining free space: insert the `new_free`
-		   entry before `new` to improve time when searching. */
-		kv->dkv_cache[dkv_slot] = new_free;
-		if (push_dkv_entry(kv, new) == -1) {
-			kv->dkv_cache[dkv_slot] = old; // Restore old
-			return -1;
+	/* Step 2: write all the couples at the end of .kv */
+	pos_t end_kv = kv->end_kv;
+	size_t nb_iov = 0;
+	for (i = 0; i < n; i++) {
+		if (offsets[i] == 0 || IS_INLINE(kv, &keys[i], &vals[i])) 
+			continue;
+
+		pos_t size = (pos_t) keys[i].len + VAL_SPACE(kv, &vals[i]) + 
+				2 * sizeof (len_t);
+		if (size >= MAX_SPACE(kv) || size > MAX_END_KV(kv) - end_kv) {
+			errno = EFBIG;
+			goto end;
 		}
-		#endif
 
-	} else if (new_free.mem_usage == 0) {
+		/* A big value goes to the blob log first */
+		kv_datum stored;
+		int blob = stored_value(kv, &keys[i], &vals[i], (refs == NULL)?
+				NULL : refs + i * BLOB_REF_SIZE, &stored);
+		if (blob == -1) goto end;
+
+		offsets[i] = end_kv;
+		end_kv += size;
+
+		lens[2*i] = keys[i].len;
+		lens[2*i + 1] = stored.len | (blob? BLOB_FLAG : 0);
+		iov[nb_iov].iov_base = &lens[2*i];
+		iov[nb_iov++].iov_len = sizeof (len_t);
+		iov[nb_iov].iov_base = keys[i].ptr;
+		iov[nb_iov++].iov_len = keys[i].len;
+		iov[nb_iov].iov_base = &lens[2*i + 1];
+		iov[nb_iov++].iov_len = sizeof (len_t);
+		iov[nb_iov].iov_base = stored.ptr;
+		iov[nb_iov++].iov_len = stored.len;
+	}
+	if (wal_undo(kv, WAL_KV, kv->end_kv, end_kv - kv->end_kv) == -1 ||
+	    safe_writev_at(kv->_fd_kv, kv->end_kv, iov, nb_iov) == -1) 
+		goto end;
+
+	/* Step 3: reference them in .dkv, then in the blocks in place of the
+	 * old couples */
+	for (pushed = 0; pushed < n; pushed++) {
+		if (offsets[pushed] == 0 || offsets[pushed] == SLOT_INLINE) 
+			continue;
+
+		pos_t size = (pos_t) keys[pushed].len + 
+				VAL_SPACE(kv, &vals[pushed]) + 
+				2 * sizeof (len_t);
+		dkv_entry entry = { DKV_USED | size, offsets[pushed] };
+		if (push_dkv_entry(kv, &entry) == -1) goto end;
+		kv->end_kv += size;
+	}
 
-		kv->dkv_cache[dkv_slot] = (*new);
+	for (i = 0; i < n; i++) {
+		size_t index = sorted[i].index;
+		if (offsets[index] == 0) continue;
+
+		pos_t offset_blk = h_get(kv, sorted[i].hash);
+		if (offset_blk != 0) {
+			if (scan_blocks(kv, offset_blk, &keys[index], 1, 
+				&infos) == -1) goto end;
+			if (infos.slot_entry != 0) {
+				dropped = &keys[index];
+				if (free_entry(kv, &infos) == -1) goto end;
+			}
+		}
 
-	} else {
-		/* The old slot has too small size */
-		errno = EINVAL; 
-		return -1;
-	};
+		if (link_entry(kv, sorted[i].hash, &keys[index], 
+			&vals[index], offsets[index]) == -1) goto end;
+		offsets[index] = 0;
+		linked[index] = true;
+		dropped = NULL;
+	}
 
-	return 0;
+	ret = h_grow(kv);
+
+end:
+	/* Logged in the order of the batch (the couples stored only, even 
+	 * after an error, so that a crash finds the same values) */
+	for (i = 0; linked != NULL && i < n; i++) 
+		if (linked[i] && wal_put(kv, &keys[i], &vals[i]) == -1) 
+			ret = -1;
+	if (dropped != NULL && key_to_kv(kv, dropped, &infos) == 0 &&
+	    wal_del(kv, dropped) == -1) ret = -1;
+	if (ret == 0) ret = wal_trim(kv);
+
+	/* Don't keep couples that cannot be reached */
+	if (ret == -1) 
+		for (i = 0; i < pushed; i++) 
+			if (offsets[i] != 0 && offsets[i] != SLOT_INLINE) 
+				remove_data(kv, offsets[i]);
+
+	free(sorted);
+	free(offsets);
+	free(linked);
+	free(lens);
+	free(iov);
+	free(refs);
+	return ret;
 }
 
 
 /**
- * @param pos Position
- * @param dir Direction
+ * Applies all the changes of a batch, or none (@ref kv_batch_commit). Only
+ * the last change of each key counts: the removals are done first, then 
+ * the couples are stored by put_batch. The old values are read beforehand:
+ * if a change fails, they are put back. With a log, the batch is logged as
+ * a whole once done (a crash replays all of it or nothing).
+ * @param kv Database
+ * @param b Batch
+ * @return 0 in case of success, -1 otherwise
  */
-#ifdef _SORT_DKV_
-int shift_dkv(KV *kv, len_t pos, int dir){
-	
-	/* Current size database */
-	len_t size = kv->nb_dkv_entries * sizeof (dkv_entry);
-	len_t new_size = size + dir * sizeof (dkv_entry);
-	
-	/* Allocate more memory if necessary */
-	if (kv->max_dkv_cache < new_size){
-		dkv_entry* ptr = realloc ( kv->dkv_cache, 
-			kv->max_dkv_cache + CACHE_PAGE);
-		if (ptr == NULL) return -1;
+int commit_batch(KV *kv, const kv_batch *b){
 
-		kv->dkv_cache = ptr;
-		kv->max_dkv_cache += CACHE_PAGE;
+	if (kv->flags == O_RDONLY) {
+		errno = EBADF;
+		return -1;
+	}
+	if (b->nb_ops == 0) return 0;
+
+	size_t i, m, n = b->nb_ops, nb_puts = 0;
+	batch_op *ops = malloc(n * sizeof (batch_op));
+	kv_datum *keys = malloc(n * sizeof (kv_datum));
+	kv_datum *vals = malloc(n * sizeof (kv_datum));
+	if (ops == NULL || keys == NULL || vals == NULL) {
+		free(ops);
+		free(keys);
+		free(vals);
+		return -1;
 	}
-	
-	/* Update the number of entries */
-	kv->nb_dkv_entries += dir;
 
-	/* Shift block of memory */
-	size_t size_shift = size - (pos * sizeof (dkv_entry));
-	if (size_shift <= 0) return 0;
-	memmove(&kv->dkv_cache[pos+dir], &kv->dkv_cache[pos], size_shift);
+	/* Step 1: the last change of each key */
+	pos_t used = 0;
+	for (i = 0; i < n; i++) {
+		batch_next(b->ops, b->len, &used, &ops[i].type, &ops[i].key, 
+			   &ops[i].val);
+		init_datum(&ops[i].old);
+		ops[i].found = 0;
+		ops[i].index = i;
+	}
+	qsort(ops, n, sizeof (batch_op), cmp_batch_ops);
+	for (i = 0, m = 0; i < n; i++) 
+		if (i + 1 == n || !eq_datum(&ops[i].key, &ops[i + 1].key))
+			ops[m++] = ops[i];
+
+	/* Step 2: the old values (allocated, not taken from the arena) */
+	int ret = -1;
+	kv_arena *arena = kv->arena;
+	kv->arena = NULL;
+	for (i = 0; i < m; i++) 
+		if ((ops[i].found = read_entry(kv, &ops[i].key, 
+			&ops[i].old)) == -1) break;
+	kv->arena = arena;
+	if (i < m) goto end;
+
+	/* Step 3: the changes, logged at once */
+	bool redo = kv->wal_redo;
+	kv->wal_redo = false;
+	for (i = 0; i < m; i++) {
+		if (ops[i].type == WAL_PUT) {
+			keys[nb_puts] = ops[i].key;
+			vals[nb_puts++] = ops[i].val;
+		} else if (ops[i].found && del_entry(kv, &ops[i].key) == -1) 
+			break;
+	}
+	if (i == m && put_batch(kv, keys, vals, nb_puts) == 0) {
+		kv->wal_redo = redo;
+		ret = wal_batch(kv, b);
+		kv->wal_redo = false;
+	}
 
+	if (ret == -1) {
+		int err = errno;
+		undo_batch(kv, ops, m);
+		errno = err;
+	}
+	kv->wal_redo = redo;
+	if (ret == 0) ret = wal_trim(kv);
+
+end:
+	for (i = 0; i < m; i++) free(ops[i].old.ptr);
+	free(ops);
+	free(keys);
+	free(vals);
+	return ret;
+}
 
-	return 0;
-}	
-#endif
 
 /**
- * Search the first free block of memory big enough to contain `size` bytes
- * @param: kv Database
- * @param: size Length in byte of the space to search
- * @param: dkv_content Address to a struct dkv_entry that will be filled with
- *	   the content of the dkv_entry refering to the free space of memory.
- *	   If the free momory found is not referred by any dkv_entry 
- *	   ,theb this variable will contain a reference to the 
- *	   free space at the end of the file .kv.
- * @param: dkv_slot If the free memory is referred by an entry in the 
- *	   file dkv then the offset of that entry is stored here. In the other
- *	   cases the stored value is undefined.
- * @return: 0 if a dkv_entry has been found, 1 if the dkv_entry represent the
- *	    end of the file .kv, -1 in case of error.
+ * Removes the free spaces of .kv by sliding the couples that follow them 
+ * towards the beginning of the file, which is then truncated (@ref 
+ * kv_compact). The work can be split between several calls.
+ * @param kv Database
+ * @param max_bytes Stop once this amount of data has been moved (0 for 
+ *	  no limit)
+ * @return 1 if free spaces remain, 0 if the file is compact, -1 in case of
+ *	   error
  */
-int first_fit(KV *kv, len_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
-
-	memset(dkv_content, 0, sizeof (dkv_entry));
+int compact_kv(KV *kv, size_t max_bytes){
 
-	len_t size_free_space = 0;
+	if (need_dkv(kv) == -1) return -1;
+	release_views(kv);
 
-	len_t i;
-	for (i = 0; i < kv->nb_dkv_entries; i++){
+	size_t moved = 0;
+	int r;
+	do {
+		r = compact_run(kv, &moved);
+	} while (r == 1 && (max_bytes == 0 || moved < max_bytes));
 
-		if (DKV_IS_USED(kv->dkv_cache[i].mem_usage)) continue;
-		
-		size_free_space = DKV_GET_SIZE(kv->dkv_cache[i].mem_usage);
-		if (size <= size_free_space){
-			/* Found */
-			dkv_content->mem_usage = size_free_space;
-			dkv_content->offset = kv->dkv_cache[i].offset;
-			(*dkv_slot) = i;
-			return 1;
-		}
-	}
+	/* The Bloom filter forgets the deleted keys */
+	if (r == 0 && kv->bf != NULL && kv->bf_dels > 0 && 
+	    bf_build(kv, 0) == -1) return -1;
 
-	/* No free entries, try using remaining kv space */
-	size_free_space = UNSIGNED_MAX(len_t) - kv->end_kv;
-	if (size <= size_free_space) {
-		dkv_content->mem_usage = size_free_space;
-		dkv_content->offset = kv->end_kv;
-		(*dkv_slot) = UNSIGNED_MAX(len_t);
-		return 0;
-	}
+	/* The blob log drops its dead values once it is mostly garbage */
+	if (r == 0 && BLOB_GC_NEEDED(kv) && blob_gc(kv) == -1) return -1;
 
-	return -1;
+	return r;
 }
 
 
 /**
- * Search the biggest free block of memory big enough to contain `size` bytes
- * @reference first_fit
+ * Reads the value of a key (@ref kv_get). It only reads the files and the
+ * mapping of .h, hence several threads can run it at the same time.
+ * @param kv Database
+ * @param key Key
+ * @param val Where to store the value
+ * @return 1 if the key has been found, 0 if not, -1 in case of error
  */
-int worst_fit(KV *kv, len_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
-
-	memset(dkv_content, 0, sizeof (dkv_entry));
+int get_entry(KV *kv, const kv_datum *key, kv_datum *val){
 
-	len_t size_free_space = 0;
-	len_t index_worst = 0;
-	len_t current_free_space = 0;
+	/* Do you have the permissions? */
+	if (kv->write_only) {
+		errno = EACCES;
+		return -1;
+	}
 
-	/* Search worst */
-	len_t i;
-	for (i = 0; i < kv->nb_dkv_entries; i++){
+	return read_entry(kv, key, val);
+}
 
-		if (DKV_IS_USED(kv->dkv_cache[i].mem_usage)) continue;
-		
-		current_free_space = DKV_GET_SIZE(kv->dkv_cache[i].mem_usage);
 
-		if (current_free_space > size_free_space){
-			index_worst = i;
-			size_free_space = current_free_space;
-		}
+/**
+ * Reads the value of a key, whatever the permissions (see get_entry)
+ * @param kv Database
+ * @param key Key
+ * @param val Where to store the value
+ * @return 1 if the key has been found, 0 if not, -1 in case of error
+ */
+int read_entry(KV *kv, const kv_datum *key, kv_datum *val){
 
+	/* Get offset on .kv */
+	scan_infos infos;
+	int r = key_to_kv(kv, key, &infos);
+	if (r != 1) return r;
+
+	/* Inline couple: the value is in the block */
+	if (infos.offset_kv == SLOT_INLINE) {
+		kv_datum k, v;
+		inline_datums(infos.record, &k, &v);
+		return (copy_datum(kv, v.ptr, v.len, val) == -1)? -1 : 1;
 	}
 
-	/* Use it if big enough */
-	if (size <= size_free_space){
-		dkv_content->mem_usage = size_free_space;
-		dkv_content->offset = kv->dkv_cache[index_worst].offset;
-		(*dkv_slot) = index_worst;
-		return 1;
-	}
+	/* Read the stored value */
+	pos_t val_offset = infos.offset_kv + key->len + sizeof (len_t);
+	if (read_value(kv, val_offset, key->len, val) == -1) return -1;
 
-	/* No free entries, try using remaining kv space */
-	size_free_space = UNSIGNED_MAX(len_t) - kv->end_kv;
-	if (size <= size_free_space) {
-		dkv_content->mem_usage = size_free_space;
-		dkv_content->offset = kv->end_kv;
-		(*dkv_slot) = UNSIGNED_MAX(len_t);
-		return 0;
-	}
+	return 1;
 
-	return -1;
 }
 
+
 /**
- * Search the smallest free block of memory big enough to contain `size` bytes
- * @reference first_fit
+ * Reads the values of n keys (@ref kv_get_many). The keys are sorted by 
+ * bucket, so that each chain of blocks is read only once for all its keys,
+ * then the values are read in the order of .kv, with one preadv for values
+ * close to each other. Like get_entry, it can run in several threads.
+ * @param kv Database
+ * @param keys Keys to search
+ * @param vals Where to store the values (each one as in kv_get: allocated 
+ *	  if its ptr is NULL, limited to its len otherwise)
+ * @param status Filled with the result of each key, as returned by kv_get:
+ *	  1 found, 0 not found, -1 error
+ * @param n Number of keys
+ * @return The number of keys found, -1 in case of error (for some keys at
+ *	   least, see status)
  */
-int best_fit(KV *kv, len_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
+int get_many
+(KV *kv, const kv_datum *keys, kv_datum *vals, int *status, size_t n){
 
-	memset(dkv_content, 0, sizeof (dkv_entry));
-
-	len_t size_free_space = UNSIGNED_MAX(len_t);
-	len_t index_best = 0;
-	len_t current_free_space = 0;
-	bool found = false; 
-
-	/* Search best */
-	len_t i;
-	for (i = 0; i < kv->nb_dkv_entries; i++){
-
-		if (DKV_IS_USED(kv->dkv_cache[i].mem_usage)) continue;
-		
-		current_free_space = DKV_GET_SIZE(kv->dkv_cache[i].mem_usage);
+	/* Do you have the permissions? */
+	if (kv->write_only) {
+		errno = EACCES;
+		return -1;
+	}
 
-		if (size <= current_free_space &&
-		    current_free_space < size_free_space){
+	many_entry *entries = malloc(n * sizeof (many_entry));
+	if (entries == NULL && n != 0) return -1;
 
-			index_best = i;
-			size_free_space = current_free_space;
-			found = true;
-			if (size == size_free_space) break;
-		}
+	size_t i, j, m = 0, found = 0;
+	for (i = 0; i < n; i++) {
+		status[i] = 0;
+		if (!bf_test(kv, &keys[i])) continue; // Certainly absent
+		entries[m].hash = key_bucket(kv, &keys[i]);
+		entries[m].index = i;
+		entries[m++].val_offset = 0;
 	}
 
-	if (found){
-		dkv_content->mem_usage = size_free_space;
-		dkv_content->offset = kv->dkv_cache[index_best].offset;
-		(*dkv_slot) = index_best;
-		return 1;
+	/* Step 1: find the values, bucket by bucket */
+	qsort(entries, m, sizeof (many_entry), cmp_many_buckets);
+	for (i = 0; i < m; i = j) {
+		for (j = i + 1; j < m && entries[j].hash == entries[i].hash;)
+			j++;
+		if (find_bucket_keys(kv, keys, vals, status, &entries[i], 
+			j - i) == -1)
+			for (; i < j; i++) 
+				if (status[entries[i].index] == 0)
+					status[entries[i].index] = -1;
 	}
 
+	/* Step 2: read them in the order of the file */
+	qsort(entries, m, sizeof (many_entry), cmp_many_values);
+	for (i = 0; i < m && entries[i].val_offset == 0; i++);
+	read_values(kv, vals, status, &entries[i], m - i);
 
-	/* No free entries, try using remaining kv space */
-	size_free_space = UNSIGNED_MAX(len_t) - kv->end_kv;
-	if (size <= size_free_space) {
-		dkv_content->mem_usage = size_free_space;
-		dkv_content->offset = kv->end_kv;
-		(*dkv_slot) = UNSIGNED_MAX(len_t);
-		return 0;
+	int ret = 0;
+	for (i = 0; i < n; i++) {
+		if (status[i] == -1) ret = -1;
+		if (status[i] == 1) found++;
 	}
 
-	return -1;
+	free(entries);
+	return (ret == -1)? -1 : (int) found;
 }
 
 
 /**
- * Remove an entry from .dkv
+ * Removes a key and its value (@ref kv_del)
  * @param kv Database
- * @param offset_kv Offset to the kv stored data
+ * @param key Key
  * @return 0 in case of success, -1 otherwise
  */
-int remove_data(KV *kv, len_t offset_kv){
-	len_t indexes[3]; bool found[3];
-	if (dkv_find_contiguos(kv, offset_kv, indexes, found) == -1) return -1;
+int del_entry(KV *kv, const kv_datum *key) {
 
-		
-	dkv_entry* target = &kv->dkv_cache[indexes[1]];
-
-	target->mem_usage &= ~FLAG_USED; // Set free
-
-	if (found[0] && !DKV_IS_USED(kv->dkv_cache[indexes[0]].mem_usage)) {
-		
-		target->offset = kv->dkv_cache[indexes[0]].offset;
-		target->mem_usage += 
-			DKV_GET_SIZE(kv->dkv_cache[indexes[0]].mem_usage);
-		#ifdef _SORT_DKV_
-		if (shift_dkv(kv,indexes[1],-1) == -1) return -1;
-		indexes[1]--; indexes[2]--;
-		#else
-		kv->dkv_cache[indexes[0]] = 
-			kv->dkv_cache[--kv->nb_dkv_entries];
-		#endif
+	if (need_dkv(kv) == -1) return -1;
+	release_views(kv);
 
-	}
+	/* Get offset on .kv, and offset on .blk */
+	scan_infos infos;
+	int r = key_to_kv(kv, key, &infos);
+	if (r == 0) errno = ENOENT;
+	if (r != 1) return -1;
+	
+	/* Remove data on .kv and reference on .blk */
+	if (free_entry(kv, &infos) == -1) return -1;
 
-	if (found[2] && !DKV_IS_USED(kv->dkv_cache[indexes[2]].mem_usage)) {
+	bf_del(kv);
+	if (wal_del(kv, key) == -1) return -1;
 
-		target->mem_usage += 
-			DKV_GET_SIZE(kv->dkv_cache[indexes[2]].mem_usage);
-		#ifdef _SORT_DKV_
-		if (shift_dkv(kv,indexes[2]+1,-1) == -1) return -1;
-		#else
-		kv->dkv_cache[indexes[2]] = 
-			kv->dkv_cache[--kv->nb_dkv_entries];
-		#endif
+	return wal_trim(kv);
+}
 
+/**
+ * Reads the couple key/value following the last one read (@ref kv_next)
+ * @param kv Database
+ * @param key Where to store the key
+ * @param val Where to store the value
+ * @return 1 if a couple has been read, 0 at the end, -1 in case of error
+ */
+int next_couple(KV *kv, kv_datum *key, kv_datum *val){
+
+	pos_t key_offset, cursor;
+	char inline_rec[2 + INLINE_MAX];
+	int r = next_record(kv, &key_offset, &cursor, inline_rec);
+	if (r != 1) return r;
+
+	if (key_offset == SLOT_INLINE) {
+		kv_datum k, v;
+		inline_datums(inline_rec, &k, &v);
+		if (copy_datum(kv, k.ptr, k.len, key) == -1 ||
+		    copy_datum(kv, v.ptr, v.len, val) == -1) return -1;
+		kv->next_entry = cursor;
+		return 1;
 	}
 
-	if (target->offset + target->mem_usage == kv->end_kv){
-
-		if (ftruncate(kv->_fd_kv, target->offset) == -1) return -1;
-		kv->end_kv = target->offset;
-		*target = kv->dkv_cache[--kv->nb_dkv_entries];
-
-		if (kv->nb_dkv_entries * sizeof (dkv_entry) 
-			<= kv->max_dkv_cache - CACHE_PAGE  && 
-		    kv->max_dkv_cache > CACHE_PAGE ){
+	/* Read total size of the stored key */
+	len_t key_size;
+	if (safe_read_at(kv->_fd_kv, key_offset, &key_size, 
+		sizeof key_size) == -1) return -1;
 
-			dkv_entry* tmp = realloc(kv->dkv_cache, 
-					kv->max_dkv_cache-CACHE_PAGE);
-			if (tmp == NULL) return -1;
-			kv->dkv_cache = tmp;
-			kv->max_dkv_cache -= CACHE_PAGE;
-		}
-		
-	}
+	/* Read data */
+	pos_t val_offset = key_offset + key_size + sizeof (len_t);
+	if ( fill_datum(kv, kv->_fd_kv, key_offset + sizeof (len_t),
+					 key_size, key) == -1 ||
+	     read_value(kv, val_offset, key_size, val) == -1 
+	   ) return -1;
 	
-	return 0;
+	kv->next_entry = cursor;
+
+	return 1;
 }
 
 
 /**
- * Find a dkv slot and the slots adjacents to that slot (who points to adjacents
- * memory zones).
+ * Finds the value of a key without copying it (@ref kv_get_view)
+ * @param kv Database
+ * @param key Key
+ * @param val Filled with a view of the value in the mapping of .kv
+ * @return 1 if the key has been found, 0 if not, -1 in case of error
  */
-int dkv_find_contiguos(KV* kv, len_t offset_kv, len_t indexes[3], bool found[3]){
+int get_view(KV *kv, const kv_datum *key, kv_datum *val){
 
-	enum { prev = 0, target = 1, next = 2};
+	/* Do you have the permissions? */
+	if (kv->write_only) {
+		errno = EACCES;
+		return -1;
+	}
 
-	found[0] = false; found[1] = false; found[2] = false; 
+	/* Get offset on .kv */
+	scan_infos infos;
+	int r = key_to_kv(kv, key, &infos);
+	if (r != 1) return r;
+
+	/* Inline couple: view of a copy of its record */
+	if (infos.offset_kv == SLOT_INLINE) {
+		kv_datum k;
+		char *record = view_record(kv, infos.record);
+		if (record == NULL) return -1;
+		inline_datums(record, &k, val);
+		return 1;
+	}
 
-	len_t guess_offset_next = UNSIGNED_MAX(len_t);
-	len_t offset_next;
-	len_t c_offset, c_mem_usage; // Offset/mem_usage current entry
+	char *map = map_kv(kv);
+	if (map == NULL) return -1;
 
-	len_t i;
-	for (i = 0; i < kv->nb_dkv_entries; i++){
+	char *value = map + infos.offset_kv + sizeof (len_t) + key->len;
+	memcpy(&val->len, value, sizeof (len_t));
+	val->ptr = value + sizeof (len_t);
 
-		c_offset = kv->dkv_cache[i].offset;
-		c_mem_usage = kv->dkv_cache[i].mem_usage;
+	/* Value of the blob log: view of a copy */
+	if (IS_BLOB_REF(kv, val->len) && 
+	    view_blob(kv, key->len, val->ptr, val) == -1) return -1;
 
-		if (c_offset == offset_kv){
-			/* Entry found */
-			indexes[target] = i;
-			found[target] = true;
-			break;
+	return 1;
+}
 
-		} else if (c_offset > offset_kv && c_offset < guess_offset_next){
 
-			guess_offset_next = c_offset;
-			indexes[next] = i;
+/**
+ * Returns the couple following the last one read without copying it 
+ * (@ref kv_next_view)
+ * @param kv Database
+ * @param key,val Filled with views of the couple in the mapping of .kv
+ * @return 1 if a couple has been found, 0 at the end, -1 in case of error
+ */
+int next_view(KV *kv, kv_datum *key, kv_datum *val){
+
+	pos_t key_offset, cursor;
+	char inline_rec[2 + INLINE_MAX];
+	int r = next_record(kv, &key_offset, &cursor, inline_rec);
+	if (r != 1) return r;
+
+	if (key_offset == SLOT_INLINE) {
+		char *copy = view_record(kv, inline_rec);
+		if (copy == NULL) return -1;
+		inline_datums(copy, key, val);
+		kv->next_entry = cursor;
+		return 1;
+	}
 
-		} else if (c_offset + DKV_GET_SIZE(c_mem_usage) == offset_kv){
+	char *map = map_kv(kv);
+	if (map == NULL) return -1;
 
-			indexes[prev] = i;
-			found[prev] = true;
-		}
+	char *record = map + key_offset;
+	memcpy(&key->len, record, sizeof (len_t));
+	key->ptr = record + sizeof (len_t);
 
+	record += sizeof (len_t) + key->len;
+	memcpy(&val->len, record, sizeof (len_t));
+	val->ptr = record + sizeof (len_t);
 
-	}
+	if (IS_BLOB_REF(kv, val->len) && 
+	    view_blob(kv, key->len, val->ptr, val) == -1) return -1;
 
+	kv->next_entry = cursor;
 
-	if (found[target] == false) { 
-		errno = ENOENT;
-		return -1;
-	}
-	
-	offset_next = offset_kv + DKV_GET_SIZE(c_mem_usage);
+	return 1;
+}
 
-	if (offset_next == guess_offset_next) found[next] = true;	
 
-	for (i++ ; i < kv->nb_dkv_entries; i++){
-		
-		if (found[prev] == true && found[next] == true) break;
 
+/**
+ * Finds the couple that kv_next has to return: the couples of .kv first, 
+ * then the inline couples (version 3 of .blk). The cursor is not moved, the
+ * caller does it once the couple has been read.
+ * @param kv Database
+ * @param key_offset Filled with the offset of the couple in .kv, or with 
+ *	  SLOT_INLINE
+ * @param cursor Filled with the next value of the cursor kv->next_entry
+ * @param record Filled with the record of an inline couple
+ * @return 1 if a couple has been found, 0 at the end, -1 in case of error
+ */
+int next_record(KV *kv, pos_t *key_offset, pos_t *cursor, char *record){
 
-		c_offset = kv->dkv_cache[i].offset;
-		c_mem_usage = kv->dkv_cache[i].mem_usage;
+	/* Do you have the permissions? */
+	if (kv->write_only) {
+		errno = EACCES;
+		return -1;
+	}
 
+	if (need_dkv(kv) == -1) return -1;
 
-		if (offset_next == c_offset){
+	/* The couples of .kv have been read */
+	if (kv->next_entry & NEXT_INLINE) goto blocks;
 
-			indexes[next] = i;
-			found[next] = true;	
+	len_t slot;
 
-		} else if (c_offset + DKV_GET_SIZE(c_mem_usage) == offset_kv){
+	#ifdef _SORT_DKV_
+	/* next_entry is the offset of .kv where to continue */
+	len_t node = idx_lower_bound(&kv->dkv_offsets, kv->next_entry, 0);
 
-			indexes[prev] = i;
-			found[prev] = true;
-		}
-			
+	/* Skip empty blocks of memory */	
+	while (node != 0 && DKV_IS_USED(kv->dkv_cache[
+			kv->dkv_offsets.nodes[node].val].mem_usage) == 0) {
+		node = idx_lower_bound(&kv->dkv_offsets, 
+				kv->dkv_offsets.nodes[node].k1 + 1, 0);
 	}
 
-	return 0;
-}
-
+	/* End of kv */	
+	if (node == 0) goto end_kv;
+	slot = kv->dkv_offsets.nodes[node].val;
+	#else
+	/* End of kv */	
+	if (kv->next_entry >= kv->nb_dkv_entries) goto end_kv;
 
+	/* Skip empty blocks of memory */	
+	while (DKV_IS_USED(kv->dkv_cache[kv->next_entry].mem_usage) == 0) {
+		
+		kv->next_entry++; 
+		if (kv->next_entry >= kv->nb_dkv_entries) goto end_kv;
+	}
+	slot = kv->next_entry;
+	#endif
 
+	*key_offset = kv->dkv_cache[slot].offset;
+	#ifdef _SORT_DKV_
+	*cursor = *key_offset + 1;
+	#else
+	*cursor = slot + 1;
+	#endif
 
+	return 1;
 
+end_kv:
+	if (kv->blk_version != 3) return 0;
+	kv->next_entry = NEXT_INLINE; // First slot of the first block
 
+blocks:
+	*cursor = kv->next_entry & ~NEXT_INLINE;
+	int r = next_inline(kv, cursor, record);
+	if (r != 1) return r;
 
+	*key_offset = SLOT_INLINE;
+	*cursor |= NEXT_INLINE;
+	return 1;
+}
 
 
 /**
- * Zero initialize a struct of type kv_datum
- * @param: dat Address to the data to initialize
+ * Finds the next inline couple in the blocks (version 3 of .blk), in the 
+ * order of the file
+ * @param kv Database
+ * @param cursor Number of the first slot to look at (block number * 
+ *	  MAX_BLK_ENTR + slot), moved after the couple found
+ * @param record Filled with the record of the couple
+ * @return 1 if a couple has been found, 0 at the end, -1 in case of error
  */
-void init_datum(kv_datum *dat){
-	memset(dat, 0, sizeof (kv_datum));
+int next_inline(KV *kv, pos_t *cursor, char *record){
+
+	block blk;
+	len_t max = MAX_BLK_ENTR(kv);
+	pos_t n = *cursor / max;
+	len_t i = *cursor % max;
+
+	for (; n < kv->nb_blocks; n++, i = 0) {
+		if (read_blk(kv, HSIZE_BLK + n * SIZE_BLK, &blk) == -1) 
+			return -1;
+
+		for (; i < blk.n_entries; i++) {
+			if (blk.slots[i].offset_kv != SLOT_INLINE) continue;
+
+			char *rec = INLINE_REC(kv, &blk, i);
+			memcpy(record, rec, 2 + (unsigned char) rec[0] + 
+						(unsigned char) rec[1]);
+			*cursor = n * max + i + 1;
+			return 1;
+		}
+	}
+
+	*cursor = n * max;
+	return 0;
 }
 
 
 /**
- * Get rid of a struct of type kv_datum
- * @parem: dat Address of the struct to drop
+ * Finds a stored key in the chain of its bucket
+ * @param kv Database
+ * @param key Pointer to a struct containing the key to search
+ * @param infos Filled by scan_blocks: offset of the key on the file .kv (or
+ *	  SLOT_INLINE with its record), slot (file .blk) who points to it
+ * @return 1 if the key has been found, 0 if not, -1 in case of error
  */
-void drop_datum(kv_datum *dat){
-	free(dat->ptr);
-	init_datum(dat);
+int key_to_kv(KV* kv, const kv_datum *key, scan_infos *infos){
+
+	/* Certainly absent: nothing to read */
+	if (!bf_test(kv, key)) return 0;
+
+	/* Read offset first block of the chain */	
+	pos_t offset_blk = h_get(kv, key_bucket(kv, key));
+	if (offset_blk == 0) return 0;
+	
+	/* Find offset on .kv */	
+	if (scan_blocks(kv, offset_blk, key, 1, infos) == -1) return -1;
+
+	return (infos->slot_entry != 0)? 1 : 0;
 }
 
 
 /**
- * Compare two kv_datum
- * @param: a,b The addresses of the elements to compare
- * @return: 1 if a == b , 0 otherwise
+ * Finds the values of several keys of the same bucket, reading each block
+ * of the chain only once
+ * @param kv Database
+ * @param keys Keys of the request
+ * @param vals,status Values and status of the request: the inline couples
+ *	  found are copied at once (status 1, or -1 in case of error)
+ * @param entries Entries of the keys to find (same hash), their val_offset
+ *	  and val_len are set for the keys found in .kv
+ * @param n Number of entries
+ * @return 0 in case of success, -1 otherwise
  */
-inline int eq_datum(const kv_datum *a, const kv_datum *b){
-	return a->len == b->len && (memcmp(a->ptr,b->ptr,a->len) == 0);
-}
+int find_bucket_keys(KV *kv, const kv_datum *keys, kv_datum *vals, 
+		     int *status, many_entry *entries, size_t n){
 
-/** 
- * Read a stored entry in to a kv_datum 
- * @param: kv Database from where to read
- * @param: offset Offset to the target data 
- * @param: dat Address to the kv_datum where to store
- *	   the entry. It must have been initialized 
- * @return: 0 in case of success, -1 otherwise
- */
-int read_datum(KV *kv, len_t offset, kv_datum *dat){ 
+	pos_t offset_blk = h_get(kv, entries[0].hash);
+	bool use_fp = kv->blk_version != 1;
+	size_t k, pending = n;
 
-	if (safe_read_at(kv->_fd_kv, offset, &dat->len, sizeof (len_t)) == -1){
-		return -1;
-	}
+	/* Fingerprints of the keys */
+	for (k = 0; k < n; k++) entries[k].fp = 
+		use_fp? key_fingerprint(&keys[entries[k].index]) : 0;
 
-	if (dat->len == 0) return 0;
-	
-	void *new_ptr;
-	if ( (new_ptr = realloc(dat->ptr, dat->len)) == NULL) return -1;
+	block blk;
+	while (offset_blk != 0 && pending > 0) {
 
-	dat->ptr = new_ptr;
+		if (read_blk(kv, offset_blk, &blk) == -1) return -1;
 
-	if (safe_read_at(kv->_fd_kv, offset + sizeof (len_t), 
-			 dat->ptr, dat->len) == -1 ) return -1;
+		len_t i;
+		for (i = 0; i < blk.n_entries; i++) {
+			pos_t offset_kv = blk.slots[i].offset_kv;
+			if (offset_kv == 0 || offset_kv == SLOT_CONT) continue;
+
+			for (k = 0; k < n; k++) {
+				size_t index = entries[k].index;
+				if (entries[k].val_offset != 0 || 
+				    status[index] != 0 ||
+				    (use_fp && blk.slots[i].fingerprint != entries[k].fp))
+					continue;
+
+				if (offset_kv == SLOT_INLINE) {
+					/* Found in the block */
+					kv_datum key, val;
+					inline_datums(INLINE_REC(kv, &blk, i),
+						      &key, &val);
+					if (!eq_datum(&keys[index], &key))
+						continue;
+					status[index] = (copy_datum(kv, val.ptr,
+					    val.len, &vals[index]) == -1)? 
+						-1 : 1;
+					pending--;
+					continue;
+				}
+
+				int r = match_key(kv, blk.slots[i].offset_kv, 
+					&keys[entries[k].index], 
+					&entries[k].val_len);
+				if (r == -1) return -1;
+				if (r == 0) continue;
+
+				/* Value of the blob log: read at once */
+				if (IS_BLOB_REF(kv, entries[k].val_len)) {
+					status[index] = (read_value(kv, 
+					    blk.slots[i].offset_kv + 
+					    sizeof (len_t) + keys[index].len,
+					    keys[index].len, &vals[index]) 
+						== -1)? -1 : 1;
+					pending--;
+					continue;
+				}
+
+				/* Found (the same key can be asked twice) */
+				entries[k].val_offset = blk.slots[i].offset_kv +
+					keys[entries[k].index].len + 
+					2 * sizeof (len_t);
+				pending--;
+			}
+		}
+
+		offset_blk = blk.offset_nextblk;
+	}
 
 	return 0;
-} 
+}
 
 
+/**
+ * Checks if a stored couple has the given key. The key and the size of the
+ * value are read at once, or piece by piece for a long key (no memory is
+ * allocated: it is used by scan_blocks, for each slot compared).
+ * @param kv Database
+ * @param offset_kv Offset to the couple in .kv
+ * @param key Key searched
+ * @param val_len Filled with the size of the value if the keys are equal
+ * @return 1 if the keys are equal, 0 if not, -1 in case of error
+ */
+int match_key(KV *kv, pos_t offset_kv, const kv_datum *key, len_t *val_len){
+
+	size_t size = key->len + 2 * sizeof (len_t);
+	char buf[256];
+	len_t len;
+
+	if (size > sizeof buf) {
+		/* Long key: compared piece by piece */
+		if (safe_read_at(kv->_fd_kv, offset_kv, &len, 
+				 sizeof len) == -1) return -1;
+		if (len != key->len) return 0;
+
+		size_t done, n;
+		for (done = 0; done < key->len; done += n) {
+			n = key->len - done;
+			if (n > sizeof buf) n = sizeof buf;
+			if (safe_read_at(kv->_fd_kv, offset_kv + sizeof len +
+					 done, buf, n) == -1) return -1;
+			if (memcmp(buf, (char*) key->ptr + done, n) != 0) 
+				return 0;
+		}
 
+		if (safe_read_at(kv->_fd_kv, offset_kv + sizeof len + 
+				 key->len, val_len, sizeof (len_t)) == -1) 
+			return -1;
+		return 1;
+	}
 
+	ssize_t nb = read_at(kv->_fd_kv, offset_kv, buf, size);
+	if (nb == -1) return -1;
+	if ((size_t) nb < sizeof (len_t)) {
+		errno = EINVAL;
+		return -1;
+	}
 
+	memcpy(&len, buf, sizeof len);
+	if (len != key->len) return 0;
 
+	if ((size_t) nb != size) {
+		errno = EINVAL;
+		return -1;
+	}
 
+	if (memcmp(buf + sizeof (len_t), key->ptr, key->len) != 0) return 0;
 
-		
-		
+	memcpy(val_len, buf + sizeof (len_t) + key->len, sizeof (len_t));
+	return 1;
+}
 
 
-/* Read data from file at the given offset */
-ssize_t read_at(int fd, len_t offset, void *buff, size_t count){
+/* Comparison function sorting the entries of kv_get_many by bucket */
+int cmp_many_buckets(const void *a, const void *b){
 
-	if (lseek(fd, offset, SEEK_SET) == -1) return -1;
+	const many_entry *ea = a, *eb = b;
 
-	return read(fd, buff, count);
+	if (ea->hash != eb->hash) return (ea->hash < eb->hash)? -1 : 1;
+	return (ea->index < eb->index)? -1 : (ea->index > eb->index);
 }
 
-/* Read data from file at the given offset. Returns an error if the size
- * of the data that has been read is different than count 
- */
-ssize_t safe_read_at(int fd, len_t offset, void *buff, size_t count){
-	ssize_t nb = read_at(fd, offset, buff, count);
-	if (nb == -1 ) return -1;
-	return ( (size_t) nb == count)? nb : -1;
+
+/* Comparison function sorting the entries of kv_get_many by offset of
+ * their value (the keys not found first) */
+int cmp_many_values(const void *a, const void *b){
+
+	const many_entry *ea = a, *eb = b;
+
+	if (ea->val_offset != eb->val_offset) 
+		return (ea->val_offset < eb->val_offset)? -1 : 1;
+	return (ea->index < eb->index)? -1 : (ea->index > eb->index);
 }
 
-/* @ref read_at */
-ssize_t write_at(int fd, len_t offset, const void *buff, size_t count){
+
+/**
+ * Fill a given kv_datum with the data contained in the given file at the given
+ * offset. If dat.ptr is NULL it is allocated (see alloc_datum), otherwise 
+ * dat.len represent the maximum of data to be read.
+ * @param kv Database
+ * @param fd File descriptor (.kv or .blob)
+ * @param offset Offset to the value to read.
+ * @param size Size of the data to read. This parameter is ignored if dat.ptr 
+ *	  is not NULL, in this case dat.len is considered
+ * @param dat Pointer to the kv_datum structure where to store the data
+ * @return 0 in case of success, -1 otherwise
+ */
+int fill_datum(KV *kv, int fd, pos_t offset, len_t size, kv_datum *dat){
 	
-	if (lseek(fd, offset, SEEK_SET) == -1) return -1;
-	return write(fd, buff, count);
-}
+	/* Empty value */
+	if (size == 0) {
+		dat->len = 0;
+		return 0;
+	}
 
-/* @ref safe_read_at */
-ssize_t safe_write_at(int fd, len_t offset, const void *buff, size_t count){
-	ssize_t nb = write_at(fd, offset, buff, count);
-	if (nb == -1 ) return -1;
-	return ( (size_t) nb == count)? nb : -1;
-}
+	/* Allocate ptr if necessary, adapt the size otherwise */
+	if (dat->ptr == NULL){
 
+		if ((dat->ptr = alloc_datum(kv, size)) == NULL) return -1;
 
+	} else {
+		size  = (size > dat->len)? dat->len : size;
+	}
 
+	if (safe_read_at(fd, offset, dat->ptr, size) == -1) return -1;
 
-/**
- * Assign hash fun to KV struct following the hidx
- */
-int setHashFun(KV *db, int hidx){
+	dat->len = size;
 
-	switch (hidx){ 
-		case 0:
-		case HASH_1:	db->_hash_fun = hash_fun1;
-				break;
-		case HASH_2:	db->_hash_fun = hash_fun2;
-				break;
-		case HASH_3:	db->_hash_fun = hash_fun3;
-				break;
-		default:	errno = EINVAL;
-				return -1;
-	}	
-		
 	return 0;
 }
 
 
 /**
- * Opens db files and assing fds to the KV struct
+ * Same as fill_datum, for data in memory (the record of an inline couple)
+ * @param kv Database
+ * @param data Data to copy
+ * @param size Size of the data
+ * @param dat Pointer to the kv_datum structure where to store the data
+ * @return 0 in case of success, -1 otherwise
  */
-int openFilesKV(KV *db, const char *dbname, int flags){
-	/* Open database files */
-	char *filename;
-	mode_t permissions = 0666;
-	size_t ll = strlen(dbname);
+int copy_datum(KV *kv, const char *data, len_t size, kv_datum *dat){
 
-	if ( (filename = malloc( ll + 4)) == NULL) return -1;
-	char *sffx = filename + ll;
-	memcpy(filename, dbname, ll);
-	
-	
-	sffx[0] = '.'; sffx[1] = 'h'; sffx[2] = 0; 			// ".h"
-	db->_fd_h = open(filename, flags, permissions);
+	/* Empty value */
+	if (size == 0) {
+		dat->len = 0;
+		return 0;
+	}
 
-	sffx[1] = 'k'; sffx[2] = 'v'; sffx[3] = 0;			// ".kv"
-	db->_fd_kv = open(filename, flags, permissions);
+	/* Allocate ptr if necessary, adapt the size otherwise */
+	if (dat->ptr == NULL){
 
-	sffx[1] = 'b'; sffx[2] = 'l'; sffx[3] = 'k'; sffx[4] = 0;	// ".blk"
-	db->_fd_blk = open(filename, flags, permissions);
-	
-	sffx[1] = 'd'; sffx[2] = 'k'; sffx[3] = 'v'; sffx[4] = 0;	// ".dkv"
-	db->_fd_dkv = open(filename, flags, permissions);
-	
-	if ( db->_fd_h   == -1 || db->_fd_kv  == -1 || 
-	     db->_fd_blk == -1 || db->_fd_dkv == -1 ) {	
-		free(filename);
-		return -1;	// errno = [error on last failed open call]
+		if ((dat->ptr = alloc_datum(kv, size)) == NULL) return -1;
+
+	} else {
+		size  = (size > dat->len)? dat->len : size;
 	}
-	
-	free(filename);
+
+	memcpy(dat->ptr, data, size);
+	dat->len = size;
 
 	return 0;
 }
 
+
 /**
- * Writes headers into all the database related files
- * WARNING: this function must be consistent with the 
- *          definition  of the headers size (HSIZE_*)
- * @note: hidx must be a valid index
- */
+ * Reads a value stored in .kv, or in the blob log if .kv holds a reference 
+ * to it. The size and the reference are read at once.
+ * @param kv Database
+ * @param val_offset Offset in .kv of the size of the value
+ * @param key_len Size of the key of the couple
+ * @param val Where to store the value (see fill_datum)
+ * @return 0 in case of success, -1 otherwise
+ */
+int read_value(KV *kv, pos_t val_offset, len_t key_len, kv_datum *val){
+
+	char head[sizeof (len_t) + BLOB_REF_SIZE];
+	len_t size;
+
+	ssize_t nb = read_at(kv->_fd_kv, val_offset, head, sizeof head);
+	if (nb == -1) return -1;
+	if ((size_t) nb < sizeof size) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&size, head, sizeof size);
+
+	if (!IS_BLOB_REF(kv, size)) return fill_datum(kv, kv->_fd_kv, 
+				val_offset + sizeof (len_t), size, val);
+
+	if ((size_t) nb != sizeof head) {
+		errno = EINVAL;
+		return -1;
+	}
+	return blob_get(kv, key_len, head + sizeof (len_t), val);
+}
+
+
+/**
+ * Allocates the memory of a datum returned to the user: in the arena given 
+ * to kv_set_arena if any, with malloc otherwise
+ * @param kv Database
+ * @param size Size (bytes) of the datum
+ * @return The memory allocated, NULL in case of error (ENOBUFS if the arena
+ *	   is full)
+ */
+void *alloc_datum(KV *kv, size_t size){
+
+	if (kv->arena == NULL) return malloc(size);
+
+	/* kv_get can run in several threads (on all the shards sharing the 
+	 * arena too) */
+	pthread_mutex_t *mutex = (kv->parent != NULL)? 
+		&kv->parent->arena_mutex : &kv->arena_mutex;
+	pthread_mutex_lock(mutex);
+
+	kv_arena *arena = kv->arena;
+	char *ptr = NULL;
+	size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t) 
+			(ARENA_ALIGN - 1);
+	if (start < arena->used || start > arena->size || 
+	    size > arena->size - start) {
+		errno = ENOBUFS;
+	} else {
+		ptr = (char*) arena->ptr + start;
+		arena->used = start + size;
+	}
+
+	pthread_mutex_unlock(mutex);
+	return ptr;
+}
+
+
+/**
+ * Frees the memory of a datum allocated by alloc_datum (it is simply lost if
+ * it comes from the arena of the user, until the user empties it)
+ * @param kv Database
+ * @param ptr Memory to free
+ */
+void free_datum(KV *kv, void *ptr){
+
+	if (kv->arena == NULL) free(ptr);
+}
+
+
+/**
+ * Gives a buffer of a given size for the temporaries of the functions 
+ * modifying the database. The buffer is kept from a call to another and only
+ * grows (up to MAX_SCRATCH for its users): the hot path does not allocate 
+ * memory. The functions called by kv_get must not use it (they run in 
+ * several threads).
+ * @param kv Database
+ * @param size Size (bytes) needed
+ * @return The buffer, valid until the next call, NULL in case of error
+ */
+char *scratch_get(KV *kv, size_t size){
+
+	if (size <= kv->scratch_size) return kv->scratch;
+
+	size_t new_size = (kv->scratch_size < MIN_SCRATCH)? 
+				MIN_SCRATCH : kv->scratch_size;
+	while (new_size < size) new_size *= 2;
+
+	/* The content is not kept: no need to copy it */
+	free(kv->scratch);
+	kv->scratch_size = 0;
+	if ((kv->scratch = malloc(new_size)) == NULL) return NULL;
+	kv->scratch_size = new_size;
+
+	return kv->scratch;
+}
+
+
+/**
+ * Reads the values found by kv_get_many. Values separated by less than 
+ * MAX_READ_GAP bytes are read by the same preadv (the gaps being read into
+ * a scratch buffer).
+ * @param kv Database
+ * @param vals Values of the request (see get_many)
+ * @param status Status of the keys of the request, set to 1 for the values
+ *	  read and to -1 in case of error
+ * @param entries Entries of the keys found, sorted by val_offset
+ * @param n Number of entries
+ * @return 0 in case of success, -1 otherwise
+ */
+int read_values
+(KV *kv, kv_datum *vals, int *status, many_entry *entries, size_t n){
+
+	char gap[MAX_READ_GAP];
+	struct iovec iov[IOV_MAX];
+	size_t i = 0, j, k;
+	int ret = 0;
+
+	while (i < n) {
+
+		pos_t start = entries[i].val_offset, end = start;
+		int cnt = 0;
+
+		/* Gather the next values close to each other */
+		for (j = i; j < n && cnt + 2 <= IOV_MAX; j++) {
+			many_entry *e = &entries[j];
+			kv_datum *val = &vals[e->index];
+			if (status[e->index] == -1) break;
+			if (e->val_offset < end ||
+			    e->val_offset - end > MAX_READ_GAP) break;
+
+			/* Allocate the value or adapt its size (see fill_datum) */
+			len_t size = e->val_len;
+			e->allocated = false;
+			if (val->ptr == NULL && size != 0) {
+				if ((val->ptr = alloc_datum(kv, size)) == NULL)
+					break;
+				e->allocated = true;
+			} else if (val->ptr != NULL && size > val->len) {
+				size = val->len;
+			}
+			val->len = size;
+
+			if (e->val_offset > end) {
+				iov[cnt].iov_base = gap;
+				iov[cnt++].iov_len = e->val_offset - end;
+			}
+			iov[cnt].iov_base = val->ptr;
+			iov[cnt++].iov_len = size;
+			end = e->val_offset + size;
+		}
+
+		/* First value cannot be read (error or allocation failure) */
+		if (j == i) {
+			status[entries[i++].index] = -1;
+			ret = -1;
+			continue;
+		}
+
+		ssize_t nb = (end == start)? 0 : 
+				preadv(kv->_fd_kv, iov, cnt, start);
+		bool ok = nb != -1 && (size_t) nb == end - start;
+		if (nb != -1 && !ok) errno = EINVAL;
+		
+		for (k = i; k < j; k++) {
+			size_t index = entries[k].index;
+			if (ok) {
+				status[index] = 1;
+				continue;
+			}
+			if (entries[k].allocated) {
+				free_datum(kv, vals[index].ptr);
+				vals[index].ptr = NULL;
+			}
+			status[index] = -1;
+			ret = -1;
+		}
+
+		i = j;
+	}
+
+	return ret;
+}
+
+
+/**
+ * Insert an entry using an empty .h slot
+ * @param kv Database
+ * @param hash Corresponding hash (= number of the .h slot)
+ * @param key,val Couple (key,value) to store
+ * @return 0 in case of success, -1 otherwise
+ */
+int insert_first_entry
+(KV *kv, len_t hash, const kv_datum *key, const kv_datum *val){
+
+	/* Inline couple: written in the new block */
+	if (IS_INLINE(kv, key, val)) {
+		scan_infos infos;
+		memset(&infos, 0, sizeof infos);
+		if ((infos.last_block = allocate_blk(kv, NULL)) == 0 ||
+		    h_set(kv, hash, infos.last_block) == -1) return -1;
+		return link_inline(kv, &infos, key, val);
+	}
+	
+	/* Store the couple key-value */
+	kv_stored ref_kv;
+	if ( store_kv(kv, key, val, &ref_kv) == -1) return -1;
+
+	/* Allocate a new empty block */
+	pos_t offset_blk = allocate_blk(kv, NULL);
+	if (offset_blk == 0) goto err_kv_lost;
+
+	/* Update hash table */
+	if (h_set(kv, hash, offset_blk) == -1) goto err_blk_lost;
+
+	/* Write the entry to the block */
+	if ( write_slot(kv, SLOT_OFFSET(kv, offset_blk, 0), ref_kv.offset_kv,
+		key_fingerprint(key)) == -1) goto err_kv_lost;
+
+	if ( write_blk_head(kv, offset_blk, 1) == -1) goto err_kv_lost;
+
+	return 0;
+
+
+err_blk_lost:
+	//pop_block(KV *kv); // Further implementation
+err_kv_lost:
+	remove_data(kv, ref_kv.offset_kv);
+	return -1;
+
+}
+
+
+
+/**
+ * Insert an entry to a chain of blocks 
+ * @param kv Database
+ * @param key,val Couple key,value to store
+ * @param offset_first_blk Offset to the first block of the chain
+ * @return 0 in case of success, -1 otherwie
+ * @warning: the insertion of values with identical keys result in the 
+ * 	     suppression of the first inserted value. If an error occours
+ *	     both values could be lost (the old value is overwritten in place
+ *	     when the new couple fits in its space, see rewrite_kv)
+ */
+int insert_to_chain
+(KV *kv, const kv_datum *key, const kv_datum *val, pos_t offset_first_blk){
+	
+	/* Step 1: Find the key and the free slots of the chain */
+
+	bool is_inline = IS_INLINE(kv, key, val);
+	len_t need = is_inline? INLINE_SLOTS(kv, INLINE_SIZE(key, val)) : 1;
+	scan_infos infos;	
+	if (scan_blocks(kv,offset_first_blk,key,need,&infos) == -1) return -1;
+
+	/* Check if key exists */
+	if (infos.slot_entry != 0) {
+		/* Overwrite the old couple if the new one fits in its space */
+		if (!is_inline && infos.offset_kv != SLOT_INLINE) {
+			int r = rewrite_kv(kv, infos.offset_kv, key, val);
+			if (r != 0) return (r == 1) ? 0 : -1;
+		}
+
+ 		/* Remove old value, fill its slots with 0 */
+		if ( free_entry(kv, &infos) == -1) return -1;
+
+		/* New free slots avalable */
+		if ( infos.free_slot == 0 && infos.entry_slots >= need) {
+			infos.free_slot = infos.slot_entry;
+			infos.free_block= infos.last_block;
+		} else if ( infos.free_slot == 0 && 
+			    scan_blocks(kv, offset_first_blk, key, need, 
+				&infos) == -1) return -1; // Up to the end
+	}
+
+
+	/* Step 2: Store the couple key-value */
+
+	if (is_inline) return link_inline(kv, &infos, key, val);
+
+	// Store data
+	kv_stored ref_kv;
+	if ( store_kv(kv, key, val, &ref_kv) == -1) return -1;
+
+	// Write block entry
+	if (link_slot(kv, &infos, ref_kv.offset_kv,
+		key_fingerprint(key)) == -1) goto err_kv_lost;
+
+	return 0;	
+
+err_kv_lost:
+	remove_data(kv, ref_kv.offset_kv);
+	return -1;
+	
+}
+
+
+/**
+ * Writes the reference to a stored couple into a chain of blocks: in the
+ * first free slot found by scan_blocks, or at the end of the last block
+ * (extending the chain if it is full)
+ * @param kv Database
+ * @param infos Result of scan_blocks for this chain
+ * @param offset_kv Offset to the couple in .kv
+ * @param fp Fingerprint of the key
+ * @return 0 in case of success, -1 otherwise
+ */
+int link_slot(KV *kv, const scan_infos *infos, pos_t offset_kv, len_t fp){
+
+	pos_t offset_slot = find_room(kv, infos, 1);
+	if (offset_slot == 0) return -1;
+
+	return write_slot(kv, offset_slot, offset_kv, fp);
+}
+
+
+/**
+ * Writes an inline couple into a chain of blocks, like link_slot
+ * @param kv Database
+ * @param infos Result of scan_blocks for this chain (looking for the slots
+ *	  of the couple)
+ * @param key,val Couple (see IS_INLINE)
+ * @return 0 in case of success, -1 otherwise
+ */
+int link_inline
+(KV *kv, const scan_infos *infos, const kv_datum *key, const kv_datum *val){
+
+	pos_t offset_slot = find_room(kv, infos, 
+				INLINE_SLOTS(kv, INLINE_SIZE(key, val)));
+	if (offset_slot == 0) return -1;
+
+	return write_inline(kv, offset_slot, key, val);
+}
+
+
+/**
+ * Finds free slots in a row in a chain of blocks: the first ones found by 
+ * scan_blocks, or at the end of the last block (extending the chain if it 
+ * has no room). The header of the block is updated.
+ * @param kv Database
+ * @param infos Result of scan_blocks for this chain
+ * @param need Number of slots
+ * @return The offset of the first slot, 0 in case of error
+ */
+pos_t find_room(KV *kv, const scan_infos *infos, len_t need){
+
+	if (infos->free_slot != 0) return infos->free_slot;
+
+	/* Use the last block of the chain */
+	pos_t last_block = infos->last_block;
+	len_t n_entries = infos->nblk_entries;
+	if (n_entries + need > MAX_BLK_ENTR(kv)) {
+		/* Last block is full */
+		last_block = extend_blocks_chain(kv, last_block);
+		if (last_block == 0) return 0;
+		n_entries = 0;
+	}
+
+	/* Append to the last block */
+	if (write_blk_head(kv, last_block, n_entries + need) == -1) return 0;
+
+	return SLOT_OFFSET(kv, last_block, n_entries);
+}
+
+
+/**
+ * Writes the reference to a stored couple into the chain of its bucket,
+ * creating the chain if needed. The key must not be in the chain.
+ * @param kv Database
+ * @param hash Bucket of the key
+ * @param key,val Couple
+ * @param offset_kv Offset to the couple in .kv, SLOT_INLINE to write the 
+ *	  couple inline
+ * @return 0 in case of success, -1 otherwise
+ */
+int link_entry(KV *kv, len_t hash, const kv_datum *key, 
+	       const kv_datum *val, pos_t offset_kv){
+
+	scan_infos infos;
+	pos_t offset_blk = h_get(kv, hash);
+	len_t need = (offset_kv == SLOT_INLINE)? 
+			INLINE_SLOTS(kv, INLINE_SIZE(key, val)) : 1;
+
+	if (offset_blk == 0) {
+		/* New chain */
+		if ((offset_blk = allocate_blk(kv, NULL)) == 0 ||
+		    h_set(kv, hash, offset_blk) == -1) return -1;
+		memset(&infos, 0, sizeof infos);
+		infos.last_block = offset_blk;
+
+	} else if (scan_blocks(kv, offset_blk, key, need, &infos) == -1) 
+		return -1;
+
+	if (offset_kv == SLOT_INLINE) return link_inline(kv, &infos, key, val);
+	return link_slot(kv, &infos, offset_kv, key_fingerprint(key));
+}
+
+
+/* Comparison function used to sort the entries of a batch (see qsort) */
+int cmp_batch_entries(const void *a, const void *b){
+
+	const batch_entry *ea = a, *eb = b;
+
+	if (ea->hash != eb->hash) return (ea->hash < eb->hash)? -1 : 1;
+	return (ea->index < eb->index)? -1 : (ea->index > eb->index);
+}
+
+
+/**
+ * Copies a change at the end of a batch
+ * @param b Batch
+ * @param type WAL_PUT or WAL_DEL
+ * @param key,val Couple (val is not used by WAL_DEL)
+ * @return 0 in case of success, -1 otherwise
+ */
+int batch_add
+(kv_batch *b, len_t type, const kv_datum *key, const kv_datum *val){
+
+	pos_t need = 2 * sizeof (len_t) + (pos_t) key->len;
+	if (type == WAL_PUT) need += sizeof (len_t) + (pos_t) val->len;
+
+	if (b->size - b->len < need) {
+		pos_t size = (b->size == 0)? BATCH_BUFFER : 2 * b->size;
+		while (size - b->len < need) size *= 2;
+		char *ops = realloc(b->ops, size);
+		if (ops == NULL) return -1;
+		b->ops = ops;
+		b->size = size;
+	}
+
+	char *op = b->ops + b->len;
+	memcpy(op, &type, sizeof (len_t));
+	memcpy(op + sizeof (len_t), &key->len, sizeof (len_t));
+	op += 2 * sizeof (len_t);
+	memcpy(op, key->ptr, key->len);
+	if (type == WAL_PUT) {
+		memcpy(op + key->len, &val->len, sizeof (len_t));
+		memcpy(op + key->len + sizeof (len_t), val->ptr, val->len);
+	}
+
+	b->len += need;
+	b->nb_ops++;
+	return 0;
+}
+
+
+/**
+ * Reads the next change of a batch
+ * @param ops,size Changes of the batch
+ * @param used Offset of the change in ops, moved to the next one
+ * @param type Filled with the type of the change (WAL_PUT or WAL_DEL)
+ * @param key,val Filled with the couple (pointing into ops)
+ * @return 1 if a change has been read, 0 at the end of the batch, -1 if the
+ *	   change is not well formed
+ */
+int batch_next(const char *ops, pos_t size, pos_t *used, len_t *type,
+	       kv_datum *key, kv_datum *val){
+
+	if (*used == size) return 0;
+
+	pos_t at = *used;
+	len_t len;
+	if (size - at < 2 * sizeof (len_t)) return -1;
+	memcpy(type, ops + at, sizeof (len_t));
+	memcpy(&len, ops + at + sizeof (len_t), sizeof (len_t));
+	at += 2 * sizeof (len_t);
+	if ((*type != WAL_PUT && *type != WAL_DEL) || size - at < len) 
+		return -1;
+	key->ptr = (char*) ops + at;
+	key->len = len;
+	at += len;
+
+	if (*type == WAL_PUT) {
+		if (size - at < sizeof (len_t)) return -1;
+		memcpy(&len, ops + at, sizeof (len_t));
+		at += sizeof (len_t);
+		if (size - at < len) return -1;
+		val->ptr = (char*) ops + at;
+		val->len = len;
+		at += len;
+	}
+
+	*used = at;
+	return 1;
+}
+
+
+/* Comparison function used to sort the changes of a batch (see qsort) */
+int cmp_batch_ops(const void *a, const void *b){
+
+	const batch_op *oa = a, *ob = b;
+
+	if (oa->key.len != ob->key.len) 
+		return (oa->key.len < ob->key.len)? -1 : 1;
+	int r = memcmp(oa->key.ptr, ob->key.ptr, oa->key.len);
+	if (r != 0) return r;
+	return (oa->index < ob->index)? -1 : (oa->index > ob->index);
+}
+
+
+/**
+ * Puts back the values of the keys of a batch that failed. An error here 
+ * cannot be reported (the one of the batch is): the next open of a 
+ * database with a log still goes back to the state before the batch.
+ * @param kv Database
+ * @param ops Changes of the batch (one per key) with their old values
+ * @param n Number of changes
+ */
+void undo_batch(KV *kv, const batch_op *ops, size_t n){
+
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (ops[i].found) put_entry(kv, &ops[i].key, &ops[i].old);
+		else del_entry(kv, &ops[i].key);
+	}
+}
+
+
+
+
+
+
+
+
+/**
+ * Traverse the chain of blocks searching for a key while collecting 
+ * different informations depending on the given mode. Those informations
+ * are stored into the fields of the given scan_infos structure.
+ * @param: kv The database
+ * @param: first_blk Offset (address) to the first block
+ * @param: key The key to search
+ * @param: need Number of free slots in a row wanted (more than 1 for an 
+ *	   inline couple, see find_room)
+ * @param: infos The address to the struct of type scan_infos to be filled
+ *
+ * Here is a more detailed explaination of the fields of the struct scan_infos:
+ *
+ * +--------------+--------------------------------------------------+
+ * |   FIELD      |         VALUE				     |
+ * +--------------+--------------------------------------------------+
+ * | slot_entry   | If the key exists it contains the offset to the  |
+ * |              | slot refering the entry, 0 otherwise.	     |
+ * +--------------+--------------------------------------------------+
+ * | offset_kv    | If the key exists it contains the offset to the  |
+ * |              | slot refering the stored data, 0 otherwise.      |
+ * |              | SLOT_INLINE for an inline couple.		     |
+ * +--------------+--------------------------------------------------+
+ * | entry_slots, | If the key exists, the number of slots it takes  |
+ * | record       | and, if inline, a copy of its record.	     |
+ * +--------------+--------------------------------------------------+
+ * | free_slot    | The offset to the first run of `need` free slots |
+ * |              | found, 0 if none has been found.		     |
+ * +--------------+--------------------------------------------------+
+ * | last_block   | If slot_entry == 0, it contains the offset to the|
+ * |              | last allocated block of the chain, otherwise it  |
+ * |              | contains the offset to the block where the entry |
+ * |              | has been found (the last block visited by	     |
+ * |              | by scan_infos).				     |
+ * +--------------+--------------------------------------------------+
+ * | free_block   | If free_slot != 0 it contains the offset to the  |
+ * | 		  | block containing the free slot.		     |
+ * +--------------+--------------------------------------------------+
+ * | nblk_entries | Number of entries in last_block		     |
+ * +--------------+--------------------------------------------------+
+ * @return 0 in case of success, -1 otherwise
+ */
+int scan_blocks(KV *kv, pos_t offset_blk, const kv_datum *key, len_t need,
+		scan_infos *infos) {
+
+	#define EMPTY 0
+	memset(infos, EMPTY, sizeof (scan_infos));
+	
+	block blk;
+	pos_t off_last_blk = 0;
+
+	/* Fingerprints are not available in version 1 */
+	bool use_fp = kv->blk_version != 1;
+	len_t fingerprint = use_fp? key_fingerprint(key) : 0;
+
+	while ( offset_blk != EMPTY ){ // While there are blocks
+
+		// Read block
+		if ( read_blk(kv, offset_blk, &blk) == -1) return -1;
+		// Scan block
+		len_t i, run = 0;
+		for (i = 0; i < blk.n_entries; i++) {
+		
+			pos_t offset_slot = SLOT_OFFSET(kv, offset_blk, i);
+	
+			if (blk.slots[i].offset_kv == EMPTY ) {
+				/* Free slot (ending a run long enough) */
+				if (++run >= need && infos->free_slot == EMPTY) {
+					infos->free_slot = SLOT_OFFSET(kv, 
+						offset_blk, i + 1 - need);
+					infos->free_block = offset_blk;
+				}
+				continue;
+			}
+			run = 0;
+
+			/* Different fingerprints: different keys */
+			if (blk.slots[i].offset_kv == SLOT_CONT ||
+			    (use_fp && blk.slots[i].fingerprint != fingerprint))
+				continue;
+
+			if (blk.slots[i].offset_kv == SLOT_INLINE) {
+				/* Compare with the key in the block */
+				kv_datum k, v;
+				char *rec = INLINE_REC(kv, &blk, i);
+				inline_datums(rec, &k, &v);
+				if (!eq_datum(key, &k)) continue;
+
+				infos->slot_entry = offset_slot;
+				infos->offset_kv = SLOT_INLINE;
+				infos->entry_slots = INLINE_SLOTS(kv, 
+						2 + k.len + v.len);
+				memcpy(infos->record, rec, 2 + k.len + v.len);
+				infos->last_block = offset_blk;
+				infos->nblk_entries  = blk.n_entries;
+				return 0;
+			}
+	
+			/* Compare with the stored key */
+			len_t val_len;
+			int r = match_key(kv, blk.slots[i].offset_kv, key, 
+					  &val_len);
+			if (r == -1) return -1;
+	
+			if (r == 1) {
+				/* Key found */
+				infos->slot_entry = offset_slot;
+				infos->offset_kv = blk.slots[i].offset_kv;
+				infos->entry_slots = 1;
+				infos->last_block = offset_blk;
+				infos->nblk_entries  = blk.n_entries;
+				return 0;
+			}
+		}
+			
+		off_last_blk = offset_blk;
+		offset_blk = blk.offset_nextblk;
+	}
+	
+	/* End of the chain (no entry has been found) */
+	
+	infos->last_block = off_last_blk;
+	if (off_last_blk != EMPTY) infos->nblk_entries = blk.n_entries;
+
+	return 0;
+}
+
+
+/**
+ * Read a whole block into a struct of type block
+ * @param: kv Target database
+ * @param: blk_offset Offset to the target block
+ * @param: blk Address of the block struct where to store the data
+ * @return: 0 in cae of success, -1 otherwise
+ */
+int read_blk(KV *kv, pos_t blk_offset, block *blk) {
+
+	/* kv_get can run in several threads: the pool needs its mutex */
+	pthread_mutex_lock(&kv->pool.mutex);
+
+	char *raw = pool_page(kv, blk_offset, true, false);
+	if (raw == NULL) goto error;
+
+	/* Position first bit from the left */
+	int first_bit = sizeof (len_t) * CHAR_BIT - 1;
+	len_t header = *(len_t*) raw;
+	len_t max_entries = MAX_BLK_ENTR(kv);
+	
+	/* Check if the block is full */
+	if (BITSLICE(header, first_bit, first_bit) == 0) { 
+		// Block not full
+		blk->n_entries = header;
+		blk->offset_nextblk = 0;
+	} else {
+		// Block full
+		blk->n_entries = max_entries; 
+		blk->offset_nextblk = HSIZE_BLK + (pos_t) SIZE_BLK * 
+				BITSLICE(header,first_bit-1,0);
+	}
+
+	if (blk->n_entries > max_entries) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	/* Decode the slots */
+	len_t i, k;
+	for (i = 0; i < blk->n_entries; i++) {
+		get_slot(kv, raw, i, &blk->slots[i]);
+		if (kv->blk_version != 3 || 
+		    blk->slots[i].offset_kv != SLOT_INLINE) continue;
+
+		/* Inline couple: its record fills the following slots */
+		unsigned char *rec = (unsigned char*) raw + SIZE_BLK_HEAD + 
+					(i + 1) * SIZE_SLOT(kv);
+		if (i + 1 >= blk->n_entries || rec[0] + rec[1] > INLINE_MAX) {
+			errno = EINVAL;
+			goto error;
+		}
+		k = INLINE_SLOTS(kv, 2 + rec[0] + rec[1]) - 1;
+		if (i + k >= blk->n_entries) {
+			errno = EINVAL;
+			goto error;
+		}
+		while (k-- > 0) {
+			blk->slots[++i].offset_kv = SLOT_CONT;
+			blk->slots[i].fingerprint = 0;
+		}
+	}
+	if (kv->blk_version == 3) memcpy(blk->raw, raw, SIZE_BLK_HEAD + 
+					blk->n_entries * SIZE_SLOT(kv));
+
+	pthread_mutex_unlock(&kv->pool.mutex);
+	return 0;
+
+error:
+	pthread_mutex_unlock(&kv->pool.mutex);
+	return -1;
+}
+
+
+/**
+ * Writes the content of a slot of a block (version 2)
+ * @param kv Database
+ * @param offset_slot Offset to the slot
+ * @param offset_kv Offset to the data referred by the slot, 0 to free it
+ * @param fingerprint Fingerprint of the key of the data
+ * @return 0 in case of success, -1 otherwise
+ */
+int write_slot(KV *kv, pos_t offset_slot, pos_t offset_kv, len_t fingerprint){
+
+	/* Offset of the block containing the slot */
+	pos_t blk_offset = offset_slot - (offset_slot - HSIZE_BLK) % SIZE_BLK;
+
+	char *page = pool_page(kv, blk_offset, true, true);
+	if (page == NULL) return -1;
+
+	/* Number of keys of the database: a slot is used or freed */
+	char *slot = page + (offset_slot - blk_offset);
+	pos_t old = get_off(kv, slot);
+	if (old == 0 && offset_kv != 0) kv->nb_keys++;
+	if (old != 0 && offset_kv == 0) kv->nb_keys--;
+
+	put_off(kv, slot, offset_kv);
+	memcpy(slot + OFF_SIZE(kv), &fingerprint, sizeof (len_t));
+
+	return 0;
+}
+
+
+/**
+ * Writes the header of a block
+ * @param kv Database
+ * @param blk_offset Offset to the block
+ * @param header New header (number of entries or next block, see above)
+ * @return 0 in case of success, -1 otherwise
+ */
+int write_blk_head(KV *kv, pos_t blk_offset, len_t header){
+
+	char *page = pool_page(kv, blk_offset, true, true);
+	if (page == NULL) return -1;
+
+	memcpy(page, &header, sizeof header);
+
+	return 0;
+}
+
+/**
+ * Writes an inline couple (version 3): its head slot and its record in the
+ * following slots, which must be free
+ * @param kv Database
+ * @param offset_slot Offset to the head slot
+ * @param key,val Couple (see IS_INLINE)
+ * @return 0 in case of success, -1 otherwise
+ */
+int write_inline
+(KV *kv, pos_t offset_slot, const kv_datum *key, const kv_datum *val){
+
+	pos_t blk_offset = offset_slot - (offset_slot - HSIZE_BLK) % SIZE_BLK;
+	len_t nb_slots = INLINE_SLOTS(kv, INLINE_SIZE(key, val));
+	len_t fp = key_fingerprint(key);
+
+	char *page = pool_page(kv, blk_offset, true, true);
+	if (page == NULL) return -1;
+
+	char *slot = page + (offset_slot - blk_offset);
+	memset(slot, 0, nb_slots * SIZE_SLOT(kv));
+	put_off(kv, slot, SLOT_INLINE);
+	memcpy(slot + OFF_SIZE(kv), &fp, sizeof (len_t));
+
+	unsigned char *rec = (unsigned char*) slot + SIZE_SLOT(kv);
+	rec[0] = key->len;
+	rec[1] = val->len;
+	if (key->len > 0) memcpy(rec + 2, key->ptr, key->len);
+	if (val->len > 0) memcpy(rec + 2 + key->len, val->ptr, val->len);
+
+	/* The number of keys counts the slots (see FILE .BLK) */
+	kv->nb_keys += nb_slots;
+
+	return 0;
+}
+
+/**
+ * Points two kv_datum to the key and the value of the record of an inline
+ * couple
+ * @param record Record (key size, value size, key, value)
+ * @param key,val Filled with the key and the value
+ */
+void inline_datums(const char *record, kv_datum *key, kv_datum *val){
+	key->len = (unsigned char) record[0];
+	val->len = (unsigned char) record[1];
+	key->ptr = (char*) record + 2;
+	val->ptr = (char*) record + 2 + key->len;
+}
+
+/**
+ * Copies the record of an inline couple returned as a view: the copy stays
+ * valid until release_views, like the mappings of .kv
+ * @param kv Database
+ * @param record Record of the couple
+ * @return The copy of the record, NULL in case of error
+ */
+char* view_record(KV *kv, const char *record){
+
+	size_t size = 2 + (unsigned char) record[0] + (unsigned char) record[1];
+	char *copy = view_alloc(kv, size);
+	if (copy != NULL) memcpy(copy, record, size);
+
+	return copy;
+}
+
+/**
+ * Copies a value of the blob log returned as a view, like view_record
+ * @param kv Database
+ * @param key_len Size of the key of the couple
+ * @param ref Reference to the value (in the mapping of .kv)
+ * @param val Filled with a view of the copy
+ * @return 0 in case of success, -1 otherwise
+ */
+int view_blob(KV *kv, len_t key_len, const char *ref, kv_datum *val){
+
+	memcpy(&val->len, ref, sizeof (len_t));
+	if ((val->ptr = view_alloc(kv, val->len)) == NULL) return -1;
+
+	return blob_get(kv, key_len, ref, val);
+}
+
+/**
+ * Allocates a copy returned as a view: it is linked to the list of the 
+ * copies freed by release_views
+ * @param kv Database
+ * @param size Size of the copy
+ * @return The memory of the copy, NULL in case of error
+ */
+char* view_alloc(KV *kv, size_t size){
+
+	char *copy = malloc(sizeof (char*) + size);
+	if (copy == NULL) return NULL;
+
+	/* kv_get_view can run in several threads */
+	pthread_mutex_lock(&kv->kv_map_mutex);
+	memcpy(copy, &kv->view_copies, sizeof (char*));
+	kv->view_copies = copy;
+	pthread_mutex_unlock(&kv->kv_map_mutex);
+
+	return copy + sizeof (char*);
+}
+	
+
+
+/**
+ * Allocates a new empty block
+ * @param: kv Database
+ * @param block_number A pointer where to store the number of the new allocated
+ *	  block if it's not null, and if the function executed successfully
+ * @return: The address of the new block or 0 in case of error
+ */
+pos_t allocate_blk(KV *kv, len_t* block_number){
+
+	/* Do not allocate more than allowed max of blocks */
+	len_t n_blocks = kv->nb_blocks;
+	if (n_blocks >= MAX_BLKS(kv) ) {
+		errno = EFBIG;
+		return 0;
+	}
+
+	/* New empty block (header = 0), written to the file by the pool */
+	pos_t blk_offset = HSIZE_BLK + (pos_t) n_blocks*SIZE_BLK; // New block
+	if ( pool_page(kv, blk_offset, false, true) == NULL ) return 0;
+
+	if (block_number != NULL) *block_number = n_blocks;
+
+	kv->nb_blocks = n_blocks + 1;
+	
+	return blk_offset;
+
+}
+
+
+	
+/**
+ * Extends a chain of blocks by adding a new block at the end of it
+ * @param kv Database
+ * @param last_block Offset to the last block of the chain
+ * @return the offset of the new allocated block or 0 in case of error
+ */
+pos_t extend_blocks_chain(KV *kv, pos_t last_block){
+
+	/* Allocate a new empty block */
+	len_t block_number;
+	pos_t offset_blk = allocate_blk(kv, &block_number);
+	if (offset_blk == 0) return 0;
+
+	/* Update last_block header: [ 1 | block_number] */
+	if ( write_blk_head(kv, last_block, FLAG_USED | block_number) == -1) 
+		return 0;
+
+
+	return offset_blk;
+
+}
+
+
+
+/**
+ * (Re)allocates the buffer pool with the given number of pages, all unused.
+ * The modified pages of the previous pool are lost (see pool_flush).
+ * @param kv Database
+ * @param nb_pages Number of pages (at least 1)
+ * @return 0 in case of success, -1 otherwise (the pool is left unchanged)
+ */
+int pool_init(KV *kv, len_t nb_pages){
+
+	blk_page* pages = malloc((nb_pages + 1) * sizeof (blk_page));
+	len_t* buckets = malloc(nb_pages * sizeof (len_t));
+	if (pages == NULL || buckets == NULL) {
+		free(pages);
+		free(buckets);
+		return -1;
+	}
+
+	free(kv->pool.pages);
+	free(kv->pool.buckets);
+	kv->pool.pages = pages;
+	kv->pool.buckets = buckets;
+	kv->pool.nb_pages = nb_pages;
+
+	pool_clear(kv);
+
+	return 0;
+}
+
+
+/**
+ * Marks all the pages of the buffer pool as unused, without writing them
+ * @param kv Database
+ */
+void pool_clear(KV *kv){
+
+	blk_pool *pool = &kv->pool;
+	len_t i, n = pool->nb_pages;
+
+	/* Circular list 0 <-> 1 <-> ... <-> n <-> 0 */
+	for (i = 0; i <= n; i++){
+		pool->pages[i].offset = 0;
+		pool->pages[i].dirty = false;
+		pool->pages[i].prev = (i == 0)? n : i - 1;
+		pool->pages[i].next = (i == n)? 0 : i + 1;
+	}
+
+	memset(pool->buckets, 0, n * sizeof (len_t));
+}
+
+
+/**
+ * Frees the buffer pool (without writing the modified pages)
+ * @param kv Database
+ */
+void pool_drop(KV *kv){
+
+	free(kv->pool.pages);
+	free(kv->pool.buckets);
+	kv->pool.pages = NULL;
+	kv->pool.buckets = NULL;
+	kv->pool.nb_pages = 0;
+
+	pthread_mutex_destroy(&kv->pool.mutex);
+}
+
+
+/**
+ * Writes to the file .blk all the modified pages of the buffer pool
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int pool_flush(KV *kv){
+
+	len_t i;
+	for (i = 1; i <= kv->pool.nb_pages; i++){
+		blk_page *page = &kv->pool.pages[i];
+		if (page->dirty == false) continue;
+
+		if (wal_undo(kv, WAL_BLK, page->offset, SIZE_BLK) == -1 ||
+		    safe_write_at(kv->_fd_blk, page->offset, 
+			page->data, SIZE_BLK) == -1) return -1;
+		page->dirty = false;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Moves a page of the buffer pool to the head of the LRU list
+ * @param kv Database
+ * @param page Number of the page
+ */
+void pool_touch(KV *kv, len_t page){
+
+	blk_page *pages = kv->pool.pages;
+
+	/* Unlink */
+	pages[pages[page].prev].next = pages[page].next;
+	pages[pages[page].next].prev = pages[page].prev;
+
+	/* Insert after the head */
+	pages[page].prev = 0;
+	pages[page].next = pages[0].next;
+	pages[pages[0].next].prev = page;
+	pages[0].next = page;
+}
+
+
+/**
+ * Returns the page of the buffer pool holding a block, reading it if needed.
+ * The least recently used page is replaced (and written if modified) when
+ * the block is not in the pool.
+ * @param kv Database
+ * @param blk_offset Offset to the block
+ * @param load False for a new block: its page is filled with 0 instead of
+ *	  being read
+ * @param modify The caller will modify the page (it is marked as dirty)
+ * @return The content of the block or NULL in case of error
+ */
+char* pool_page(KV *kv, pos_t blk_offset, bool load, bool modify){
+
+	blk_pool *pool = &kv->pool;
+	len_t bucket = (blk_offset / SIZE_BLK) % pool->nb_pages;
+	len_t n;
+
+	/* Search the block */
+	for (n = pool->buckets[bucket]; n != 0; n = pool->pages[n].hnext)
+		if (pool->pages[n].offset == blk_offset) break;
+
+	if (n != 0) {
+		pool->hits++;
+		if (load == false) memset(pool->pages[n].data, 0, SIZE_BLK);
+
+	} else {
+		/* Replace the least recently used page */
+		n = pool->pages[0].prev;
+		blk_page *page = &pool->pages[n];
+
+		if (page->dirty && (
+		    wal_undo(kv, WAL_BLK, page->offset, SIZE_BLK) == -1 ||
+		    safe_write_at(kv->_fd_blk, page->offset, 
+				page->data, SIZE_BLK) == -1)) return NULL;
+		page->dirty = false;
+
+		if (page->offset != 0) {
+			/* Remove it from its bucket */
+			len_t *link = &pool->buckets[
+				(page->offset / SIZE_BLK) % pool->nb_pages];
+			while (*link != n) link = &pool->pages[*link].hnext;
+			*link = page->hnext;
+			page->offset = 0;
+		}
+
+		if (load) {
+			pool->misses++;
+			ssize_t nb = read_at(kv->_fd_blk, blk_offset, 
+						page->data, SIZE_BLK);
+			if (nb < SIZE_BLK_HEAD) {
+				if (nb != -1) errno = EINVAL;
+				return NULL;
+			}
+			/* The end of the last block may not be written yet */
+			memset(page->data + nb, 0, SIZE_BLK - nb);
+		} else {
+			memset(page->data, 0, SIZE_BLK);
+		}
+
+		page->offset = blk_offset;
+		page->hnext = pool->buckets[bucket];
+		pool->buckets[bucket] = n;
+	}
+
+	if (modify) pool->pages[n].dirty = true;
+
+	pool_touch(kv, n);
+
+	return pool->pages[n].data;
+}
+
+
+
+/**
+ * Stores a couple (key,value) into the file .kv creating a reference into
+ * the file .dkv
+ * @param: kv, Database to use
+ * @param: key, Key to save
+ * @param: value, Value to save
+ * @param: ref_kv, Pointer to a struct kv_stored where to write informations
+ *	   about the stored couple.
+ * @return: 0 in case of success, -1 otherwise
+ */
+int store_kv
+(KV *kv, const kv_datum* key, const kv_datum* value, kv_stored* ref_kv){
+
+	pos_t size_entry = (pos_t) key->len + VAL_SPACE(kv, value) + 
+				2 * sizeof (len_t);
+	len_t dkv_slot;
+	dkv_entry free_dkv_slot;
+
+	/* The size must fit in a dkv_entry */
+	if (size_entry >= MAX_SPACE(kv)) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	/* Find a free space in the file .kv*/
+	int ret;
+	switch (kv->alloc) {
+		case FIRST_FIT: ret = first_fit(kv, size_entry,
+					&free_dkv_slot, &dkv_slot);
+				break;
+		case WORST_FIT: ret = worst_fit(kv, size_entry, 
+					&free_dkv_slot, &dkv_slot);
+				break;
+		case BEST_FIT:  ret = best_fit(kv, size_entry, 
+					&free_dkv_slot, &dkv_slot);
+				break;
+		
+		default: errno = EINVAL;
+			 return -1;
+	}
+
+	if (ret == -1) return -1;
+
+	dkv_entry new_dkv_entry = { DKV_USED | size_entry, 
+				    free_dkv_slot.offset 
+				  };
+
+
+	
+	/* Note that the order of the 2 following actions is important
+	   in order to avoid to create a reference to inexisting data in case
+	   of error  */ 
+
+	/* First: write data into the file .kv (and the blob log) */
+	char ref[BLOB_REF_SIZE];
+	kv_datum stored;
+	int blob = stored_value(kv, key, value, ref, &stored);
+	if (blob == -1 || write_to_kv(kv, new_dkv_entry.offset, key, &stored,
+			blob? BLOB_FLAG : 0) == -1) return -1;
+	
+	/* Second: update file .dkv */
+	if (ret == 0){
+		
+		if (push_dkv_entry(kv,&new_dkv_entry) == -1) return -1;
+		kv->end_kv += size_entry;
+
+	} else {
+		if (use_dkv_slot(kv, dkv_slot, 
+				&new_dkv_entry) == -1) return -1;
+	}
+	
+	ref_kv->offset_kv = new_dkv_entry.offset;
+	ref_kv->dkv_slot = dkv_slot;
+
+	return 0;
+
+}
+
+
+
+/**
+ * Writes a couple (key,value) to a given offset in the .kv file
+ * @param kv Database
+ * @param offset Offset to the space where to write the couple (key,value)
+ * @param key,value Data to write
+ * @param flag Added to the stored size of the value (BLOB_FLAG if the value
+ *	  is a reference to the blob log, see stored_value)
+ * @return 0 in case of success -1 otherwise
+ */
+int write_to_kv
+(KV* kv, pos_t offset, const kv_datum* key ,const kv_datum* value, len_t flag){
+
+	/* Use a unique array to avoid multiple writing steps: the scratch 
+	   buffer, unless the couple is too big to keep such a buffer */
+	size_t total_size = (size_t) key->len + value->len + 2*sizeof (len_t);
+	char* data = (total_size <= MAX_SCRATCH)? scratch_get(kv, total_size) :
+						 malloc(total_size);
+	if (data == NULL) return -1;
+
+	/* Two references to the array */
+	char* data_key = data;
+	char* data_value = data + sizeof (len_t) + key->len;
+
+	/* Fill the array with the given values */
+	(*(len_t*) data_key) = key->len;
+	memcpy(data_key + sizeof (len_t), key->ptr, key->len);
+
+	(*(len_t*) data_value) = value->len | flag;
+	memcpy(data_value + sizeof (len_t), value->ptr, value->len);
+
+	/* Store the content of the array on .kv */
+	int r = (wal_undo(kv, WAL_KV, offset, total_size) == -1 ||
+		 safe_write_at(kv->_fd_kv ,offset ,data ,total_size ) == -1)?
+		-1 : 0;
+
+	if (data != kv->scratch) free(data);
+	return r;
+}
+
+
+/**
+ * Gives the value to write in .kv for a couple: the value itself, or a 
+ * reference to it once appended to the blob log if it is big (see IS_BLOB)
+ * @param kv Database
+ * @param key,val Couple
+ * @param ref Where to build the reference (BLOB_REF_SIZE bytes)
+ * @param stored Filled with the value to write in .kv
+ * @return 1 for a reference, 0 for the value itself, -1 in case of error
+ */
+int stored_value(KV *kv, const kv_datum *key, const kv_datum *val, 
+		 char *ref, kv_datum *stored){
+
+	if (!IS_BLOB(kv, val)) {
+		*stored = *val;
+		return 0;
+	}
+
+	if (blob_put(kv, key, val, ref) == -1) return -1;
+	stored->ptr = ref;
+	stored->len = BLOB_REF_SIZE;
+
+	return 1;
+}
+
+
+/**
+ * Overwrites a couple of .kv with a new couple having the same key, if it 
+ * fits in the space of the old one. The rest of the space becomes a free 
+ * space (merged with the following one, if any)
+ * @param kv Database
+ * @param offset_kv Offset to the old couple in .kv
+ * @param key,value New couple
+ * @return 1 if the couple has been overwritten, 0 if it doesn't fit (nothing
+ *	   is done), -1 in case of error
+ */
+int rewrite_kv
+(KV *kv, pos_t offset_kv, const kv_datum* key, const kv_datum* value){
+
+	len_t dkv_slot = dkv_lookup(kv, offset_kv);
+	if (dkv_slot == UNSIGNED_MAX(len_t)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	pos_t size_old = DKV_GET_SIZE(kv->dkv_cache[dkv_slot].mem_usage);
+	pos_t size_entry = (pos_t) key->len + VAL_SPACE(kv, value) + 
+				2 * sizeof (len_t);
+	if (size_entry > size_old) return 0;
+
+	/* The old value may be in the blob log, and the new one go there */
+	char ref[BLOB_REF_SIZE];
+	kv_datum stored;
+	int blob;
+	if (blob_forget(kv, offset_kv) == -1 ||
+	    (blob = stored_value(kv, key, value, ref, &stored)) == -1 ||
+	    write_to_kv(kv, offset_kv, key, &stored, 
+			blob? BLOB_FLAG : 0) == -1) return -1;
+	if (size_entry == size_old) return 1;
+
+	/* Split the space: the rest is pushed as used, then removed */
+	dkv_entry used = { DKV_USED | size_entry, offset_kv };
+	dkv_entry rest = { DKV_USED | (size_old - size_entry), 
+			   offset_kv + size_entry };
+
+	if (dkv_set_slot(kv, dkv_slot, &used) == -1 ||
+	    push_dkv_entry(kv, &rest) == -1 ||
+	    remove_data(kv, rest.offset) == -1) return -1;
+
+	return 1;
+}
+
+
+/**
+ * Push a new dkv_entry at the end of the file .dkv
+ * @param kv Database to use
+ * @param new_entry A pointer to the dkv_entry to push
+ * @return 0 in case of success, -1 otherwise
+ */
+int push_dkv_entry(KV *kv, const dkv_entry* new_entry){
+
+	/* Number of entries */
+	len_t nb_entries = kv->nb_dkv_entries + 1;
+	
+	/* Allocate more memory if necessary */
+	if (kv->max_dkv_cache < (size_t) nb_entries * sizeof (dkv_entry) &&
+	    resize_dkv_cache(kv, kv->max_dkv_cache + CACHE_PAGE) == -1) 
+		return -1;
+
+	/* Write new_entry at the bottom of the file */
+	kv->dkv_cache[kv->nb_dkv_entries] = (*new_entry);
+	kv->dkv_dirty[DKV_PAGE(kv->nb_dkv_entries)] = 1;
+
+	if (idx_insert(&kv->dkv_offsets, new_entry->offset, 0, 
+		       kv->nb_dkv_entries) == -1) return -1;
+
+	/* Update the number of entries */
+	kv->nb_dkv_entries = nb_entries;
+
+	return 0;
+}	
+
+/**
+ * Changes the amount of memory allocated for dkv_cache (and for the dirty
+ * flags of its pages)
+ * @param kv Database
+ * @param size New size (bytes) of dkv_cache, a multiple of CACHE_PAGE
+ * @return 0 in case of success, -1 otherwise
+ */
+int resize_dkv_cache(KV *kv, size_t size){
+
+	size_t old_pages = kv->max_dkv_cache / CACHE_PAGE;
+	size_t new_pages = size / CACHE_PAGE;
+
+	dkv_entry* ptr = realloc(kv->dkv_cache, size);
+	if (ptr == NULL && size != 0) return -1;
+	kv->dkv_cache = ptr;
+
+	char* dirty = realloc(kv->dkv_dirty, new_pages);
+	if (dirty == NULL && new_pages != 0) {
+		/* dkv_cache may have shrunk already */
+		if (size < kv->max_dkv_cache) kv->max_dkv_cache = size;
+		return -1;
+	}
+	kv->dkv_dirty = dirty;
+
+	if (new_pages > old_pages) 
+		memset(dirty + old_pages, 0, new_pages - old_pages);
+
+	kv->max_dkv_cache = size;
+
+	return 0;
+}
+
+/**
+ * Writes into the file .dkv its header and the pages of dkv_cache modified
+ * since the last call (contiguous dirty pages are written at once)
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int sync_dkv(KV *kv){
+
+	if (write_dkv_head(kv) == -1) return -1;
+
+	size_t size = (size_t) kv->nb_dkv_entries * sizeof (dkv_entry);
+	size_t nb_pages = (size + CACHE_PAGE - 1) / CACHE_PAGE;
+	size_t first = 0, last;
+
+	while (first < nb_pages) {
+
+		if (!kv->dkv_dirty[first]) {
+			first++;
+			continue;
+		}
+
+		/* Write the run of dirty pages [first, last[ */
+		for (last = first; last < nb_pages && kv->dkv_dirty[last]; last++)
+			kv->dkv_dirty[last] = 0;
+
+		len_t start = first * CACHE_PAGE / sizeof (dkv_entry);
+		len_t end = (last * CACHE_PAGE < size)? 
+			last * CACHE_PAGE / sizeof (dkv_entry) : 
+			kv->nb_dkv_entries;
+		if ( write_dkv_entries(kv, start, kv->dkv_cache + start, 
+			end - start) == -1 ) return -1;
+
+		first = last;
+	}
+
+	/* The file has less entries than before */
+	if (kv->nb_dkv_entries < kv->synced_dkv_entries &&
+	    wal_truncate(kv, WAL_DKV, HSIZE_DKV_OF(kv) + (pos_t) 
+		kv->nb_dkv_entries * SIZE_DKV_ENTRY(kv)) == -1) return -1;
+
+	kv->synced_dkv_entries = kv->nb_dkv_entries;
+
+	return 0;
+}
+
+/**
+ * Change te old content of a dkv slot with a new content. If the size of the
+ * data pointed by new is smaller than the size of the data of the given 
+ * dkv_slot then a new dvk entry pointing to the free remaining memory is 
+ * generated.
+ *
+ * @param kv Database
+ * @param dkv_slot Number of the slot to use (= index kv->dkv_cache).
+ *	  The size of the space pointed by this slot must be smaller or equal
+ *	  than the size pointed by the new entry.
+ * @param new  A pointer to the new dkv_entry to store at offset
+ * @return 0 in case of success, -1 otherwise
+ */
+int use_dkv_slot
+(KV *kv, len_t dkv_slot, dkv_entry* new){
+
+	/* Calculate remaining free space  */ 	
+	dkv_entry old = kv->dkv_cache[dkv_slot];
+	pos_t size_new = DKV_GET_SIZE(new->mem_usage);
+
+	dkv_entry new_free;
+	new_free.mem_usage = DKV_GET_SIZE(old.mem_usage) - size_new;
+	new_free.offset = old.offset + size_new;
+
+	if (size_new > DKV_GET_SIZE(old.mem_usage)) {
+		/* The old slot has too small size */
+		errno = EINVAL; 
+		return -1;
+	}
+
+	/* The old free space is no longer available */
+	if (idx_remove(&kv->free_space, DKV_GET_SIZE(old.mem_usage),
+		       old.offset) == -1) return -1;
+
+	if (new_free.mem_usage > 0) {
+		/* There is remaining free space: insert the `new_free`
+		   entry before `new` to improve time when searching. */
+		if (dkv_set_slot(kv, dkv_slot, &new_free) == -1) return -1;
+		if (push_dkv_entry(kv, new) == -1) {
+			dkv_set_slot(kv, dkv_slot, &old); // Restore old
+			return -1;
+		}
+
+		/* The remaining free space is available */
+		if (idx_insert(&kv->free_space, new_free.mem_usage, 
+			       new_free.offset, 0) == -1) return -1;
+
+	} else {
+
+		if (dkv_set_slot(kv, dkv_slot, new) == -1) return -1;
+
+	}
+
+	return 0;
+}
+
+
+/**
+ * Search the first free block of memory big enough to contain `size` bytes
+ * (the one with the smallest offset)
+ * @param: kv Database
+ * @param: size Length in byte of the space to search
+ * @param: dkv_content Address to a struct dkv_entry that will be filled with
+ *	   the content of the dkv_entry refering to the free space of memory.
+ *	   If the free momory found is not referred by any dkv_entry 
+ *	   ,theb this variable will contain a reference to the 
+ *	   free space at the end of the file .kv.
+ * @param: dkv_slot If the free memory is referred by an entry in the 
+ *	   file dkv then the offset of that entry is stored here. In the other
+ *	   cases the stored value is undefined.
+ * @return: 0 if a dkv_entry has been found, 1 if the dkv_entry represent the
+ *	    end of the file .kv, -1 in case of error.
+ */
+int first_fit(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
+
+	len_t node = idx_first_fit(&kv->free_space, size);
+	if (node != 0) return use_free_space(kv, node, dkv_content, dkv_slot);
+
+	/* No free entries, try using remaining kv space */
+	return end_kv_space(kv, size, dkv_content, dkv_slot);
+}
+
+
+/**
+ * Search the biggest free block of memory big enough to contain `size` bytes
+ * (the one with the smallest offset among the biggest ones)
+ * @reference first_fit
+ */
+int worst_fit(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
+
+	/* Search worst */
+	len_t node = idx_max(&kv->free_space);
+
+	/* Use it if big enough */
+	if (node != 0 && size <= kv->free_space.nodes[node].k1){
+		node = idx_lower_bound(&kv->free_space, 
+				kv->free_space.nodes[node].k1, 0);
+		return use_free_space(kv, node, dkv_content, dkv_slot);
+	}
+
+	/* No free entries, try using remaining kv space */
+	return end_kv_space(kv, size, dkv_content, dkv_slot);
+}
+
+/**
+ * Search the smallest free block of memory big enough to contain `size` bytes
+ * (the one with the smallest offset among the smallest ones)
+ * @reference first_fit
+ */
+int best_fit(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
+
+	/* Search best */
+	len_t node = idx_lower_bound(&kv->free_space, size, 0);
+	if (node != 0) return use_free_space(kv, node, dkv_content, dkv_slot);
+
+	/* No free entries, try using remaining kv space */
+	return end_kv_space(kv, size, dkv_content, dkv_slot);
+}
+
+
+/**
+ * Fills the results of an allocation function with a free space found
+ * in the index of the free spaces
+ * @param: kv Database
+ * @param: node Node of kv->free_space refering to the free space
+ * @reference first_fit
+ * @return: 1 in case of success, -1 otherwise
+ */
+int use_free_space(KV *kv, len_t node, dkv_entry* dkv_content ,len_t* dkv_slot){
+
+	dkv_content->mem_usage = kv->free_space.nodes[node].k1;
+	dkv_content->offset = kv->free_space.nodes[node].k2;
+
+	(*dkv_slot) = dkv_lookup(kv, dkv_content->offset);
+	if ((*dkv_slot) == UNSIGNED_MAX(len_t)) {
+		/* The index is not consistent with .dkv */
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 1;
+}
+
+
+/**
+ * Fills the results of an allocation function with the free space at the
+ * end of the file .kv
+ * @reference first_fit
+ * @return: 0 in case of success, -1 if there is not enough space
+ */
+int end_kv_space(KV *kv, pos_t size, dkv_entry* dkv_content ,len_t* dkv_slot){
+
+	pos_t size_free_space = MAX_END_KV(kv) - kv->end_kv;
+	if (size <= size_free_space) {
+		dkv_content->mem_usage = size_free_space;
+		dkv_content->offset = kv->end_kv;
+		(*dkv_slot) = UNSIGNED_MAX(len_t);
+		return 0;
+	}
+
+	errno = EFBIG;
+	return -1;
+}
+
+
+/**
+ * Moves the run of couples that follows the first free space of .kv at the 
+ * beginning of this free space (at most COMPACT_RUN bytes, or one couple).
+ * The free space then follows the run, merged with the next one.
+ * @param kv Database
+ * @param moved Incremented by the number of bytes moved
+ * @return 1 if a run has been moved, 0 if there is no free space, -1 in case
+ *	   of error
+ */
+int compact_run(KV *kv, size_t *moved){
+
+	/* First free space: the smallest offset among all the sizes */
+	len_t node = idx_first_fit(&kv->free_space, 0);
+	if (node == 0) return 0;
+
+	pos_t hole = kv->free_space.nodes[node].k1;
+	pos_t start = kv->free_space.nodes[node].k2 + hole;
+
+	/* The couples following it (free spaces at the end are truncated) */
+	pos_t end = start;
+	while ((node = idx_lower_bound(&kv->dkv_offsets, end, 0)) != 0 &&
+	       kv->dkv_offsets.nodes[node].k1 == end) {
+		dkv_entry *e = &kv->dkv_cache[kv->dkv_offsets.nodes[node].val];
+		if (!DKV_IS_USED(e->mem_usage) || (end != start && 
+		    end - start + DKV_GET_SIZE(e->mem_usage) > COMPACT_RUN))
+			break;
+		end += DKV_GET_SIZE(e->mem_usage);
+	}
+	if (end == start) {
+		/* The index is not consistent with .dkv */
+		errno = EINVAL;
+		return -1;
+	}
+
+	char *run = malloc(end - start);
+	if (run == NULL) return -1;
+	if (safe_read_at(kv->_fd_kv, start, run, end - start) == -1) 
+		goto error;
+
+	/* Move the references of the couples, one by one */
+	pos_t offset = start;
+	while (offset < end) {
+		char *data = run + (offset - start);
+		if (move_data(kv, offset, offset - hole, data) == -1) 
+			goto error;
+
+		len_t key_len, val_len;
+		memcpy(&key_len, data, sizeof (len_t));
+		memcpy(&val_len, data + sizeof (len_t) + key_len, 
+			sizeof (len_t));
+		if (IS_BLOB_REF(kv, val_len)) val_len &= ~BLOB_FLAG;
+		offset += key_len + val_len + 2 * sizeof (len_t);
+	}
+
+	/* Then the couples themselves */
+	if (wal_undo(kv, WAL_KV, start - hole, end - start) == -1 ||
+	    safe_write_at(kv->_fd_kv, start - hole, run, end - start) == -1)
+		goto error;
+
+	*moved += end - start;
+	free(run);
+	return 1;
+
+error:
+	free(run);
+	return -1;
+}
+
+
+/**
+ * Moves the references (.dkv and .blk) to a stored couple towards the free
+ * space which precedes it. The data of the couple is not written.
+ * @param kv Database
+ * @param offset_kv Offset of the couple in .kv
+ * @param new_offset New offset of the couple (in the free space)
+ * @param data Content of the couple
+ * @return 0 in case of success, -1 otherwise
+ */
+int move_data(KV *kv, pos_t offset_kv, pos_t new_offset, const char *data){
+
+	kv_datum key;
+	memcpy(&key.len, data, sizeof (len_t));
+	key.ptr = (char*) data + sizeof (len_t);
+
+	pos_t slot_blk = find_slot(kv, key_bucket(kv, &key), offset_kv);
+	if (slot_blk == 0) return -1;
+
+	len_t dkv_slot = dkv_lookup(kv, offset_kv);
+	if (dkv_slot == UNSIGNED_MAX(len_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	dkv_entry moved = { kv->dkv_cache[dkv_slot].mem_usage, new_offset };
+
+	/* Free the old space, merged with the free space before it */
+	if (remove_data(kv, offset_kv) == -1) return -1;
+
+	/* Use the beginning of the merged space (or the end of the file if
+	   it has been truncated) */
+	dkv_slot = dkv_lookup(kv, new_offset);
+	if (dkv_slot != UNSIGNED_MAX(len_t)) {
+		if (use_dkv_slot(kv, dkv_slot, &moved) == -1) return -1;
+	} else {
+		if (push_dkv_entry(kv, &moved) == -1) return -1;
+		kv->end_kv = new_offset + DKV_GET_SIZE(moved.mem_usage);
+	}
+
+	return write_slot(kv, slot_blk, new_offset, key_fingerprint(&key));
+}
+
+
+/**
+ * Finds the slot of .blk referring to a stored couple
+ * @param kv Database
+ * @param hash Hash of the key of the couple
+ * @param offset_kv Offset of the couple in .kv
+ * @return The offset of the slot or 0 in case of error
+ */
+pos_t find_slot(KV *kv, len_t hash, pos_t offset_kv){
+
+	block blk;
+	pos_t offset_blk = h_get(kv, hash);
+
+	while (offset_blk != 0) {
+		if (read_blk(kv, offset_blk, &blk) == -1) return 0;
+
+		len_t i;
+		for (i = 0; i < blk.n_entries; i++)
+			if (blk.slots[i].offset_kv == offset_kv)
+				return SLOT_OFFSET(kv, offset_blk, i);
+
+		offset_blk = blk.offset_nextblk;
+	}
+
+	/* The couple is not referenced */
+	errno = EINVAL;
+	return 0;
+}
+
+
+/**
+ * Opens a new database for the bulk loader (@ref kv_build_open)
+ * @param dbname Name of the database
+ * @param hidx Index of the hash function
+ * @param mode Mode of kv_open creating the database ("w" and its letters)
+ * @return The builder, NULL in case of error
+ */
+kv_builder *build_open(const char *dbname, int hidx, const char *mode){
+
+	kv_builder *b = calloc(1, sizeof (kv_builder));
+	if (b == NULL) return NULL;
+	b->_fd_runs = -1;
+
+	size_t ll = strlen(dbname);
+	if ( (b->runs_name = malloc(ll + sizeof BUILD_SFFX)) == NULL ||
+	     (b->kv_buf = malloc(BUILD_BUFFER)) == NULL ||
+	     (b->dkv_buf = malloc(BUILD_BUFFER)) == NULL ||
+	     (b->entries = malloc(BUILD_RUN * sizeof (build_entry))) == NULL ||
+	     (b->kv = kv_open(dbname, mode, hidx, FIRST_FIT)) == NULL ) {
+		build_drop(b);
+		return NULL;
+	}
+
+	memcpy(b->runs_name, dbname, ll);
+	memcpy(b->runs_name + ll, BUILD_SFFX, sizeof BUILD_SFFX);
+
+	/* The file .dkv is written by the builder, not from dkv_cache (the
+	   couples all go to .kv, even with inline couples) */
+	b->kv->dkv_loaded = false;
+
+	return b;
+}
+
+
+/**
+ * Writes the couples and the entries of .dkv buffered by the bulk loader
+ * @param b Builder
+ * @return 0 in case of success, -1 otherwise
+ */
+int build_flush(kv_builder *b){
+
+	KV *kv = b->kv;
+
+	if ( b->kv_used > 0 && safe_write_at(kv->_fd_kv, 
+		kv->end_kv - b->kv_used, b->kv_buf, b->kv_used) == -1 ) 
+		return -1;
+	b->kv_used = 0;
+
+	len_t first = kv->nb_dkv_entries - b->dkv_used;
+	if ( b->dkv_used > 0 && write_dkv_entries(kv, first, b->dkv_buf, 
+		b->dkv_used) == -1 ) return -1;
+	b->dkv_used = 0;
+
+	return 0;
+}
+
+
+/**
+ * Sorts the entries in memory of the bulk loader and appends them to the
+ * temporary file, as a new run
+ * @param b Builder
+ * @return 0 in case of success, -1 otherwise
+ */
+int build_spill(kv_builder *b){
+
+	qsort(b->entries, b->nb_entries, sizeof (build_entry), 
+		cmp_build_entries);
+
+	if ( b->_fd_runs == -1 && (b->_fd_runs = open(b->runs_name, 
+		O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1 ) return -1;
+
+	size_t *runs = realloc(b->runs, (b->nb_runs + 1) * sizeof (size_t));
+	if (runs == NULL) return -1;
+	b->runs = runs;
+
+	/* Appended at the end of the file */
+	size_t size = b->nb_entries * sizeof (build_entry);
+	if (write(b->_fd_runs, b->entries, size) != (ssize_t) size) return -1;
+
+	b->runs[b->nb_runs++] = b->nb_entries;
+	b->nb_entries = 0;
+
+	return 0;
+}
+
+
+/**
+ * Merges the runs of the bulk loader and writes the chain of blocks of each
+ * bucket, the blocks of a chain being contiguous in .blk
+ * @param b Builder
+ * @return 0 in case of success, -1 otherwise
+ */
+int build_index(kv_builder *b){
+
+	KV *kv = b->kv;
+	build_run single, *runs = &single;
+	size_t nb_runs = 1, i;
+	int r = -1;
+
+	/* Level of the directory, from the number of couples added */
+	while ( (size_t) H_LOAD(kv) * (H_BUCKETS << kv->h_level) < 
+		kv->nb_dkv_entries && 
+		(size_t) H_BUCKETS << (kv->h_level + 1) <= H_MAX_BUCKETS ) 
+		kv->h_level++;
+	if (kv->h_level > 0 && remap_h(kv, kv->h_level) == -1) return -1;
+
+	build_entry *bucket = NULL, e;
+	size_t n = 0, max = 0;
+
+	if (b->nb_runs == 0) {
+		/* Everything is in memory */
+		qsort(b->entries, b->nb_entries, sizeof (build_entry), 
+			cmp_build_entries);
+		memset(&single, 0, sizeof single);
+		single.buf = b->entries;
+		single.len = b->nb_entries;
+
+	} else {
+		if (b->nb_entries > 0 && build_spill(b) == -1) return -1;
+		free(b->entries);
+		b->entries = NULL;
+
+		nb_runs = b->nb_runs;
+		if ((runs = calloc(nb_runs, sizeof (build_run))) == NULL) 
+			return -1;
+
+		off_t next = 0;
+		for (i = 0; i < nb_runs; i++) {
+			runs[i].left = b->runs[i];
+			runs[i].next = next;
+			next += b->runs[i] * sizeof (build_entry);
+			runs[i].buf = malloc(BUILD_READ * sizeof (build_entry));
+			if (runs[i].buf == NULL) goto end;
+		}
+	}
+
+	for (;;) {
+		int found = build_next(b, runs, nb_runs, &e);
+		if (found == -1) goto end;
+
+		/* End of a bucket */
+		if ( n > 0 && (found == 0 || 
+		     h_bucket(kv, e.hash) != h_bucket(kv, bucket[0].hash)) ) {
+			if (build_bucket(b, bucket, n) == -1) goto end;
+			n = 0;
+		}
+		if (found == 0) break;
+
+		if (n == max) {
+			max = (max == 0)? 64 : 2 * max;
+			build_entry *tmp = realloc(bucket, max * sizeof e);
+			if (tmp == NULL) goto end;
+			bucket = tmp;
+		}
+		bucket[n++] = e;
+	}
+
+	r = build_flush_blocks(b);
+
+end:
+	free(bucket);
+	if (runs != &single) {
+		for (i = 0; i < nb_runs; i++) free(runs[i].buf);
+		free(runs);
+	}
+	return r;
+}
+
+
+/**
+ * Returns the smallest entry (by bucket then by offset) of a set of runs
+ * @param b Builder
+ * @param runs Runs to merge
+ * @param n Number of runs
+ * @param e Filled with the entry
+ * @return 1 if an entry has been found, 0 if the runs are empty, -1 in case
+ *	   of error
+ */
+int build_next(kv_builder *b, build_run *runs, size_t n, build_entry *e){
+
+	size_t i, best = n;
+
+	for (i = 0; i < n; i++) {
+		build_run *run = &runs[i];
+
+		if (run->pos == run->len) {
+			if (run->left == 0) continue;
+
+			/* Read the next entries of the run */
+			size_t count = (run->left < BUILD_READ)? 
+					run->left : BUILD_READ;
+			size_t size = count * sizeof (build_entry);
+			if (pread(b->_fd_runs, run->buf, size, run->next) != 
+			    (ssize_t) size) return -1;
+			run->next += size;
+			run->left -= count;
+			run->pos = 0;
+			run->len = count;
+		}
+
+		if (best == n || cmp_build_entries(&run->buf[run->pos], 
+		    &runs[best].buf[runs[best].pos]) < 0) best = i;
+	}
+
+	if (best == n) return 0;
+
+	*e = runs[best].buf[runs[best].pos++];
+	return 1;
+}
+
+
+/**
+ * Writes the chain of blocks of a bucket. Only the last couple added with
+ * a given key is kept, the others are added to the overwritten couples.
+ * @param b Builder
+ * @param bucket Entries of the bucket
+ * @param n Number of entries
+ * @return 0 in case of success, -1 otherwise
+ */
+int build_bucket(kv_builder *b, build_entry *bucket, size_t n){
+
+	KV *kv = b->kv;
+	size_t i, j, live = n;
+	len_t hash = h_bucket(kv, bucket[0].hash);
+
+	/* Equal keys have equal fingerprints: group them, newest first */
+	qsort(bucket, n, sizeof (build_entry), cmp_build_fps);
+
+	kv_datum key;
+	init_datum(&key);
+	for (i = 1; i < n; i++) {
+		if (bucket[i].fp != bucket[i-1].fp) continue;
+		if (read_datum(kv, bucket[i].offset_kv, &key) == -1) goto error;
+
+		/* Compare with the newer couples of the group */
+		for (j = i; j-- > 0 && bucket[j].fp == bucket[i].fp; ) {
+			if (bucket[j].offset_kv == 0) continue;
+
+			len_t val_len;
+			int eq = match_key(kv, bucket[j].offset_kv, &key, &val_len);
+			if (eq == -1) goto error;
+			if (eq == 0) continue;
+
+			/* Overwritten */
+			if (b->nb_dead == b->max_dead) {
+				size_t max = (b->max_dead == 0)? 
+						64 : 2 * b->max_dead;
+				pos_t *tmp = realloc(b->dead, max * sizeof (pos_t));
+				if (tmp == NULL) goto error;
+				b->dead = tmp;
+				b->max_dead = max;
+			}
+			b->dead[b->nb_dead++] = bucket[i].offset_kv;
+			if (blob_forget(kv, bucket[i].offset_kv) == -1) 
+				goto error;
+			bucket[i].offset_kv = 0;
+			live--;
+			break;
+		}
+	}
+	drop_datum(&key);
+
+	kv->nb_keys += live;
+
+	/* Contiguous chain: each block but the last is full */
+	len_t nb_blks = (live + MAX_BLK_ENTR(kv) - 1) / MAX_BLK_ENTR(kv);
+	if (kv->nb_blocks + nb_blks > MAX_BLKS(kv)) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (h_set(kv, hash, HSIZE_BLK + (pos_t) kv->nb_blocks * SIZE_BLK) == -1)
+		return -1;
+
+	len_t k;
+	for (i = 0, k = 0; k < nb_blks; k++) {
+
+		len_t buffered = kv->nb_blocks - b->blk_written;
+		if (buffered == BUILD_BUFFER / SIZE_BLK) {
+			if (build_flush_blocks(b) == -1) return -1;
+			buffered = 0;
+		}
+
+		char *raw = b->kv_buf + buffered * SIZE_BLK;
+		len_t nb_slots = 0;
+		memset(raw, 0, SIZE_BLK);
+
+		for (; i < n && nb_slots < MAX_BLK_ENTR(kv); i++) {
+			if (bucket[i].offset_kv == 0) continue;
+			blk_slot slot = { bucket[i].offset_kv, bucket[i].fp };
+			put_slot(kv, raw, nb_slots++, &slot);
+		}
+
+		/* Full blocks point to the next one */
+		len_t header = (k + 1 < nb_blks)? 
+				FLAG_USED | (kv->nb_blocks + 1) : nb_slots;
+		memcpy(raw, &header, sizeof header);
+
+		kv->nb_blocks++;
+	}
+
+	return 0;
+
+error:
+	drop_datum(&key);
+	return -1;
+}
+
+
+/**
+ * Writes the blocks buffered by the bulk loader into .blk
+ * @param b Builder
+ * @return 0 in case of success, -1 otherwise
+ */
+int build_flush_blocks(kv_builder *b){
+
+	KV *kv = b->kv;
+	len_t buffered = kv->nb_blocks - b->blk_written;
+
+	if ( buffered > 0 && safe_write_at(kv->_fd_blk, 
+		HSIZE_BLK + (pos_t) b->blk_written * SIZE_BLK, b->kv_buf, 
+		buffered * SIZE_BLK) == -1 ) return -1;
+
+	b->blk_written = kv->nb_blocks;
+	return 0;
+}
+
+
+/**
+ * Rewrites the file .dkv of the bulk loader in one pass: the entries of the
+ * overwritten couples become free, and the adjacent free spaces are merged.
+ * The last couple added is never overwritten, so .kv has no free space at
+ * its end.
+ * @param b Builder
+ * @return 0 in case of success, -1 otherwise
+ */
+int build_dkv(kv_builder *b){
+
+	if (b->nb_dead == 0) return 0;
+
+	KV *kv = b->kv;
+	qsort(b->dead, b->nb_dead, sizeof (pos_t), cmp_offsets);
+
+	/* The entries are read into dkv_buf and written from kv_buf */
+	dkv_entry *in = b->dkv_buf, *out = (dkv_entry*) b->kv_buf;
+	size_t per_buf = BUILD_BUFFER / sizeof (dkv_entry);
+	len_t nb_in = 0, nb_out = 0, total = kv->nb_dkv_entries;
+	size_t d = 0, used = 0;
+
+	dkv_entry last;
+	bool has_last = false;
+
+	while (nb_in < total) {
+		size_t count = (total - nb_in < per_buf)? total - nb_in : per_buf;
+		if (read_dkv_entries(kv, nb_in, in, count) == -1) return -1;
+		nb_in += count;
+
+		size_t i;
+		for (i = 0; i < count; i++) {
+			dkv_entry e = in[i];
+			if (d < b->nb_dead && b->dead[d] == e.offset) {
+				e.mem_usage &= ~DKV_USED;
+				d++;
+			}
+
+			if (has_last && !DKV_IS_USED(last.mem_usage) && 
+			    !DKV_IS_USED(e.mem_usage)) {
+				last.mem_usage += e.mem_usage;
+				continue;
+			}
+
+			if (has_last) {
+				/* Never beyond the entries already read */
+				if (used == per_buf) {
+					if ( write_dkv_entries(kv, nb_out - used, 
+						out, used) == -1 ) return -1;
+					used = 0;
+				}
+				out[used++] = last;
+				nb_out++;
+			}
+			last = e;
+			has_last = true;
+		}
+	}
+
+	out[used++] = last;
+	nb_out++;
+	if ( write_dkv_entries(kv, nb_out - used, out, used) == -1 ||
+	     ftruncate(kv->_fd_dkv, HSIZE_DKV_OF(kv) + 
+		(pos_t) nb_out * SIZE_DKV_ENTRY(kv)) == -1 ) return -1;
+
+	kv->nb_dkv_entries = nb_out;
+	return 0;
+}
+
+
+/**
+ * Frees a builder, removing its temporary file. The database is closed 
+ * without being synced if it is still open.
+ * @param b Builder
+ */
+void build_drop(kv_builder *b){
+
+	int _errbkp = errno;
+
+	if (b->kv != NULL) infail_kvclose(b->kv);
+	if (b->_fd_runs != -1) {
+		close(b->_fd_runs);
+		unlink(b->runs_name);
+	}
+
+	free(b->runs_name);
+	free(b->kv_buf);
+	free(b->dkv_buf);
+	free(b->entries);
+	free(b->runs);
+	free(b->dead);
+	free(b);
+
+	errno = _errbkp;
+}
+
+
+/* Comparison function sorting the entries of the bulk loader by bucket. The
+ * size of the directory is not known yet: the hashes are sorted by their
+ * bits in reverse order, which keeps together the hashes having the same
+ * last bits (the same bucket) whatever the level of the linear hashing. */
+int cmp_build_entries(const void *a, const void *b){
+
+	const build_entry *ea = a, *eb = b;
+
+	if (ea->hash != eb->hash) 
+		return (reverse_bits(ea->hash) < reverse_bits(eb->hash))? -1 : 1;
+	return (ea->offset_kv < eb->offset_kv)? -1 : 
+		(ea->offset_kv > eb->offset_kv);
+}
+
+
+/* Comparison function sorting the entries of a bucket by fingerprint, the
+ * newest couples first */
+int cmp_build_fps(const void *a, const void *b){
+
+	const build_entry *ea = a, *eb = b;
+
+	if (ea->fp != eb->fp) return (ea->fp < eb->fp)? -1 : 1;
+	return (ea->offset_kv > eb->offset_kv)? -1 : 
+		(ea->offset_kv < eb->offset_kv);
+}
+
+
+/* Comparison function sorting offsets */
+int cmp_offsets(const void *a, const void *b){
+
+	pos_t oa = *(const pos_t*) a, ob = *(const pos_t*) b;
+
+	return (oa < ob)? -1 : (oa > ob);
+}
+
+
+/**
+ * Renames the files of a database (used by kv_convert): the four files, and
+ * the blob log if there is one. If it fails midway, the files not renamed 
+ * yet keep their old name.
+ * @param from Old name of the database
+ * @param to New name of the database
+ * @return 0 in case of success, -1 otherwise
+ */
+int rename_db(const char *from, const char *to){
+
+	static const char *sffx[] = { ".h", ".blk", ".kv", ".dkv", BLOB_SFFX };
+	size_t lf = strlen(from), lt = strlen(to);
+	char *name_from = malloc(lf + sizeof BLOB_SFFX);
+	char *name_to = malloc(lt + sizeof BLOB_SFFX);
+	int i, ret = -1;
+
+	if (name_from == NULL || name_to == NULL) goto end;
+	memcpy(name_from, from, lf);
+	memcpy(name_to, to, lt);
+
+	for (i = 0; i < 5; i++) {
+		strcpy(name_from + lf, sffx[i]);
+		strcpy(name_to + lt, sffx[i]);
+		if (rename(name_from, name_to) == -1 && 
+		    (i < 4 || errno != ENOENT)) goto end;
+	}
+	ret = 0;
+
+end:
+	free(name_from);
+	free(name_to);
+	return ret;
+}
+
+
+/**
+ * Removes a couple found by scan_blocks: its slot and its data in .kv, or
+ * all the slots of an inline couple
+ * @param kv Database
+ * @param infos Result of scan_blocks (the key has been found)
+ * @return 0 in case of success, -1 otherwise
+ */
+int free_entry(KV *kv, const scan_infos *infos){
+
+	if (infos->offset_kv != SLOT_INLINE) {
+		if (write_slot(kv, infos->slot_entry, 0, 0) == -1 ||
+		    blob_forget(kv, infos->offset_kv) == -1) return -1;
+		return remove_data(kv, infos->offset_kv);
+	}
+
+	pos_t blk_offset = infos->slot_entry - 
+			(infos->slot_entry - HSIZE_BLK) % SIZE_BLK;
+	char *page = pool_page(kv, blk_offset, true, true);
+	if (page == NULL) return -1;
+
+	memset(page + (infos->slot_entry - blk_offset), 0, 
+		infos->entry_slots * SIZE_SLOT(kv));
+	kv->nb_keys -= infos->entry_slots;
+
+	return 0;
+}
+
+
+/**
+ * Remove an entry from .dkv. The freed space is merged with the adjacent
+ * free spaces, and given back to the file system if it is at the end of .kv
+ * @param kv Database
+ * @param offset_kv Offset to the kv stored data
+ * @return 0 in case of success, -1 otherwise
+ */
+int remove_data(KV *kv, pos_t offset_kv){
+
+	enum { prev = 0, target = 1, next = 2};
+
+	len_t indexes[3]; bool found[3];
+	if (dkv_find_contiguos(kv, offset_kv, indexes, found) == -1 ||
+	    idx_reserve(&kv->free_space) == -1) return -1; // Nothing changed
+
+	dkv_entry merged = kv->dkv_cache[indexes[target]];
+	merged.mem_usage &= ~DKV_USED; // Set free
+
+	/* Merge with the adjacent free spaces */
+	bool merge[3] = { false, false, false };
+	int side;
+	for (side = prev; side <= next; side += next - prev) {
+
+		dkv_entry *adj = &kv->dkv_cache[indexes[side]];
+		if (!found[side] || DKV_IS_USED(adj->mem_usage)) continue;
+
+		if (idx_remove(&kv->free_space, DKV_GET_SIZE(adj->mem_usage),
+			       adj->offset) == -1) return -1;
+
+		if (side == prev) merged.offset = adj->offset;
+		merged.mem_usage += DKV_GET_SIZE(adj->mem_usage);
+		merge[side] = true;
+	}
+
+	/* Drop the merged neighbours (highest slot first) */
+	len_t slot = indexes[target];
+	if (merge[prev] && merge[next] && indexes[prev] < indexes[next]) {
+		if (dkv_remove_slot(kv, indexes[next], &slot) == -1 ||
+		    dkv_remove_slot(kv, indexes[prev], &slot) == -1) return -1;
+	} else {
+		if (merge[prev] && 
+		    dkv_remove_slot(kv, indexes[prev], &slot) == -1) return -1;
+		if (merge[next] && 
+		    dkv_remove_slot(kv, indexes[next], &slot) == -1) return -1;
+	}
+
+	if (dkv_set_slot(kv, slot, &merged) == -1) return -1;
+
+	if (merged.offset + merged.mem_usage == kv->end_kv){
+
+		/* Give back the space at the end of .kv */
+		if (wal_truncate(kv, WAL_KV, merged.offset) == -1) return -1;
+		kv->end_kv = merged.offset;
+		if (dkv_remove_slot(kv, slot, NULL) == -1) return -1;
+		
+	} else {
+
+		/* Make the new free space available */
+		if (idx_insert(&kv->free_space, merged.mem_usage, 
+			       merged.offset, 0) == -1) return -1;
+	}
+	
+	return 0;
+}
+
+
+/**
+ * Search the slot of .dkv refering to a given offset of .kv
+ * @param kv Database
+ * @param offset_kv Offset of the space in the file .kv
+ * @return The number of the slot, or UNSIGNED_MAX(len_t) if there is none
+ */
+len_t dkv_lookup(KV* kv, pos_t offset_kv){
+
+	len_t node = idx_lower_bound(&kv->dkv_offsets, offset_kv, 0);
+	if (node != 0 && kv->dkv_offsets.nodes[node].k1 == offset_kv)
+		return kv->dkv_offsets.nodes[node].val;
+
+	return UNSIGNED_MAX(len_t);
+}
+
+
+/**
+ * Changes the content of a slot of .dkv
+ * @param kv Database
+ * @param dkv_slot Number of the slot
+ * @param entry New content of the slot
+ * @return 0 in case of success, -1 otherwise
+ */
+int dkv_set_slot(KV *kv, len_t dkv_slot, const dkv_entry* entry){
+
+	pos_t old_offset = kv->dkv_cache[dkv_slot].offset;
+	if (old_offset != entry->offset) {
+		if (idx_remove(&kv->dkv_offsets, old_offset, 0) == -1 ||
+		    idx_insert(&kv->dkv_offsets, entry->offset, 0, 
+			       dkv_slot) == -1) return -1;
+	}
+
+	kv->dkv_cache[dkv_slot] = (*entry);
+	kv->dkv_dirty[DKV_PAGE(dkv_slot)] = 1;
+
+	return 0;
+}
+
+
+/**
+ * Removes a slot of .dkv: the last slot takes its place.
+ * @param kv Database
+ * @param dkv_slot Number of the slot to remove
+ * @param follow If not NULL, number of a slot to update if it is moved
+ * @return 0 in case of success, -1 otherwise
+ */
+int dkv_remove_slot(KV *kv, len_t dkv_slot, len_t* follow){
+
+	len_t last = kv->nb_dkv_entries - 1;
+	if (idx_remove(&kv->dkv_offsets, 
+		       kv->dkv_cache[dkv_slot].offset, 0) == -1) return -1;
+
+	if (dkv_slot != last) {
+		/* Move the last entry */
+		kv->dkv_cache[dkv_slot] = kv->dkv_cache[last];
+		kv->dkv_dirty[DKV_PAGE(dkv_slot)] = 1;
+		len_t node = idx_lower_bound(&kv->dkv_offsets, 
+					     kv->dkv_cache[last].offset, 0);
+		kv->dkv_offsets.nodes[node].val = dkv_slot;
+		if (follow != NULL && *follow == last) *follow = dkv_slot;
+	}
+	kv->nb_dkv_entries--;
+
+	/* Release memory if possible (the entry is removed anyway) */
+	if ((size_t) kv->nb_dkv_entries * sizeof (dkv_entry) 
+		<= kv->max_dkv_cache - CACHE_PAGE  && 
+	    kv->max_dkv_cache > CACHE_PAGE) 
+		resize_dkv_cache(kv, kv->max_dkv_cache - CACHE_PAGE);
+
+	return 0;
+}
+
+
+/**
+ * Find a dkv slot and the slots adjacents to that slot (who points to adjacents
+ * memory zones).
+ * @param kv Database
+ * @param offset_kv Offset of the target space in the file .kv
+ * @param indexes Slots of the previous space, of the target and of the next 
+ *	  space (in this order)
+ * @param found Tells for each one of the 3 spaces if it has been found
+ * @return 0 in case of success, -1 if the target has not been found
+ */
+int dkv_find_contiguos(KV* kv, pos_t offset_kv, len_t indexes[3], bool found[3]){
+
+	enum { prev = 0, target = 1, next = 2};
+
+	found[prev] = false; found[target] = false; found[next] = false; 
+
+	indexes[target] = dkv_lookup(kv, offset_kv);
+	if (indexes[target] == UNSIGNED_MAX(len_t)) {
+		errno = ENOENT;
+		return -1;
+	}
+	found[target] = true;
+
+	pos_t offset_next = offset_kv + 
+		DKV_GET_SIZE(kv->dkv_cache[indexes[target]].mem_usage);
+
+	len_t node = idx_prev(&kv->dkv_offsets, offset_kv, 0);
+	if (node != 0) {
+		indexes[prev] = kv->dkv_offsets.nodes[node].val;
+		found[prev] = true;
+	}
+	indexes[next] = dkv_lookup(kv, offset_next);
+	found[next] = indexes[next] != UNSIGNED_MAX(len_t);
+
+	/* Check that they are really adjacent */
+	if (found[prev]) {
+		dkv_entry *p = &kv->dkv_cache[indexes[prev]];
+		found[prev] = p->offset + DKV_GET_SIZE(p->mem_usage) == offset_kv;
+	}
+	if (found[next]) 
+		found[next] = kv->dkv_cache[indexes[next]].offset == offset_next;
+
+	return 0;
+}
+
+
+
+/* Access to a node of an index tree */
+#define IDX_NODE(t, n) ((t)->nodes[(n)])
+
+/* Height of a subtree */
+#define IDX_HEIGHT(t, n) ((n) == 0 ? 0 : IDX_NODE(t, n).height)
+
+/* Comparison between the key of a node and a couple (k1, k2) */
+#define IDX_CMP(t, n, a, b) \
+	((IDX_NODE(t, n).k1 != (a))? ((IDX_NODE(t, n).k1 < (a))? -1 : 1) : \
+	 (IDX_NODE(t, n).k2 != (b))? ((IDX_NODE(t, n).k2 < (b))? -1 : 1) : 0)
+
+/**
+ * Updates the height and the min_k2 of a node from the ones of its children
+ * @param t Index tree
+ * @param n Node to update
+ */
+void idx_update(idx_tree *t, len_t n){
+
+	idx_node *node = &IDX_NODE(t, n);
+	len_t hl = IDX_HEIGHT(t, node->left), hr = IDX_HEIGHT(t, node->right);
+	node->height = 1 + ((hl > hr)? hl : hr);
+
+	node->min_k2 = n;
+	if (node->left != 0 && IDX_NODE(t, IDX_NODE(t, node->left).min_k2).k2 
+				< IDX_NODE(t, node->min_k2).k2)
+		node->min_k2 = IDX_NODE(t, node->left).min_k2;
+	if (node->right != 0 && IDX_NODE(t, IDX_NODE(t, node->right).min_k2).k2
+				< IDX_NODE(t, node->min_k2).k2)
+		node->min_k2 = IDX_NODE(t, node->right).min_k2;
+}
+
+/* Rotations, return the new root of the subtree */
+len_t idx_rotate_right(idx_tree *t, len_t n){
+	len_t l = IDX_NODE(t, n).left;
+	IDX_NODE(t, n).left = IDX_NODE(t, l).right;
+	IDX_NODE(t, l).right = n;
+	idx_update(t, n);
+	idx_update(t, l);
+	return l;
+}
+
+len_t idx_rotate_left(idx_tree *t, len_t n){
+	len_t r = IDX_NODE(t, n).right;
+	IDX_NODE(t, n).right = IDX_NODE(t, r).left;
+	IDX_NODE(t, r).left = n;
+	idx_update(t, n);
+	idx_update(t, r);
+	return r;
+}
+
+/**
+ * Restores the AVL property of a subtree whose children are balanced
+ * @param t Index tree
+ * @param n Root of the subtree
+ * @return The new root of the subtree
+ */
+len_t idx_balance(idx_tree *t, len_t n){
+
+	idx_update(t, n);
+
+	len_t l = IDX_NODE(t, n).left, r = IDX_NODE(t, n).right;
+	long long diff = (long long) IDX_HEIGHT(t, l) - IDX_HEIGHT(t, r);
+
+	if (diff > 1) {
+		if (IDX_HEIGHT(t, IDX_NODE(t, l).left) < 
+		    IDX_HEIGHT(t, IDX_NODE(t, l).right))
+			IDX_NODE(t, n).left = idx_rotate_left(t, l);
+		return idx_rotate_right(t, n);
+	}
+
+	if (diff < -1) {
+		if (IDX_HEIGHT(t, IDX_NODE(t, r).right) < 
+		    IDX_HEIGHT(t, IDX_NODE(t, r).left))
+			IDX_NODE(t, n).right = idx_rotate_right(t, r);
+		return idx_rotate_left(t, n);
+	}
+
+	return n;
+}
+
+/* Inserts the node `new` into the subtree `n`, returns the new root */
+len_t idx_insert_node(idx_tree *t, len_t n, len_t new){
+
+	if (n == 0) return new;
+
+	if (IDX_CMP(t, n, IDX_NODE(t, new).k1, IDX_NODE(t, new).k2) > 0)
+		IDX_NODE(t, n).left = idx_insert_node(t, IDX_NODE(t, n).left, new);
+	else
+		IDX_NODE(t, n).right = idx_insert_node(t, IDX_NODE(t, n).right,new);
+
+	return idx_balance(t, n);
+}
+
+/**
+ * Inserts a key into an index tree 
+ * @param t Index tree
+ * @param k1,k2 Key to insert
+ * @param val Value associated to the key
+ * @return 0 in case of success, -1 otherwise
+ */
+int idx_insert(idx_tree *t, pos_t k1, pos_t k2, len_t val){
+
+	/* Get a node from the pool */
+	if (idx_reserve(t) == -1) return -1;
+	len_t new = t->free_nodes;
+	if (new != 0) t->free_nodes = IDX_NODE(t, new).right;
+	else new = ++t->used_nodes;
+
+	idx_node *node = &IDX_NODE(t, new);
+	node->k1 = k1;
+	node->k2 = k2;
+	node->val = val;
+	node->left = node->right = 0;
+	idx_update(t, new);
+
+	t->root = idx_insert_node(t, t->root, new);
+
+	return 0;
+}
+
+/**
+ * Makes sure that the next idx_insert into a tree cannot fail
+ * @param t Index tree
+ * @return 0 in case of success, -1 otherwise
+ */
+int idx_reserve(idx_tree *t){
+
+	if (t->free_nodes != 0 || t->used_nodes + 1 < t->max_nodes) return 0;
+
+	len_t max = (t->max_nodes == 0)? 
+		CACHE_PAGE / sizeof (idx_node) : 2 * t->max_nodes;
+	idx_node *tmp = realloc(t->nodes, max * sizeof (idx_node));
+	if (tmp == NULL) return -1;
+	t->nodes = tmp;
+	t->max_nodes = max;
+
+	return 0;
+}
+
+/* Detaches the smallest node of the subtree `n`, returns the new root */
+len_t idx_remove_min(idx_tree *t, len_t n){
+
+	if (IDX_NODE(t, n).left == 0) return IDX_NODE(t, n).right;
+
+	IDX_NODE(t, n).left = idx_remove_min(t, IDX_NODE(t, n).left);
+	return idx_balance(t, n);
+}
+
+/* Detaches the node (k1, k2) of the subtree `n` and stores it into `removed`,
+ * returns the new root */
+len_t idx_remove_node
+(idx_tree *t, len_t n, pos_t k1, pos_t k2, len_t *removed){
+
+	if (n == 0) return 0;
+
+	int cmp = IDX_CMP(t, n, k1, k2);
+	if (cmp > 0) {
+		IDX_NODE(t, n).left = 
+			idx_remove_node(t, IDX_NODE(t, n).left, k1, k2, removed);
+	} else if (cmp < 0) {
+		IDX_NODE(t, n).right = 
+			idx_remove_node(t, IDX_NODE(t, n).right, k1, k2, removed);
+	} else {
+		*removed = n;
+		len_t l = IDX_NODE(t, n).left, r = IDX_NODE(t, n).right;
+		if (l == 0) return r;
+		if (r == 0) return l;
+
+		/* Replace the node by the smallest node of its right subtree */
+		len_t m = r;
+		while (IDX_NODE(t, m).left != 0) m = IDX_NODE(t, m).left;
+		IDX_NODE(t, m).right = idx_remove_min(t, r);
+		IDX_NODE(t, m).left = l;
+		return idx_balance(t, m);
+	}
+
+	return idx_balance(t, n);
+}
+
+/**
+ * Removes a key from an index tree
+ * @param t Index tree
+ * @param k1,k2 Key to remove
+ * @return 0 in case of success, -1 if the key does not exist
+ */
+int idx_remove(idx_tree *t, pos_t k1, pos_t k2){
+
+	len_t removed = 0;
+	t->root = idx_remove_node(t, t->root, k1, k2, &removed);
+
+	if (removed == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Give back the node to the pool */
+	IDX_NODE(t, removed).right = t->free_nodes;
+	t->free_nodes = removed;
+
+	return 0;
+}
+
+/**
+ * Search the smallest key greater or equal to (k1, k2)
+ * @return The node containing the key, 0 if there is none
+ */
+len_t idx_lower_bound(idx_tree *t, pos_t k1, pos_t k2){
+
+	len_t n = t->root, found = 0;
+	while (n != 0) {
+		if (IDX_CMP(t, n, k1, k2) >= 0) {
+			found = n;
+			n = IDX_NODE(t, n).left;
+		} else {
+			n = IDX_NODE(t, n).right;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Search the greatest key smaller than (k1, k2)
+ * @return The node containing the key, 0 if there is none
+ */
+len_t idx_prev(idx_tree *t, pos_t k1, pos_t k2){
+
+	len_t n = t->root, found = 0;
+	while (n != 0) {
+		if (IDX_CMP(t, n, k1, k2) < 0) {
+			found = n;
+			n = IDX_NODE(t, n).right;
+		} else {
+			n = IDX_NODE(t, n).left;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Search the greatest key of an index tree
+ * @return The node containing the key, 0 if the tree is empty
+ */
+len_t idx_max(idx_tree *t){
+
+	len_t n = t->root;
+	if (n == 0) return 0;
+	while (IDX_NODE(t, n).right != 0) n = IDX_NODE(t, n).right;
+
+	return n;
+}
+
+/**
+ * Search the key with the smallest k2 among the ones whose k1 is greater or
+ * equal to a given value
+ * @return The node containing the key, 0 if there is none
+ */
+len_t idx_first_fit(idx_tree *t, pos_t k1){
+
+	len_t n = t->root, found = 0;
+	while (n != 0) {
+		if (IDX_NODE(t, n).k1 >= k1) {
+			/* n and its right subtree are candidates */
+			if (found == 0 || IDX_NODE(t, n).k2 < IDX_NODE(t, found).k2)
+				found = n;
+
+			len_t r = IDX_NODE(t, n).right;
+			if (r != 0 && IDX_NODE(t, IDX_NODE(t, r).min_k2).k2 <
+				      IDX_NODE(t, found).k2)
+				found = IDX_NODE(t, r).min_k2;
+
+			n = IDX_NODE(t, n).left;
+		} else {
+			n = IDX_NODE(t, n).right;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Frees the memory used by an index tree
+ */
+void idx_drop(idx_tree *t){
+	free(t->nodes);
+	memset(t, 0, sizeof (idx_tree));
+}
+
+
+
+/**
+ * Zero initialize a struct of type kv_datum
+ * @param: dat Address to the data to initialize
+ */
+void init_datum(kv_datum *dat){
+	memset(dat, 0, sizeof (kv_datum));
+}
+
+
+/**
+ * Get rid of a struct of type kv_datum
+ * @parem: dat Address of the struct to drop
+ */
+void drop_datum(kv_datum *dat){
+	free(dat->ptr);
+	init_datum(dat);
+}
+
+
+/**
+ * Compare two kv_datum
+ * @param: a,b The addresses of the elements to compare
+ * @return: 1 if a == b , 0 otherwise
+ */
+static inline int eq_datum(const kv_datum *a, const kv_datum *b){
+	return a->len == b->len && (memcmp(a->ptr,b->ptr,a->len) == 0);
+}
+
+/** 
+ * Read a stored entry in to a kv_datum 
+ * @param: kv Database from where to read
+ * @param: offset Offset to the target data 
+ * @param: dat Address to the kv_datum where to store
+ *	   the entry. It must have been initialized 
+ * @return: 0 in case of success, -1 otherwise
+ */
+int read_datum(KV *kv, pos_t offset, kv_datum *dat){ 
+
+	if (safe_read_at(kv->_fd_kv, offset, &dat->len, sizeof (len_t)) == -1){
+		return -1;
+	}
+
+	if (dat->len == 0) return 0;
+	
+	void *new_ptr;
+	if ( (new_ptr = realloc(dat->ptr, dat->len)) == NULL) return -1;
+
+	dat->ptr = new_ptr;
+
+	if (safe_read_at(kv->_fd_kv, offset + sizeof (len_t), 
+			 dat->ptr, dat->len) == -1 ) return -1;
+
+	return 0;
+} 
+
+
+
+
+
+
+
+
+		
+		
+
+
+/* Read data from file at the given offset */
+ssize_t read_at(int fd, pos_t offset, void *buff, size_t count){
+
+	return pread(fd, buff, count, offset);
+}
+
+/* Read data from file at the given offset. Returns an error if the size
+ * of the data that has been read is different than count 
+ */
+ssize_t safe_read_at(int fd, pos_t offset, void *buff, size_t count){
+	ssize_t nb = read_at(fd, offset, buff, count);
+	if (nb == -1 ) return -1;
+	return ( (size_t) nb == count)? nb : -1;
+}
+
+/* @ref read_at */
+ssize_t write_at(int fd, pos_t offset, const void *buff, size_t count){
+
+	return pwrite(fd, buff, count, offset);
+}
+
+/* @ref safe_read_at */
+ssize_t safe_write_at(int fd, pos_t offset, const void *buff, size_t count){
+	ssize_t nb = write_at(fd, offset, buff, count);
+	if (nb == -1 ) return -1;
+	return ( (size_t) nb == count)? nb : -1;
+}
+
+/* Write a list of buffers contiguously from the given offset (by groups of
+ * IOV_MAX buffers). Returns an error if they cannot be entirely written.
+ */
+int safe_writev_at(int fd, pos_t offset, const struct iovec *iov, size_t iovcnt){
+
+	while (iovcnt > 0) {
+		int cnt = (iovcnt > IOV_MAX)? IOV_MAX : iovcnt;
+
+		size_t i, count = 0;
+		for (i = 0; i < (size_t) cnt; i++) count += iov[i].iov_len;
+
+		ssize_t nb = pwritev(fd, iov, cnt, offset);
+		if (nb == -1 ) return -1;
+		if ((size_t) nb != count) {
+			errno = EIO;
+			return -1;
+		}
+
+		offset += count;
+		iov += cnt;
+		iovcnt -= cnt;
+	}
+
+	return 0;
+}
+
+
+/* Read an offset stored in the format of the database */
+pos_t get_off(KV *kv, const char *raw){
+	if (OFF_SIZE(kv) == sizeof (pos_t)) {
+		pos_t off;
+		memcpy(&off, raw, sizeof (pos_t));
+		return off;
+	} else {
+		len_t off;
+		memcpy(&off, raw, sizeof (len_t));
+		return off;
+	}
+}
+
+/* Store an offset in the format of the database */
+void put_off(KV *kv, char *raw, pos_t off){
+	if (OFF_SIZE(kv) == sizeof (pos_t)) {
+		memcpy(raw, &off, sizeof (pos_t));
+	} else {
+		len_t off32 = off;
+		memcpy(raw, &off32, sizeof (len_t));
+	}
+}
+
+/* Read the slot n of a block (raw content of the block, header included) */
+void get_slot(KV *kv, const char *raw, len_t n, blk_slot *slot){
+	const char *s = raw + SIZE_BLK_HEAD + n * SIZE_SLOT(kv);
+	if (kv->blk_version == 1) {
+		len_t off;
+		memcpy(&off, s, sizeof (len_t));
+		slot->offset_kv = off;
+		slot->fingerprint = 0;
+	} else {
+		slot->offset_kv = get_off(kv, s);
+		memcpy(&slot->fingerprint, s + OFF_SIZE(kv), sizeof (len_t));
+	}
+}
+
+/* Store the slot n of a block (version 2 of .blk) */
+void put_slot(KV *kv, char *raw, len_t n, const blk_slot *slot){
+	char *s = raw + SIZE_BLK_HEAD + n * SIZE_SLOT(kv);
+	put_off(kv, s, slot->offset_kv);
+	memcpy(s + OFF_SIZE(kv), &slot->fingerprint, sizeof (len_t));
+}
+
+/**
+ * Reads entries of the file .dkv. The entries stored on 32 bits are read
+ * at the beginning of the array, then widened from the last one.
+ * @param kv Database
+ * @param first Number of the first entry to read
+ * @param entries Where to store the entries
+ * @param n Number of entries
+ * @return 0 in case of success, -1 otherwise
+ */
+int read_dkv_entries(KV *kv, len_t first, dkv_entry *entries, size_t n){
+
+	if ( safe_read_at(kv->_fd_dkv, HSIZE_DKV_OF(kv) + 
+		(pos_t) first * SIZE_DKV_ENTRY(kv), entries, 
+		n * SIZE_DKV_ENTRY(kv)) == -1 ) return -1;
+
+	if (OFF_SIZE(kv) == sizeof (pos_t)) return 0;
+
+	len_t *raw = (len_t*) entries;
+	while (n-- > 0) {
+		len_t mem_usage = raw[2*n], offset = raw[2*n + 1];
+		entries[n].mem_usage = (mem_usage & ~FLAG_USED) | 
+				((mem_usage & FLAG_USED)? DKV_USED : 0);
+		entries[n].offset = offset;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes entries into the file .dkv, in the format of the database (by 
+ * groups of CACHE_PAGE bytes when they are stored on 32 bits)
+ * @param kv Database
+ * @param first Number of the first entry to write
+ * @param entries Entries to write
+ * @param n Number of entries
+ * @return 0 in case of success, -1 otherwise
+ */
+int write_dkv_entries
+(KV *kv, len_t first, const dkv_entry *entries, size_t n){
+
+	pos_t offset = HSIZE_DKV_OF(kv) + (pos_t) first * SIZE_DKV_ENTRY(kv);
+	if (wal_undo(kv, WAL_DKV, offset, n * SIZE_DKV_ENTRY(kv)) == -1) 
+		return -1;
+
+	if (OFF_SIZE(kv) == sizeof (pos_t))
+		return (safe_write_at(kv->_fd_dkv, offset, entries, 
+			n * sizeof (dkv_entry)) == -1)? -1 : 0;
+
+	len_t raw[CACHE_PAGE / sizeof (len_t)];
+	while (n > 0) {
+		size_t i, count = (n < CACHE_PAGE / SIZE_DKV_ENTRY(kv))? 
+				n : CACHE_PAGE / SIZE_DKV_ENTRY(kv);
+		for (i = 0; i < count; i++) {
+			raw[2*i] = DKV_GET_SIZE(entries[i].mem_usage) | 
+				(DKV_IS_USED(entries[i].mem_usage)? FLAG_USED : 0);
+			raw[2*i + 1] = entries[i].offset;
+		}
+		if ( safe_write_at(kv->_fd_dkv, offset, raw, 
+			count * SIZE_DKV_ENTRY(kv)) == -1 ) return -1;
+
+		offset += count * SIZE_DKV_ENTRY(kv);
+		entries += count;
+		n -= count;
+	}
+
+	return 0;
+}
+
+/* Writes the header of .dkv (number of entries and end of .kv) */
+int write_dkv_head(KV *kv){
+	char header[HSIZE_DKV64 - MGN_SIZE];
+	memcpy(header, &kv->nb_dkv_entries, sizeof (len_t));
+	put_off(kv, header + sizeof (len_t), kv->end_kv);
+	return ( wal_undo(kv, WAL_DKV, MGN_SIZE, 
+		sizeof (len_t) + OFF_SIZE(kv)) == -1 ||
+		 safe_write_at(kv->_fd_dkv, MGN_SIZE, header, 
+		sizeof (len_t) + OFF_SIZE(kv)) == -1 )? -1 : 0;
+}
+
+
+
+
+/**
+ * Assign hash fun to KV struct following the hidx. The directories with
+ * linear hashing (version 2 of .h) use all the bits of the hash, the fixed
+ * ones a value smaller than NB_HASH.
+ */
+int setHashFun(KV *db, int hidx){
+
+	bool full = (db->h_version == 2);
+
+	switch (hidx){ 
+		case 0:
+		case HASH_1:	db->_hash_fun = full? hash_full1 : hash_fun1;
+				break;
+		case HASH_2:	db->_hash_fun = full? hash_full2 : hash_fun2;
+				break;
+		case HASH_3:	db->_hash_fun = full? hash_full3 : hash_fun3;
+				break;
+		case HASH_4:	db->_hash_fun = hash_xxh32;
+				break;
+		case HASH_5:	db->_hash_fun = hash_wyhash;
+				break;
+		default:	errno = EINVAL;
+				return -1;
+	}	
+
+	/* The fixed directories only know the first functions */
+	if (!full && hidx > HASH_3) {
+		errno = EINVAL;
+		return -1;
+	}
+		
+	return 0;
+}
+
+
+/**
+ * Opens db files and assing fds to the KV struct
+ */
+int openFilesKV(KV *db, const char *dbname, int flags){
+	/* Open database files */
+	char *filename;
+	mode_t permissions = 0666;
+	size_t ll = strlen(dbname);
+
+	if ( (filename = malloc( ll + 5)) == NULL) return -1;
+	char *sffx = filename + ll;
+	memcpy(filename, dbname, ll);
+	
+	
+	sffx[0] = '.'; sffx[1] = 'h'; sffx[2] = 0; 			// ".h"
+	db->_fd_h = open(filename, flags, permissions);
+
+	sffx[1] = 'k'; sffx[2] = 'v'; sffx[3] = 0;			// ".kv"
+	db->_fd_kv = open(filename, flags, permissions);
+
+	sffx[1] = 'b'; sffx[2] = 'l'; sffx[3] = 'k'; sffx[4] = 0;	// ".blk"
+	db->_fd_blk = open(filename, flags, permissions);
+	
+	sffx[1] = 'd'; sffx[2] = 'k'; sffx[3] = 'v'; sffx[4] = 0;	// ".dkv"
+	db->_fd_dkv = open(filename, flags, permissions);
+	
+	if ( db->_fd_h   == -1 || db->_fd_kv  == -1 || 
+	     db->_fd_blk == -1 || db->_fd_dkv == -1 ) {	
+		free(filename);
+		return -1;	// errno = [error on last failed open call]
+	}
+	
+	free(filename);
+
+	return 0;
+}
+
+/**
+ * Writes headers into all the database related files
+ * WARNING: this function must be consistent with the 
+ *          definition  of the headers size (HSIZE_*)
+ * @note: hidx must be a valid index
+ */
 int writeHeaders(KV *db, int hidx){
 
-	char header[MAX_HSIZE];
+	char header[MAX_HSIZE];
+	bool large = (OFF_SIZE(db) == sizeof (pos_t));
+
+	// File .h (level, split pointer and number of keys = 0)
+	memset(header, 0, MAX_HSIZE);
+	(*(len_t*) (&header[0])) = large? MGN_H64 : MGN_H2;
+	(*(len_t*) (&header[MGN_SIZE])) = (len_t) hidx;
+	if (safe_write_at(db->_fd_h, 0, header, HSIZE_H_OF(db)) == -1) 
+		return -1;
+
+	// File .blk (version 2, or 3 with inline couples)
+	if (db->blk_version == 3)
+		(*(len_t*) (&header[0])) = large? MGN_BLK364 : MGN_BLK3;
+	else	(*(len_t*) (&header[0])) = large? MGN_BLK64 : MGN_BLK2;
+	(*(len_t*) (&header[MGN_SIZE])) =  0;
+	if (safe_write_at(db->_fd_blk, 0, header, HSIZE_BLK) == -1) return -1;
+	
+	// File .kv
+	(*(len_t*) (&header[0])) = MGN_KV;
+	if (safe_write_at(db->_fd_kv, 0, header, HSIZE_KV) == -1) return -1;
+
+	// File .dkv
+	(*(len_t*) (&header[0])) = large? MGN_DKV64 : MGN_DKV;
+	(*(len_t*) (&header[MGN_SIZE])) =  0; // n entries
+	put_off(db, &header[MGN_SIZE+sizeof (len_t)], HSIZE_KV); // end kv
+	if (safe_write_at(db->_fd_dkv, 0, header, HSIZE_DKV_OF(db)) == -1) 
+		return -1;
+
+
+	return 0;
+	
+	
+}
+
+/**
+ * Checks magic nb validity and sync db with headers infos
+ * WARNING: same as "writeHeaders"
+ */
+int useHeaders(KV *db){
+	/* Magic numbers */
+	uint32_t mgn_h, mgn_kv, mgn_blk, mgn_dkv;
+ 	
+	if ( safe_read_at(db->_fd_h,0,&mgn_h,MGN_SIZE)     == -1 ||
+	     safe_read_at(db->_fd_kv,0,&mgn_kv,MGN_SIZE)   == -1 ||
+	     safe_read_at(db->_fd_blk,0,&mgn_blk,MGN_SIZE) == -1 ||
+	     safe_read_at(db->_fd_dkv,0,&mgn_dkv,MGN_SIZE) == -1 
+	   ) return -1;
+
+	if ( (mgn_h != MGN_H && mgn_h != MGN_H2 && mgn_h != MGN_H64) || 
+	     mgn_kv  != MGN_KV || 
+	     (mgn_blk != MGN_BLK && mgn_blk != MGN_BLK2 && 
+	      mgn_blk != MGN_BLK64 && mgn_blk != MGN_BLK3 &&
+	      mgn_blk != MGN_BLK364) || 
+	     (mgn_dkv != MGN_DKV && mgn_dkv != MGN_DKV64) ){
+		errno = EINVAL; 
+		return -1;
+	}
+
+	// Format: the three files must agree
+	bool large = (mgn_dkv == MGN_DKV64);
+	if ( (mgn_h == MGN_H64) != large || 
+	     (mgn_blk == MGN_BLK64 || mgn_blk == MGN_BLK364) != large ){
+		errno = EINVAL; 
+		return -1;
+	}
+	db->off_size = large? sizeof (pos_t) : sizeof (len_t);
+
+	// Versions of the files .blk and .h
+	if (mgn_blk == MGN_BLK) db->blk_version = 1;
+	else db->blk_version = (mgn_blk == MGN_BLK3 || mgn_blk == MGN_BLK364)?
+				3 : 2;
+	db->h_version = (mgn_h == MGN_H)? 1 : 2;
+
+	// Linear hashing: level, split pointer, number of keys
+	if (db->h_version == 2) {
+		char lh[2 * sizeof (len_t) + sizeof (pos_t)];
+		if ( safe_read_at(db->_fd_h, MGN_SIZE + sizeof (len_t), lh, 
+			2 * sizeof (len_t) + OFF_SIZE(db)) == -1 ) return -1;
+		memcpy(&db->h_level, lh, sizeof (len_t));
+		memcpy(&db->h_split, lh + sizeof (len_t), sizeof (len_t));
+		db->nb_keys = get_off(db, lh + 2 * sizeof (len_t));
+
+		if ( (size_t) H_BUCKETS << db->h_level > H_MAX_BUCKETS ||
+		     db->h_split >= (len_t) H_BUCKETS << db->h_level ) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	// Hash function
+	uint32_t hidx;
+	if ( safe_read_at(db->_fd_h,MGN_SIZE,&hidx,4) == -1) return -1;
+	if ( setHashFun(db,(int) hidx) == -1) return -1;
+
+	// Nb blocks	
+	if ( safe_read_at(db->_fd_blk,MGN_SIZE,&db->nb_blocks, 
+		sizeof (len_t)) == -1) return -1;
+
+	// Nb dkv entries
+	if ( safe_read_at(db->_fd_dkv,MGN_SIZE,&db->nb_dkv_entries, 
+		sizeof (len_t)) == -1) return -1;
+
+	// Offset end kv
+	char end_kv[sizeof (pos_t)];
+	if ( safe_read_at(db->_fd_dkv,MGN_SIZE + sizeof (len_t),
+		end_kv,OFF_SIZE(db)) == -1) return -1;
+	db->end_kv = get_off(db, end_kv);
+
+	return 0;
+}
+
+len_t hash_fun1(const kv_datum *key){
+	len_t hash = 0;
+	len_t i;
+	for (i = 0; i < key->len; i++) {
+		hash += ((unsigned char*) key->ptr)[i];
+		hash %= NB_HASH;
+	}
+	return hash;
+}
+/* XOR compression */
+len_t hash_fun2(const kv_datum *key){
+	len_t hash = 0, k = 0;
+	len_t i;
+	for (i = 0; i < key->len; i++) {
+		k = ((unsigned char*) key->ptr)[i];
+		hash ^= k << (i % (sizeof (len_t) * CHAR_BIT));
+		hash %= NB_HASH;
+	}
+	return hash;
+}
+/* FNV-1a hash */
+len_t hash_fun3(const kv_datum *key){
+	len_t hash = 2166136261;
+	len_t i;
+	for (i = 0; i < key->len; i++) {
+		hash ^= ((char*) key->ptr)[i];
+		hash *= 16777619;
+		hash %= NB_HASH;
+	}
+	return hash;
+}
+
+/* 
+ * Same functions on all the bits of the hash, for the directories with 
+ * linear hashing (the bucket only depends on the last bits)
+ */
+len_t hash_full1(const kv_datum *key){
+	len_t hash = 0;
+	len_t i;
+	for (i = 0; i < key->len; i++)
+		hash += ((unsigned char*) key->ptr)[i];
+	return hash;
+}
+/* XOR compression */
+len_t hash_full2(const kv_datum *key){
+	len_t hash = 0, k = 0;
+	len_t i;
+	for (i = 0; i < key->len; i++) {
+		k = ((unsigned char*) key->ptr)[i];
+		hash ^= k << (i % (sizeof (len_t) * CHAR_BIT));
+	}
+	return hash;
+}
+/* FNV-1a hash */
+len_t hash_full3(const kv_datum *key){
+	len_t hash = 2166136261;
+	len_t i;
+	for (i = 0; i < key->len; i++) {
+		hash ^= ((unsigned char*) key->ptr)[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/*
+ * Word-at-a-time hash functions (directories with linear hashing only).
+ * Both read the keys by words of 4 or 8 bytes (in the byte order of the
+ * machine, as the other data of the files) and process the long keys by
+ * stripes split between independent accumulators: the multiplications of
+ * the different lanes do not depend on each other, so they run in parallel
+ * (and can be vectorized by the compiler).
+ */
+
+/* Words of a key */
+uint32_t read_u32(const unsigned char *p){
+	uint32_t w;
+	memcpy(&w, p, sizeof w);
+	return w;
+}
+uint64_t read_u64(const unsigned char *p){
+	uint64_t w;
+	memcpy(&w, p, sizeof w);
+	return w;
+}
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+/* xxHash32 (seed 0): stripes of 16 bytes on 4 lanes */
+#define XXH_P1 0x9E3779B1U
+#define XXH_P2 0x85EBCA77U
+#define XXH_P3 0xC2B2AE3DU
+#define XXH_P4 0x27D4EB2FU
+#define XXH_P5 0x165667B1U
+#define XXH_ROUND(acc, w) ((acc) = ROTL32((acc) + (w) * XXH_P2, 13) * XXH_P1)
+
+len_t hash_xxh32(const kv_datum *key){
+	const unsigned char *p = key->ptr, *end = p + key->len;
+	uint32_t hash;
+
+	if (key->len >= 16) {
+		uint32_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+		const unsigned char *limit = end - 16;
+		do {
+			XXH_ROUND(v1, read_u32(p));
+			XXH_ROUND(v2, read_u32(p + 4));
+			XXH_ROUND(v3, read_u32(p + 8));
+			XXH_ROUND(v4, read_u32(p + 12));
+			p += 16;
+		} while (p <= limit);
+		hash = ROTL32(v1, 1) + ROTL32(v2, 7) + 
+		       ROTL32(v3, 12) + ROTL32(v4, 18);
+	} else {
+		hash = XXH_P5;
+	}
+	hash += key->len;
+
+	for (; p + 4 <= end; p += 4)
+		hash = ROTL32(hash + read_u32(p) * XXH_P3, 17) * XXH_P4;
+	for (; p < end; p++)
+		hash = ROTL32(hash + *p * XXH_P5, 11) * XXH_P1;
+
+	hash ^= hash >> 15;
+	hash *= XXH_P2;
+	hash ^= hash >> 13;
+	hash *= XXH_P3;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/* wyhash: 64 bits multiply-mix, stripes of 48 bytes on 3 lanes */
+#define WY_S0 0xa0761d6478bd642fULL
+#define WY_S1 0xe7037ed1a0b428dbULL
+#define WY_S2 0x8ebc6af09c88c6e3ULL
+#define WY_S3 0x589965cc75374cc3ULL
+
+/* 128 bits product of *a and *b: low bits into *a, high bits into *b */
+void wy_mum(uint64_t *a, uint64_t *b){
+	uint64_t ha = *a >> 32, la = (uint32_t) *a;
+	uint64_t hb = *b >> 32, lb = (uint32_t) *b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t mid = (ll >> 32) + (uint32_t) hl + (uint32_t) lh;
+	*a = (mid << 32) | (uint32_t) ll;
+	*b = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+}
+
+/* Same product, folded to 64 bits */
+uint64_t wy_mix(uint64_t a, uint64_t b){
+	wy_mum(&a, &b);
+	return a ^ b;
+}
+
+len_t hash_wyhash(const kv_datum *key){
+	uint64_t hash = wyhash64(key, wy_mix(WY_S0, WY_S1));
+	return (len_t) (hash ^ (hash >> 32));
+}
+
+/* The 64 bits of wyhash, from a given seed */
+uint64_t wyhash64(const kv_datum *key, uint64_t seed){
+	const unsigned char *p = key->ptr;
+	size_t len = key->len, i = len;
+	uint64_t a, b;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			size_t k = (len >> 3) << 2;
+			a = ((uint64_t) read_u32(p) << 32) | read_u32(p + k);
+			b = ((uint64_t) read_u32(p + len - 4) << 32) | 
+			    read_u32(p + len - 4 - k);
+		} else if (len > 0) {
+			a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8)
+			    | p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wy_mix(read_u64(p) ^ WY_S1, 
+					      read_u64(p + 8) ^ seed);
+				see1 = wy_mix(read_u64(p + 16) ^ WY_S2, 
+					      read_u64(p + 24) ^ see1);
+				see2 = wy_mix(read_u64(p + 32) ^ WY_S3, 
+					      read_u64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		for (; i > 16; i -= 16, p += 16)
+			seed = wy_mix(read_u64(p) ^ WY_S1, read_u64(p + 8) ^ seed);
+		a = read_u64(p + i - 16);
+		b = read_u64(p + i - 8);
+	}
+
+	a ^= WY_S1;
+	b ^= seed;
+	wy_mum(&a, &b);
+	return wy_mix(a ^ WY_S0 ^ len, b ^ WY_S1);
+}
+
+/**
+ * Fingerprint of a key stored in the slots of the blocks. It must be
+ * independent from the hash functions (keys sharing a chain of blocks share
+ * their hash), here a full 32 bits FNV-1a followed by the finalizer 
+ * of MurmurHash3.
+ */
+len_t key_fingerprint(const kv_datum *key){
+	uint32_t fp = 2166136261;
+	len_t i;
+	for (i = 0; i < key->len; i++) {
+		fp ^= ((unsigned char*) key->ptr)[i];
+		fp *= 16777619;
+	}
+	fp ^= fp >> 16;
+	fp *= 0x85ebca6b;
+	fp ^= fp >> 13;
+	fp *= 0xc2b2ae35;
+	fp ^= fp >> 16;
+	return fp;
+}
+
+/* Reverses the order of the bits of x */
+len_t reverse_bits(len_t x){
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+
+
+/**
+ * Closes all fds != -1 and free all the memory, errno keeps the pre-call value
+ */
+void infail_kvclose(KV *db){
+
+	int _errbkp = errno;
+
+	/* Close all open files */
+	if (db->_fd_h != -1)   close(db->_fd_h);
+	if (db->_fd_kv != -1)  close(db->_fd_kv);
+	if (db->_fd_blk != -1) close(db->_fd_blk);
+	if (db->_fd_dkv != -1) close(db->_fd_dkv);
+
+	/* Unmap the file .h */
+	if (db->h_map != NULL) munmap(db->h_map, db->h_map_size);
+
+	/* Free allocated memory */
+	free(db->dkv_cache);
+	free(db->dkv_dirty);
+	idx_drop(&db->free_space);
+	idx_drop(&db->dkv_offsets);
+	pool_drop(db);
+	unmap_kv(db);
+	bf_drop(db);
+	blob_drop(db);
+	wal_drop(db);
+	free(db->scratch);
+	pthread_rwlock_destroy(&db->lock);
+	free(db);
+
+
+	errno = _errbkp;
+}
+
+/**
+ * Initializes a KV struct with NULL bytes, and fds = -1
+ */
+void initKV(KV *db){
+	memset(db, 0, sizeof(KV));
+	db->_fd_h   = -1;
+	db->_fd_kv  = -1;
+	db->_fd_blk = -1;
+	db->_fd_dkv = -1;
+	db->_fd_bf  = -1;
+	db->_fd_blob = -1;
+	db->_fd_wal = -1;
+	
+	db->end_kv = HSIZE_KV;
+	db->blk_version = 2;
+	db->h_version = 2;
+	db->off_size = sizeof (len_t);
+
+	db->lock = (pthread_rwlock_t) PTHREAD_RWLOCK_INITIALIZER;
+	db->pool.mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	db->kv_map_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	db->arena_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	db->wal_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	db->wal_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+}
+
+int load_cache(KV* kv){
+	/* DKV cache */
+	size_t size_entries = (size_t) kv->nb_dkv_entries * sizeof (dkv_entry);
+	size_t size_cache = size_entries + CACHE_PAGE - 
+		(size_entries % CACHE_PAGE); // Min cache pages needed
+
+	if (resize_dkv_cache(kv, size_cache) == -1) return -1;
+	kv->synced_dkv_entries = kv->nb_dkv_entries;
+
+	if (read_dkv_entries(kv, 0, kv->dkv_cache, 
+		kv->nb_dkv_entries) == -1 ||
+	    index_dkv(kv) == -1 ) {
+		/* Back to the unloaded state */
+		idx_drop(&kv->free_space);
+		idx_drop(&kv->dkv_offsets);
+		resize_dkv_cache(kv, 0);
+		return -1;
+	}
+
+	kv->dkv_loaded = true;
+
+	return 0;
+}
+
+/**
+ * Loads the entries of .dkv if it has not been done yet. kv_open does not
+ * load them since kv_get never uses them.
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int need_dkv(KV* kv){
+	return kv->dkv_loaded? 0 : load_cache(kv);
+}
+
+/**
+ * Builds the indexes of the entries of .dkv (free spaces, offsets)
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int index_dkv(KV *kv){
+
+	len_t i;
+	for (i = 0; i < kv->nb_dkv_entries; i++){
+		dkv_entry *entry = &kv->dkv_cache[i];
+
+		if (idx_insert(&kv->dkv_offsets, entry->offset, 0, i) == -1) 
+			return -1;
+
+		if (DKV_IS_USED(entry->mem_usage)) continue;
+		if (idx_insert(&kv->free_space, DKV_GET_SIZE(entry->mem_usage),
+			       entry->offset, 0) == -1) return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Maps the file .h in memory. When the database is writable the file is first
+ * extended to its maximal size (the file is sparse, so this costs no disk 
+ * space): SIZE_H, or for a directory with linear hashing the size needed by
+ * the buckets of the current level (the mapping is replaced when the level
+ * changes). Otherwise only the existing part of the file is mapped.
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int map_h(KV *kv){
+
+	struct stat infos;
+	if (fstat(kv->_fd_h, &infos) == -1) return -1;
+
+	int prot = PROT_READ;
+	size_t size = infos.st_size;
+	size_t max = (kv->h_version == 1)? SIZE_H : SIZE_H2(kv, kv->h_level);
+
+	if (kv->flags != O_RDONLY){
+		if (size < max && ftruncate(kv->_fd_h, max) == -1) 
+			return -1;
+		size = max;
+		prot |= PROT_WRITE;
+	} 
+	
+	if (size > max) size = max;
+
+	void *map = mmap(NULL, size, prot, MAP_SHARED, kv->_fd_h, 0);
+	if (map == MAP_FAILED) return -1;
+
+	kv->h_map = map;
+	kv->h_map_size = size;
+
+	return 0;
+}
+
+/**
+ * Returns a read-only mapping of the file .kv covering all its couples
+ * (up to end_kv). A bigger mapping replaces the current one when the file
+ * has grown: the old one stays valid for the views already returned, until
+ * release_views.
+ * @param kv Database
+ * @return The start of the mapping or NULL in case of error
+ */
+char* map_kv(KV *kv){
+
+	pthread_mutex_lock(&kv->kv_map_mutex);
+
+	char *ptr = kv->kv_map.ptr;
+	if (kv->kv_map.size >= kv->end_kv) goto end;
+
+	/* Mapping beyond the end of the file is allowed (but not its use) */
+	size_t size = (kv->kv_map.size < MIN_KV_MAP)? 
+			MIN_KV_MAP : kv->kv_map.size;
+	while (size < kv->end_kv) size *= 2;
+
+	kv_mapping *old = realloc(kv->old_kv_maps, 
+			(kv->nb_old_kv_maps + 1) * sizeof (kv_mapping));
+	if (old == NULL) {
+		ptr = NULL;
+		goto end;
+	}
+	kv->old_kv_maps = old;
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, kv->_fd_kv, 0);
+	if (map == MAP_FAILED) {
+		ptr = NULL;
+		goto end;
+	}
+
+	if (kv->kv_map.ptr != NULL) 
+		kv->old_kv_maps[kv->nb_old_kv_maps++] = kv->kv_map;
+	kv->kv_map.ptr = ptr = map;
+	kv->kv_map.size = size;
+
+end:
+	pthread_mutex_unlock(&kv->kv_map_mutex);
+	return ptr;
+}
+
+/**
+ * Unmaps the old mappings of .kv (see map_kv) and frees the copies returned
+ * as views. The views returned before are no more valid.
+ * @param kv Database
+ */
+void release_views(KV *kv){
+
+	int i;
+	for (i = 0; i < kv->nb_old_kv_maps; i++) 
+		munmap(kv->old_kv_maps[i].ptr, kv->old_kv_maps[i].size);
+
+	kv->nb_old_kv_maps = 0;
+
+	/* Copies of the inline couples and of the values of .blob (see
+	   view_alloc) */
+	while (kv->view_copies != NULL) {
+		char *copy = kv->view_copies;
+		memcpy(&kv->view_copies, copy, sizeof (char*));
+		free(copy);
+	}
+}
+
+/**
+ * Unmaps all the mappings of .kv
+ * @param kv Database
+ */
+void unmap_kv(KV *kv){
+
+	release_views(kv);
+	free(kv->old_kv_maps);
+	kv->old_kv_maps = NULL;
+
+	if (kv->kv_map.ptr != NULL) munmap(kv->kv_map.ptr, kv->kv_map.size);
+	kv->kv_map.ptr = NULL;
+	kv->kv_map.size = 0;
+
+	pthread_mutex_destroy(&kv->kv_map_mutex);
+}
+
+/**
+ * Opens the Bloom filter of a database, if it has one (file .bf), or creates
+ * it if asked (mode 'b'). A database created by kv_open loses its old filter.
+ * @param kv Database
+ * @param dbname Name of the database
+ * @return 0 in case of success (with or without filter), -1 otherwise
+ */
+int bf_open(KV *kv, const char *dbname){
+
+	bool writable = (kv->flags != O_RDONLY);
+	size_t ll = strlen(dbname);
+	char *name = malloc(ll + sizeof BF_SFFX);
+	if (name == NULL) return -1;
+	memcpy(name, dbname, ll);
+	memcpy(name + ll, BF_SFFX, sizeof BF_SFFX);
+
+	int ret = -1;
+	if ((kv->flags & O_TRUNC) == O_TRUNC && unlink(name) == -1 && 
+	    errno != ENOENT) goto end;
+
+	kv->_fd_bf = open(name, writable? O_RDWR : O_RDONLY);
+	if (kv->_fd_bf == -1) {
+		if (errno != ENOENT) goto end;
+		ret = 0;
+		if (!kv->bf_create || !writable) goto end; // No filter
+
+		kv->_fd_bf = open(name, O_RDWR | O_CREAT, 0666);
+		ret = (kv->_fd_bf == -1 || 
+		       bf_build(kv, 0) == -1 || bf_sync(kv) == -1)? -1 : 0;
+		goto end;
+	}
+
+	/* Header (a file shorter than it has never been synced) */
+	char header[HSIZE_BF];
+	len_t mgn, state = BF_DIRTY;
+	ssize_t n = read_at(kv->_fd_bf, 0, header, HSIZE_BF);
+	if (n == -1) goto end;
+	if (n == HSIZE_BF) {
+		memcpy(&mgn, header, MGN_SIZE);
+		memcpy(&state, header + MGN_SIZE, sizeof (len_t));
+		memcpy(&kv->bf_lines, header + MGN_SIZE + sizeof (len_t), 
+			sizeof (len_t));
+		memcpy(&kv->bf_keys, header + MGN_SIZE + 2*sizeof (len_t),
+			sizeof (pos_t));
+		memcpy(&kv->bf_dels, header + MGN_SIZE + 2*sizeof (len_t) +
+			sizeof (pos_t), sizeof (pos_t));
+		if (mgn != MGN_BF || kv->bf_lines == 0) {
+			errno = EINVAL;
+			goto end;
+		}
+	}
+
+	if (state != BF_CLEAN) {
+		if (writable) {
+			ret = (bf_build(kv, 0) == -1 || bf_sync(kv) == -1)? -1 : 0;
+		} else {
+			/* Useless, the database can't be fixed */
+			close(kv->_fd_bf);
+			kv->_fd_bf = -1;
+			ret = 0;
+		}
+		goto end;
+	}
+
+	size_t size = (size_t) kv->bf_lines * BF_LINE;
+	size_t pages = (size + CACHE_PAGE - 1) / CACHE_PAGE;
+	if (posix_memalign((void**) &kv->bf, BF_LINE, size) != 0) {
+		kv->bf = NULL;
+		errno = ENOMEM;
+		goto end;
+	}
+	if ((kv->bf_dirty = calloc(pages, 1)) == NULL ||
+	    safe_read_at(kv->_fd_bf, BF_LINE, kv->bf, size) == -1) goto end;
+
+	kv->bf_clean = true;
+	ret = 0;
+
+end:
+	free(name);
+	return ret;
+}
+
+/**
+ * (Re)builds the Bloom filter from the keys of the database, with room for
+ * twice their number. The file is written by the next sync.
+ * @param kv Database
+ * @param extra Number of keys about to be added
+ * @return 0 in case of success, -1 otherwise
+ */
+int bf_build(KV *kv, pos_t extra){
+
+	if (need_dkv(kv) == -1) return -1;
+
+	len_t i;
+	pos_t keys = 0, room;
+	for (i = 0; i < kv->nb_dkv_entries; i++)
+		if (DKV_IS_USED(kv->dkv_cache[i].mem_usage)) keys++;
+
+	/* With inline couples, the number of slots used is an upper bound */
+	room = (kv->blk_version == 3 && kv->nb_keys > keys)? kv->nb_keys : keys;
+
+	pos_t lines = (2 * (room + extra) * BF_BITS + BF_LINE * CHAR_BIT - 1) / 
+			(BF_LINE * CHAR_BIT);
+	if (lines < BF_MIN_LINES) lines = BF_MIN_LINES;
+	if (lines > UNSIGNED_MAX(len_t)) lines = UNSIGNED_MAX(len_t);
+
+	size_t size = (size_t) lines * BF_LINE;
+	size_t pages = (size + CACHE_PAGE - 1) / CACHE_PAGE;
+	char *map = (keys > 0)? map_kv(kv) : NULL;
+	if (keys > 0 && map == NULL) return -1;
+
+	uint64_t *bf;
+	char *dirty = malloc(pages);
+	if (dirty == NULL || posix_memalign((void**) &bf, BF_LINE, size) != 0){
+		free(dirty);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(bf, 0, size);
+	memset(dirty, 1, pages);
+
+	free(kv->bf);
+	free(kv->bf_dirty);
+	kv->bf = bf;
+	kv->bf_dirty = dirty;
+	kv->bf_lines = lines;
+	kv->bf_keys = 0;
+	kv->bf_dels = 0;
+	kv->bf_changed = true;
+
+	/* The keys are read in the mapping of .kv */
+	for (i = 0; i < kv->nb_dkv_entries; i++) {
+		if (!DKV_IS_USED(kv->dkv_cache[i].mem_usage)) continue;
+		kv_datum key;
+		char *record = map + kv->dkv_cache[i].offset;
+		memcpy(&key.len, record, sizeof (len_t));
+		key.ptr = record + sizeof (len_t);
+		if (bf_add(kv, &key) == -1) return -1;
+	}
+
+	/* And in the blocks for the inline couples */
+	if (kv->blk_version != 3) return 0;
+
+	char inline_rec[2 + INLINE_MAX];
+	kv_datum key, val;
+	pos_t cursor = 0;
+	int r;
+	while ((r = next_inline(kv, &cursor, inline_rec)) == 1) {
+		inline_datums(inline_rec, &key, &val);
+		if (bf_add(kv, &key) == -1) return -1;
+	}
+
+	return r;
+}
+
+/* Hash of a key for the Bloom filter: wyhash with its own seed */
+uint64_t bf_hash(const kv_datum *key){
+	return wyhash64(key, wy_mix(WY_S2, WY_S3));
+}
+
+/**
+ * Tells whether a key may be stored, according to the Bloom filter
+ * @param kv Database
+ * @param key Key
+ * @return false if the key is certainly absent, true otherwise (or without
+ *	   filter)
+ */
+bool bf_test(KV *kv, const kv_datum *key){
+
+	if (kv->bf == NULL) return true;
+
+	/* The high bits choose the line, the others the bits in the line */
+	uint64_t hash = bf_hash(key);
+	uint64_t *line = kv->bf + ((hash >> 32) * kv->bf_lines >> 32) * 
+				(BF_LINE / sizeof (uint64_t));
+	uint64_t bits = hash * WY_S0;
+	int i;
+	for (i = 0; i < BF_PROBES; i++, bits >>= 9) 
+		if ((line[(bits & 511) >> 6] & (1ULL << (bits & 63))) == 0) 
+			return false;
+
+	return true;
+}
+
+/**
+ * Adds a key to the Bloom filter (if the database has one). The filter is
+ * rebuilt bigger when it is full.
+ * @param kv Database
+ * @param key Key
+ * @return 0 in case of success, -1 otherwise
+ */
+int bf_add(KV *kv, const kv_datum *key){
+
+	if (kv->bf == NULL) return 0;
+	if (bf_mark(kv) == -1 || bf_reserve(kv, 1) == -1) return -1;
+
+	uint64_t hash = bf_hash(key);
+	pos_t n = (hash >> 32) * kv->bf_lines >> 32;
+	uint64_t *line = kv->bf + n * (BF_LINE / sizeof (uint64_t));
+	uint64_t bits = hash * WY_S0;
+	bool changed = false;
+	int i;
+	for (i = 0; i < BF_PROBES; i++, bits >>= 9) {
+		uint64_t *word = &line[(bits & 511) >> 6];
+		uint64_t bit = 1ULL << (bits & 63);
+		if ((*word & bit) == 0) {
+			*word |= bit;
+			changed = true;
+		}
+	}
+
+	/* Keys already there (or lucky ones) are not counted */
+	if (changed) {
+		kv->bf_keys++;
+		kv->bf_dirty[n * BF_LINE / CACHE_PAGE] = 1;
+		kv->bf_changed = true;
+	}
+
+	return 0;
+}
+
+/**
+ * Makes room in the Bloom filter for n new keys, rebuilding it bigger if 
+ * needed. The keys added before the rebuild must be on .kv already.
+ * @param kv Database
+ * @param n Number of keys
+ * @return 0 in case of success, -1 otherwise
+ */
+int bf_reserve(KV *kv, size_t n){
+
+	if (kv->bf == NULL || kv->bf_keys + n <= BF_CAPACITY(kv)) return 0;
+	return bf_build(kv, n);
+}
+
+/**
+ * Counts a deleted key: its bits stay in the Bloom filter until it is 
+ * rebuilt (see compact_kv)
+ * @param kv Database
+ */
+void bf_del(KV *kv){
+
+	if (kv->bf == NULL) return;
+	kv->bf_dels++;
+	kv->bf_changed = true;
+}
+
+/**
+ * Marks the file .bf as dirty before the first change after a sync, the
+ * filter on the disk missing then the new keys
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int bf_mark(KV *kv){
+
+	if (!kv->bf_clean) return 0;
+
+	len_t state = BF_DIRTY;
+	if (safe_write_at(kv->_fd_bf, MGN_SIZE, &state, 
+		sizeof state) == -1) return -1;
+
+	kv->bf_clean = false;
+	return 0;
+}
+
+/**
+ * Writes the pages of the Bloom filter modified since the last sync, then its
+ * header, marked clean
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int bf_sync(KV *kv){
+
+	if (kv->bf == NULL || !kv->bf_changed) return 0;
+	if (bf_mark(kv) == -1) return -1;
+
+	size_t size = (size_t) kv->bf_lines * BF_LINE;
+	size_t page, pages = (size + CACHE_PAGE - 1) / CACHE_PAGE;
+	for (page = 0; page < pages; page++) {
+		if (!kv->bf_dirty[page]) continue;
+		size_t start = page * CACHE_PAGE;
+		size_t len = (size - start < CACHE_PAGE)? size - start : CACHE_PAGE;
+		if (safe_write_at(kv->_fd_bf, BF_LINE + start, 
+			(char*) kv->bf + start, len) == -1) return -1;
+		kv->bf_dirty[page] = 0;
+	}
+
+	/* A rebuilt filter may be smaller */
+	if (ftruncate(kv->_fd_bf, BF_LINE + size) == -1) return -1;
+
+	char header[HSIZE_BF];
+	len_t mgn = MGN_BF, state = BF_CLEAN;
+	memcpy(header, &mgn, MGN_SIZE);
+	memcpy(header + MGN_SIZE, &state, sizeof (len_t));
+	memcpy(header + MGN_SIZE + sizeof (len_t), &kv->bf_lines, 
+		sizeof (len_t));
+	memcpy(header + MGN_SIZE + 2*sizeof (len_t), &kv->bf_keys, 
+		sizeof (pos_t));
+	memcpy(header + MGN_SIZE + 2*sizeof (len_t) + sizeof (pos_t), 
+		&kv->bf_dels, sizeof (pos_t));
+	if (safe_write_at(kv->_fd_bf, 0, header, HSIZE_BF) == -1) return -1;
+
+	kv->bf_clean = true;
+	kv->bf_changed = false;
+	return 0;
+}
+
+/**
+ * Frees the Bloom filter and closes its file
+ * @param kv Database
+ */
+void bf_drop(KV *kv){
+
+	if (kv->_fd_bf != -1) close(kv->_fd_bf);
+	kv->_fd_bf = -1;
+	free(kv->bf);
+	free(kv->bf_dirty);
+	kv->bf = NULL;
+	kv->bf_dirty = NULL;
+}
+
+/**
+ * Opens the blob log of a database, if it has one (file .blob), or creates
+ * it if asked (mode 'v'). A database created by kv_open loses its old log.
+ * @param kv Database
+ * @param dbname Name of the database
+ * @return 0 in case of success (with or without log), -1 otherwise
+ */
+int blob_open(KV *kv, const char *dbname){
+
+	bool writable = (kv->flags != O_RDONLY);
+	size_t ll = strlen(dbname);
+	char *name = malloc(ll + sizeof BLOB_SFFX);
+	if (name == NULL) return -1;
+	memcpy(name, dbname, ll);
+	memcpy(name + ll, BLOB_SFFX, sizeof BLOB_SFFX);
+
+	int ret = -1;
+	if ((kv->flags & O_TRUNC) == O_TRUNC && unlink(name) == -1 && 
+	    errno != ENOENT) goto end;
+
+	kv->_fd_blob = open(name, writable? O_RDWR : O_RDONLY);
+	if (kv->_fd_blob == -1) {
+		if (errno != ENOENT) goto end;
+		ret = 0;
+		if (!kv->blob_create || !writable) goto end; // No log
+
+		kv->_fd_blob = open(name, O_RDWR | O_CREAT, 0666);
+		kv->blob_min = BLOB_MIN;
+		kv->blob_end = HSIZE_BLOB;
+		kv->blob_changed = true;
+		ret = (kv->_fd_blob == -1 || blob_sync(kv) == -1)? -1 : 0;
+		goto end;
+	}
+
+	char header[HSIZE_BLOB];
+	len_t mgn;
+	struct stat st;
+	if (safe_read_at(kv->_fd_blob, 0, header, HSIZE_BLOB) == -1 ||
+	    fstat(kv->_fd_blob, &st) == -1) goto end;
+	memcpy(&mgn, header, MGN_SIZE);
+	memcpy(&kv->blob_min, header + MGN_SIZE, sizeof (len_t));
+	memcpy(&kv->blob_garbage, header + MGN_SIZE + sizeof (len_t), 
+		sizeof (pos_t));
+	if (mgn != MGN_BLOB) {
+		errno = EINVAL;
+		goto end;
+	}
+	kv->blob_end = st.st_size;
+	ret = 0;
+
+end:
+	if (ret == -1) blob_drop(kv);
+	free(name);
+	return ret;
+}
+
+/**
+ * Appends a value to the blob log
+ * @param kv Database
+ * @param key,val Couple
+ * @param ref Filled with the reference to the value (BLOB_REF_SIZE bytes)
+ * @return 0 in case of success, -1 otherwise
+ */
+int blob_put(KV *kv, const kv_datum *key, const kv_datum *val, char *ref){
+
+	struct iovec iov[4];
+	iov[0].iov_base = (void*) &key->len;
+	iov[0].iov_len = sizeof (len_t);
+	iov[1].iov_base = key->ptr;
+	iov[1].iov_len = key->len;
+	iov[2].iov_base = (void*) &val->len;
+	iov[2].iov_len = sizeof (len_t);
+	iov[3].iov_base = val->ptr;
+	iov[3].iov_len = val->len;
+	if (wal_undo(kv, WAL_BLOB, kv->blob_end, 2 * sizeof (len_t) + 
+		(pos_t) key->len + val->len) == -1 ||
+	    safe_writev_at(kv->_fd_blob, kv->blob_end, iov, 4) == -1) 
+		return -1;
+
+	memcpy(ref, &val->len, sizeof (len_t));
+	memcpy(ref + sizeof (len_t), &kv->blob_end, sizeof (pos_t));
+	kv->blob_end += 2 * sizeof (len_t) + (pos_t) key->len + val->len;
+
+	return 0;
+}
+
+/**
+ * Reads a value of the blob log
+ * @param kv Database
+ * @param key_len Size of the key of the couple
+ * @param ref Reference to the value (read in .kv)
+ * @param val Where to store the value (see fill_datum)
+ * @return 0 in case of success, -1 otherwise
+ */
+int blob_get(KV *kv, len_t key_len, const char *ref, kv_datum *val){
+
+	len_t size;
+	pos_t offset;
+	memcpy(&size, ref, sizeof (len_t));
+	memcpy(&offset, ref + sizeof (len_t), sizeof (pos_t));
+
+	return fill_datum(kv, kv->_fd_blob, 
+		offset + 2 * sizeof (len_t) + key_len, size, val);
+}
+
+/**
+ * Counts as garbage the value of the blob log referred by a couple of .kv,
+ * about to be overwritten or removed
+ * @param kv Database
+ * @param offset_kv Offset of the couple in .kv
+ * @return 0 in case of success, -1 otherwise
+ */
+int blob_forget(KV *kv, pos_t offset_kv){
+
+	if (kv->_fd_blob == -1) return 0;
+
+	len_t key_len, val_len;
+	char ref[BLOB_REF_SIZE];
+	if (safe_read_at(kv->_fd_kv, offset_kv, &key_len, 
+		sizeof (len_t)) == -1 ||
+	    safe_read_at(kv->_fd_kv, offset_kv + sizeof (len_t) + key_len, 
+		&val_len, sizeof (len_t)) == -1) return -1;
+	if (!IS_BLOB_REF(kv, val_len)) return 0;
+
+	if (safe_read_at(kv->_fd_kv, offset_kv + 2 * sizeof (len_t) + key_len,
+		ref, BLOB_REF_SIZE) == -1) return -1;
+	memcpy(&val_len, ref, sizeof (len_t));
+
+	kv->blob_garbage += 2 * sizeof (len_t) + (pos_t) key_len + val_len;
+	kv->blob_changed = true;
+
+	return 0;
+}
+
+/**
+ * Rewrites the blob log without its garbage: the records still referenced by
+ * .kv slide towards the beginning of the file, which is then truncated. A
+ * record is alive if the reference of its key points to it.
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int blob_gc(KV *kv){
+
+	pos_t from = HSIZE_BLOB, to = HSIZE_BLOB;
+
+	while (from < kv->blob_end) {
+		len_t key_len, val_len;
+		if (safe_read_at(kv->_fd_blob, from, &key_len, 
+			sizeof (len_t)) == -1) return -1;
+
+		char *buf = scratch_get(kv, key_len);
+		if (buf == NULL ||
+		    safe_read_at(kv->_fd_blob, from + sizeof (len_t), buf, 
+			key_len) == -1 ||
+		    safe_read_at(kv->_fd_blob, from + sizeof (len_t) + key_len,
+			&val_len, sizeof (len_t)) == -1) return -1;
+		pos_t size = 2 * sizeof (len_t) + (pos_t) key_len + val_len;
+
+		/* A torn record at the end of the log (never referenced) */
+		if (size > kv->blob_end - from) break;
+
+		/* Is it the value of its key? */
+		kv_datum key = { buf, key_len };
+		scan_infos infos;
+		char ref[BLOB_REF_SIZE];
+		pos_t offset_ref = 0, offset_blob = 0;
+		int r = key_to_kv(kv, &key, &infos);
+		if (r == -1) return -1;
+		if (r == 1 && infos.offset_kv != SLOT_INLINE) {
+			offset_ref = infos.offset_kv + 2 * sizeof (len_t) + 
+					key_len;
+			if (safe_read_at(kv->_fd_kv, offset_ref - sizeof (len_t),
+				&val_len, sizeof (len_t)) == -1) return -1;
+			if (IS_BLOB_REF(kv, val_len)) {
+				if (safe_read_at(kv->_fd_kv, offset_ref, ref, 
+					BLOB_REF_SIZE) == -1) return -1;
+				memcpy(&offset_blob, ref + sizeof (len_t), 
+					sizeof (pos_t));
+			}
+		}
+
+		if (offset_blob != from) {
+			from += size;
+			continue;
+		}
+
+		/* Alive: the record slides, by chunks, then its reference */
+		if (to != from) {
+			pos_t done;
+			for (done = 0; done < size; ) {
+				size_t chunk = (size - done < MAX_SCRATCH)? 
+						size - done : MAX_SCRATCH;
+				if ((buf = scratch_get(kv, chunk)) == NULL ||
+				    safe_read_at(kv->_fd_blob, from + done, 
+					buf, chunk) == -1 ||
+				    wal_undo(kv, WAL_BLOB, to + done, 
+					chunk) == -1 ||
+				    safe_write_at(kv->_fd_blob, to + done, 
+					buf, chunk) == -1) return -1;
+				done += chunk;
+			}
+			if (wal_undo(kv, WAL_KV, offset_ref + sizeof (len_t),
+				sizeof (pos_t)) == -1 ||
+			    safe_write_at(kv->_fd_kv, offset_ref + 
+				sizeof (len_t), &to, sizeof (pos_t)) == -1) 
+				return -1;
+		}
+		from += size;
+		to += size;
+	}
+
+	if (wal_truncate(kv, WAL_BLOB, to) == -1) return -1;
+	kv->blob_end = to;
+	kv->blob_garbage = 0;
+	kv->blob_changed = true;
+
+	return 0;
+}
+
+/**
+ * Writes the header of the blob log if it changed
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int blob_sync(KV *kv){
+
+	if (kv->_fd_blob == -1 || !kv->blob_changed) return 0;
+
+	char header[HSIZE_BLOB];
+	len_t mgn = MGN_BLOB;
+	memcpy(header, &mgn, MGN_SIZE);
+	memcpy(header + MGN_SIZE, &kv->blob_min, sizeof (len_t));
+	memcpy(header + MGN_SIZE + sizeof (len_t), &kv->blob_garbage, 
+		sizeof (pos_t));
+	if (wal_undo(kv, WAL_BLOB, 0, HSIZE_BLOB) == -1 ||
+	    safe_write_at(kv->_fd_blob, 0, header, HSIZE_BLOB) == -1) 
+		return -1;
+
+	kv->blob_changed = false;
+	return 0;
+}
+
+/**
+ * Closes the file of the blob log
+ * @param kv Database
+ */
+void blob_drop(KV *kv){
+
+	if (kv->_fd_blob != -1) close(kv->_fd_blob);
+	kv->_fd_blob = -1;
+}
+
+/**
+ * Opens the write-ahead log of a database, if it has one (file .wal), or 
+ * creates it if asked (mode 'j'). If the log has records, the files are 
+ * put back in their state of the last checkpoint (see wal_restore), the
+ * changes being replayed by wal_recover once the database is open. A 
+ * database created by kv_open loses its old log.
+ * @param kv Database (its files .h, .blk, .kv and .dkv are open)
+ * @param dbname Name of the database
+ * @return 0 in case of success (with or without log), -1 otherwise
+ */
+int wal_open(KV *kv, const char *dbname){
+
+	bool writable = (kv->flags != O_RDONLY);
+	size_t ll = strlen(dbname);
+	char *name = malloc(ll + sizeof WAL_SFFX);
+	if (name == NULL) return -1;
+	memcpy(name, dbname, ll);
+	memcpy(name + ll, WAL_SFFX, sizeof WAL_SFFX);
+
+	int ret = -1;
+	if ((kv->flags & O_TRUNC) == O_TRUNC && unlink(name) == -1 && 
+	    errno != ENOENT) goto end;
+
+	kv->_fd_wal = open(name, writable? O_RDWR : O_RDONLY);
+	if (kv->_fd_wal == -1) {
+		if (errno != ENOENT) goto end;
+		ret = 0;
+		if (!kv->wal_create || !writable) goto end; // No log
+
+		/* Empty until the checkpoint of wal_recover */
+		kv->_fd_wal = open(name, O_RDWR | O_CREAT, 0666);
+		ret = (kv->_fd_wal == -1)? -1 : 0;
+		goto end;
+	}
+
+	/* Header (a shorter one has been torn by a checkpoint: no record) */
+	char header[HSIZE_WAL];
+	len_t mgn;
+	uint64_t sum;
+	ssize_t n = read_at(kv->_fd_wal, 0, header, HSIZE_WAL);
+	if (n == -1) goto end;
+	ret = 0;
+	if (n < (ssize_t) HSIZE_WAL) goto end;
+
+	memcpy(&mgn, header, MGN_SIZE);
+	memcpy(kv->wal_sizes, header + MGN_SIZE, WAL_FILES * sizeof (pos_t));
+	memcpy(&sum, header + HSIZE_WAL - WAL_SUM, WAL_SUM);
+	if (mgn != MGN_WAL) {
+		errno = EINVAL;
+		ret = -1;
+		goto end;
+	}
+	if (sum != wal_sum(header, NULL, 0)) goto end;
+
+	ret = wal_restore(kv, dbname);
+
+end:
+	if (ret == -1) wal_drop(kv);
+	free(name);
+	return ret;
+}
+
+/**
+ * Puts back the content of the pages saved by the undo records of the log,
+ * and the sizes of the files at the last checkpoint, if the log has any 
+ * record. The undo records then go on (the replay modifies the files).
+ * @param kv Database (the header of the log has been read)
+ * @param dbname Name of the database
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_restore(KV *kv, const char *dbname){
+
+	size_t ll = strlen(dbname);
+	char *name_blob = malloc(ll + sizeof BLOB_SFFX);
+	if (name_blob == NULL) return -1;
+	memcpy(name_blob, dbname, ll);
+	memcpy(name_blob + ll, BLOB_SFFX, sizeof BLOB_SFFX);
+
+	pos_t offset = HSIZE_WAL, size;
+	char *record;
+	int r, fd_blob = -1, ret = -1;
+	kv->wal_end = HSIZE_WAL;
+
+	/* The blob log is not open yet */
+	if (kv->flags != O_RDONLY) fd_blob = open(name_blob, O_RDWR);
+
+	/* The pages first */
+	while ((r = wal_read(kv, offset, &record, &size)) == 1) {
+		len_t type, file;
+		pos_t at;
+		char *data = record + WAL_HEAD;
+		memcpy(&type, record, sizeof (len_t));
+		offset += WAL_HEAD + size + WAL_SUM;
+		kv->wal_end = kv->wal_replay = offset;
+
+		/* Only a writable database can be fixed */
+		if (kv->flags == O_RDONLY) errno = EBUSY;
+		if (kv->flags == O_RDONLY || type != WAL_UNDO) {
+			free(record);
+			if (kv->flags == O_RDONLY) goto end;
+			continue;
+		}
+
+		memcpy(&file, data, sizeof (len_t));
+		memcpy(&at, data + sizeof (len_t), sizeof (pos_t));
+		data += sizeof (len_t) + sizeof (pos_t);
+		size -= sizeof (len_t) + sizeof (pos_t);
+
+		int fd = (file == WAL_BLOB)? fd_blob : wal_fd(kv, file);
+
+		r = (file >= WAL_FILES || fd == -1 ||
+		     safe_write_at(fd, at, data, size) == -1 ||
+		     idx_insert(&kv->wal_pages, file, at / WAL_PAGE, 0) == -1)?
+			-1 : 1;
+		free(record);
+		if (r == -1) goto end;
+	}
+	if (r == -1) goto end;
+
+	/* Then the sizes, if something happened */
+	if (kv->wal_replay != 0) {
+		len_t file;
+		for (file = 0; file < WAL_FILES; file++) {
+			int fd = (file == WAL_BLOB)? fd_blob : wal_fd(kv, file);
+			if (file == WAL_BLOB && kv->wal_sizes[file] == 0) {
+				/* Created after the checkpoint */
+				if (unlink(name_blob) == -1 && errno != ENOENT)
+					goto end;
+			} else if (fd != -1 && 
+				ftruncate(fd, kv->wal_sizes[file]) == -1) 
+				goto end;
+		}
+
+		/* The torn records are dropped, the next ones will follow */
+		if (ftruncate(kv->_fd_wal, kv->wal_end) == -1) goto end;
+	}
+
+	kv->wal_undo = true;
+	ret = 0;
+
+end:
+	if (fd_blob != -1) close(fd_blob);
+	free(name_blob);
+	return ret;
+}
+
+/**
+ * Replays the changes of the log found by wal_open, then makes a checkpoint
+ * if the database is writable and the log not empty or new
+ * @param kv Database (open)
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_recover(KV *kv){
+
+	if (kv->_fd_wal == -1 || kv->flags == O_RDONLY) return 0;
+
+	pos_t offset = HSIZE_WAL, size;
+	char *record;
+	int r = 1;
+	while (offset < kv->wal_replay && 
+	       (r = wal_read(kv, offset, &record, &size)) == 1) {
+		len_t type;
+		struct iovec iov[4];
+		memcpy(&type, record, sizeof (len_t));
+		offset += WAL_HEAD + size + WAL_SUM;
+
+		/* The parts are the lengths and the data of the couple */
+		kv_datum key, val;
+		if (type == WAL_PUT || type == WAL_DEL) {
+			wal_parts(type, record + WAL_HEAD, size, iov);
+			key.ptr = iov[1].iov_base;
+			key.len = iov[1].iov_len;
+			if (type == WAL_PUT) {
+				val.ptr = iov[3].iov_base;
+				val.len = iov[3].iov_len;
+			}
+			r = wal_apply(kv, type, &key, &val);
+		} else if (type == WAL_BATCH) {
+			pos_t used = 0;
+			while ((r = batch_next(record + WAL_HEAD, size, &used, 
+				&type, &key, &val)) == 1 &&
+			       (r = wal_apply(kv, type, &key, &val)) == 0);
+		}
+		free(record);
+		if (r == -1) return -1;
+	}
+	if (r == -1) return -1;
+
+	kv->wal_redo = true;
+	if (kv->wal_replay != 0 || !kv->wal_undo) return wal_checkpoint(kv);
+
+	return 0;
+}
+
+/**
+ * Reads a record of the log and checks it
+ * @param kv Database
+ * @param offset Offset of the record
+ * @param record Filled with the record (head and payload, to free)
+ * @param size Filled with the size of the payload
+ * @return 1 if a record has been read, 0 at the end of the log (or at a
+ *	   torn record), -1 in case of error
+ */
+int wal_read(KV *kv, pos_t offset, char **record, pos_t *size){
+
+	char head[WAL_HEAD];
+	len_t type;
+	struct stat st;
+	ssize_t n = read_at(kv->_fd_wal, offset, head, WAL_HEAD);
+	if (n == -1 || fstat(kv->_fd_wal, &st) == -1) return -1;
+	if (n < (ssize_t) WAL_HEAD) return 0;
+
+	memcpy(&type, head, sizeof (len_t));
+	memcpy(size, head + sizeof (len_t), sizeof (pos_t));
+	if (type < WAL_PUT || type > WAL_BATCH || 
+	    (pos_t) st.st_size < offset + WAL_HEAD + WAL_SUM ||
+	    *size > (pos_t) st.st_size - offset - WAL_HEAD - WAL_SUM) return 0;
+
+	if ((*record = malloc(WAL_HEAD + *size + WAL_SUM)) == NULL) return -1;
+	if (safe_read_at(kv->_fd_wal, offset, *record, 
+		WAL_HEAD + *size + WAL_SUM) == -1) goto error;
+
+	struct iovec iov[4];
+	uint64_t sum;
+	int nb = wal_parts(type, *record + WAL_HEAD, *size, iov);
+	memcpy(&sum, *record + WAL_HEAD + *size, WAL_SUM);
+	if (nb == -1 || sum != wal_sum(*record, iov, nb)) {
+		free(*record);
+		return 0;
+	}
+
+	return 1;
+
+error:
+	free(*record);
+	return -1;
+}
+
+/**
+ * Splits the payload of a record into its parts
+ * @param type Type of the record
+ * @param payload,size Payload
+ * @param iov Filled with the parts (4 at most)
+ * @return The number of parts, -1 if the payload is not well formed
+ */
+int wal_parts(len_t type, char *payload, pos_t size, struct iovec *iov){
+
+	len_t len;
+	pos_t used = 0;
+	int n, nb = (type == WAL_PUT)? 2 : 1;
+
+	/* The changes of a batch, summed as one part */
+	if (type == WAL_BATCH) {
+		len_t t;
+		kv_datum key, val;
+		while ((n = batch_next(payload, size, &used, &t, &key, &val)) 
+			== 1);
+		iov[0].iov_base = payload;
+		iov[0].iov_len = size;
+		return (n == -1)? -1 : 1;
+	}
+
+	if (type == WAL_UNDO) {
+		if (size < sizeof (len_t) + sizeof (pos_t)) return -1;
+		iov[0].iov_base = payload;
+		iov[0].iov_len = sizeof (len_t) + sizeof (pos_t);
+		iov[1].iov_base = payload + iov[0].iov_len;
+		iov[1].iov_len = size - iov[0].iov_len;
+		return 2;
+	}
+
+	/* Size and data of the key, then of the value */
+	for (n = 0; n < nb; n++) {
+		if (size - used < sizeof (len_t)) return -1;
+		memcpy(&len, payload + used, sizeof (len_t));
+		iov[2*n].iov_base = payload + used;
+		iov[2*n].iov_len = sizeof (len_t);
+		used += sizeof (len_t);
+		if (size - used < len) return -1;
+		iov[2*n + 1].iov_base = payload + used;
+		iov[2*n + 1].iov_len = len;
+		used += len;
+	}
+
+	return (used == size)? 2 * nb : -1;
+}
+
+/**
+ * Checksum of a record (or of the header of the log if iov is NULL)
+ * @param head Head of the record (or header of the log)
+ * @param iov,n Parts of the payload
+ * @return The checksum
+ */
+uint64_t wal_sum(const char *head, const struct iovec *iov, int n){
+
+	kv_datum part = { (char*) head, (iov == NULL)? 
+			  HSIZE_WAL - WAL_SUM : WAL_HEAD };
+	uint64_t sum = wyhash64(&part, MGN_WAL);
+
+	int i;
+	for (i = 0; i < n; i++) {
+		part.ptr = iov[i].iov_base;
+		part.len = iov[i].iov_len;
+		sum = wyhash64(&part, sum);
+	}
+
+	return sum;
+}
+
+/**
+ * Appends a record to the log
+ * @param kv Database
+ * @param type Type of the record
+ * @param iov,n Parts of the payload (4 at most, see wal_parts)
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_write(KV *kv, len_t type, const struct iovec *iov, int n){
+
+	char head[WAL_HEAD];
+	pos_t size = 0;
+	int i;
+	for (i = 0; i < n; i++) size += iov[i].iov_len;
+	memcpy(head, &type, sizeof (len_t));
+	memcpy(head + sizeof (len_t), &size, sizeof (pos_t));
+	uint64_t sum = wal_sum(head, iov, n);
+
+	struct iovec all[6];
+	all[0].iov_base = head;
+	all[0].iov_len = WAL_HEAD;
+	memcpy(all + 1, iov, n * sizeof (struct iovec));
+	all[n + 1].iov_base = &sum;
+	all[n + 1].iov_len = WAL_SUM;
+
+	if (safe_writev_at(kv->_fd_wal, kv->wal_end, all, n + 2) == -1) {
+		/* The records written next must not follow a torn one */
+		int err = errno;
+		if (ftruncate(kv->_fd_wal, kv->wal_end) == -1) {}
+		errno = err;
+		return -1;
+	}
+
+	size += WAL_HEAD + WAL_SUM;
+	kv->wal_end += size;
+	pthread_mutex_lock(&kv->wal_mutex);
+	kv->wal_lsn += size;
+	pthread_mutex_unlock(&kv->wal_mutex);
+
+	return 0;
+}
+
+/**
+ * Logs a couple stored (redo record), if the database has a log
+ * @param kv Database
+ * @param key,val Couple
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_put(KV *kv, const kv_datum *key, const kv_datum *val){
+
+	if (!kv->wal_redo) return 0;
+
+	struct iovec iov[4];
+	iov[0].iov_base = (void*) &key->len;
+	iov[0].iov_len = sizeof (len_t);
+	iov[1].iov_base = key->ptr;
+	iov[1].iov_len = key->len;
+	iov[2].iov_base = (void*) &val->len;
+	iov[2].iov_len = sizeof (len_t);
+	iov[3].iov_base = val->ptr;
+	iov[3].iov_len = val->len;
+
+	return wal_write(kv, WAL_PUT, iov, 4);
+}
+
+/**
+ * Logs a key removed (redo record), if the database has a log
+ * @param kv Database
+ * @param key Key
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_del(KV *kv, const kv_datum *key){
+
+	if (!kv->wal_redo) return 0;
+
+	struct iovec iov[2];
+	iov[0].iov_base = (void*) &key->len;
+	iov[0].iov_len = sizeof (len_t);
+	iov[1].iov_base = key->ptr;
+	iov[1].iov_len = key->len;
+
+	return wal_write(kv, WAL_DEL, iov, 2);
+}
+
+/**
+ * Logs all the changes of a batch in one record, if the database has a log
+ * @param kv Database
+ * @param b Batch
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_batch(KV *kv, const kv_batch *b){
+
+	if (!kv->wal_redo) return 0;
+
+	struct iovec iov[1];
+	iov[0].iov_base = b->ops;
+	iov[0].iov_len = b->len;
+
+	return wal_write(kv, WAL_BATCH, iov, 1);
+}
+
+/**
+ * Replays a change of the log (a key already removed is not an error)
+ * @param kv Database
+ * @param type WAL_PUT or WAL_DEL
+ * @param key,val Couple (val is not used by WAL_DEL)
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_apply(KV *kv, len_t type, const kv_datum *key, const kv_datum *val){
+
+	if (type == WAL_PUT) return put_entry(kv, key, val);
+
+	int r = del_entry(kv, key);
+	return (r == -1 && errno == ENOENT)? 0 : r;
+}
+
+/**
+ * Makes a checkpoint if the log has grown beyond WAL_MAX. Called at the end 
+ * of the changes, when the files are consistent.
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_trim(KV *kv){
+
+	if (!kv->wal_redo || kv->wal_end <= WAL_MAX) return 0;
+
+	return wal_checkpoint(kv);
+}
+
+/**
+ * Saves in undo records the pages of a file about to be modified in place, 
+ * if they have not been saved since the last checkpoint. The data beyond
+ * the size of the file at the checkpoint need no record.
+ * @param kv Database
+ * @param file File (WAL_H, WAL_BLK...)
+ * @param offset,size Part of the file about to be modified
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_undo(KV *kv, int file, pos_t offset, pos_t size){
+
+	if (!kv->wal_undo || size == 0 || offset >= kv->wal_sizes[file]) 
+		return 0;
+
+	pos_t end = kv->wal_sizes[file];
+	if (size < end - offset) end = offset + size;
+
+	pos_t page, last = (end - 1) / WAL_PAGE;
+	bool saved = false;
+	char data[WAL_PAGE];
+	for (page = offset / WAL_PAGE; page <= last; page++) {
+		len_t node = idx_lower_bound(&kv->wal_pages, file, page);
+		if (node != 0 && kv->wal_pages.nodes[node].k1 == (pos_t) file
+		    && kv->wal_pages.nodes[node].k2 == page) continue;
+
+		/* The page may be cut by the end of the file */
+		char where[sizeof (len_t) + sizeof (pos_t)];
+		len_t f = file;
+		pos_t at = page * WAL_PAGE;
+		ssize_t n = read_at(wal_fd(kv, file), at, data, WAL_PAGE);
+		if (n == -1) return -1;
+		memcpy(where, &f, sizeof (len_t));
+		memcpy(where + sizeof (len_t), &at, sizeof (pos_t));
+
+		struct iovec iov[2];
+		iov[0].iov_base = where;
+		iov[0].iov_len = sizeof where;
+		iov[1].iov_base = data;
+		iov[1].iov_len = n;
+		if (wal_write(kv, WAL_UNDO, iov, 2) == -1 ||
+		    idx_insert(&kv->wal_pages, file, page, 0) == -1) return -1;
+		saved = true;
+	}
+
+	/* Synced before the pages change, whatever the policy */
+	if (saved && fdatasync(kv->_fd_wal) == -1) return -1;
+
+	return 0;
+}
+
+/**
+ * Truncates (or extends) a file of the database, saving the pages cut in 
+ * undo records
+ * @param kv Database
+ * @param file File (WAL_H, WAL_BLK...)
+ * @param size New size of the file
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_truncate(KV *kv, int file, pos_t size){
+
+	if (kv->wal_undo && size < kv->wal_sizes[file] &&
+	    wal_undo(kv, file, size, kv->wal_sizes[file] - size) == -1) 
+		return -1;
+
+	return ftruncate(wal_fd(kv, file), size);
+}
+
+/**
+ * File descriptor of a file of the database
+ * @param kv Database
+ * @param file File (WAL_H, WAL_BLK...)
+ * @return The file descriptor (-1 if the file is not open)
+ */
+int wal_fd(KV *kv, int file){
+
+	switch (file) {
+		case WAL_H:	return kv->_fd_h;
+		case WAL_BLK:	return kv->_fd_blk;
+		case WAL_KV:	return kv->_fd_kv;
+		case WAL_DKV:	return kv->_fd_dkv;
+		case WAL_BLOB:	return kv->_fd_blob;
+	}
+
+	return -1;
+}
+
+/**
+ * Writes all the pending changes to the files of the database, and if it
+ * has a log, syncs the files then empties the log (@ref kv_sync)
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_checkpoint(KV *kv){
+
+	if (sync_kv(kv) == -1) return -1;
+	if (kv->_fd_wal == -1 || kv->flags == O_RDONLY) return 0;
+
+	/* The files hold the changes of the records */
+	char header[HSIZE_WAL];
+	len_t mgn = MGN_WAL;
+	int file;
+	memcpy(header, &mgn, MGN_SIZE);
+	for (file = 0; file < WAL_FILES; file++) {
+		struct stat st;
+		int fd = wal_fd(kv, file);
+		kv->wal_sizes[file] = 0;
+		if (fd == -1) continue;
+		if (fsync(fd) == -1 || fstat(fd, &st) == -1) return -1;
+		kv->wal_sizes[file] = st.st_size;
+	}
+	memcpy(header + MGN_SIZE, kv->wal_sizes, WAL_FILES * sizeof (pos_t));
+	uint64_t sum = wal_sum(header, NULL, 0);
+	memcpy(header + HSIZE_WAL - WAL_SUM, &sum, WAL_SUM);
+
+	/* Emptied before the new sizes are written */
+	if (ftruncate(kv->_fd_wal, 0) == -1 ||
+	    safe_write_at(kv->_fd_wal, 0, header, HSIZE_WAL) == -1 ||
+	    fdatasync(kv->_fd_wal) == -1) return -1;
+
+	idx_drop(&kv->wal_pages);
+	kv->wal_end = HSIZE_WAL;
+	kv->wal_replay = 0;
+	kv->wal_undo = true;
+
+	pthread_mutex_lock(&kv->wal_mutex);
+	kv->wal_synced = kv->wal_lsn;
+	pthread_mutex_unlock(&kv->wal_mutex);
+
+	return 0;
+}
+
+/**
+ * Waits until the log is synced up to a given point. The first thread to 
+ * wait syncs all the records written so far, the others wait for it (and
+ * maybe for the next sync): a single fdatasync serves many changes.
+ * @param kv Database
+ * @param lsn Point to reach (see wal_lsn)
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_sync_to(KV *kv, uint64_t lsn){
+
+	int r = 0;
+	pthread_mutex_lock(&kv->wal_mutex);
+
+	while (r == 0 && kv->wal_synced < lsn) {
+		if (kv->wal_syncing) {
+			pthread_cond_wait(&kv->wal_cond, &kv->wal_mutex);
+			continue;
+		}
+
+		uint64_t target = kv->wal_lsn;
+		kv->wal_syncing = true;
+		pthread_mutex_unlock(&kv->wal_mutex);
+
+		r = fdatasync(kv->_fd_wal);
+
+		pthread_mutex_lock(&kv->wal_mutex);
+		kv->wal_syncing = false;
+		if (r == 0 && target > kv->wal_synced) kv->wal_synced = target;
+		pthread_cond_broadcast(&kv->wal_cond);
+	}
+
+	pthread_mutex_unlock(&kv->wal_mutex);
+	return r;
+}
+
+/**
+ * Changes the sync policy of the log (@ref kv_setopt), starting or stopping
+ * the thread syncing it every n ms
+ * @param kv Database
+ * @param policy KV_SYNC_NONE, KV_SYNC_ALWAYS or a delay in ms
+ * @return 0 in case of success, -1 otherwise
+ */
+int wal_set_policy(KV *kv, long policy){
+
+	if (kv->wal_thread_on) {
+		pthread_mutex_lock(&kv->wal_mutex);
+		kv->wal_stop = true;
+		pthread_cond_broadcast(&kv->wal_cond);
+		pthread_mutex_unlock(&kv->wal_mutex);
+		pthread_join(kv->wal_thread, NULL);
+		kv->wal_thread_on = false;
+		kv->wal_stop = false;
+	}
+
+	kv->wal_policy = policy;
+	if (policy <= 0 || kv->_fd_wal == -1) return 0;
+
+	int err = pthread_create(&kv->wal_thread, NULL, wal_flusher, kv);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	kv->wal_thread_on = true;
+
+	return 0;
+}
+
+/**
+ * Body of the thread syncing the log every n ms (n > 0 policy)
+ * @param arg Database
+ * @return NULL
+ */
+void* wal_flusher(void *arg){
+
+	KV *kv = arg;
+	pthread_mutex_lock(&kv->wal_mutex);
+
+	while (!kv->wal_stop) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_sec += kv->wal_policy / 1000;
+		t.tv_nsec += (kv->wal_policy % 1000) * 1000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&kv->wal_cond, &kv->wal_mutex, &t);
+		if (kv->wal_stop || kv->wal_syncing || 
+		    kv->wal_synced == kv->wal_lsn) continue;
+
+		uint64_t target = kv->wal_lsn;
+		kv->wal_syncing = true;
+		pthread_mutex_unlock(&kv->wal_mutex);
+
+		int r = fdatasync(kv->_fd_wal);
 
-	// File .h
-	(*(len_t*) (&header[0])) = MGN_H;
-	(*(len_t*) (&header[MGN_SIZE])) = (len_t) hidx;
-	if (safe_write_at(db->_fd_h, 0, header, HSIZE_H) == -1) return -1;
+		pthread_mutex_lock(&kv->wal_mutex);
+		kv->wal_syncing = false;
+		if (r == 0 && target > kv->wal_synced) kv->wal_synced = target;
+		pthread_cond_broadcast(&kv->wal_cond);
+	}
 
-	// File .blk
-	(*(len_t*) (&header[0])) = MGN_BLK;
-	(*(len_t*) (&header[MGN_SIZE])) =  0;
-	if (safe_write_at(db->_fd_blk, 0, header, HSIZE_BLK) == -1) return -1;
-	
-	// File .kv
-	(*(len_t*) (&header[0])) = MGN_KV;
-	if (safe_write_at(db->_fd_kv, 0, header, HSIZE_KV) == -1) return -1;
+	pthread_mutex_unlock(&kv->wal_mutex);
+	return NULL;
+}
 
-	// File .dkv
-	(*(len_t*) (&header[0])) = MGN_DKV;
-	(*(len_t*) (&header[MGN_SIZE])) =  0; // n entries
-	(*(len_t*) (&header[MGN_SIZE+sizeof (len_t)])) =  HSIZE_KV; // end kv
-	if (safe_write_at(db->_fd_dkv, 0, header, HSIZE_DKV) == -1) return -1;
+/**
+ * Stops the thread of the log and closes its file
+ * @param kv Database
+ */
+void wal_drop(KV *kv){
 
+	if (kv->wal_thread_on) wal_set_policy(kv, KV_SYNC_NONE);
+	if (kv->_fd_wal != -1) close(kv->_fd_wal);
+	kv->_fd_wal = -1;
+	kv->wal_undo = kv->wal_redo = false;
+	idx_drop(&kv->wal_pages);
+}
 
-	return 0;
-	
-	
+/**
+ * Reads a slot of the hash table
+ * @param kv Database
+ * @param hash Bucket (number of the slot)
+ * @return The offset of the first block of the chain, 0 if the slot is empty
+ */
+pos_t h_get(KV *kv, len_t hash){
+
+	size_t offset = H_SLOT(kv, hash);
+
+	/* Beyond the end of a read-only mapping: the slot is empty */
+	if (offset + OFF_SIZE(kv) > kv->h_map_size) return 0;
+
+	return get_off(kv, kv->h_map + offset);
 }
 
 /**
- * Checks magic nb validity and sync db with headers infos
- * WARNING: same as "writeHeaders"
+ * Updates a slot of the hash table
+ * @param kv Database
+ * @param hash Bucket (number of the slot)
+ * @param offset_blk Offset of the first block of the chain
+ * @return 0 in case of success, -1 otherwise
  */
-int useHeaders(KV *db){
-	/* Magic numbers */
-	uint32_t mgn_h, mgn_kv, mgn_blk, mgn_dkv;
- 	
-	if ( safe_read_at(db->_fd_h,0,&mgn_h,MGN_SIZE)     == -1 ||
-	     safe_read_at(db->_fd_kv,0,&mgn_kv,MGN_SIZE)   == -1 ||
-	     safe_read_at(db->_fd_blk,0,&mgn_blk,MGN_SIZE) == -1 ||
-	     safe_read_at(db->_fd_dkv,0,&mgn_dkv,MGN_SIZE) == -1 
-	   ) return -1;
+int h_set(KV *kv, len_t hash, pos_t offset_blk){
 
-	if ( mgn_h   != MGN_H   || mgn_kv  != MGN_KV || 
-	     mgn_blk != MGN_BLK || mgn_dkv != MGN_DKV  ){
-		errno = EINVAL; 
+	size_t offset = H_SLOT(kv, hash);
+
+	if (kv->flags == O_RDONLY || offset + OFF_SIZE(kv) > kv->h_map_size){
+		errno = EBADF;
 		return -1;
 	}
 
-	// Hash function
-	uint32_t hidx;
-	if ( safe_read_at(db->_fd_h,MGN_SIZE,&hidx,4) == -1) return -1;
-	if ( setHashFun(db,(int) hidx) == -1) return -1;
+	if (wal_undo(kv, WAL_H, offset, OFF_SIZE(kv)) == -1) return -1;
+	put_off(kv, kv->h_map + offset, offset_blk);
+	return 0;
+}
 
-	// Nb blocks	
-	if ( safe_read_at(db->_fd_blk,MGN_SIZE,&db->nb_blocks, 
-		sizeof (len_t)) == -1) return -1;
+/**
+ * Bucket of a key
+ * @param kv Database
+ * @param key Key
+ * @return The number of the slot of .h of the chain of the key
+ */
+len_t key_bucket(KV *kv, const kv_datum *key){
 
-	// Nb dkv entries
-	if ( safe_read_at(db->_fd_dkv,MGN_SIZE,&db->nb_dkv_entries, 
-		sizeof (len_t)) == -1) return -1;
+	return h_bucket(kv, kv->_hash_fun(key));
+}
 
-	// Offset end kv
-	if ( safe_read_at(db->_fd_dkv,MGN_SIZE + sizeof (len_t),
-		&db->end_kv,sizeof (len_t)) == -1) return -1;
+/**
+ * Bucket of a hash value. The directories with linear hashing use its last
+ * bits: one more bit for the buckets already split at the current level.
+ * @param kv Database
+ * @param hash Hash value
+ * @return The number of the slot of .h
+ */
+len_t h_bucket(KV *kv, len_t hash){
 
-	return 0;
+	if (kv->h_version == 1) return hash;
+
+	len_t n = (len_t) H_BUCKETS << kv->h_level;
+	len_t bucket = hash & (n - 1);
+	if (bucket < kv->h_split) bucket = hash & (2 * n - 1);
+
+	return bucket;
 }
 
-len_t hash_fun1(const kv_datum *key){
-	len_t hash = 0;
-	len_t i;
-	for (i = 0; i < key->len; i++) {
-		hash += ((unsigned char*) key->ptr)[i];
-		hash %= 999983;
+/**
+ * Splits buckets of a directory with linear hashing until the average
+ * number of keys per bucket is at most H_LOAD
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int h_grow(KV *kv){
+
+	if (kv->h_version == 1) return 0;
+
+	for (;;) {
+		size_t n = (size_t) H_BUCKETS << kv->h_level;
+		if (kv->nb_keys <= H_LOAD(kv) * (n + kv->h_split) ||
+		    2 * n > H_MAX_BUCKETS) return 0;
+
+		if (split_bucket(kv) == -1) return -1;
 	}
-	return hash;
 }
-/* XOR compression */
-len_t hash_fun2(const kv_datum *key){
-	len_t hash = 0, k = 0;
-	len_t i;
-	for (i = 0; i < key->len; i++) {
-		k = ((unsigned char*) key->ptr)[i];
-		hash ^= k << (i % (sizeof (len_t) * CHAR_BIT));
-		hash %= 999983;
+
+/**
+ * Splits the bucket pointed by h_split: the keys whose hash has the next
+ * bit set move to the bucket h_split + (H_BUCKETS << h_level). The chain of
+ * blocks of the bucket is rewritten, keeping the blocks it needs, the new
+ * bucket takes the others (with new blocks if needed).
+ * @param kv Database
+ * @return 0 in case of success, -1 otherwise
+ */
+int split_bucket(KV *kv){
+
+	len_t n = (len_t) H_BUCKETS << kv->h_level;
+	len_t old = kv->h_split, new = old + n;
+	size_t size_slot = SIZE_SLOT(kv);
+	int r = -1;
+
+	/* Last bucket of the level: .h must hold the buckets of the next one */
+	if (old == n - 1 && remap_h(kv, kv->h_level + 1) == -1) return -1;
+
+	pos_t *blocks = NULL;
+	char *raw = NULL;	    // Slots of the couples, as in the blocks
+	chain_entry *entries = NULL;
+	bool *stay = NULL;
+	size_t nb_blocks = 0, nb_entries = 0, nb_slots = 0, i;
+	kv_datum key, rec_key, rec_val;
+	init_datum(&key);
+
+	/* Read the chain */
+	block blk;
+	pos_t offset_blk = h_get(kv, old);
+	while (offset_blk != 0) {
+		if (read_blk(kv, offset_blk, &blk) == -1) goto end;
+
+		pos_t *tmp_blocks = realloc(blocks, (nb_blocks + 1) * 
+						sizeof (pos_t));
+		if (tmp_blocks == NULL) goto end;
+		blocks = tmp_blocks;
+		blocks[nb_blocks++] = offset_blk;
+
+		size_t max = nb_blocks * MAX_BLK_ENTR(kv);
+		char *tmp_raw = realloc(raw, max * size_slot);
+		chain_entry *tmp_entries = realloc(entries, 
+						max * sizeof (chain_entry));
+		bool *tmp_stay = realloc(stay, max * sizeof (bool));
+		if (tmp_raw != NULL) raw = tmp_raw;
+		if (tmp_entries != NULL) entries = tmp_entries;
+		if (tmp_stay != NULL) stay = tmp_stay;
+		if (tmp_raw == NULL || tmp_entries == NULL || tmp_stay == NULL)
+			goto end;
+
+		for (i = 0; i < blk.n_entries; i++) {
+			pos_t offset_kv = blk.slots[i].offset_kv;
+			if (offset_kv == 0 || offset_kv == SLOT_CONT) continue;
+
+			/* The key, to know where the couple goes */
+			len_t len = 1;
+			kv_datum *k = &key;
+			if (offset_kv == SLOT_INLINE) {
+				inline_datums(INLINE_REC(kv, &blk, i), 
+					      &rec_key, &rec_val);
+				k = &rec_key;
+			} else if (read_datum(kv, offset_kv, &key) == -1) 
+				goto end;
+			stay[nb_entries] = 
+				(kv->_hash_fun(k) & (2 * n - 1)) == old;
+
+			/* Its slots (the head, then the record if inline) */
+			char *dst = raw + nb_slots * size_slot;
+			put_off(kv, dst, offset_kv);
+			memcpy(dst + OFF_SIZE(kv), &blk.slots[i].fingerprint, 
+				sizeof (len_t));
+			if (offset_kv == SLOT_INLINE) {
+				while (i + len < blk.n_entries && 
+				       blk.slots[i + len].offset_kv == SLOT_CONT)
+					len++;
+				memcpy(raw + (nb_slots + 1) * size_slot,
+				       INLINE_REC(kv, &blk, i), 
+				       (len - 1) * size_slot);
+			}
+			entries[nb_entries].start = nb_slots;
+			entries[nb_entries++].len = len;
+			nb_slots += len;
+			i += len - 1;
+		}
+
+		offset_blk = blk.offset_nextblk;
 	}
-	return hash;
-}
-/* FNV-1a hash */
-len_t hash_fun3(const kv_datum *key){
-	len_t hash = 2166136261;
-	len_t i;
-	for (i = 0; i < key->len; i++) {
-		hash ^= ((char*) key->ptr)[i];
-		hash *= 16777619;
-		hash %= 999983;
+
+	/* The keys staying in the bucket first */
+	size_t nb_stay = 0;
+	for (i = 0; i < nb_entries; i++) {
+		if (!stay[i]) continue;
+
+		chain_entry tmp = entries[i];
+		entries[i] = entries[nb_stay];
+		entries[nb_stay++] = tmp;
 	}
-	return hash;
-}
 
+	size_t blk_stay = chain_blocks(kv, entries, nb_stay);
+	size_t blk_move = chain_blocks(kv, entries + nb_stay, 
+					nb_entries - nb_stay);
+	if (blk_move == 0) blk_stay = nb_blocks; // Nothing moves
+
+	while (blk_stay + blk_move > nb_blocks) {
+		/* One block more */
+		pos_t *tmp_blocks = realloc(blocks, (nb_blocks + 1) * 
+						sizeof (pos_t));
+		if (tmp_blocks == NULL) goto end;
+		blocks = tmp_blocks;
+		if ((blocks[nb_blocks] = allocate_blk(kv, NULL)) == 0) goto end;
+		nb_blocks++;
+	}
 
+	if ( write_chain(kv, blocks, blk_stay, raw, entries, nb_stay) == -1 ||
+	     write_chain(kv, blocks + blk_stay, nb_blocks - blk_stay, raw,
+		entries + nb_stay, nb_entries - nb_stay) == -1 ||
+	     h_set(kv, old, (blk_stay > 0)? blocks[0] : 0) == -1 ||
+	     h_set(kv, new, (nb_blocks > blk_stay)? blocks[blk_stay] : 0) == -1
+	   ) goto end;
+
+	/* Next bucket to split */
+	if (++kv->h_split == n) {
+		kv->h_split = 0;
+		kv->h_level++;
+	}
+	r = 0;
+
+end:
+	free(blocks);
+	free(raw);
+	free(entries);
+	free(stay);
+	drop_datum(&key);
+	return r;
+}
 
 /**
- * Closes all fds != -1 and free all the memory, errno keeps the pre-call value
+ * Extends the file .h of a writable database (version 2) and replaces its
+ * mapping, to hold the buckets of a given level
+ * @param kv Database
+ * @param level Level of the linear hashing
+ * @return 0 in case of success, -1 otherwise
  */
-void infail_kvclose(KV *db){
+int remap_h(KV *kv, len_t level){
 
-	int _errbkp = errno;
+	size_t size = SIZE_H2(kv, level);
+	if (ftruncate(kv->_fd_h, size) == -1) return -1;
 
-	/* Close all open files */
-	if (db->_fd_h != -1)   close(db->_fd_h);
-	if (db->_fd_kv != -1)  close(db->_fd_kv);
-	if (db->_fd_blk != -1) close(db->_fd_blk);
-	if (db->_fd_dkv != -1) close(db->_fd_dkv);
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+			 kv->_fd_h, 0);
+	if (map == MAP_FAILED) return -1;
 
-	/* Free allocated memory */
-	free(db);
+	munmap(kv->h_map, kv->h_map_size);
+	kv->h_map = map;
+	kv->h_map_size = size;
+
+	return 0;
+}
+
+/**
+ * Number of blocks needed by a chain, its couples being written in order and
+ * the slots of a couple staying in the same block (see write_chain)
+ * @param kv Database
+ * @param entries Couples of the chain
+ * @param n Number of couples
+ * @return The number of blocks
+ */
+size_t chain_blocks(KV *kv, const chain_entry *entries, size_t n){
 
+	size_t i, nb_blocks = 0;
+	len_t count = MAX_BLK_ENTR(kv);
 
-	errno = _errbkp;
+	for (i = 0; i < n; i++) {
+		if (count + entries[i].len > MAX_BLK_ENTR(kv)) {
+			nb_blocks++;
+			count = 0;
+		}
+		count += entries[i].len;
+	}
+
+	return nb_blocks;
 }
 
 /**
- * Initializes a KV struct with NULL bytes, and fds = -1
+ * Rewrites a chain of blocks with the given couples. The blocks are filled 
+ * in order, the last ones may stay empty. The slots following the couples
+ * are cleared: the blocks pointing to the next one are read up to the end.
+ * @param kv Database
+ * @param blocks Offsets of the blocks of the chain
+ * @param nb_blocks Number of blocks (at least chain_blocks of the couples)
+ * @param raw Slots of the couples, as read from the blocks
+ * @param entries Couples to write (their slots in raw)
+ * @param n Number of couples
+ * @return 0 in case of success, -1 otherwise
  */
-void initKV(KV *db){
-	memset(db, 0, sizeof(KV));
-	db->_fd_h   = -1;
-	db->_fd_kv  = -1;
-	db->_fd_blk = -1;
-	db->_fd_dkv = -1;
-	
-	db->end_kv = HSIZE_KV;
+int write_chain(KV *kv, const pos_t *blocks, size_t nb_blocks, 
+		const char *raw, const chain_entry *entries, size_t n){
+
+	size_t i, done = 0, size_slot = SIZE_SLOT(kv);
+	len_t max = MAX_BLK_ENTR(kv);
+
+	for (i = 0; i < nb_blocks; i++) {
+		char *page = pool_page(kv, blocks[i], false, true);
+		if (page == NULL) return -1;
+
+		len_t count = 0;
+		for (; done < n && count + entries[done].len <= max; done++) {
+			memcpy(page + SIZE_BLK_HEAD + count * size_slot,
+			       raw + entries[done].start * size_slot, 
+			       entries[done].len * size_slot);
+			count += entries[done].len;
+		}
+		memset(page + SIZE_BLK_HEAD + count * size_slot, 0, 
+			SIZE_BLK - SIZE_BLK_HEAD - count * size_slot);
+
+		/* Full blocks point to the next one */
+		len_t header = (i + 1 < nb_blocks)? 
+			FLAG_USED | ((blocks[i+1] - HSIZE_BLK) / SIZE_BLK) : count;
+		memcpy(page, &header, sizeof header);
+	}
+
+	return 0;
 }
 
-int load_cache(KV* kv){
-	/* DKV cache */
-	len_t size_entries = kv->nb_dkv_entries * sizeof (dkv_entry);
-	len_t size_cache = size_entries + CACHE_PAGE - 
-		(size_entries % CACHE_PAGE); // Min cache pages needed
+/**
+ * Upgrades a file .blk from the version 1 (no fingerprints) to the version 2.
+ * Every chain of blocks is rewritten into a new file, computing the 
+ * fingerprints of the stored keys, then the new file replaces the old one
+ * and the slots of the hash table are updated.
+ * @param kv Database (opened for writing, with the file .h mapped)
+ * @param dbname Name of the database
+ * @return 0 in case of success, -1 otherwise
+ */
+int upgrade_blk(KV *kv, const char *dbname){
 
-	if ((kv->dkv_cache = malloc(size_cache)) == NULL) return -1;
+	/* Names of the old and new files */
+	size_t ll = strlen(dbname);
+	char *name_blk = malloc(2 * (ll + 6));
+	if (name_blk == NULL) return -1;
+	char *name_tmp = name_blk + ll + 6;
+	sprintf(name_blk, "%s.blk", dbname);
+	sprintf(name_tmp, "%s.blk~", dbname);
+
+	int old_fd = kv->_fd_blk;
+	len_t old_nb_blocks = kv->nb_blocks;
+	int new_fd = open(name_tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (new_fd == -1) {
+		free(name_blk);
+		return -1;
+	}
+
+	/* From now on allocate_blk and the pool work on the new file */
+	kv->_fd_blk = new_fd;
+	kv->blk_version = 2;
+	kv->nb_blocks = 0;
+
+	blk_slot *entries = NULL; // Entries of the current chain
+	len_t max_entries = 0, n, i, j;
+	pos_t *heads = calloc(NB_HASH, sizeof (pos_t)); // New first blocks
+	kv_datum key;
+	init_datum(&key);
+
+	len_t header[2] = { MGN_BLK2, 0 };
+	if (heads == NULL ||
+	    safe_write_at(new_fd, 0, header, HSIZE_BLK) == -1) goto error;
+
+	len_t hash;
+	for (hash = 0; hash < NB_HASH; hash++){
+
+		pos_t offset_blk = h_get(kv, hash);
+		if (offset_blk == 0) continue;
+
+		/* Collect the entries of the old chain */
+		n = 0;
+		while (offset_blk != 0){
+			len_t raw[MAX_BLK_ENTR_V1 + 1];
+			ssize_t nb = read_at(old_fd, offset_blk, raw, SIZE_BLK);
+			if (nb < SIZE_BLK_HEAD) {
+				if (nb != -1) errno = EINVAL;
+				goto error;
+			}
+
+			len_t nblk_entries = MAX_BLK_ENTR_V1;
+			if ((raw[0] & FLAG_USED) == 0) {
+				nblk_entries = raw[0];
+				offset_blk = 0;
+			} else {
+				offset_blk = HSIZE_BLK + (pos_t) SIZE_BLK * 
+						(raw[0] & ~FLAG_USED);
+			}
+			if (nblk_entries > MAX_BLK_ENTR_V1 || SIZE_BLK_HEAD + 
+			    nblk_entries * sizeof (len_t) > (size_t) nb) {
+				errno = EINVAL;
+				goto error;
+			}
 
-	kv->max_dkv_cache = size_cache;
+			for (i = 1; i <= nblk_entries; i++){
+				if (raw[i] == 0) continue;
 
-	if (safe_read_at(kv->_fd_dkv, HSIZE_DKV, 
-		kv->dkv_cache, size_entries) == -1 ) return -1;
+				if (n >= max_entries){
+					max_entries += MAX_BLK_ENTR(kv);
+					blk_slot *tmp = realloc(entries,
+					    max_entries * sizeof (blk_slot));
+					if (tmp == NULL) goto error;
+					entries = tmp;
+				}
+				if (read_datum(kv, raw[i], &key) == -1) 
+					goto error;
+				entries[n].offset_kv = raw[i];
+				entries[n].fingerprint = key_fingerprint(&key);
+				n++;
+			}
+		}
 
-	return 0;
+		/* Write the new chain (empty chains are dropped) */
+		pos_t first_blk = 0;
+		len_t blk_number;
+		for (i = 0; i < n; i += MAX_BLK_ENTR(kv)){
+			pos_t offset_new = allocate_blk(kv, &blk_number);
+			if (offset_new == 0) goto error;
+			char *blk = pool_page(kv, offset_new, true, true);
+			if (blk == NULL) goto error;
+			if (first_blk == 0) first_blk = offset_new;
+
+			len_t nblk_entries = n - i, header;
+			if (nblk_entries > MAX_BLK_ENTR(kv)) {
+				/* Full: the next block is the following one */
+				nblk_entries = MAX_BLK_ENTR(kv);
+				header = FLAG_USED | (blk_number + 1);
+			} else {
+				header = nblk_entries;
+			}
+			memcpy(blk, &header, sizeof header);
+			for (j = 0; j < nblk_entries; j++)
+				put_slot(kv, blk, j, &entries[i + j]);
+		}
+
+		heads[hash] = first_blk;
+	}
+
+	/* Replace the old file */
+	header[1] = kv->nb_blocks;
+	if (pool_flush(kv) == -1 ||
+	    safe_write_at(new_fd, 0, header, HSIZE_BLK) == -1 ||
+	    fsync(new_fd) == -1 ||
+	    rename(name_tmp, name_blk) == -1) goto error;
+
+	/* Point the hash table to the new chains */
+	for (hash = 0; hash < NB_HASH; hash++)
+		if (h_get(kv, hash) != heads[hash]) 
+			h_set(kv, hash, heads[hash]);
+	int ret = msync(kv->h_map, kv->h_map_size, MS_SYNC);
+
+	close(old_fd);
+	free(heads);
+	free(entries);
+	free(name_blk);
+	drop_datum(&key);
+	return ret;
+
+error:
+	pool_clear(kv);
+	close(new_fd);
+	unlink(name_tmp);
+	kv->_fd_blk = old_fd;
+	kv->blk_version = 1;
+	kv->nb_blocks = old_nb_blocks;
+	free(heads);
+	free(entries);
+	free(name_blk);
+	drop_datum(&key);
+	return -1;
 }
 
 int set_flags(KV *kv, const char *mode){
@@ -1775,9 +8150,238 @@ int set_flags(KV *kv, const char *mode){
 		oflags = O_RDWR;
 		cflags |= O_CREAT; // "r+" must create if necessary
 		kv->write_only = false;
+		mode++;
+	}
+	for (; *mode != '\0' && strchr("lbivj", *mode) != NULL; mode++){
+		if (*mode == 'l') // Large format, only used at the creation
+			kv->off_size = sizeof (pos_t);
+		else if (*mode == 'i') // Inline couples, same
+			kv->blk_version = 3;
+		else if (*mode == 'v') // Blob log, created if missing
+			kv->blob_create = true;
+		else if (*mode == 'j') // Write-ahead log, same
+			kv->wal_create = true;
+		else		  // Bloom filter, created if missing
+			kv->bf_create = true;
 	}
 
 	kv->flags = oflags | cflags;	
 	return 0;
 }
 
+
+
+/**
+ * Counts the shards of a sharded database (see kv_open_sharded)
+ * @param dbname Name of the database
+ * @param max Max number of shards to count
+ * @return The number of files dbname.<i>.h existing from i = 0
+ */
+len_t count_shards(const char *dbname, len_t max){
+
+	char *name = malloc(strlen(dbname) + 14); // dbname.<shard>.h
+	if (name == NULL) return 0;
+
+	len_t n;
+	struct stat infos;
+	for (n = 0; n < max; n++) {
+		sprintf(name, "%s.%lu.h", dbname, (unsigned long) n);
+		if (stat(name, &infos) == -1) break;
+	}
+
+	free(name);
+	return n;
+}
+
+
+/**
+ * @param kv Sharded database
+ * @param key Key
+ * @return The number of the shard of the key
+ */
+len_t shard_index(KV *kv, const kv_datum *key){
+
+	return wyhash64(key, SHARD_SEED) % kv->nb_shards;
+}
+
+
+/**
+ * @param kv Sharded database
+ * @param key Key
+ * @return The database of the shard of the key
+ */
+KV *shard_of(KV *kv, const kv_datum *key){
+
+	return kv->shards[shard_index(kv, key)];
+}
+
+
+/**
+ * Groups n keys by shard, keeping their order in each shard
+ * @param kv Sharded database
+ * @param keys Keys
+ * @param n Number of keys
+ * @param order Filled with the indexes of the keys, shard after shard
+ * @param first Filled with the position in order of the first key of each
+ *	  shard (nb_shards + 1 entries, the last one being n)
+ */
+void shard_order
+(KV *kv, const kv_datum *keys, size_t n, size_t *order, size_t *first){
+
+	size_t i;
+	len_t s;
+
+	/* Counting sort: first[s] is the end of the shard s at the end */
+	memset(first, 0, (kv->nb_shards + 1) * sizeof (size_t));
+	for (i = 0; i < n; i++) first[shard_index(kv, &keys[i]) + 1]++;
+	for (s = 1; s < kv->nb_shards; s++) first[s] += first[s - 1];
+	for (i = 0; i < n; i++) order[first[shard_index(kv, &keys[i])]++] = i;
+
+	for (s = kv->nb_shards; s > 0; s--) first[s] = first[s - 1];
+	first[0] = 0;
+}
+
+
+/**
+ * Stores n couples in a sharded database (@ref kv_put_batch), with one
+ * kv_put_batch per shard
+ * @param kv Sharded database
+ * @param keys Keys
+ * @param vals Values
+ * @param n Number of couples
+ * @return 0 in case of success, -1 otherwise (the couples of some shards 
+ *	   may have been stored)
+ */
+int shard_put_batch
+(KV *kv, const kv_datum *keys, const kv_datum *vals, size_t n){
+
+	kv_datum *k = malloc(n * (2 * sizeof (kv_datum) + sizeof (size_t)));
+	size_t *first = malloc((kv->nb_shards + 1) * sizeof (size_t));
+	if ((k == NULL && n != 0) || first == NULL) {
+		free(k);
+		free(first);
+		return -1;
+	}
+	kv_datum *v = k + n;
+	size_t *order = (size_t*) (v + n);
+
+	shard_order(kv, keys, n, order, first);
+
+	int r = 0;
+	size_t j, m;
+	len_t s;
+	for (s = 0; s < kv->nb_shards && r == 0; s++) {
+		m = first[s + 1] - first[s];
+		if (m == 0) continue;
+		for (j = 0; j < m; j++) {
+			k[j] = keys[order[first[s] + j]];
+			v[j] = vals[order[first[s] + j]];
+		}
+		r = kv_put_batch(kv->shards[s], k, v, m);
+	}
+
+	free(k);
+	free(first);
+	return r;
+}
+
+
+/**
+ * Reads the values of n keys in a sharded database (@ref kv_get_many), with
+ * one kv_get_many per shard
+ * @param kv Sharded database
+ * @param keys Keys to search
+ * @param vals Where to store the values (as in kv_get_many)
+ * @param status Filled with the result of each key (as in kv_get_many)
+ * @param n Number of keys
+ * @return The number of keys found, -1 in case of error
+ */
+int shard_get_many
+(KV *kv, const kv_datum *keys, kv_datum *vals, int *status, size_t n){
+
+	kv_datum *k = malloc(n * (2 * sizeof (kv_datum) + sizeof (size_t) + 
+				  sizeof (int)));
+	size_t *first = malloc((kv->nb_shards + 1) * sizeof (size_t));
+	if ((k == NULL && n != 0) || first == NULL) {
+		free(k);
+		free(first);
+		return -1;
+	}
+	kv_datum *v = k + n;
+	size_t *order = (size_t*) (v + n);
+	int *st = (int*) (order + n);
+
+	shard_order(kv, keys, n, order, first);
+
+	int ret = 0;
+	size_t j, m, found = 0;
+	len_t s;
+	for (s = 0; s < kv->nb_shards; s++) {
+		m = first[s + 1] - first[s];
+		if (m == 0) continue;
+		for (j = 0; j < m; j++) {
+			k[j] = keys[order[first[s] + j]];
+			v[j] = vals[order[first[s] + j]];
+		}
+		if (kv_get_many(kv->shards[s], k, v, st, m) == -1) ret = -1;
+		for (j = 0; j < m; j++) {
+			vals[order[first[s] + j]] = v[j];
+			status[order[first[s] + j]] = st[j];
+			if (st[j] == 1) found++;
+		}
+	}
+
+	free(k);
+	free(first);
+	return (ret == -1)? -1 : (int) found;
+}
+
+
+/**
+ * Reads the couple following the last one read in a sharded database
+ * (@ref kv_next, @ref kv_next_view), the shards being read one after the 
+ * other
+ * @param kv Sharded database
+ * @param key Where to store the key
+ * @param val Where to store the value
+ * @param view Return views (see kv_next_view) and not copies
+ * @return 1 if a couple has been read, 0 at the end, -1 in case of error
+ */
+int shard_next(KV *kv, kv_datum *key, kv_datum *val, bool view){
+
+	int r;
+	while (kv->next_shard < kv->nb_shards) {
+		KV *shard = kv->shards[kv->next_shard];
+		r = (view)? kv_next_view(shard, key, val) : 
+			kv_next(shard, key, val);
+		if (r != 0) return r;
+
+		if (++kv->next_shard < kv->nb_shards) 
+			kv_start(kv->shards[kv->next_shard]);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Closes the shards of a sharded database, then frees it (@ref kv_close)
+ * @param kv Sharded database
+ * @return 0 in case of success, -1 otherwise (the shards not closed yet
+ *	   stay open, and kv_close can be called again)
+ */
+int close_shards(KV *kv){
+
+	len_t i;
+	for (i = 0; i < kv->nb_shards; i++) {
+		if (kv->shards[i] == NULL) continue;
+		if (kv_close(kv->shards[i]) == -1) return -1;
+		kv->shards[i] = NULL;
+	}
+
+	free(kv->shards);
+	pthread_rwlock_destroy(&kv->lock);
+	free(kv);
+
+	return 0;
+}
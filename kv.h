@@ -1,4 +1,5 @@
 #include <stdint.h>		/* pour uint32_t */
+#include <stddef.h>		/* pour size_t */
 
 /*
  * Définition de type incomplète : la struct KV est définie avec
@@ -33,14 +34,204 @@ typedef struct kv_datum kv_datum ;
 
 typedef enum { FIRST_FIT, WORST_FIT, BEST_FIT } alloc_t ;
 
+/*
+ * Les options d'une base ouverte (voir kv_setopt)
+ */
+
+typedef enum {
+    KV_OPT_BLK_POOL,		/* nombre de blocs gardés en mémoire */
+    KV_OPT_BLOB_MIN,		/* taille des valeurs rangées dans base.blob */
+    KV_OPT_SYNC			/* synchronisation du journal base.wal */
+} kv_opt_t ;
+
+/*
+ * Politiques de synchronisation du journal (KV_OPT_SYNC) : un entier
+ * positif n demande une synchronisation toutes les n ms. La politique
+ * ne porte que sur les dernières modifications, qui peuvent être perdues
+ * par un arrêt brutal du système : la base revient toujours à un état
+ * cohérent.
+ */
+
+#define	KV_SYNC_NONE	(-1)	/* jamais, sauf aux points de reprise */
+#define	KV_SYNC_ALWAYS	0	/* avant le retour de chaque modification */
+
+/*
+ * Statistiques d'une base ouverte (voir kv_getstats)
+ */
+
+struct kv_stats
+{
+    unsigned long blk_hits ;	/* blocs trouvés en mémoire */
+    unsigned long blk_misses ;	/* blocs lus dans le fichier */
+} ;
+
+typedef struct kv_stats kv_stats ;
+
+/*
+ * Zone mémoire fournie par l'utilisateur pour les données renvoyées
+ * (voir kv_set_arena)
+ */
+
+struct kv_arena
+{
+    void *ptr ;			/* la zone elle-même */
+    size_t size ;		/* sa taille */
+    size_t used ;		/* octets déjà distribués */
+} ;
+
+typedef struct kv_arena kv_arena ;
+
 /*
  * Définition de l'API de la bibliothèque kv
+ *
+ * Le mode de kv_open est "r", "r+", "w" ou "w+", éventuellement suivi
+ * des lettres 'l', 'b', 'i', 'v' et 'j' ("w+l" ou "r+lb" par exemple) :
+ * - 'l' : une base créée par cet appel utilise le grand format, avec des
+ *   positions sur 64 bits dans les fichiers, et peut dépasser 4 Go. Le
+ *   format d'une base existante est reconnu à l'ouverture.
+ * - 'b' : si la base n'en a pas, un filtre de Bloom de ses clefs est
+ *   créé (fichier base.bf, mode en écriture seulement). Le filtre d'une
+ *   base est ensuite toujours utilisé : kv_get sait alors sans accès au
+ *   disque que la plupart des clefs absentes le sont. Pour le retirer,
+ *   il suffit de supprimer le fichier base.bf, base fermée.
+ * - 'i' : une base créée par cet appel range les petits couples (clef et
+ *   valeur de 64 octets au plus en tout) dans les blocs de base.blk, et
+ *   non dans base.kv : kv_get les lit sans autre accès. Comme pour 'l',
+ *   une base existante garde son format. Les vues (kv_get_view) de ces
+ *   couples sont des copies, libérées par kv_release_views.
+ * - 'v' : si la base n'en a pas, un journal des grandes valeurs est créé
+ *   (fichier base.blob, mode en écriture seulement). Les valeurs d'au
+ *   moins 4096 octets (voir KV_OPT_BLOB_MIN) y sont ajoutées, et base.kv
+ *   ne garde que leur position : les couples de base.kv restent petits.
+ *   Les valeurs remplacées ou supprimées du journal sont récupérées par
+ *   kv_compact, quand elles en occupent plus de la moitié. Les vues de
+ *   ces valeurs sont des copies, comme pour 'i'.
+ * - 'j' : si la base n'en a pas, un journal des modifications est créé
+ *   (fichier base.wal, mode en écriture seulement). Sans journal, les
+ *   fichiers de la base ne sont cohérents qu'après kv_sync ou kv_close.
+ *   Avec, chaque kv_put, kv_del ou kv_put_batch y est noté avant de
+ *   rendre la main, et une base interrompue (plantage, arrêt brutal)
+ *   revient à son dernier point de reprise puis rejoue les modifications
+ *   du journal à l'ouverture suivante, qui doit être en écriture (sinon
+ *   kv_open échoue avec errno = EBUSY). kv_sync, kv_close, et tout
+ *   journal dépassant 64 Mo, font un point de reprise qui le vide. Le
+ *   journal est synchronisé avant le retour de chaque modification par
+ *   défaut (les fils d'exécution qui attendent partagent le même appel
+ *   à fdatasync), voir KV_OPT_SYNC pour les autres politiques.
  */
 
 KV *kv_open (const char *dbname, const char *mode, int hidx, alloc_t alloc) ;
 int kv_close (KV *kv) ;
+int kv_sync (KV *kv) ;
+int kv_setopt (KV *kv, kv_opt_t opt, long value) ;
+int kv_getstats (KV *kv, kv_stats *stats) ;
 int kv_get (KV *kv, const kv_datum *key, kv_datum *val) ;
+int kv_get_many (KV *kv, const kv_datum *keys, kv_datum *vals, int *status,
+								size_t n) ;
 int kv_put (KV *kv, const kv_datum *key, const kv_datum *val) ;
+int kv_put_batch (KV *kv, const kv_datum *keys, const kv_datum *vals,
+								size_t n) ;
+int kv_compact (KV *kv, size_t max_bytes) ;
 int kv_del (KV *kv, const kv_datum *key) ;
 void kv_start (KV *kv) ;
 int kv_next (KV *kv, kv_datum *key, kv_datum *val) ;
+
+/*
+ * Par défaut, les données renvoyées par kv_get, kv_get_many et kv_next
+ * dans un kv_datum dont le champ ptr est NULL sont allouées par malloc,
+ * et l'utilisateur doit les libérer. Après kv_set_arena, elles sont
+ * prises à la suite dans la zone indiquée (champ used, aligné sur 16
+ * octets) : elles ne doivent plus être libérées, et l'utilisateur remet
+ * used à 0 quand il n'en a plus besoin. Si la zone est pleine, la
+ * fonction échoue avec errno = ENOBUFS. La zone doit rester valide tant
+ * qu'elle est utilisée ; kv_set_arena (kv, NULL) revient à malloc.
+ */
+
+int kv_set_arena (KV *kv, kv_arena *arena) ;
+
+/*
+ * Valeur de hachage d'une clef pour la fonction d'index hidx d'une nouvelle
+ * base (1 à 3 : fonctions historiques, 4 : xxHash32, 5 : wyhash), pour
+ * comparer les fonctions
+ */
+
+int kv_hash (int hidx, const kv_datum *key, len_t *hash) ;
+
+/*
+ * Lectures sans copie : les kv_datum renvoyés pointent directement dans
+ * le fichier .kv projeté en mémoire (en lecture seule, ils ne doivent pas
+ * être libérés ni modifiés). Ils restent valides jusqu'à la prochaine
+ * modification de la base ou jusqu'à l'appel de kv_release_views.
+ */
+
+int kv_get_view (KV *kv, const kv_datum *key, kv_datum *val) ;
+int kv_next_view (KV *kv, kv_datum *key, kv_datum *val) ;
+void kv_release_views (KV *kv) ;
+
+/*
+ * Lots de modifications atomiques : kv_batch_begin prépare un lot vide,
+ * kv_batch_put et kv_batch_del y ajoutent des modifications (copiées en
+ * mémoire, rien n'est écrit) et kv_batch_commit les applique toutes ou
+ * aucune. Dans un lot, seule la dernière modification d'une clef compte,
+ * et supprimer une clef absente est sans effet. Si kv_batch_commit
+ * échoue, les valeurs d'avant le lot sont remises ; avec un journal (mode
+ * 'j'), le lot y est noté en une seule fois et synchronisé une seule
+ * fois, et une base interrompue le retrouve en entier ou pas du tout. Un
+ * lot est utilisé par un seul fil d'exécution ; il est libéré par
+ * kv_batch_commit (même en cas d'erreur) ou par kv_batch_abort, qui
+ * l'abandonne.
+ */
+
+typedef struct kv_batch kv_batch ;
+
+kv_batch *kv_batch_begin (KV *kv) ;
+int kv_batch_put (kv_batch *b, const kv_datum *key, const kv_datum *val) ;
+int kv_batch_del (kv_batch *b, const kv_datum *key) ;
+int kv_batch_commit (kv_batch *b) ;
+void kv_batch_abort (kv_batch *b) ;
+
+/*
+ * Base partagée entre nshards bases indépendantes (1 à 1024), nommées
+ * base.0 à base.n-1 (fichiers base.0.h, base.0.kv...) et ouvertes avec
+ * le même mode : chaque clef va dans l'une d'elles selon sa valeur de
+ * hachage. Chaque base a son propre verrou, et les modifications de
+ * clefs de bases différentes se font donc en parallèle. Toutes les
+ * fonctions ci-dessus s'appliquent au KV renvoyé, sauf kv_batch_begin
+ * (un lot ne peut être atomique que dans une seule base : errno =
+ * EINVAL) ; kv_close ferme toutes les bases. kv_put_batch et
+ * kv_get_many répartissent leurs clefs entre les bases, kv_next les
+ * parcourt l'une après l'autre, et kv_compact déplace au plus max_bytes
+ * octets dans chacune. Le nombre de bases doit être celui de leur
+ * création (sinon errno = EINVAL) : les fichiers d'une ancienne base
+ * partagée en plus de bases doivent être supprimés avant de la recréer
+ * en mode "w".
+ */
+
+KV *kv_open_sharded (const char *dbname, int nshards, const char *mode,
+						int hidx, alloc_t alloc) ;
+
+/*
+ * Construction d'une nouvelle base à partir d'un grand nombre de couples
+ * (la base est écrasée si elle existe). Les couples ajoutés par
+ * kv_build_add sont écrits à la suite dans le fichier .kv, puis triés par
+ * valeur de hachage (en passant par un fichier temporaire base.runs si
+ * nécessaire) : kv_build_close écrit les fichiers .blk et .h en une seule
+ * fois. Si une clef est ajoutée plusieurs fois, seul le dernier couple
+ * est gardé. Le kv_builder est libéré par kv_build_close, même en cas
+ * d'erreur (la base est alors inutilisable).
+ */
+
+typedef struct kv_builder kv_builder ;
+
+kv_builder *kv_build_open (const char *dbname, int hidx, int large) ;
+int kv_build_add (kv_builder *b, const kv_datum *key, const kv_datum *val) ;
+int kv_build_close (kv_builder *b) ;
+
+/*
+ * Conversion d'une base existante au grand format (sans effet si elle
+ * l'est déjà). La base est reconstruite sous le nom base.conv, puis ses
+ * fichiers remplacent ceux de l'ancienne. La base ne doit pas être
+ * ouverte pendant la conversion.
+ */
+
+int kv_convert (const char *dbname) ;
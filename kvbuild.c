@@ -0,0 +1,103 @@
+/*
+ * Construit une nouvelle base à partir des couples <clef, valeur> lus
+ * sur l'entrée standard
+ */
+
+#define _GNU_SOURCE			/* pour getline */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "kv.h"
+#include "common.h"
+
+char *usage_string = "usage: %s [-h][-l][-i hidx] base < couples\n" ;
+
+char *help_string = "\
+Construit une nouvelle base (écrasée si elle existe) à partir des\n\
+couples lus sur l'entrée standard, un par ligne, sous la forme\n\
+'clef<tab>valeur'. Une ligne sans tabulation donne une valeur vide.\n\
+Si une clef apparaît plusieurs fois, la dernière valeur est gardée.\n\
+\n\
+Les options sont :\n\
+-h : à l'aide !\n\
+-i : index de la fonction de hachage. L'index 0 existe toujours\n\
+-l : grand format (positions sur 64 bits, base de plus de 4 Go)\n\
+" ;
+
+/*
+ * @brief Fonction principale
+ */
+
+int main (int argc, char *argv [])
+{
+    int opt ;
+    kv_builder *b ;
+    int hidx = 0 ;
+    int large = 0 ;
+    kv_datum key, val ;
+    char *ligne = NULL ;
+    size_t taille = 0 ;
+    ssize_t n ;
+    char *tab ;
+
+    while ((opt = getopt (argc, argv, "hli:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'h' :				/* help */
+		usage (argv [0], 0) ;
+		break ;
+	    case 'i' :				/* index de la fct de hash */
+		hidx = atoi (optarg) ;
+		break ;
+	    case 'l' :				/* grand format */
+		large = 1 ;
+		break ;
+	    default :
+		usage (argv [0], 1) ;
+	}
+    }
+
+    if (argc - optind != 1)
+	usage (argv [0], 1) ;
+
+    if ((b = kv_build_open (argv [optind], hidx, large)) == NULL)
+	raler (NULL, "kv_build_open") ;
+
+    while ((n = getline (&ligne, &taille, stdin)) != -1)
+    {
+	if (n > 0 && ligne [n - 1] == '\n')
+	    ligne [--n] = '\0' ;
+
+	key.ptr = ligne ;
+	tab = memchr (ligne, '\t', n) ;
+	if (tab == NULL)
+	{
+	    key.len = n ;
+	    val.ptr = ligne + n ;
+	    val.len = 0 ;
+	}
+	else
+	{
+	    key.len = tab - ligne ;
+	    val.ptr = tab + 1 ;
+	    val.len = n - key.len - 1 ;
+	}
+
+	if (kv_build_add (b, &key, &val) == -1)
+	    raler (NULL, "kv_build_add") ;
+    }
+    if (ferror (stdin))
+	raler (NULL, "getline") ;
+
+    free (ligne) ;
+
+    if (kv_build_close (b) == -1)
+	raler (NULL, "kv_build_close") ;
+
+    exit (0) ;
+}
@@ -0,0 +1,50 @@
+/*
+ * Convertit une base existante au grand format (positions sur 64 bits)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "common.h"
+
+char *usage_string = "usage: %s [-h] base\n" ;
+
+char *help_string = "\
+Convertit la base indiquée au grand format, qui permet de dépasser\n\
+4 Go. La base est reconstruite, ce qui libère aussi l'espace perdu\n\
+dans le fichier .kv. Une base déjà au grand format n'est pas modifiée.\n\
+\n\
+Les options sont :\n\
+-h : à l'aide !\n\
+";
+
+/*
+ * @brief Fonction principale
+ */
+
+int main (int argc, char *argv [])
+{
+    int opt ;
+
+    while ((opt = getopt (argc, argv, "h")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'h':			/* help */
+		usage (argv [0], 0) ;
+		break ;
+	    default :
+		usage (argv [0], 1) ;
+	}
+    }
+
+    if (optind != argc - 1)
+	usage (argv [0], 1) ;
+
+    if (kv_convert (argv [optind]) == -1)
+	raler (NULL, "kv_convert") ;
+
+    exit (0) ;
+}
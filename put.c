@@ -13,7 +13,7 @@
 #include "kv.h"
 #include "common.h"
 
-char *usage_string = "usage: %s [-h][-i hidx][-a first|worst|best] base key [val]\n" ;
+char *usage_string = "usage: %s [-h][-l][-b][-s][-j][-v seuil][-i hidx][-a first|worst|best] base key [val]\n" ;
 
 char *help_string = "\
 Stocke un couple <clef, valeur>. Si la valeur n'est\n\
@@ -22,6 +22,12 @@ pas spécifiée comme un argument, elle est lue sur l'entrée standard.\n\
 Les options sont :\n\
 -h : à l'aide !\n\
 -i : index de la fonction de hachage. L'index 0 existe toujours\n\
+-l : grand format si la base est créée (positions sur 64 bits)\n\
+-b : ajoute un filtre de Bloom à la base si elle n'en a pas\n\
+-s : petits couples rangés dans les blocs si la base est créée\n\
+-v : grandes valeurs (au moins 'seuil' octets, 0 pour le seuil actuel)\n\
+     rangées dans un journal à part (base.blob), créé s'il n'existe pas\n\
+-j : ajoute un journal des modifications (base.wal) s'il n'existe pas\n\
 -a : algorithme d'allocation ('first' pour 'first fit', 'worst' ou 'best')\n\
 " ;
 
@@ -113,9 +119,12 @@ int main (int argc, char *argv [])
     int hidx = 0 ;
     char *alloc = NULL ;
     alloc_t a ;
+    char mode [8] = "r+" ;
+    int m = 2 ;
+    long seuil = 0 ;
     kv_datum key, val ;
 
-    while ((opt = getopt (argc, argv, "ha:i:")) != -1)
+    while ((opt = getopt (argc, argv, "hlbsjv:a:i:")) != -1)
     {
 	switch (opt)
 	{
@@ -128,6 +137,27 @@ int main (int argc, char *argv [])
 	    case 'i' :				/* index de la fct de hash */
 		hidx = atoi (optarg) ;
 		break ;
+	    case 'l' :				/* grand format */
+		if (strchr (mode, 'l') == NULL)
+		    mode [m++] = 'l' ;
+		break ;
+	    case 'b' :				/* filtre de Bloom */
+		if (strchr (mode, 'b') == NULL)
+		    mode [m++] = 'b' ;
+		break ;
+	    case 's' :				/* couples dans les blocs */
+		if (strchr (mode, 'i') == NULL)
+		    mode [m++] = 'i' ;
+		break ;
+	    case 'v' :				/* journal des grandes valeurs */
+		if (strchr (mode, 'v') == NULL)
+		    mode [m++] = 'v' ;
+		seuil = atol (optarg) ;
+		break ;
+	    case 'j' :				/* journal des modifications */
+		if (strchr (mode, 'j') == NULL)
+		    mode [m++] = 'j' ;
+		break ;
 	    default :
 		usage (argv [0], 1) ;
 	}
@@ -151,9 +181,12 @@ int main (int argc, char *argv [])
 
     a = allocation (alloc) ;
 
-    if ((kv = kv_open (argv [optind], "r+", hidx, a)) == NULL)
+    if ((kv = kv_open (argv [optind], mode, hidx, a)) == NULL)
 	raler (kv, "kv_open") ;
 
+    if (seuil != 0 && kv_setopt (kv, KV_OPT_BLOB_MIN, seuil) == -1)
+	raler (kv, "kv_setopt") ;
+
     key.ptr = argv [optind + 1] ;
     key.len = strlen (key.ptr) ;
 
@@ -35,6 +35,16 @@ $V put $DB ma-clef abc				|| fail "put ma-clef 1"
 rm -f $DB.*
 $V put -i 0 $DB ma-clef abc			|| fail "put -i 0 ma-clef"
 
+# les fonctions mot à mot (xxHash32, wyhash), mémorisées dans le .h
+for HIDX in 4 5
+do
+    rm -f $DB.*
+    $V put -i $HIDX $DB ma-clef abc		|| fail "put -i $HIDX ma-clef"
+    $V put $DB autre-clef def			|| fail "put -i $HIDX autre-clef"
+    test "$(get -q $DB ma-clef)" = abc		|| fail "get -i $HIDX ma-clef"
+    test "$(get -q $DB autre-clef)" = def	|| fail "get -i $HIDX autre-clef"
+done
+
 # on recommence en spécifiant un index de h débile
 rm -f $DB.*
 put -i 9999 $DB ma-clef abc			&& fail "put -i 9999 ma-clef"
@@ -126,6 +126,17 @@ do
 done
 tester_ordre a1 a2 a3 a4 a5 a6			|| fail "ordre sans best"
 
+##############################################################################
+# remplacement : une valeur qui tient dans la place de l'ancienne reste sur
+# place (sinon first fit la mettrait dans le premier trou)
+
+$V put -a first $DB a4 r-04			|| fail "put a4 plus courte"
+$V put -a first $DB a4 r-05			|| fail "put a4 même taille"
+tester_ordre a1 a2 a3 a4 a5 a6			|| fail "ordre remplacement"
+test "$(get -q $DB a4)" = r-05			|| fail "get a4 remplacée"
+$V put -a first $DB a4 repere-4-bis		|| fail "put a4 trop long"
+tester_ordre a1 a4 a2 a3 a5 a6			|| fail "ordre déplacement"
+
 # supprimer le fichier temporaire en cas de sortie normale
 rm -f $DB.*
 
@@ -0,0 +1,84 @@
+#!/bin/sh
+
+#
+# Test de la construction d'une base (kvbuild)
+#
+
+TEST=$(basename $0 .sh)-$$
+
+DB=${TEST}-db
+TMP=/tmp/$TEST
+LOG=$TEST.log
+V=${VALGRIND}			# mettre VALGRIND à "valgrind -q" pour activer
+
+N=3000				# nombre de clefs
+
+exec 2> $LOG
+set -x
+
+fail ()
+{
+    echo "==> Échec du test '$TEST' sur '$1'."
+    echo "==> Log : '$LOG'."
+    echo "==> DB : '$DB'."
+    echo "==> Exit"
+    exit 1
+}
+
+rm -f $DB.*
+
+# Test des options
+$V kvbuild -h					|| fail "kvbuild -h"
+kvbuild -x $DB < /dev/null			&& fail "kvbuild -x"
+kvbuild < /dev/null				&& fail "kvbuild sans base"
+kvbuild -i 9999 $DB < /dev/null			&& fail "kvbuild -i 9999"
+
+# une base vide
+rm -f $DB.*
+$V kvbuild $DB < /dev/null			|| fail "kvbuild vide"
+test -z "$(get -q $DB)"				|| fail "base vide"
+
+##############################################################################
+# Les clefs multiples de 7 apparaissent deux fois : seule la dernière
+# valeur doit être gardée
+
+for i in $(seq 1 $N)
+do
+    printf 'clef-%d\tvaleur-%d\n' $i $i
+    if [ $((i % 7)) = 0 ]
+    then
+	printf 'clef-%d\tancienne-%d\n' $((i - 3)) $i
+    fi
+done > $TMP.couples
+printf 'sans-valeur\n' >> $TMP.couples
+
+$V kvbuild $DB < $TMP.couples			|| fail "kvbuild"
+test ! -f $DB.runs				|| fail "fichier temporaire"
+
+# Vérification de la liste des clefs
+cut -f 1 $TMP.couples | sort -u > $TMP.liste
+$V get -q $DB | sort | diff -q $TMP.liste -	|| fail "diff liste"
+
+# Vérification des valeurs
+test "$(get -q $DB clef-1)" = valeur-1		|| fail "get clef-1"
+test "$(get -q $DB clef-4)" = ancienne-7	|| fail "get clef-4"
+test "$(get -q $DB clef-7)" = valeur-7		|| fail "get clef-7"
+test "$(get -q $DB clef-$N)" = valeur-$N	|| fail "get clef-$N"
+test "$(get $DB sans-valeur)" = "sans-valeur: "	|| fail "get sans-valeur"
+
+# La base construite est une base normale
+$V put $DB clef-4 nouvelle			|| fail "put clef-4"
+$V del $DB clef-5				|| fail "del clef-5"
+test "$(get -q $DB clef-4)" = nouvelle		|| fail "get clef-4 nouvelle"
+get $DB clef-5					&& fail "get clef-5"
+$V put $DB autre-clef autre			|| fail "put autre-clef"
+test "$(get -q $DB autre-clef)" = autre		|| fail "get autre-clef"
+
+# Reconstruire écrase l'ancienne base
+echo "seule	clef" | $V kvbuild -i 1 $DB		|| fail "kvbuild -i 1"
+test "$(get -q $DB)" = seule			|| fail "base écrasée"
+
+# supprimer les fichiers temporaires en cas de sortie normale
+rm -f $DB.* $TMP.*
+
+exit 0
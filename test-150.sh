@@ -0,0 +1,109 @@
+#!/bin/sh
+
+#
+# Test du grand format (positions sur 64 bits) et de la conversion (kvconv)
+#
+
+TEST=$(basename $0 .sh)-$$
+
+DB=${TEST}-db
+TMP=/tmp/$TEST
+LOG=$TEST.log
+V=${VALGRIND}			# mettre VALGRIND à "valgrind -q" pour activer
+
+N=3000				# nombre de clefs
+
+exec 2> $LOG
+set -x
+
+fail ()
+{
+    echo "==> Échec du test '$TEST' sur '$1'."
+    echo "==> Log : '$LOG'."
+    echo "==> DB : '$DB'."
+    echo "==> Exit"
+    exit 1
+}
+
+# le format se lit dans le nombre magique du fichier .dkv
+grand_format ()
+{
+    test "$(head -c 4 $DB.dkv)" = 46kd
+}
+
+rm -f $DB.*
+
+# Test des options
+$V kvconv -h					|| fail "kvconv -h"
+kvconv -x $DB					&& fail "kvconv -x"
+kvconv						&& fail "kvconv sans base"
+kvconv $DB					&& fail "kvconv base absente"
+
+for i in $(seq 1 $N)
+do
+    printf 'clef-%d\tvaleur-%d\n' $i $i
+done > $TMP.couples
+cut -f 1 $TMP.couples | sort > $TMP.liste
+
+##############################################################################
+# Une base créée au grand format par put
+
+rm -f $DB.*
+$V put -l $DB clef-1 valeur-1			|| fail "put -l"
+grand_format					|| fail "format put -l"
+for i in $(seq 2 $N)
+do
+    put $DB clef-$i valeur-$i			|| fail "put clef-$i"
+done
+get -q $DB | sort | diff -q $TMP.liste -	|| fail "diff liste put -l"
+$V del $DB clef-5				|| fail "del clef-5"
+get $DB clef-5					&& fail "get clef-5"
+test "$(get -q $DB clef-$N)" = valeur-$N	|| fail "get clef-$N"
+
+# -l est sans effet sur une base existante
+$V put -l $DB clef-5 valeur-5			|| fail "put -l existante"
+get -q $DB | sort | diff -q $TMP.liste -	|| fail "diff liste put -l 2"
+
+##############################################################################
+# Une base construite au grand format par kvbuild
+
+rm -f $DB.*
+$V kvbuild -l -i 4 $DB < $TMP.couples		|| fail "kvbuild -l"
+grand_format					|| fail "format kvbuild -l"
+get -q $DB | sort | diff -q $TMP.liste -	|| fail "diff liste kvbuild -l"
+test "$(get -q $DB clef-7)" = valeur-7		|| fail "get clef-7"
+
+# Convertir une base déjà au grand format ne change rien
+$V kvconv $DB					|| fail "kvconv grand format"
+get -q $DB | sort | diff -q $TMP.liste -	|| fail "diff liste kvconv"
+
+##############################################################################
+# Conversion d'une base au format normal, avec des trous dans .kv
+
+rm -f $DB.*
+$V kvbuild -i 2 $DB < $TMP.couples		|| fail "kvbuild"
+grand_format					&& fail "format kvbuild"
+for i in $(seq 1 10 $N)
+do
+    del $DB clef-$i				|| fail "del clef-$i"
+done
+put $DB clef-2 nouvelle				|| fail "put clef-2"
+get $DB > $TMP.avant				|| fail "get avant"
+
+$V kvconv $DB					|| fail "kvconv"
+grand_format					|| fail "format kvconv"
+test ! -f $DB.conv.kv				|| fail "fichiers temporaires"
+get $DB | sort > $TMP.apres			|| fail "get après"
+sort $TMP.avant | diff -q - $TMP.apres		|| fail "diff après kvconv"
+test "$(get -q $DB clef-2)" = nouvelle		|| fail "get clef-2"
+
+# La base convertie est une base normale
+$V put $DB clef-1 valeur-1			|| fail "put clef-1"
+$V del $DB clef-3				|| fail "del clef-3"
+test "$(get -q $DB clef-1)" = valeur-1		|| fail "get clef-1"
+get $DB clef-3					&& fail "get clef-3"
+
+# supprimer les fichiers temporaires en cas de sortie normale
+rm -f $DB.* $TMP.*
+
+exit 0
@@ -0,0 +1,87 @@
+#!/bin/sh
+
+#
+# Test du filtre de Bloom (put -b)
+#
+
+TEST=$(basename $0 .sh)-$$
+
+DB=${TEST}-db
+TMP=/tmp/$TEST
+LOG=$TEST.log
+V=${VALGRIND}			# mettre VALGRIND à "valgrind -q" pour activer
+
+N=2000				# nombre de clefs
+
+exec 2> $LOG
+set -x
+
+fail ()
+{
+    echo "==> Échec du test '$TEST' sur '$1'."
+    echo "==> Log : '$LOG'."
+    echo "==> DB : '$DB'."
+    echo "==> Exit"
+    exit 1
+}
+
+# vérifie les clefs présentes (liste dans $TMP.liste) et quelques absentes
+verifier ()
+{
+    get -q $DB | sort | diff -q $TMP.liste -	|| fail "diff liste $1"
+    for i in $(seq 1 97 $N)
+    do
+	get $DB absente-$i			&& fail "get absente-$i $1"
+    done
+    for clef in $(head -20 $TMP.liste)
+    do
+	test "$(get -q $DB $clef)" = "val-$clef" || fail "get $clef $1"
+    done
+}
+
+##############################################################################
+# Une base créée avec un filtre
+
+rm -f $DB.*
+$V put -b $DB clef-0 val-clef-0			|| fail "put -b"
+test -f $DB.bf					|| fail "fichier .bf"
+for i in $(seq 1 $N)
+do
+    put $DB clef-$i val-clef-$i			|| fail "put clef-$i"
+done
+seq 0 $N | sed 's/^/clef-/' | sort > $TMP.liste
+verifier "après put"
+
+# Les clefs supprimées restent dans le filtre, mais sont bien absentes
+for i in $(seq 1 10 $N)
+do
+    del $DB clef-$i				|| fail "del clef-$i"
+    get $DB clef-$i				&& fail "get clef-$i supprimée"
+done
+seq 1 10 $N | sed 's/^/clef-/' > $TMP.supp
+seq 0 $N | sed 's/^/clef-/' | grep -v -x -f $TMP.supp | sort > $TMP.liste
+verifier "après del"
+
+##############################################################################
+# Un filtre ajouté à une base existante contient ses clefs
+
+rm -f $DB.*
+for i in $(seq 1 200)
+do
+    put $DB clef-$i val-clef-$i			|| fail "put clef-$i sans filtre"
+done
+test ! -f $DB.bf				|| fail "fichier .bf sans -b"
+$V put -b $DB clef-0 val-clef-0			|| fail "put -b ajout"
+test -f $DB.bf					|| fail "fichier .bf ajouté"
+seq 0 200 | sed 's/^/clef-/' | sort > $TMP.liste
+N=200
+verifier "filtre ajouté"
+
+# Sans son fichier .bf, la base reste utilisable
+rm -f $DB.bf
+verifier "sans filtre"
+
+# supprimer les fichiers temporaires en cas de sortie normale
+rm -f $DB.* $TMP.*
+
+exit 0
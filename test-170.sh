@@ -0,0 +1,116 @@
+#!/bin/sh
+
+#
+# Test des petits couples rangés dans les blocs (put -s)
+#
+
+TEST=$(basename $0 .sh)-$$
+
+DB=${TEST}-db
+TMP=/tmp/$TEST
+LOG=$TEST.log
+V=${VALGRIND}			# mettre VALGRIND à "valgrind -q" pour activer
+
+N=3000				# nombre de clefs
+
+exec 2> $LOG
+set -x
+
+fail ()
+{
+    echo "==> Échec du test '$TEST' sur '$1'."
+    echo "==> Log : '$LOG'."
+    echo "==> DB : '$DB'."
+    echo "==> Exit"
+    exit 1
+}
+
+# le fichier .blk est-il à la version 3 (nombre magique) ?
+en_ligne ()
+{
+    case "$(head -c 4 $DB.blk)" in
+	3klb|463b) return 0 ;;
+	*) return 1 ;;
+    esac
+}
+
+# taille du fichier .kv (l'en-tête seul fait 4 octets)
+taille_kv ()
+{
+    wc -c < $DB.kv | tr -d ' '
+}
+
+# la liste des couples est-elle celle attendue ('clef: valeur' dans
+# $TMP.couples) ?
+verifier ()
+{
+    get $DB | sort | diff -q $TMP.couples -	|| fail "diff couples $1"
+    for clef in $(head -20 $TMP.couples | cut -d : -f 1)
+    do
+	test "$(get -q $DB $clef)" = "$(sed -n "s/^$clef: //p" $TMP.couples)" \
+						|| fail "get $clef $1"
+    done
+}
+
+##############################################################################
+# Une base créée avec les petits couples dans les blocs
+
+rm -f $DB.*
+$V put -s $DB clef-0 val-0			|| fail "put -s"
+en_ligne					|| fail "format put -s"
+for i in $(seq 1 $N)
+do
+    put $DB clef-$i val-$i			|| fail "put clef-$i"
+done
+test "$(taille_kv)" -eq 4			|| fail "taille .kv petits couples"
+seq 0 $N | awk '{ printf "clef-%d: val-%d\n", $1, $1 }' | sort > $TMP.couples
+verifier "après put"
+
+# Une grande valeur va dans .kv, et revient dans le bloc si elle rapetisse
+GRANDE=$(printf '%0100d' 7)
+$V put $DB clef-7 $GRANDE			|| fail "put grande valeur"
+test "$(taille_kv)" -gt 4			|| fail "taille .kv grande valeur"
+test "$(get -q $DB clef-7)" = $GRANDE		|| fail "get grande valeur"
+$V put $DB clef-7 val-7				|| fail "put petite valeur"
+test "$(get -q $DB clef-7)" = val-7		|| fail "get petite valeur"
+verifier "après remplacements"
+
+# Suppressions
+for i in $(seq 1 10 $N)
+do
+    del $DB clef-$i				|| fail "del clef-$i"
+    get $DB clef-$i				&& fail "get clef-$i supprimée"
+done
+del $DB clef-1					&& fail "del clef-1 deux fois"
+seq 0 $N | awk '$1 % 10 != 1 { printf "clef-%d: val-%d\n", $1, $1 }' \
+	| sort > $TMP.couples
+verifier "après del"
+
+# -s est sans effet sur une base existante, et inversement
+rm -f $DB.*
+$V put $DB clef-0 val-0				|| fail "put sans -s"
+en_ligne					&& fail "format put sans -s"
+$V put -s $DB clef-1 val-1			|| fail "put -s existante"
+en_ligne					&& fail "format put -s existante"
+
+##############################################################################
+# Conversion au grand format : les couples restent dans les blocs
+
+rm -f $DB.*
+for i in $(seq 1 200)
+do
+    put -s $DB clef-$i val-$i			|| fail "put -s clef-$i"
+done
+$V put $DB grande $GRANDE			|| fail "put grande"
+$V kvconv $DB					|| fail "kvconv"
+en_ligne					|| fail "format kvconv"
+test "$(head -c 4 $DB.dkv)" = 46kd		|| fail "grand format kvconv"
+seq 1 200 | awk '{ printf "clef-%d: val-%d\n", $1, $1 }' > $TMP.couples
+printf 'grande: %s\n' $GRANDE >> $TMP.couples
+sort -o $TMP.couples $TMP.couples
+verifier "après kvconv"
+
+# supprimer les fichiers temporaires en cas de sortie normale
+rm -f $DB.* $TMP.*
+
+exit 0
@@ -0,0 +1,108 @@
+#!/bin/sh
+
+#
+# Test du journal des grandes valeurs (put -v)
+#
+
+TEST=$(basename $0 .sh)-$$
+
+DB=${TEST}-db
+TMP=/tmp/$TEST
+LOG=$TEST.log
+V=${VALGRIND}			# mettre VALGRIND à "valgrind -q" pour activer
+
+N=300				# nombre de clefs
+SEUIL=100			# taille minimum des valeurs du journal
+
+exec 2> $LOG
+set -x
+
+fail ()
+{
+    echo "==> Échec du test '$TEST' sur '$1'."
+    echo "==> Log : '$LOG'."
+    echo "==> DB : '$DB'."
+    echo "==> Exit"
+    exit 1
+}
+
+# taille d'un fichier de la base
+taille ()
+{
+    wc -c < $DB.$1 | tr -d ' '
+}
+
+# valeur de i octets (chiffres)
+valeur ()
+{
+    printf "%0${1}d" $2
+}
+
+# la liste des couples est-elle celle attendue ('clef: valeur' dans
+# $TMP.couples) ?
+verifier ()
+{
+    get $DB | sort | diff -q $TMP.couples -	|| fail "diff couples $1"
+    for clef in $(head -20 $TMP.couples | cut -d : -f 1)
+    do
+	test "$(get -q $DB $clef)" = "$(sed -n "s/^$clef: //p" $TMP.couples)" \
+						|| fail "get $clef $1"
+    done
+}
+
+##############################################################################
+# Une base créée avec le journal : les grandes valeurs n'encombrent pas .kv
+
+rm -f $DB.*
+$V put -v $SEUIL $DB clef-0 $(valeur 500 0)	|| fail "put -v"
+test -f $DB.blob				|| fail "pas de journal"
+for i in $(seq 1 $N)
+do
+    put $DB clef-$i $(valeur 500 $i)		|| fail "put clef-$i"
+done
+test "$(taille kv)" -lt $((N * 100))		|| fail "taille .kv"
+test "$(taille blob)" -gt $((N * 500))		|| fail "taille .blob"
+seq 0 $N | awk '{ printf "clef-%d: %0500d\n", $1, $1 }' | sort > $TMP.couples
+verifier "après put"
+
+# Les petites valeurs restent dans .kv
+$V put $DB petite val				|| fail "put petite"
+test "$(get -q $DB petite)" = val		|| fail "get petite"
+echo "petite: val" >> $TMP.couples
+sort -o $TMP.couples $TMP.couples
+
+# Remplacements et suppressions
+for i in $(seq 1 2 $N)
+do
+    put $DB clef-$i $(valeur 600 $i)		|| fail "remplacement clef-$i"
+done
+for i in $(seq 2 4 $N)
+do
+    del $DB clef-$i				|| fail "del clef-$i"
+    get $DB clef-$i				&& fail "get clef-$i supprimée"
+done
+{
+    seq 0 $N | awk '$1 % 2 == 1 { printf "clef-%d: %0600d\n", $1, $1 }
+		    $1 % 4 == 0 { printf "clef-%d: %0500d\n", $1, $1 }'
+    echo "petite: val"
+} | sort > $TMP.couples
+verifier "après remplacements"
+
+# -v sans seuil garde le seuil actuel
+$V put -v 0 $DB moyenne $(valeur 200 9)		|| fail "put -v 0"
+test "$(get -q $DB moyenne)" = $(valeur 200 9)	|| fail "get moyenne"
+echo "moyenne: $(valeur 200 9)" >> $TMP.couples
+sort -o $TMP.couples $TMP.couples
+
+##############################################################################
+# Conversion au grand format : le journal suit la base
+
+$V kvconv $DB					|| fail "kvconv"
+test "$(head -c 4 $DB.dkv)" = 46kd		|| fail "grand format kvconv"
+test -f $DB.blob				|| fail "journal kvconv"
+verifier "après kvconv"
+
+# supprimer les fichiers temporaires en cas de sortie normale
+rm -f $DB.* $TMP.*
+
+exit 0
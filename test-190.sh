@@ -0,0 +1,104 @@
+#!/bin/sh
+
+#
+# Test du journal des modifications (put -j)
+#
+
+TEST=$(basename $0 .sh)-$$
+
+DB=${TEST}-db
+TMP=/tmp/$TEST
+LOG=$TEST.log
+V=${VALGRIND}			# mettre VALGRIND à "valgrind -q" pour activer
+
+N=300				# nombre de clefs
+
+exec 2> $LOG
+set -x
+
+fail ()
+{
+    echo "==> Échec du test '$TEST' sur '$1'."
+    echo "==> Log : '$LOG'."
+    echo "==> DB : '$DB'."
+    echo "==> Exit"
+    exit 1
+}
+
+# taille d'un fichier de la base
+taille ()
+{
+    wc -c < $DB.$1 | tr -d ' '
+}
+
+# la liste des couples est-elle celle attendue ('clef: valeur' dans
+# $TMP.couples) ?
+verifier ()
+{
+    get $DB | sort | diff -q $TMP.couples -	|| fail "diff couples $1"
+    for clef in $(head -20 $TMP.couples | cut -d : -f 1)
+    do
+	test "$(get -q $DB $clef)" = "$(sed -n "s/^$clef: //p" $TMP.couples)" \
+						|| fail "get $clef $1"
+    done
+}
+
+##############################################################################
+# Une base créée avec le journal : il est vide après chaque fermeture
+
+rm -f $DB.*
+$V put -j $DB clef-0 val-0			|| fail "put -j"
+test -f $DB.wal					|| fail "pas de journal"
+VIDE=$(taille wal)
+test "$(head -c 4 $DB.wal)" = 0law		|| fail "nombre magique"
+for i in $(seq 1 $N)
+do
+    put $DB clef-$i val-$i			|| fail "put clef-$i"
+done
+test "$(taille wal)" -eq $VIDE			|| fail "journal non vidé"
+for i in $(seq 2 2 $N)
+do
+    del $DB clef-$i				|| fail "del clef-$i"
+done
+seq 0 $N | awk '$1 % 2 == 1 || $1 == 0 { printf "clef-%d: val-%d\n", $1, $1 }' \
+	| sort > $TMP.couples
+verifier "après del"
+
+# Un journal vide n'empêche pas la lecture seule
+$V get $DB clef-1 > /dev/null			|| fail "get lecture seule"
+
+# Un journal abîmé est refusé
+cp $DB.wal $TMP.wal
+printf 'xxxx' | dd of=$DB.wal conv=notrunc 2> /dev/null
+put $DB clef-1 autre				&& fail "journal abîmé"
+cp $TMP.wal $DB.wal
+verifier "après journal abîmé"
+
+# -j ajoute un journal à une base existante
+rm -f $DB.*
+$V put $DB clef val				|| fail "put sans -j"
+test -f $DB.wal					&& fail "journal sans -j"
+$V put -j $DB clef val2				|| fail "put -j existante"
+test -f $DB.wal					|| fail "journal ajouté"
+test "$(get -q $DB clef)" = val2		|| fail "get après -j"
+
+##############################################################################
+# Conversion au grand format : le journal suit la base
+
+for i in $(seq 1 $N)
+do
+    put $DB clef-$i val-$i			|| fail "put clef-$i"
+done
+$V kvconv $DB					|| fail "kvconv"
+test "$(head -c 4 $DB.dkv)" = 46kd		|| fail "grand format kvconv"
+test "$(taille wal)" -eq $VIDE			|| fail "journal kvconv"
+{
+    seq 1 $N | awk '{ printf "clef-%d: val-%d\n", $1, $1 }'
+    echo "clef: val2"
+} | sort > $TMP.couples
+verifier "après kvconv"
+
+# supprimer les fichiers temporaires en cas de sortie normale
+rm -f $DB.* $TMP.*
+
+exit 0
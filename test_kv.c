@@ -11,12 +11,49 @@ extern int errno;
 
 #define MAX_VAL 4096
 #define MAX_KEY 100
+#define BENCH_VAL 16		/* Size of the values of the benchmark */
+#define BENCH_ARENA 4096	/* Size of the arena of the benchmark (-z) */
 
 typedef enum { false, true} bool;
 
 
-char* usage_string = "usage: %s [-h][-i hidx][-a first|worst|best][-s size] base\n";
-char* help_string = NULL;
+char* usage_string = "usage: %s [-h][-i hidx][-a first|worst|best][-s size]"
+		     "[-b rounds][-z] base\n";
+char* help_string = "\
+Insère et supprime size clefs aléatoires dans une base existante.\n\
+\n\
+Les options sont :\n\
+-h : à l'aide !\n\
+-i : index de la fonction de hachage\n\
+-a : méthode d'allocation (first, worst ou best)\n\
+-s : nombre de clefs\n\
+-b : mesure plutôt une boucle de kv_get/kv_put sur size clefs, rounds fois,\n\
+     et compte les appels à malloc, calloc et realloc\n\
+-z : avec -b, les valeurs lues sont rangées dans une zone (kv_set_arena)\n\
+";
+
+/* Number of calls to malloc, calloc and realloc (the program is linked with
+ * --wrap for these functions, see the Makefile) */
+unsigned long nb_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size){ 
+	nb_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){ 
+	nb_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){ 
+	nb_allocs++;
+	return __real_realloc(ptr, size);
+}
 
 
 alloc_t allocation (const char *alloc){
@@ -95,6 +132,67 @@ int test(KV* kv, len_t n){
 
 
 
+/* Loop of kv_get and kv_put (value of the same size) on n keys, once the 
+ * keys are stored: prints the throughput and the allocations per operation */
+int bench(KV* kv, len_t n, len_t rounds, bool use_arena){
+	char vkey[MAX_KEY];
+	char data[BENCH_VAL];
+	char zone[BENCH_ARENA];
+	kv_datum key, val;
+	key.ptr = vkey;
+
+	kv_arena arena;
+	arena.ptr = zone;
+	arena.size = sizeof zone;
+	arena.used = 0;
+	if (use_arena && kv_set_arena(kv, &arena) == -1) return -1;
+
+	/* Store the keys (and load the caches) */
+	len_t i, r;
+	memset(data, 'v', sizeof data);
+	val.ptr = data;
+	val.len = sizeof data;
+	for (i = 0; i < n; i++){
+		key.len = sprintf(vkey, "key-%u", i);
+		if (kv_put(kv, &key, &val) == -1) return -1;
+	}
+
+	struct timeval start, end;
+	unsigned long allocs = nb_allocs;
+	if (gettimeofday(&start,NULL) == -1) return -1;
+	for (r = 0; r < rounds; r++){
+		for (i = 0; i < n; i++){
+			key.len = sprintf(vkey, "key-%u", i);
+
+			val.ptr = NULL;
+			if (kv_get(kv, &key, &val) != 1) return -1;
+
+			/* Counter-style update */
+			((char*) val.ptr)[0]++;
+			if (kv_put(kv, &key, &val) == -1) return -1;
+
+			if (use_arena) arena.used = 0;
+			else free(val.ptr);
+		}
+	}
+	if (gettimeofday(&end,NULL) == -1) return -1;
+	allocs = nb_allocs - allocs;
+
+	double sec = (end.tv_sec - start.tv_sec) +
+		     (end.tv_usec - start.tv_usec) / 1e6;
+	if (sec <= 0) sec = 1e-6;
+	double ops = 2.0 * n * rounds;
+
+	printf("%u keys, %.0f get+put: %.0f op/s, %lu allocations "
+	       "(%.3f/op)%s\n", n, ops, ops / sec, allocs, allocs / ops, 
+	       use_arena? ", arena" : "");
+
+	if (use_arena && kv_set_arena(kv, NULL) == -1) return -1;
+	return 0;
+}
+
+
+
 int main(int argc, char* argv[]){
 
 	int opt ;
@@ -104,10 +202,12 @@ int main(int argc, char* argv[]){
 	int hidx = 0 ;
 	char *alloc = NULL;
 	len_t size_test = 10;
+	len_t rounds = 0;
+	bool use_arena = false;
 
 	alloc_t a;
 
-	while ((opt = getopt (argc, argv, "ha:i:s:")) != -1) {
+	while ((opt = getopt (argc, argv, "ha:i:s:b:z")) != -1) {
 		switch (opt) {
 			case 'h' :				/* help */
 				usage (argv [0], 0) ;
@@ -121,6 +221,12 @@ int main(int argc, char* argv[]){
 			case 's' :
 				size_test = atoi(optarg);
 				break;
+			case 'b' :
+				rounds = atoi(optarg);
+				break;
+			case 'z' :
+				use_arena = true;
+				break;
 	    		default :
 				usage (argv [0], 1);
 		}
@@ -133,7 +239,10 @@ int main(int argc, char* argv[]){
     	if ((kv = kv_open(argv [optind], "r+", hidx, a)) == NULL) 
 		raler(kv, "kv_open");
 
-	if (test(kv,size_test) == -1) raler(kv, "test");
+	if (rounds > 0) {
+		if (bench(kv,size_test,rounds,use_arena) == -1) 
+			raler(kv, "bench");
+	} else if (test(kv,size_test) == -1) raler(kv, "test");
 
 	if (kv_close(kv) == -1) raler(kv, "kv_close");
 	